@@ -0,0 +1,193 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "broker_cache.h"
+#include "esp_log.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include "sdkconfig.h"
+
+#define BROKER_CACHE_NAMESPACE  "broker_cache"
+#define BROKER_CACHE_KEY        "last_good"
+#define BROKER_CACHE_HOST_LEN   64
+// Before this (2020-01-01) the system time is considered not set
+#define BROKER_CACHE_MIN_TIME   1577836800
+
+static const char *TAG = "broker_cache";
+
+typedef struct {
+    int64_t stored_at;  // seconds since epoch or 0 if the time was not set
+    int64_t uptime;     // seconds since boot when stored
+    uint32_t boot_id;   // tags the boot that stored the entry
+    char hostname[BROKER_CACHE_HOST_LEN];
+    char address[BROKER_CACHE_ADDRESS_LEN];
+} broker_cache_entry_t;
+
+static inline int64_t now_or_unset(void)
+{
+    time_t now = time(NULL);
+    return now > BROKER_CACHE_MIN_TIME ? now : 0;
+}
+
+static inline int64_t uptime(void)
+{
+    return esp_timer_get_time() / 1000000;
+}
+
+/**
+ * @brief Random tag of the current boot, tells whether an entry was stored since the device started
+ */
+static uint32_t boot_id(void)
+{
+    static uint32_t s_boot_id;
+    if (!s_boot_id) {
+        s_boot_id = esp_random() | 1;
+    }
+    return s_boot_id;
+}
+
+/**
+ * @brief Age of an entry in seconds
+ *
+ * The wall clock is used when both the entry and the system time have it (SNTP or RTC), otherwise the time since
+ * boot is. An entry stored during a previous boot without a wall clock is at least as old as the current boot.
+ */
+static int64_t entry_age(const broker_cache_entry_t *entry)
+{
+    int64_t now = now_or_unset();
+    if (now && entry->stored_at && now >= entry->stored_at) {
+        return now - entry->stored_at;
+    }
+    if (entry->boot_id == boot_id() && uptime() >= entry->uptime) {
+        return uptime() - entry->uptime;
+    }
+    return uptime();
+}
+
+/**
+ * @brief Whether the age of an entry is measured from when it was stored
+ *
+ * That is by the wall clock, or by the uptime if neither has a wall clock and the entry was stored during this boot.
+ * An entry of a previous boot without one can only be aged by the current uptime, so it is rewritten once its address
+ * is confirmed, instead of looking a few seconds old after every reboot.
+ */
+static bool entry_dated(const broker_cache_entry_t *entry)
+{
+    if (now_or_unset()) {
+        return entry->stored_at != 0;
+    }
+    return !entry->stored_at && entry->boot_id == boot_id();
+}
+
+static esp_err_t read_entry(broker_cache_entry_t *entry)
+{
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(BROKER_CACHE_NAMESPACE, NVS_READONLY, &handle);
+    if (err != ESP_OK) {
+        return err == ESP_ERR_NVS_NOT_FOUND ? ESP_ERR_NOT_FOUND : err;
+    }
+
+    size_t size = sizeof(broker_cache_entry_t);
+    err = nvs_get_blob(handle, BROKER_CACHE_KEY, entry, &size);
+    nvs_close(handle);
+
+    if (err == ESP_ERR_NVS_NOT_FOUND || (err == ESP_OK && size != sizeof(broker_cache_entry_t))) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    return err;
+}
+
+esp_err_t broker_cache_get(const char *hostname, char *address, size_t len)
+{
+    if (!hostname || !address) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!CONFIG_BROKER_CACHE_TTL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    broker_cache_entry_t entry;
+    esp_err_t err = read_entry(&entry);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    if (strncmp(entry.hostname, hostname, sizeof(entry.hostname))) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    int64_t age = entry_age(&entry);
+    if (age > CONFIG_BROKER_CACHE_TTL) {
+        ESP_LOGI(TAG, "Cached address %s for %s expired %" PRId64 " s ago", entry.address, hostname,
+                 age - CONFIG_BROKER_CACHE_TTL);
+        return ESP_ERR_TIMEOUT;
+    }
+
+    if (strnlen(entry.address, sizeof(entry.address)) >= len) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    strcpy(address, entry.address);
+    return ESP_OK;
+}
+
+esp_err_t broker_cache_set(const char *hostname, const char *address)
+{
+    if (!hostname || !address
+            || strlen(hostname) >= BROKER_CACHE_HOST_LEN || strlen(address) >= BROKER_CACHE_ADDRESS_LEN) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!CONFIG_BROKER_CACHE_TTL) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    broker_cache_entry_t entry;
+    if (read_entry(&entry) == ESP_OK
+            && !strcmp(entry.hostname, hostname) && !strcmp(entry.address, address)
+            && entry_dated(&entry)
+            && entry_age(&entry) < CONFIG_BROKER_CACHE_TTL / 2) {
+        // still fresh
+        return ESP_OK;
+    }
+
+    memset(&entry, 0, sizeof(entry));
+    entry.stored_at = now_or_unset();
+    entry.uptime = uptime();
+    entry.boot_id = boot_id();
+    strcpy(entry.hostname, hostname);
+    strcpy(entry.address, address);
+
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(BROKER_CACHE_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    err = nvs_set_blob(handle, BROKER_CACHE_KEY, &entry, sizeof(entry));
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Cached address %s for %s", address, hostname);
+    }
+    return err;
+}
+
+esp_err_t broker_cache_clear(void)
+{
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(BROKER_CACHE_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        return err == ESP_ERR_NVS_NOT_FOUND ? ESP_OK : err;
+    }
+
+    err = nvs_erase_key(handle, BROKER_CACHE_KEY);
+    if (err == ESP_OK || err == ESP_ERR_NVS_NOT_FOUND) {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    return err;
+}
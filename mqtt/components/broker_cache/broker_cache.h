@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stddef.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Maximum length of a cached address string (IPv6 included)
+ */
+#define BROKER_CACHE_ADDRESS_LEN 46
+
+/**
+ * @brief Retrieve the last-good address of a broker from NVS
+ *
+ * @note The NVS flash must be already initialized
+ *
+ * @param[in] hostname broker hostname the address was resolved from
+ * @param[out] address buffer for the address string
+ * @param[in] len size of the address buffer
+ * @return
+ *          - ESP_OK on success
+ *          - ESP_ERR_INVALID_ARG when passed invalid pointers or the buffer is too small
+ *          - ESP_ERR_NOT_FOUND if there is no entry for the hostname or the cache is disabled
+ *          - ESP_ERR_TIMEOUT if the entry is older than CONFIG_BROKER_CACHE_TTL
+ *          - other NVS errors
+ */
+esp_err_t broker_cache_get(const char *hostname, char *address, size_t len);
+
+/**
+ * @brief Store the last-good address of a broker into NVS
+ *
+ * In order to spare the flash the entry is only rewritten if the address changes or
+ * it is halfway through its time to live. Without a wall clock (SNTP or RTC) an entry
+ * stored during a previous boot is rewritten as well, once per boot.
+ *
+ * @note The NVS flash must be already initialized
+ *
+ * @param[in] hostname broker hostname the address was resolved from
+ * @param[in] address address string
+ * @return
+ *          - ESP_OK on success
+ *          - ESP_ERR_INVALID_ARG when passed invalid pointers or the strings are too long
+ *          - ESP_ERR_NOT_SUPPORTED if the cache is disabled
+ *          - other NVS errors
+ */
+esp_err_t broker_cache_set(const char *hostname, const char *address);
+
+/**
+ * @brief Remove the cached broker address
+ *
+ * @return
+ *          - ESP_OK on success
+ *          - other NVS errors
+ */
+esp_err_t broker_cache_clear(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,276 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "mdns.h"
+#include "host_resolver.h"
+
+#define HOST_RESOLVER_TASK_STACK    4096
+#define HOST_RESOLVER_TASK_PRIO     5
+// How often a running mDNS lookup checks whether another one already won
+#define HOST_RESOLVER_POLL_MS       50
+
+static const char *TAG = "host_resolver";
+
+// State shared by all the lookups of a host_resolver_start() call
+typedef struct {
+    host_resolver_cb_t cb;
+    void *arg;
+    uint32_t timeout_ms;
+    atomic_int pending;     // running lookups plus the starter reference
+    atomic_bool done;       // callback already called
+} resolve_ctx_t;
+
+typedef enum {
+    LOOKUP_DNS,
+    LOOKUP_MDNS
+} lookup_kind_t;
+
+typedef struct {
+    resolve_ctx_t *ctx;
+    lookup_kind_t kind;
+    char *hostname;         // candidate as passed by the user
+    char *query;            // name actually queried
+} lookup_t;
+
+static void report(resolve_ctx_t *ctx, const char *hostname, const esp_ip_addr_t *addr)
+{
+    if (!atomic_exchange(&ctx->done, true)) {
+        ctx->cb(hostname, addr, ctx->arg);
+    }
+}
+
+/**
+ * @brief Drop a reference to the context, the last one reports the failure if nobody won
+ *
+ * @return true if the context was freed
+ */
+static bool release(resolve_ctx_t *ctx)
+{
+    if (atomic_fetch_sub(&ctx->pending, 1) != 1) {
+        return false;
+    }
+    report(ctx, NULL, NULL);
+    free(ctx);
+    return true;
+}
+
+static bool parse_literal(const char *hostname, esp_ip_addr_t *addr)
+{
+    memset(addr, 0, sizeof(esp_ip_addr_t));
+    if (inet_pton(AF_INET, hostname, &addr->u_addr.ip4.addr) == 1) {
+        addr->type = ESP_IPADDR_TYPE_V4;
+        return true;
+    }
+    if (inet_pton(AF_INET6, hostname, addr->u_addr.ip6.addr) == 1) {
+        addr->type = ESP_IPADDR_TYPE_V6;
+        return true;
+    }
+    return false;
+}
+
+static bool lookup_dns(const char *name, esp_ip_addr_t *addr)
+{
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo *res = NULL;
+
+    if (getaddrinfo(name, NULL, &hints, &res) != 0 || !res) {
+        return false;
+    }
+
+    bool found = false;
+    memset(addr, 0, sizeof(esp_ip_addr_t));
+    for (struct addrinfo *ai = res; ai && !found; ai = ai->ai_next) {
+        if (ai->ai_family == AF_INET) {
+            addr->type = ESP_IPADDR_TYPE_V4;
+            addr->u_addr.ip4.addr = ((struct sockaddr_in *)ai->ai_addr)->sin_addr.s_addr;
+            found = true;
+        } else if (ai->ai_family == AF_INET6) {
+            addr->type = ESP_IPADDR_TYPE_V6;
+            memcpy(addr->u_addr.ip6.addr, &((struct sockaddr_in6 *)ai->ai_addr)->sin6_addr,
+                   sizeof(addr->u_addr.ip6.addr));
+            found = true;
+        }
+    }
+    freeaddrinfo(res);
+    return found;
+}
+
+static bool first_address(mdns_result_t *results, esp_ip_addr_t *addr)
+{
+    for (mdns_result_t *r = results; r; r = r->next) {
+        if (r->addr) {
+            *addr = r->addr->addr;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool lookup_mdns(resolve_ctx_t *ctx, const char *name, esp_ip_addr_t *addr)
+{
+    // IPv4 and IPv6 addresses are separate queries, whichever answers first wins
+    mdns_search_once_t *searches[] = {
+        mdns_query_async_new(name, NULL, NULL, MDNS_TYPE_A, ctx->timeout_ms, 1, NULL),
+        mdns_query_async_new(name, NULL, NULL, MDNS_TYPE_AAAA, ctx->timeout_ms, 1, NULL),
+    };
+    const size_t count = sizeof(searches) / sizeof(searches[0]);
+    size_t running = 0;
+    for (size_t i = 0; i < count; ++i) {
+        running += searches[i] != NULL;
+    }
+
+    bool found = false;
+    bool cancelled = false;
+    // the searches end on their first answer, after timeout_ms or shortly after an address was found
+    while (running) {
+        for (size_t i = 0; i < count; ++i) {
+            mdns_result_t *results = NULL;
+            if (!searches[i] || !mdns_query_async_get_results(searches[i], HOST_RESOLVER_POLL_MS / count,
+                                                              &results, NULL)) {
+                continue;
+            }
+            found = found || first_address(results, addr);
+            mdns_query_results_free(results);
+            mdns_query_async_delete(searches[i]);
+            searches[i] = NULL;
+            --running;
+        }
+        if (!cancelled && (found || atomic_load(&ctx->done))) {
+            for (size_t i = 0; i < count; ++i) {
+                if (searches[i]) {
+                    mdns_query_async_cancel(searches[i]);
+                }
+            }
+            cancelled = true;
+        }
+    }
+    return found;
+}
+
+static void lookup_task(void *pvParameters)
+{
+    lookup_t *lookup = (lookup_t *)pvParameters;
+    resolve_ctx_t *ctx = lookup->ctx;
+    esp_ip_addr_t addr;
+
+    bool found = lookup->kind == LOOKUP_DNS
+                 ? lookup_dns(lookup->query, &addr)
+                 : lookup_mdns(ctx, lookup->query, &addr);
+
+    if (found) {
+        ESP_LOGD(TAG, "%s resolved through %s", lookup->query, lookup->kind == LOOKUP_DNS ? "DNS" : "mDNS");
+        report(ctx, lookup->hostname, &addr);
+    } else {
+        ESP_LOGD(TAG, "%s not resolved through %s", lookup->query, lookup->kind == LOOKUP_DNS ? "DNS" : "mDNS");
+    }
+
+    release(ctx);
+    free(lookup);
+    vTaskDelete(NULL);
+}
+
+/**
+ * @brief Start a lookup task, the lookup keeps a private copy of the names
+ */
+static bool start_lookup(resolve_ctx_t *ctx, lookup_kind_t kind, const char *hostname, size_t query_len)
+{
+    size_t len = strlen(hostname);
+    lookup_t *lookup = malloc(sizeof(lookup_t) + len + 1 + query_len + 1);
+    if (!lookup) {
+        return false;
+    }
+
+    lookup->ctx = ctx;
+    lookup->kind = kind;
+    lookup->hostname = (char *)(lookup + 1);
+    memcpy(lookup->hostname, hostname, len + 1);
+    lookup->query = lookup->hostname + len + 1;
+    memcpy(lookup->query, hostname, query_len);
+    lookup->query[query_len] = '\0';
+
+    atomic_fetch_add(&ctx->pending, 1);
+    if (xTaskCreate(lookup_task, kind == LOOKUP_DNS ? "dns_lookup" : "mdns_lookup", HOST_RESOLVER_TASK_STACK,
+                    lookup, HOST_RESOLVER_TASK_PRIO, NULL) != pdPASS) {
+        atomic_fetch_sub(&ctx->pending, 1);
+        free(lookup);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Length of the mDNS host label for a candidate, 0 if it cannot be an mDNS host
+ */
+static size_t mdns_label_len(const char *hostname)
+{
+    const char *dot = strchr(hostname, '.');
+    if (!dot) {
+        return strlen(hostname);
+    }
+    if (strcasecmp(dot, ".local") == 0 || strcasecmp(dot, ".local.") == 0) {
+        return dot - hostname;
+    }
+    return 0;
+}
+
+esp_err_t host_resolver_start(const char *const *hostnames, size_t count, uint32_t timeout_ms,
+                              host_resolver_cb_t cb, void *arg)
+{
+    if (!hostnames || !count || !cb) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    resolve_ctx_t *ctx = malloc(sizeof(resolve_ctx_t));
+    if (!ctx) {
+        return ESP_ERR_NO_MEM;
+    }
+    ctx->cb = cb;
+    ctx->arg = arg;
+    ctx->timeout_ms = timeout_ms;
+    atomic_init(&ctx->pending, 1);
+    atomic_init(&ctx->done, false);
+
+    size_t valid = 0, started = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const char *hostname = hostnames[i];
+        if (!hostname || !hostname[0]) {
+            continue;
+        }
+        ++valid;
+
+        esp_ip_addr_t addr;
+        if (parse_literal(hostname, &addr)) {
+            report(ctx, hostname, &addr);
+            ++started;
+            break;
+        }
+
+        if (start_lookup(ctx, LOOKUP_DNS, hostname, strlen(hostname))) {
+            ++started;
+        }
+
+        size_t label = mdns_label_len(hostname);
+        if (label && start_lookup(ctx, LOOKUP_MDNS, hostname, label)) {
+            ++started;
+        }
+    }
+
+    if (!started) {
+        // nothing will report, drop the context silently
+        free(ctx);
+        return valid ? ESP_ERR_NO_MEM : ESP_ERR_INVALID_ARG;
+    }
+
+    release(ctx);
+    return ESP_OK;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_netif_ip_addr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Resolution outcome notification
+ *
+ * Called once per host_resolver_start() from one of the resolver tasks, whose stack is small
+ * (4 KB): hand anything heavier than copying the result over to another task.
+ *
+ * @param[in] hostname candidate that resolved first, NULL if none did
+ * @param[in] addr its address (owned by the caller, copy it to keep it), NULL if none resolved
+ * @param[in] arg user argument passed to host_resolver_start()
+ */
+typedef void (*host_resolver_cb_t)(const char *hostname, const esp_ip_addr_t *addr, void *arg);
+
+/**
+ * @brief Resolve several candidate hosts racing DNS against mDNS
+ *
+ * Each candidate is looked up through DNS (getaddrinfo) and, if it is a single label or ends in `.local`,
+ * through mDNS as well, all of them in parallel. DNS returns an IPv4 or IPv6 address, the mDNS lookup
+ * queries the A and AAAA records at once. The first address obtained is reported and the mDNS
+ * lookups still running are cancelled, DNS lookups cannot be interrupted and are ignored when they
+ * complete. Candidates that are already IP address literals are reported straight away from the
+ * calling task.
+ *
+ * @note mDNS lookups are skipped if the mDNS service is not initialized
+ *
+ * @param[in] hostnames candidate hostnames or addresses (copied)
+ * @param[in] count number of candidates
+ * @param[in] timeout_ms mDNS query timeout, DNS follows the resolver's own retry policy
+ * @param[in] cb notification callback
+ * @param[in] arg user argument passed to the callback
+ * @return
+ *          - ESP_OK on success, the callback will be called once
+ *          - ESP_ERR_INVALID_ARG when passed invalid arguments
+ *          - ESP_ERR_NO_MEM if there is no memory to start the lookups, the callback will not be called
+ */
+esp_err_t host_resolver_start(const char *const *hostnames, size_t count, uint32_t timeout_ms,
+                              host_resolver_cb_t cb, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
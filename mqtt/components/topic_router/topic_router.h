@@ -0,0 +1,368 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * @brief Decoder customization point used by topic_router::add<Message>()
+ *
+ * Each application specializes it for the payload types it routes. The specialization must provide:
+ *
+ *     static <pointer-like to Message> decode(const uint8_t* data, size_t len);
+ *
+ * returning an empty pointer if the payload cannot be decoded (the handler is not called then).
+ */
+template<class Message>
+struct topic_decoder;
+
+/*
+ * @brief Precomputed MQTT topic dispatch table
+ *
+ * Topic filters without wildcards are kept in a hash table so dispatching them is a single lookup regardless of the
+ * number of routes. Filters with MQTT wildcards ('+' single level, '#' trailing multi level) are kept in a trie over
+ * topic levels, thus its cost depends on the topic depth not on the number of routes.
+ * Routes are meant to be set up before the MQTT client starts, dispatching is not synchronized with registration.
+ */
+class topic_router
+{
+    public:
+
+    // Undecoded payload handler
+    using raw_handler = std::function<void(std::string_view topic, const uint8_t* data, size_t len)>;
+
+    topic_router() = default;
+    topic_router(const topic_router&) = delete;
+    topic_router& operator=(const topic_router&) = delete;
+
+    /*
+     * @brief Register a handler that receives the raw payload
+     *
+     * @param filter MQTT topic filter, may contain '+' and '#' wildcards
+     * @param handler callable to invoke for each matching topic
+     * @return false if the filter is not a valid MQTT topic filter
+     */
+    bool add(std::string_view filter, raw_handler handler)
+    {
+        if (!valid_filter(filter) || !handler)
+        {
+            return false;
+        }
+
+        std::string_view key = keep_filter(filter);
+        size_t index = handlers_.size();
+        handlers_.push_back(std::move(handler));
+
+        if (key.find_first_of("+#") == std::string_view::npos)
+        {
+            exact_[key].push_back(index);
+            return true;
+        }
+
+        // walk the trie creating the missing levels
+        node* n = &root_;
+        std::string_view rest = key;
+        while (true)
+        {
+            size_t pos = rest.find('/');
+            std::string_view level = rest.substr(0, pos);
+
+            if (level == "#")
+            {
+                n->multi.push_back(index);
+                break;
+            }
+
+            std::unique_ptr<node>& next = level == "+" ? n->single : n->children[level];
+            if (!next)
+            {
+                next = std::make_unique<node>();
+            }
+            n = next.get();
+
+            if (pos == std::string_view::npos)
+            {
+                n->handlers.push_back(index);
+                break;
+            }
+            rest.remove_prefix(pos + 1);
+        }
+
+        ++wildcards_;
+        return true;
+    }
+
+    /*
+     * @brief Register a handler that receives the decoded payload
+     *
+     * @tparam Message payload type, topic_decoder<Message> must be specialized
+     * @param filter MQTT topic filter, may contain '+' and '#' wildcards
+     * @param handler callable as handler(std::string_view topic, const Message& msg)
+     * @return false if the filter is not a valid MQTT topic filter
+     */
+    template<class Message, class Handler>
+    bool add(std::string_view filter, Handler handler)
+    {
+        return add(filter,
+            [handler = std::move(handler)](std::string_view topic, const uint8_t* data, size_t len)
+            {
+                auto msg = topic_decoder<Message>::decode(data, len);
+                if (msg)
+                {
+                    handler(topic, *msg);
+                }
+            });
+    }
+
+    /*
+     * @brief Invoke all handlers whose filter matches the topic
+     *
+     * @param topic published topic name (no wildcards)
+     * @param data payload
+     * @param len payload length
+     * @return number of handlers called
+     */
+    size_t dispatch(std::string_view topic, const uint8_t* data, size_t len) const
+    {
+        if (topic.empty())
+        {
+            return 0;
+        }
+
+        size_t count = 0;
+
+        if (!exact_.empty())
+        {
+            auto it = exact_.find(topic);
+            if (it != exact_.end())
+            {
+                count += fire(it->second, topic, data, len);
+            }
+        }
+
+        if (wildcards_)
+        {
+            count += walk(root_, topic, topic, false, data, len);
+        }
+
+        return count;
+    }
+
+    /*
+     * @brief Registered filters (without duplicates), useful to set up the subscriptions
+     */
+    const std::deque<std::string>& filters() const
+    {
+        return filters_;
+    }
+
+    private:
+
+    struct node
+    {
+        std::unordered_map<std::string_view, std::unique_ptr<node>> children;
+        std::unique_ptr<node> single;   // '+' level
+        std::vector<size_t> handlers;   // filters ending at this level
+        std::vector<size_t> multi;      // filters ending with '#' after this level
+    };
+
+    static bool valid_filter(std::string_view filter)
+    {
+        if (filter.empty())
+        {
+            return false;
+        }
+
+        size_t start = 0;
+        while (true)
+        {
+            size_t pos = filter.find('/', start);
+            std::string_view level = filter.substr(start, pos == std::string_view::npos ? pos : pos - start);
+
+            // wildcards must take up the whole level and '#' must be the last one
+            if (level.find_first_of("+#") != std::string_view::npos
+                && (level.size() != 1 || (level == "#" && pos != std::string_view::npos)))
+            {
+                return false;
+            }
+
+            if (pos == std::string_view::npos)
+            {
+                return true;
+            }
+            start = pos + 1;
+        }
+    }
+
+    // keep a single stable copy of each filter, the tables keep views into it
+    std::string_view keep_filter(std::string_view filter)
+    {
+        for (const std::string& f : filters_)
+        {
+            if (f == filter)
+            {
+                return f;
+            }
+        }
+
+        return filters_.emplace_back(filter);
+    }
+
+    size_t fire(const std::vector<size_t>& indexes, std::string_view topic, const uint8_t* data, size_t len) const
+    {
+        for (size_t index : indexes)
+        {
+            handlers_[index](topic, data, len);
+        }
+
+        return indexes.size();
+    }
+
+    size_t walk(const node& n, std::string_view topic, std::string_view rest, bool done,
+                const uint8_t* data, size_t len) const
+    {
+        // wildcards at the first level must not match system topics ($SYS...)
+        bool wildcards = &n != &root_ || topic.front() != '$';
+        size_t count = 0;
+
+        // 'level/#' also matches 'level'
+        if (wildcards)
+        {
+            count += fire(n.multi, topic, data, len);
+        }
+
+        if (done)
+        {
+            return count + fire(n.handlers, topic, data, len);
+        }
+
+        size_t pos = rest.find('/');
+        std::string_view level = rest.substr(0, pos);
+        bool last = pos == std::string_view::npos;
+        std::string_view next = last ? std::string_view{} : rest.substr(pos + 1);
+
+        auto it = n.children.find(level);
+        if (it != n.children.end())
+        {
+            count += walk(*it->second, topic, next, last, data, len);
+        }
+
+        if (n.single && wildcards)
+        {
+            count += walk(*n.single, topic, next, last, data, len);
+        }
+
+        return count;
+    }
+
+    std::deque<std::string> filters_;
+    std::vector<raw_handler> handlers_;
+    std::unordered_map<std::string_view, std::vector<size_t>> exact_;
+    node root_;
+    size_t wildcards_ = 0;
+};
+
+/*
+ * @brief Reassembles MQTT messages the client delivers in several data events
+ *
+ * Clients with a bounded receive buffer (like esp-mqtt) report a large message as a sequence of fragments, only the
+ * first one carries the topic. Fragments are accumulated until the whole payload is available so the router always
+ * dispatches complete messages. Single fragment messages are passed through without copying.
+ */
+class topic_reassembler
+{
+    public:
+
+    /*
+     * @param max_len largest message accepted, bigger ones are dropped
+     */
+    explicit topic_reassembler(size_t max_len = 16 * 1024)
+        : max_len_(max_len)
+    {}
+
+    topic_reassembler(const topic_reassembler&) = delete;
+    topic_reassembler& operator=(const topic_reassembler&) = delete;
+
+    /*
+     * @brief Account for a received fragment
+     *
+     * @param topic topic name, only meaningful on the first fragment
+     * @param data fragment payload
+     * @param len fragment length
+     * @param offset position of the fragment in the message
+     * @param total whole message length
+     * @return true if the message is complete, topic() and data() are valid until the next call
+     */
+    bool feed(std::string_view topic, const uint8_t* data, size_t len, size_t offset, size_t total)
+    {
+        if (offset == 0)
+        {
+            buffer_.clear();
+            topic_.assign(topic);
+            total_ = total;
+
+            if (len == total)
+            {
+                // unfragmented, no need to copy
+                data_ = data;
+                return true;
+            }
+
+            if (total > max_len_)
+            {
+                total_ = 0; // drop the whole message
+                return false;
+            }
+            buffer_.reserve(total);
+        }
+        else if (!total_ || offset != buffer_.size() || total != total_)
+        {
+            total_ = 0; // lost or out of sequence fragment, wait for a new message
+            return false;
+        }
+
+        if (len > total_ - buffer_.size())
+        {
+            total_ = 0;
+            return false;
+        }
+
+        buffer_.insert(buffer_.end(), data, data + len);
+        if (buffer_.size() != total_)
+        {
+            return false;
+        }
+
+        data_ = buffer_.data();
+        return true;
+    }
+
+    std::string_view topic() const
+    {
+        return topic_;
+    }
+
+    const uint8_t* data() const
+    {
+        return data_;
+    }
+
+    size_t size() const
+    {
+        return total_;
+    }
+
+    private:
+
+    size_t max_len_;
+    size_t total_ = 0;
+    std::string topic_;
+    std::vector<uint8_t> buffer_;
+    const uint8_t* data_ = nullptr;
+};
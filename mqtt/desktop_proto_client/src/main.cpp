@@ -3,7 +3,10 @@
 #include <cstring>
 #include <ctime>
 #include <iostream>
+#include <optional>
+#include <sstream>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <vector>
 
@@ -19,10 +22,14 @@
 #include <mosquittopp.h>
 
 #include <gps.pb.h>
+#include <metrics.pb.h>
+
+#include "topic_router.h"
 
 // pub/sub according with esp32 client not this one
 static const char* subscriber_topic = "esp32/gps/subscribe";
 static const char* publisher_topic = "esp32/gps/publish";
+static const char* metrics_topic = "esp32/gps/metrics";
 
 // command line flags
 ABSL_FLAG(std::string, host, "localhost", "hostname of the machine where mqtt server is running");
@@ -48,20 +55,105 @@ gps::Coords random_gps_data()
     return msg;
 }
 
+// Decode protobuf payloads for the router
+template<class Message>
+std::optional<Message> parse_message(const uint8_t* data, size_t len)
+{
+    Message msg;
+
+    if (!msg.ParseFromArray(data, len))
+    {
+        LOG(ERROR) << "Cannot decode " << msg.GetTypeName() << " message of " << len << " bytes";
+        return std::nullopt;
+    }
+
+    return msg;
+}
+
+template<>
+struct topic_decoder<gps::Coords>
+{
+    static std::optional<gps::Coords> decode(const uint8_t* data, size_t len)
+    {
+        return parse_message<gps::Coords>(data, len);
+    }
+};
+
+template<>
+struct topic_decoder<metrics::Snapshot>
+{
+    static std::optional<metrics::Snapshot> decode(const uint8_t* data, size_t len)
+    {
+        return parse_message<metrics::Snapshot>(data, len);
+    }
+};
+
+// Show the received gps data
+void on_gps_data(std::string_view /*topic*/, const gps::Coords& msg)
+{
+    LOG(INFO) << std::endl
+              << "Show received message contents: " << std::endl
+              << "\tDevice: " << msg.device() << std::endl
+              << "\tLatitude: " << msg.latitudex1e7() << std::endl
+              << "\tLongitude: " << msg.longitudex1e7() << std::endl
+              << "\tAltitude: " << msg.altitudemillimetres() << std::endl
+              << "\tRadius: " << msg.radiusmillimetres() << std::endl
+              << "\tSpeed: " << msg.speedmillimetrespersecond() << std::endl
+              << "\tSatellites: " << msg.svs() << std::endl
+              << "\tTime: " << msg.timeutc();
+}
+
+// Show the received device metrics
+void on_metrics(std::string_view /*topic*/, const metrics::Snapshot& msg)
+{
+    std::ostringstream details;
+
+    for (int core = 0; core < msg.cpuloadpermille_size(); ++core)
+        details << std::endl << "\tCPU" << core << " load (permille): " << msg.cpuloadpermille(core);
+
+    for (const auto& task : msg.tasks())
+        details << std::endl << "\tTask " << task.name() << " stack high water mark: " << task.highwatermark();
+
+    LOG(INFO) << std::endl
+              << "Show received metrics: " << std::endl
+              << "\tDevice: " << msg.device() << std::endl
+              << "\tUptime (ms): " << msg.uptimems() << std::endl
+              << "\tMessages sent/acked/failed: "
+              << msg.msgssent() << "/" << msg.msgsacked() << "/" << msg.msgsfailed() << std::endl
+              << "\tMessages received: " << msg.msgsreceived() << std::endl
+              << "\tOutbox size: " << msg.outboxsize() << std::endl
+              << "\tFree heap: " << msg.freeheap() << std::endl
+              << "\tMin free heap: " << msg.minfreeheap() << std::endl
+              << "\tLargest free block: " << msg.largestfreeblock() << std::endl
+              << "\tHeap in use (host): " << msg.heapinuse() << std::endl
+              << "\tMax RSS KiB (host): " << msg.maxrsskb()
+              << details.str();
+}
+
 class mqtt_client :
     public mosqpp::mosquittopp
 {
+    // Incoming topics dispatch table
+    topic_router router;
+
     mqtt_client()
     {
         if (MOSQ_ERR_UNKNOWN == mosqpp::lib_init())
             LOG(ERROR) << "Cannot initialize MQTT";
+
+        if (!router.add<gps::Coords>(publisher_topic, on_gps_data))
+            LOG(ERROR) << "Invalid topic filter " << publisher_topic;
+
+        if (!router.add<metrics::Snapshot>(metrics_topic, on_metrics))
+            LOG(ERROR) << "Invalid topic filter " << metrics_topic;
     }
 
     public:
 
     ~mqtt_client()
     {
-		unsubscribe(nullptr, publisher_topic);
+        for (const auto& filter : router.filters())
+            unsubscribe(nullptr, filter.c_str());
         mosqpp::lib_cleanup();
     }
 
@@ -81,12 +173,16 @@ class mqtt_client :
             case 0:
                 LOG(INFO) << "Connection accepted";
 
-                // launch the subscription
-                if (MOSQ_ERR_SUCCESS != subscribe(nullptr, publisher_topic))
+                // launch the subscriptions
+                for (const auto& filter : router.filters())
                 {
-                    LOG(ERROR) << "Cannot set up the subscription";
-                    // exit the loop
-                    disconnect();
+                    if (MOSQ_ERR_SUCCESS != subscribe(nullptr, filter.c_str()))
+                    {
+                        LOG(ERROR) << "Cannot set up the subscription to " << filter;
+                        // exit the loop
+                        disconnect();
+                        break;
+                    }
                 }
             break;
             defautl:
@@ -101,26 +197,10 @@ class mqtt_client :
 
     void on_message(const mosquitto_message* message) override
     {
-        if(std::strcmp(message->topic, publisher_topic))
+        if (!router.dispatch(message->topic, static_cast<const uint8_t*>(message->payload), message->payloadlen))
         {
             LOG(ERROR) << "Unexpected topic message " << message->topic;
         }
-        else
-        {
-            gps::Coords msg;
-            msg.ParseFromArray(message->payload, message->payloadlen);
-
-            LOG(INFO) << std::endl
-                      << "Show received message contents: " << std::endl
-                      << "\tDevice: " << msg.device() << std::endl
-                      << "\tLatitude: " << msg.latitudex1e7() << std::endl
-                      << "\tLongitude: " << msg.longitudex1e7() << std::endl
-                      << "\tAltitude: " << msg.altitudemillimetres() << std::endl
-                      << "\tRadius: " << msg.radiusmillimetres() << std::endl
-                      << "\tSpeed: " << msg.speedmillimetrespersecond() << std::endl
-                      << "\tSatellites: " << msg.svs() << std::endl
-                      << "\tTime: " << msg.timeutc();
-        }
     }
 };
 
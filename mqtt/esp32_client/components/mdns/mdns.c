@@ -50,24 +50,91 @@ static const char *TAG = "mdns";
 
 static volatile TaskHandle_t _mdns_service_task_handle = NULL;
 static SemaphoreHandle_t _mdns_service_semaphore = NULL;
+static int64_t _mdns_service_locked_at;     // written by the holder of the service lock
+static mdns_stats_counters_t _mdns_stats;
+static mdns_tx_counters_t _mdns_stats_tx_reset[MDNS_MAX_INTERFACES];    // transmit counters at the last reset
+#if MDNS_PARSE_WORKER
+static volatile TaskHandle_t _mdns_parse_worker_handle = NULL;
+#endif
 
 static void _mdns_search_finish_done(void);
-static mdns_search_once_t *_mdns_search_find_from(mdns_search_once_t *search, mdns_name_t *name, uint16_t type, mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol);
+static mdns_search_once_t *_mdns_search_find_next(mdns_search_once_t *prev, mdns_name_t *name, uint16_t type, mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol);
+static void _mdns_search_host_add(mdns_search_once_t *search, mdns_result_t *r);
 static void _mdns_search_result_add_ip(mdns_search_once_t *search, const char *hostname, esp_ip_addr_t *ip,
                                        mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol, uint32_t ttl);
 static void _mdns_search_result_add_srv(mdns_search_once_t *search, const char *hostname, uint16_t port,
                                         mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol, uint32_t ttl);
-static void _mdns_search_result_add_txt(mdns_search_once_t *search, mdns_txt_item_t *txt, uint8_t *txt_value_len,
-                                        size_t txt_count, mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol,
-                                        uint32_t ttl);
+static void _mdns_search_result_add_txt(mdns_search_once_t *search, const uint8_t *data, size_t len,
+                                        mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol, uint32_t ttl);
 static mdns_result_t *_mdns_search_result_add_ptr(mdns_search_once_t *search, const char *instance,
         const char *service_type, const char *proto, mdns_if_t tcpip_if,
         mdns_ip_protocol_t ip_protocol, uint32_t ttl);
 static bool _mdns_append_host_list_in_services(mdns_out_answer_t **destination, mdns_srv_item_t *services[], size_t services_len, bool flush, bool bye);
 static bool _mdns_append_host_list(mdns_out_answer_t **destination, bool flush, bool bye);
 static void _mdns_remap_self_service_hostname(const char *old_hostname, const char *new_hostname);
+static void _mdns_timer_rearm(void);
+#if MDNS_CACHE_SIZE
+static void _mdns_cache_remove_pcb(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol);
+#endif
+#if MDNS_PARSE_WORKER
+static void _mdns_parse_names_release(mdns_parse_names_t *names);
+#endif
 static esp_err_t mdns_post_custom_action_tcpip_if(mdns_if_t mdns_if, mdns_event_actions_t event_action);
 
+/**
+ * @brief  Take the service lock, the time it is held is counted for mdns_stats_get()
+ */
+static void _mdns_service_lock(void)
+{
+    xSemaphoreTake(_mdns_service_semaphore, portMAX_DELAY);
+    _mdns_service_locked_at = esp_timer_get_time();
+}
+
+static void _mdns_service_unlock(void)
+{
+    uint32_t held = (uint32_t)(esp_timer_get_time() - _mdns_service_locked_at);
+    atomic_fetch_add_explicit(&_mdns_stats.lock_taken, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&_mdns_stats.lock_time_us, held, memory_order_relaxed);
+    if (held > atomic_load_explicit(&_mdns_stats.lock_max_us, memory_order_relaxed)) {
+        atomic_store_explicit(&_mdns_stats.lock_max_us, held, memory_order_relaxed);
+    }
+    xSemaphoreGive(_mdns_service_semaphore);
+}
+
+/**
+ * @brief  Heap allocations of the engine go through these to be counted for mdns_stats_get()
+ */
+static void *_mdns_alloc_counted(void *ptr)
+{
+    atomic_fetch_add_explicit(ptr ? &_mdns_stats.allocs : &_mdns_stats.alloc_failures, 1, memory_order_relaxed);
+    return ptr;
+}
+
+static void *_mdns_malloc(size_t size)
+{
+    return _mdns_alloc_counted(malloc(size));
+}
+
+static void *_mdns_calloc(size_t num, size_t size)
+{
+    return _mdns_alloc_counted(calloc(num, size));
+}
+
+static void *_mdns_realloc(void *ptr, size_t size)
+{
+    return _mdns_alloc_counted(realloc(ptr, size));
+}
+
+static char *_mdns_strdup(const char *str)
+{
+    return (char *)_mdns_alloc_counted(strdup(str));
+}
+
+static char *_mdns_strndup(const char *str, size_t len)
+{
+    return (char *)_mdns_alloc_counted(strndup(str, len));
+}
+
 typedef enum {
     MDNS_IF_STA = 0,
     MDNS_IF_AP = 1,
@@ -194,6 +261,14 @@ static inline bool _str_null_or_empty(const char *str)
     return (str == NULL || *str == 0);
 }
 
+/**
+ * @brief  drops the serialized records of all services, they will be rebuilt on their next use
+ */
+static inline void _mdns_wire_invalidate(void)
+{
+    _mdns_server->wire_generation++;
+}
+
 /*
  * @brief  Appends/increments a number to name/instance in case of collision
  * */
@@ -216,14 +291,14 @@ static char *_mdns_mangle_name(char *in)
     char *ret;
     if (p == NULL) {
         //need to add -2 to string
-        ret = malloc(strlen(in) + 3);
+        ret = _mdns_malloc(strlen(in) + 3);
         if (ret == NULL) {
             HOOK_MALLOC_FAILED;
             return NULL;
         }
         sprintf(ret, "%s-2", in);
     } else {
-        ret = malloc(strlen(in) + 2); //one extra byte in case 9-10 or 99-100 etc
+        ret = _mdns_malloc(strlen(in) + 2); //one extra byte in case 9-10 or 99-100 etc
         if (ret == NULL) {
             HOOK_MALLOC_FAILED;
             return NULL;
@@ -246,6 +321,193 @@ static bool _mdns_service_match(const mdns_service_t *srv, const char *service,
            (_str_null_or_empty(hostname) || !strcasecmp(srv->hostname, hostname));
 }
 
+/**
+ * @brief  Continue FNV-1a hash with a name, case-insensitive like the name comparisons
+ */
+static uint32_t _mdns_hash_name(uint32_t hash, const char *name)
+{
+    if (name) {
+        for (; *name; ++name) {
+            uint8_t c = *name;
+            hash = (hash ^ ((c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c)) * 16777619;
+        }
+    }
+    return (hash ^ '.') * 16777619;
+}
+
+static mdns_srv_item_t **_mdns_service_type_bucket(const char *service, const char *proto)
+{
+    uint32_t hash = _mdns_hash_name(_mdns_hash_name(2166136261u, service), proto);
+    return &_mdns_server->service_types[hash & (MDNS_SERVICE_INDEX_SIZE - 1)];
+}
+
+/**
+ * @brief  Bucket of services with the instance name, services with the default instance (NULL) share the empty name
+ */
+static mdns_srv_item_t **_mdns_service_instance_bucket(const char *instance, const char *service, const char *proto)
+{
+    uint32_t hash = _mdns_hash_name(_mdns_hash_name(_mdns_hash_name(2166136261u, instance), service), proto);
+    return &_mdns_server->service_instances[hash & (MDNS_SERVICE_INDEX_SIZE - 1)];
+}
+
+static void _mdns_service_index_link_instance(mdns_srv_item_t *item)
+{
+    mdns_srv_item_t **p = _mdns_service_instance_bucket(item->service->instance, item->service->service, item->service->proto);
+    while (*p && (*p)->seq > item->seq) {
+        p = &(*p)->instance_next;
+    }
+    item->instance_next = *p;
+    *p = item;
+}
+
+static void _mdns_service_index_unlink_instance(mdns_srv_item_t *item)
+{
+    mdns_srv_item_t **p = _mdns_service_instance_bucket(item->service->instance, item->service->service, item->service->proto);
+    while (*p && *p != item) {
+        p = &(*p)->instance_next;
+    }
+    if (*p) {
+        *p = item->instance_next;
+    }
+}
+
+/**
+ * @brief  Add service to the lookup tables, it must be added to the head of the services list as well
+ */
+static void _mdns_service_index_add(mdns_srv_item_t *item)
+{
+    mdns_srv_item_t **bucket = _mdns_service_type_bucket(item->service->service, item->service->proto);
+    item->seq = ++_mdns_server->service_seq;
+    item->type_next = *bucket;
+    *bucket = item;
+    _mdns_service_index_link_instance(item);
+}
+
+static void _mdns_service_index_remove(mdns_srv_item_t *item)
+{
+    mdns_srv_item_t **p = _mdns_service_type_bucket(item->service->service, item->service->proto);
+    while (*p && *p != item) {
+        p = &(*p)->type_next;
+    }
+    if (*p) {
+        *p = item->type_next;
+    }
+    _mdns_service_index_unlink_instance(item);
+    if (_mdns_server->service_slots[item->slot] == item) {
+        _mdns_server->service_slots[item->slot] = NULL;
+    }
+}
+
+/**
+ * @brief  Give the service a free probe slot, the slot stays with the service until it's removed
+ *
+ * @return false if all the slots are taken
+ */
+static bool _mdns_service_slot_alloc(mdns_srv_item_t *item)
+{
+    for (uint16_t i = 0; i < MDNS_MAX_SERVICES; i++) {
+        if (!_mdns_server->service_slots[i]) {
+            _mdns_server->service_slots[i] = item;
+            item->slot = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline void _mdns_slot_set(mdns_slots_t *slots, size_t slot)
+{
+    slots->bits[slot / 32] |= (uint32_t)1 << (slot % 32);
+}
+
+static inline void _mdns_slot_clear(mdns_slots_t *slots, size_t slot)
+{
+    slots->bits[slot / 32] &= ~((uint32_t)1 << (slot % 32));
+}
+
+static inline bool _mdns_slot_test(const mdns_slots_t *slots, size_t slot)
+{
+    return (slots->bits[slot / 32] >> (slot % 32)) & 1;
+}
+
+static bool _mdns_slots_empty(const mdns_slots_t *slots)
+{
+    for (size_t i = 0; i < MDNS_SLOT_WORDS; i++) {
+        if (slots->bits[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void _mdns_slots_merge(mdns_slots_t *slots, const mdns_slots_t *other)
+{
+    for (size_t i = 0; i < MDNS_SLOT_WORDS; i++) {
+        slots->bits[i] |= other->bits[i];
+    }
+}
+
+/**
+ * @brief  Collect the services in the slots
+ *
+ * @return number of services stored, at most MDNS_MAX_SERVICES
+ */
+static size_t _mdns_slots_services(const mdns_slots_t *slots, mdns_srv_item_t *services[])
+{
+    size_t len = 0;
+    for (size_t i = 0; i < MDNS_SLOT_WORDS; i++) {
+        uint32_t bits = slots->bits[i];
+        while (bits) {
+            size_t slot = i * 32 + __builtin_ctz(bits);
+            bits &= bits - 1;
+            if (slot < MDNS_MAX_SERVICES && _mdns_server->service_slots[slot]) {
+                services[len++] = _mdns_server->service_slots[slot];
+            }
+        }
+    }
+    return len;
+}
+
+/**
+ * @brief  Collect the registered services, each of them holds a slot so they fit MDNS_MAX_SERVICES
+ *
+ * @param  no_instance only the services without an instance name (using the default one)
+ *
+ * @return number of services stored
+ */
+static size_t _mdns_services_collect(mdns_srv_item_t *services[], bool no_instance)
+{
+    size_t len = 0;
+    for (mdns_srv_item_t *a = _mdns_server->services; a && len < MDNS_MAX_SERVICES; a = a->next) {
+        if (!no_instance || !a->service->instance) {
+            services[len++] = a;
+        }
+    }
+    return len;
+}
+
+/**
+ * @brief  Free a name of the service unless it's stored with the service
+ */
+static void _mdns_service_free_name(mdns_service_t *service, const char *name)
+{
+    if (name && (name < service->names || name >= service->names + service->names_len)) {
+        free((char *)name);
+    }
+}
+
+/**
+ * @brief  Change service instance name, keeping the lookup tables consistent
+ */
+static void _mdns_service_set_instance(mdns_srv_item_t *item, const char *instance)
+{
+    _mdns_service_index_unlink_instance(item);
+    _mdns_service_free_name(item->service, item->service->instance);
+    item->service->instance = instance;
+    _mdns_service_index_link_instance(item);
+    _mdns_wire_invalidate();
+}
+
 /**
  * @brief  finds service from given service type
  * @param  server       the server
@@ -257,30 +519,57 @@ static bool _mdns_service_match(const mdns_service_t *srv, const char *service,
  */
 static mdns_srv_item_t *_mdns_get_service_item(const char *service, const char *proto, const char *hostname)
 {
-    mdns_srv_item_t *s = _mdns_server->services;
+    if (!service || !proto) {
+        return NULL;
+    }
+    mdns_srv_item_t *s = *_mdns_service_type_bucket(service, proto);
     while (s) {
         if (_mdns_service_match(s->service, service, proto, hostname)) {
             return s;
         }
-        s = s->next;
+        s = s->type_next;
     }
     return NULL;
 }
 
+/**
+ * @brief  iterate the subtypes of a service
+ *
+ * @param  service      the service
+ * @param  subtype      the previous subtype or NULL for the first one
+ *
+ * @return the next subtype or NULL after the last one
+ */
+static const char *_mdns_service_subtype_next(const mdns_service_t *service, const char *subtype)
+{
+    if (!service->subtypes_len) {
+        return NULL;
+    }
+    subtype = subtype ? subtype + strlen(subtype) + 1 : service->subtypes;
+    return subtype < service->subtypes + service->subtypes_len ? subtype : NULL;
+}
+
+static bool _mdns_service_has_subtype(const mdns_service_t *service, const char *subtype)
+{
+    for (const char *s = _mdns_service_subtype_next(service, NULL); s; s = _mdns_service_subtype_next(service, s)) {
+        if (!strcasecmp(s, subtype)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 static mdns_srv_item_t *_mdns_get_service_item_subtype(const char *subtype, const char *service, const char *proto)
 {
-    mdns_srv_item_t *s = _mdns_server->services;
+    if (!service || !proto) {
+        return NULL;
+    }
+    mdns_srv_item_t *s = *_mdns_service_type_bucket(service, proto);
     while (s) {
-        if (_mdns_service_match(s->service, service, proto, NULL)) {
-            mdns_subtype_t *subtype_item = s->service->subtype;
-            while (subtype_item) {
-                if (!strcasecmp(subtype_item->subtype, subtype)) {
-                    return s;
-                }
-                subtype_item = subtype_item->next;
-            }
+        if (_mdns_service_match(s->service, service, proto, NULL) && _mdns_service_has_subtype(s->service, subtype)) {
+            return s;
         }
-        s = s->next;
+        s = s->type_next;
     }
     return NULL;
 }
@@ -315,25 +604,166 @@ static bool _mdns_can_add_more_services(void)
     return true;
 }
 
-esp_err_t _mdns_send_rx_action(mdns_rx_packet_t *packet)
+/**
+ * @brief  Create the action queue, all the actions of the pool are free
+ */
+static mdns_action_queue_t *_mdns_action_queue_create(void)
+{
+    mdns_action_queue_t *queue = (mdns_action_queue_t *)_mdns_calloc(1, sizeof(mdns_action_queue_t));
+    if (!queue) {
+        HOOK_MALLOC_FAILED;
+        return NULL;
+    }
+    for (uint16_t i = 0; i < MDNS_ACTION_QUEUE_LEN; i++) {
+        atomic_init(&queue->pool_next[i], i + 1 < MDNS_ACTION_QUEUE_LEN ? i + 2 : 0);
+    }
+    atomic_init(&queue->pool_head, 1);
+    for (uint32_t i = 0; i < MDNS_ACTION_RING_SIZE; i++) {
+        atomic_init(&queue->ring[i].seq, i);
+    }
+    return queue;
+}
+
+/**
+ * @brief  Take an action from the pool, it goes back with _mdns_action_release()
+ *
+ * @return zeroed action or NULL if all of them are pending
+ */
+static mdns_action_t *_mdns_action_alloc(void)
+{
+    mdns_action_queue_t *queue = _mdns_server->action_queue;
+    uint32_t head = atomic_load_explicit(&queue->pool_head, memory_order_acquire);
+    for (;;) {
+        uint16_t index = head & 0xFFFF;
+        if (!index) {
+            atomic_fetch_add_explicit(&queue->stats.dropped, 1, memory_order_relaxed);
+            return NULL;
+        }
+        // the tag changes with every push and pop, so the exchange fails if the head was popped and pushed back meanwhile
+        uint32_t next = ((head + 0x10000) & 0xFFFF0000) | atomic_load_explicit(&queue->pool_next[index - 1], memory_order_relaxed);
+        if (atomic_compare_exchange_weak_explicit(&queue->pool_head, &head, next, memory_order_acquire, memory_order_acquire)) {
+            mdns_action_t *action = &queue->pool[index - 1];
+            memset(action, 0, sizeof(mdns_action_t));
+            return action;
+        }
+    }
+}
+
+/**
+ * @brief  Give an action back to the pool
+ */
+static void _mdns_action_release(mdns_action_t *action)
+{
+    mdns_action_queue_t *queue = _mdns_server->action_queue;
+    if (action < queue->pool || action >= queue->pool + MDNS_ACTION_QUEUE_LEN) {
+        return; // the tx and the stop actions are not pooled
+    }
+    uint16_t index = action - queue->pool + 1;
+    uint32_t head = atomic_load_explicit(&queue->pool_head, memory_order_relaxed);
+    uint32_t next;
+    do {
+        atomic_store_explicit(&queue->pool_next[index - 1], head & 0xFFFF, memory_order_relaxed);
+        next = ((head + 0x10000) & 0xFFFF0000) | index;
+    } while (!atomic_compare_exchange_weak_explicit(&queue->pool_head, &head, next, memory_order_release, memory_order_relaxed));
+}
+
+/**
+ * @brief  Post an action to the service task, from any task and without blocking
+ *
+ * @return false if the ring is full, which cannot happen to the pooled actions
+ */
+static bool _mdns_action_post(mdns_action_t *action)
+{
+    mdns_action_queue_t *queue = _mdns_server->action_queue;
+    uint32_t pos = atomic_load_explicit(&queue->ring_head, memory_order_relaxed);
+    for (;;) {
+        uint32_t seq = atomic_load_explicit(&queue->ring[pos & (MDNS_ACTION_RING_SIZE - 1)].seq, memory_order_acquire);
+        int32_t diff = (int32_t)(seq - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->ring_head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false; // the slot has not been taken yet
+        } else {
+            pos = atomic_load_explicit(&queue->ring_head, memory_order_relaxed); // another task posted at pos
+        }
+    }
+    queue->ring[pos & (MDNS_ACTION_RING_SIZE - 1)].action = action;
+    atomic_store_explicit(&queue->ring[pos & (MDNS_ACTION_RING_SIZE - 1)].seq, pos + 1, memory_order_release);
+
+    atomic_fetch_add_explicit(&queue->stats.posted, 1, memory_order_relaxed);
+    uint32_t pending = pos + 1 - atomic_load_explicit(&queue->ring_tail, memory_order_relaxed);
+    uint32_t high_water = atomic_load_explicit(&queue->stats.high_water, memory_order_relaxed);
+    while (pending > high_water && !atomic_compare_exchange_weak_explicit(&queue->stats.high_water, &high_water, pending,
+            memory_order_relaxed, memory_order_relaxed)) {
+    }
+
+    // pairs with the fence of the service task: either it sees the action or we see its handle
+    atomic_thread_fence(memory_order_seq_cst);
+    TaskHandle_t task = _mdns_service_task_handle;
+    if (task) {
+        xTaskNotifyGive(task);
+    }
+    return true;
+}
+
+/**
+ * @brief  Take the next posted action, service task only
+ *
+ * @return the action or NULL if there is none
+ */
+static mdns_action_t *_mdns_action_take(void)
+{
+    mdns_action_queue_t *queue = _mdns_server->action_queue;
+    uint32_t pos = atomic_load_explicit(&queue->ring_tail, memory_order_relaxed);
+    uint32_t slot = pos & (MDNS_ACTION_RING_SIZE - 1);
+    if (atomic_load_explicit(&queue->ring[slot].seq, memory_order_acquire) != pos + 1) {
+        return NULL;
+    }
+    mdns_action_t *action = queue->ring[slot].action;
+    atomic_store_explicit(&queue->ring[slot].seq, pos + MDNS_ACTION_RING_SIZE, memory_order_release);
+    atomic_store_explicit(&queue->ring_tail, pos + 1, memory_order_relaxed);
+    return action;
+}
+
+/**
+ * @brief  Posts a received packet to the service task, with its names if the parse worker decoded them
+ */
+static esp_err_t _mdns_post_rx_action(mdns_rx_packet_t *packet, mdns_parse_names_t *names)
 {
     mdns_action_t *action = NULL;
 
-    action = (mdns_action_t *)malloc(sizeof(mdns_action_t));
+    action = _mdns_action_alloc();
     if (!action) {
-        HOOK_MALLOC_FAILED;
+        atomic_fetch_add_explicit(&_mdns_server->action_queue->stats.rx_dropped, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&_mdns_stats.rx_dropped[packet->tcpip_if], 1, memory_order_relaxed);
         return ESP_ERR_NO_MEM;
     }
 
     action->type = ACTION_RX_HANDLE;
     action->data.rx_handle.packet = packet;
-    if (xQueueSend(_mdns_server->action_queue, &action, (TickType_t)0) != pdPASS) {
-        free(action);
+    action->data.rx_handle.names = names;
+    if (!_mdns_action_post(action)) {
+        _mdns_action_release(action);
         return ESP_ERR_NO_MEM;
     }
     return ESP_OK;
 }
 
+esp_err_t _mdns_send_rx_action(mdns_rx_packet_t *packet)
+{
+    atomic_fetch_add_explicit(&_mdns_stats.rx_packets[packet->tcpip_if], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&_mdns_stats.rx_bytes[packet->tcpip_if], _mdns_get_packet_len(packet), memory_order_relaxed);
+#if MDNS_PARSE_WORKER
+    // the worker posts it once decoded, the service task decodes it itself if the worker is behind or stopped
+    if (_mdns_parse_worker_handle && xQueueSend(_mdns_server->parse_queue, &packet, 0) == pdTRUE) {
+        return ESP_OK;
+    }
+#endif
+    return _mdns_post_rx_action(packet, NULL);
+}
+
 static const char *_mdns_get_default_instance_name(void)
 {
     if (_mdns_server && !_str_null_or_empty(_mdns_server->instance)) {
@@ -383,25 +813,41 @@ static bool _mdns_service_match_instance(const mdns_service_t *srv, const char *
            !strcasecmp(srv->proto, proto) && (_str_null_or_empty(hostname) || !strcasecmp(srv->hostname, hostname));
 }
 
-static mdns_srv_item_t *_mdns_get_service_item_instance(const char *instance, const char *service, const char *proto,
-        const char *hostname)
+static mdns_srv_item_t *_mdns_find_service_item_instance(mdns_srv_item_t *s, const char *instance, const char *service,
+        const char *proto, const char *hostname)
 {
-    mdns_srv_item_t *s = _mdns_server->services;
     while (s) {
-        if (instance) {
-            if (_mdns_service_match_instance(s->service, instance, service, proto, hostname)) {
-                return s;
-            }
-        } else {
-            if (_mdns_service_match(s->service, service, proto, hostname)) {
-                return s;
-            }
+        if (_mdns_service_match_instance(s->service, instance, service, proto, hostname)) {
+            return s;
         }
-        s = s->next;
+        s = s->instance_next;
     }
     return NULL;
 }
 
+static mdns_srv_item_t *_mdns_get_service_item_instance(const char *instance, const char *service, const char *proto,
+        const char *hostname)
+{
+    if (!instance) {
+        return _mdns_get_service_item(service, proto, hostname);
+    }
+    if (!service || !proto) {
+        return NULL;
+    }
+    mdns_srv_item_t *named = _mdns_find_service_item_instance(*_mdns_service_instance_bucket(instance, service, proto),
+                             instance, service, proto, hostname);
+    // services without own instance name answer to the default one
+    const char *default_instance = _mdns_get_default_instance_name();
+    if (default_instance && !strcasecmp(default_instance, instance)) {
+        mdns_srv_item_t *unnamed = _mdns_find_service_item_instance(*_mdns_service_instance_bucket(NULL, service, proto),
+                                   instance, service, proto, hostname);
+        if (unnamed && (!named || unnamed->seq > named->seq)) {
+            return unnamed;
+        }
+    }
+    return named;
+}
+
 /**
  * @brief  reads MDNS FQDN into mdns_name_t structure
  *         FQDN is in format: [hostname.|[instance.]_service._proto.]local.
@@ -452,6 +898,9 @@ static const uint8_t *_mdns_read_fqdn(const uint8_t *packet, const uint8_t *star
                 memcpy(mdns_name_ptrs[name->parts++], buf, len + 1);
             }
         } else {
+            if (start + index >= packet_end) {
+                return NULL;
+            }
             size_t address = (((uint16_t)len & 0x3F) << 8) | start[index++];
             if ((packet + address) >= start) {
                 //reference address can not be after where we are
@@ -615,39 +1064,8 @@ static inline uint8_t _mdns_append_string(uint8_t *packet, uint16_t *index, cons
     return len + 1;
 }
 
-/**
- * @brief  appends one TXT record ("key=value" or "key")
- *
- * @param  packet       MDNS packet
- * @param  index        offset in the packet
- * @param  txt          one txt record
- *
- * @return length of added data: length of the added txt value + 1 on success
- *         0  if data won't fit the packet
- *         -1 if invalid TXT entry
- */
-static inline int append_one_txt_record_entry(uint8_t *packet, uint16_t *index, mdns_txt_linked_item_t *txt)
-{
-    if (txt == NULL || txt->key == NULL) {
-        return -1;
-    }
-    size_t key_len = strlen(txt->key);
-    size_t len = key_len + txt->value_len + (txt->value ? 1 : 0);
-    if ((*index + len + 1) >= MDNS_MAX_PACKET_SIZE) {
-        return 0;
-    }
-    _mdns_append_u8(packet, index, len);
-    memcpy(packet + *index, txt->key, key_len);
-    if (txt->value) {
-        packet[*index + key_len] = '=';
-        memcpy(packet + *index + key_len + 1, txt->value, txt->value_len);
-    }
-    *index += len;
-    return len + 1;
-}
-
-#ifdef CONFIG_MDNS_RESPOND_REVERSE_QUERIES
-static inline int append_single_str(uint8_t *packet, uint16_t *index, const char *str, int len)
+#ifdef CONFIG_MDNS_RESPOND_REVERSE_QUERIES
+static inline int append_single_str(uint8_t *packet, uint16_t *index, const char *str, int len)
 {
     if ((*index + len + 1) >= MDNS_MAX_PACKET_SIZE) {
         return 0;
@@ -700,6 +1118,194 @@ static uint16_t append_fqdn_dots(uint8_t *packet, uint16_t *index, const char *n
 }
 #endif /* CONFIG_MDNS_RESPOND_REVERSE_QUERIES */
 
+/**
+ * @brief  encodes name parts as DNS labels, each part becomes one label
+ *
+ * @param  out          output buffer
+ * @param  out_len      size of the output buffer
+ * @param  strings      string array containing the parts of the FQDN
+ * @param  count        number of strings in the array
+ *
+ * @return length of the labels including the terminating zero, 0 on error
+ */
+static uint16_t _mdns_encode_labels(uint8_t *out, size_t out_len, const char *strings[], uint8_t count)
+{
+    uint16_t len = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        size_t part_len = strlen(strings[i]);
+        if (!part_len || part_len > MDNS_LABEL_MAX_LEN || len + part_len + 2 > out_len) {
+            return 0;
+        }
+        out[len++] = part_len;
+        memcpy(out + len, strings[i], part_len);
+        len += part_len;
+    }
+    out[len++] = 0;
+    return len;
+}
+
+/**
+ * @brief  compares DNS labels with the name at offset in the packet, following compression pointers
+ *         (the first label must match exactly, so that our names keep their spelling, the domain part is case insensitive)
+ */
+static bool _mdns_labels_match(const uint8_t *packet, uint16_t packet_len, uint16_t offset, const uint8_t *labels)
+{
+    bool first = true;
+    while (offset < packet_len) {
+        uint8_t len = packet[offset];
+        if ((len & 0xC0) == 0xC0) {
+            if (offset + 1 >= packet_len) {
+                return false;
+            }
+            uint16_t target = ((len & 0x3F) << 8) | packet[offset + 1];
+            if (target >= offset) {
+                //reference address can not be after where we are
+                return false;
+            }
+            offset = target;
+            continue;
+        }
+        if (len != labels[0] || offset + len + 1 > packet_len) {
+            return false;
+        }
+        if (!len) {
+            return true;
+        }
+        if (first ? memcmp(packet + offset + 1, labels + 1, len) : strncasecmp((const char *)packet + offset + 1, (const char *)labels + 1, len)) {
+            return false;
+        }
+        first = false;
+        offset += len + 1;
+        labels += len + 1;
+    }
+    return false;
+}
+
+/**
+ * @brief  finds a previous occurrence of the name by searching the whole packet
+ *
+ * @return offset of the name or 0 if not found
+ */
+static uint16_t _mdns_find_labels(const uint8_t *packet, uint16_t packet_len, const uint8_t *labels)
+{
+    // the header is skipped, its counters are written after the records
+    uint16_t offset = MDNS_HEAD_LEN;
+    while (offset < packet_len) {
+        const uint8_t *len_location = (const uint8_t *)memchr(packet + offset, labels[0], packet_len - offset);
+        if (!len_location) {
+            return 0;
+        }
+        offset = len_location - packet;
+        if (_mdns_labels_match(packet, packet_len, offset, labels)) {
+            return offset;
+        }
+        offset++;
+    }
+    return 0;
+}
+
+/**
+ * @brief  case insensitive hash of a name in wire format (without compression pointers)
+ */
+static uint32_t _mdns_hash_labels(const uint8_t *labels)
+{
+    uint32_t hash = 2166136261u;
+    for (; *labels; labels += *labels + 1) {
+        for (uint8_t i = 0; i <= *labels; ++i) {
+            uint8_t c = labels[i];
+            hash = (hash ^ ((c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c)) * 16777619;
+        }
+    }
+    return hash;
+}
+
+/**
+ * @brief  forgets the names of the previous packet
+ */
+static void _mdns_name_dict_reset(void)
+{
+    memset(&_mdns_server->tx_names, 0, sizeof(mdns_name_dict_t));
+}
+
+/**
+ * @brief  finds a previous occurrence of the name in the packet, looking it up in the name dictionary
+ *
+ * @return offset of the name or 0 if not found
+ */
+static uint16_t _mdns_name_dict_find(const uint8_t *packet, uint16_t packet_len, const uint8_t *labels)
+{
+    mdns_name_dict_t *dict = &_mdns_server->tx_names;
+    if (dict->count >= MDNS_NAME_DICT_SIZE / 4 * 3) {
+        return _mdns_find_labels(packet, packet_len, labels);
+    }
+    for (uint32_t slot = _mdns_hash_labels(labels);; ++slot) {
+        uint16_t offset = dict->offsets[slot & (MDNS_NAME_DICT_SIZE - 1)];
+        if (!offset) {
+            return 0;
+        }
+        if (offset < packet_len && _mdns_labels_match(packet, packet_len, offset, labels)) {
+            return offset;
+        }
+    }
+}
+
+/**
+ * @brief  remembers where a name has been written, it must not be in the dictionary already
+ */
+static void _mdns_name_dict_add(uint16_t offset, const uint8_t *labels)
+{
+    mdns_name_dict_t *dict = &_mdns_server->tx_names;
+    if (dict->count >= MDNS_NAME_DICT_SIZE / 4 * 3) {
+        return;
+    }
+    uint32_t slot = _mdns_hash_labels(labels);
+    while (dict->offsets[slot & (MDNS_NAME_DICT_SIZE - 1)]) {
+        ++slot;
+    }
+    dict->offsets[slot & (MDNS_NAME_DICT_SIZE - 1)] = offset;
+    dict->count++;
+}
+
+/**
+ * @brief  appends DNS labels to a packet, incrementing the index and
+ *         compressing the output if previous occurrence of the name (or part of it) has been found
+ *
+ * @param  packet       MDNS packet
+ * @param  index        offset in the packet
+ * @param  labels       name in wire format, terminated by zero length label
+ *
+ * @return length of added data: 0 on error or length on success
+ */
+static uint16_t _mdns_append_labels(uint8_t *packet, uint16_t *index, const uint8_t *labels)
+{
+    const uint8_t *suffix = labels;
+    uint16_t offset = 0;
+    while (*suffix) {
+        offset = _mdns_name_dict_find(packet, *index, suffix);
+        if (offset) {
+            break;
+        }
+        suffix += *suffix + 1;
+    }
+    uint16_t prefix_len = suffix - labels;
+    uint16_t len = prefix_len + (offset ? 2 : 1);
+    if ((*index + len) >= MDNS_MAX_PACKET_SIZE) {
+        return 0;
+    }
+    //the suffixes written in full were not found, so the following names can point to them
+    for (const uint8_t *label = labels; label < suffix; label += *label + 1) {
+        _mdns_name_dict_add(*index + (label - labels), label);
+    }
+    memcpy(packet + *index, labels, prefix_len);
+    *index += prefix_len;
+    if (offset) {
+        _mdns_append_u16(packet, index, MDNS_NAME_REF | offset);
+    } else {
+        _mdns_append_u8(packet, index, 0);
+    }
+    return len;
+}
+
 /**
  * @brief  appends FQDN to a packet, incrementing the index and
  *         compressing the output if previous occurrence of the string (or part of it) has been found
@@ -711,67 +1317,64 @@ static uint16_t append_fqdn_dots(uint8_t *packet, uint16_t *index, const char *n
  *
  * @return length of added data: 0 on error or length on success
  */
-static uint16_t _mdns_append_fqdn(uint8_t *packet, uint16_t *index, const char *strings[], uint8_t count, size_t packet_len)
+static uint16_t _mdns_append_fqdn(uint8_t *packet, uint16_t *index, const char *strings[], uint8_t count)
 {
-    if (!count) {
-        //empty string so terminate
-        return _mdns_append_u8(packet, index, 0);
-    }
-    mdns_name_t name;
-    static char buf[MDNS_NAME_BUF_LEN];
-    uint8_t len = strlen(strings[0]);
-    //try to find first the string length in the packet (if it exists)
-    uint8_t *len_location = (uint8_t *)memchr(packet, (char)len, *index);
-    while (len_location) {
-        //check if the string after len_location is the string that we are looking for
-        if (memcmp(len_location + 1, strings[0], len)) { //not continuing with our string
-search_next:
-            //try and find the length byte further in the packet
-            len_location = (uint8_t *)memchr(len_location + 1, (char)len, *index - (len_location + 1 - packet));
-            continue;
-        }
-        //seems that we might have found the string that we are looking for
-        //read the destination into name and compare
-        name.parts = 0;
-        name.sub = 0;
-        name.invalid = false;
-        name.host[0] = 0;
-        name.service[0] = 0;
-        name.proto[0] = 0;
-        name.domain[0] = 0;
-        const uint8_t *content = _mdns_read_fqdn(packet, len_location, &name, buf, packet_len);
-        if (!content) {
-            //not a readable fqdn?
-            goto search_next; // could be our unfinished fqdn, continue searching
-        }
-        if (name.parts == count) {
-            uint8_t i;
-            for (i = 0; i < count; i++) {
-                if (strcasecmp(strings[i], (const char *)&name + (i * (MDNS_NAME_BUF_LEN)))) {
-                    //not our string! let's search more
-                    goto search_next;
-                }
-            }
-            //we actually have found the string
-            break;
-        } else {
-            goto search_next;
-        }
+    uint8_t labels[MDNS_LABELS_BUF_LEN];
+    if (!_mdns_encode_labels(labels, sizeof(labels), strings, count)) {
+        return 0;
     }
-    //string is not yet in the packet, so let's add it
-    if (!len_location) {
-        uint8_t written = _mdns_append_string(packet, index, strings[0]);
-        if (!written) {
-            return 0;
+    return _mdns_append_labels(packet, index, labels);
+}
+
+/**
+ * @brief  get the service records in wire format, they are serialized again if anything changed since the last use
+ *
+ * @param  service      the service
+ *
+ * @return the records or NULL if the service has no valid instance name (or on allocation failure)
+ */
+static const mdns_service_wire_t *_mdns_get_service_wire(mdns_service_t *service)
+{
+    if (service->wire && service->wire->generation == _mdns_server->wire_generation) {
+        return service->wire;
+    }
+    free(service->wire);
+    service->wire = NULL;
+
+    const char *instance_str[4] = {_mdns_get_service_instance_name(service), service->service, service->proto, MDNS_DEFAULT_DOMAIN};
+    const char *host_str[2] = {service->hostname ? service->hostname : _mdns_server->hostname, MDNS_DEFAULT_DOMAIN};
+    uint8_t instance[MDNS_LABELS_BUF_LEN];
+    uint8_t host[MDNS_LABELS_BUF_LEN];
+    uint16_t instance_len = instance_str[0] ? _mdns_encode_labels(instance, sizeof(instance), instance_str, 4) : 0;
+    if (!instance_len) {
+        return NULL;
+    }
+    uint16_t host_len = _str_null_or_empty(host_str[0]) ? 0 : _mdns_encode_labels(host, sizeof(host), host_str, 2);
+
+    mdns_service_wire_t *wire = (mdns_service_wire_t *)_mdns_malloc(sizeof(mdns_service_wire_t) + instance_len + 6 + host_len);
+    if (!wire) {
+        HOOK_MALLOC_FAILED;
+        return NULL;
+    }
+    wire->generation = _mdns_server->wire_generation;
+    wire->type_offset = instance[0] + 1;
+    memcpy(wire->data, instance, instance_len);
+
+    // no SRV record without target host
+    uint8_t *data = wire->data + instance_len;
+    wire->srv_offset = instance_len;
+    wire->srv_len = host_len ? host_len + 6 : 0;
+    if (host_len) {
+        const uint16_t srv[3] = {service->priority, service->weight, service->port};
+        for (int i = 0; i < 3; i++) {
+            *data++ = srv[i] >> 8;
+            *data++ = srv[i] & 0xFF;
         }
-        //run the same for the other strings in the name
-        return written + _mdns_append_fqdn(packet, index, &strings[1], count - 1, packet_len);
+        memcpy(data, host, host_len);
     }
 
-    //we have found the string so let's insert a pointer to it instead
-    uint16_t offset = len_location - packet;
-    offset |= MDNS_NAME_REF;
-    return _mdns_append_u16(packet, index, offset);
+    service->wire = wire;
+    return wire;
 }
 
 /**
@@ -799,7 +1402,7 @@ static uint16_t _mdns_append_ptr_record(uint8_t *packet, uint16_t *index, const
     str[2] = proto;
     str[3] = MDNS_DEFAULT_DOMAIN;
 
-    part_length = _mdns_append_fqdn(packet, index, str + 1, 3, MDNS_MAX_PACKET_SIZE);
+    part_length = _mdns_append_fqdn(packet, index, str + 1, 3);
     if (!part_length) {
         return 0;
     }
@@ -812,7 +1415,7 @@ static uint16_t _mdns_append_ptr_record(uint8_t *packet, uint16_t *index, const
     record_length += part_length;
 
     uint16_t data_len_location = *index - 2;
-    part_length = _mdns_append_fqdn(packet, index, str, 4, MDNS_MAX_PACKET_SIZE);
+    part_length = _mdns_append_fqdn(packet, index, str, 4);
     if (!part_length) {
         return 0;
     }
@@ -822,32 +1425,37 @@ static uint16_t _mdns_append_ptr_record(uint8_t *packet, uint16_t *index, const
 }
 
 /**
- * @brief  appends PTR record for a subtype to a packet, incrementing the index
+ * @brief  appends PTR record of a service or of its subtype to a packet, incrementing the index
  *
  * @param  packet       MDNS packet
  * @param  index        offset in the packet
- * @param  instance     the service instance name
- * @param  subtype      the service subtype
- * @param  proto        the service protocol
- * @param  flush        whether to set the flush flag
+ * @param  wire         the service records
+ * @param  subtype      the service subtype or NULL
  * @param  bye          whether to set the bye flag
  *
  * @return length of added data: 0 on error or length on success
  */
-static uint16_t _mdns_append_subtype_ptr_record(uint8_t *packet, uint16_t *index, const char *instance,
-        const char *subtype, const char *service, const char *proto, bool flush,
-        bool bye)
+static uint16_t _mdns_append_service_ptr_record(uint8_t *packet, uint16_t *index, const mdns_service_wire_t *wire,
+        const char *subtype, bool bye)
 {
-    const char *subtype_str[5] = {subtype, MDNS_SUB_STR, service, proto, MDNS_DEFAULT_DOMAIN};
-    const char *instance_str[4] = {instance, service, proto, MDNS_DEFAULT_DOMAIN};
     uint16_t record_length = 0;
-    uint8_t part_length;
-
-    if (service == NULL) {
-        return 0;
+    uint16_t part_length;
+
+    if (subtype) {
+        // subtype._sub._service._proto.local
+        uint8_t labels[MDNS_LABELS_BUF_LEN];
+        const char *subtype_str[2] = {subtype, MDNS_SUB_STR};
+        const uint8_t *type = wire->data + wire->type_offset;
+        size_t type_len = wire->srv_offset - wire->type_offset;
+        uint16_t len = _mdns_encode_labels(labels, sizeof(labels), subtype_str, 2);
+        if (!len || len - 1 + type_len > sizeof(labels)) {
+            return 0;
+        }
+        memcpy(labels + len - 1, type, type_len);
+        part_length = _mdns_append_labels(packet, index, labels);
+    } else {
+        part_length = _mdns_append_labels(packet, index, wire->data + wire->type_offset);
     }
-
-    part_length = _mdns_append_fqdn(packet, index, subtype_str, ARRAY_SIZE(subtype_str), MDNS_MAX_PACKET_SIZE);
     if (!part_length) {
         return 0;
     }
@@ -860,7 +1468,7 @@ static uint16_t _mdns_append_subtype_ptr_record(uint8_t *packet, uint16_t *index
     record_length += part_length;
 
     uint16_t data_len_location = *index - 2;
-    part_length = _mdns_append_fqdn(packet, index, instance_str, ARRAY_SIZE(instance_str), MDNS_MAX_PACKET_SIZE);
+    part_length = _mdns_append_labels(packet, index, wire->data);
     if (!part_length) {
         return 0;
     }
@@ -881,12 +1489,12 @@ static uint16_t _mdns_append_subtype_ptr_record(uint8_t *packet, uint16_t *index
  */
 static uint16_t _mdns_append_sdptr_record(uint8_t *packet, uint16_t *index, mdns_service_t *service, bool flush, bool bye)
 {
-    const char *str[3];
     const char *sd_str[4];
     uint16_t record_length = 0;
     uint8_t part_length;
 
-    if (service == NULL) {
+    const mdns_service_wire_t *wire = service ? _mdns_get_service_wire(service) : NULL;
+    if (wire == NULL) {
         return 0;
     }
 
@@ -895,11 +1503,7 @@ static uint16_t _mdns_append_sdptr_record(uint8_t *packet, uint16_t *index, mdns
     sd_str[2] = (char *)"_udp";
     sd_str[3] = MDNS_DEFAULT_DOMAIN;
 
-    str[0] = service->service;
-    str[1] = service->proto;
-    str[2] = MDNS_DEFAULT_DOMAIN;
-
-    part_length = _mdns_append_fqdn(packet, index, sd_str, 4, MDNS_MAX_PACKET_SIZE);
+    part_length = _mdns_append_fqdn(packet, index, sd_str, 4);
 
     record_length += part_length;
 
@@ -910,7 +1514,7 @@ static uint16_t _mdns_append_sdptr_record(uint8_t *packet, uint16_t *index, mdns
     record_length += part_length;
 
     uint16_t data_len_location = *index - 2;
-    part_length = _mdns_append_fqdn(packet, index, str, 3, MDNS_MAX_PACKET_SIZE);
+    part_length = _mdns_append_labels(packet, index, wire->data + wire->type_offset);
     if (!part_length) {
         return 0;
     }
@@ -924,31 +1528,21 @@ static uint16_t _mdns_append_sdptr_record(uint8_t *packet, uint16_t *index, mdns
  *
  * @param  packet       MDNS packet
  * @param  index        offset in the packet
- * @param  server       the server that is hosting the service
  * @param  service      the service to add record for
  *
  * @return length of added data: 0 on error or length on success
  */
 static uint16_t _mdns_append_txt_record(uint8_t *packet, uint16_t *index, mdns_service_t *service, bool flush, bool bye)
 {
-    const char *str[4];
     uint16_t record_length = 0;
-    uint8_t part_length;
-
-    if (service == NULL) {
-        return 0;
-    }
-
-    str[0] = _mdns_get_service_instance_name(service);
-    str[1] = service->service;
-    str[2] = service->proto;
-    str[3] = MDNS_DEFAULT_DOMAIN;
+    uint16_t part_length;
 
-    if (!str[0]) {
+    const mdns_service_wire_t *wire = service ? _mdns_get_service_wire(service) : NULL;
+    if (wire == NULL) {
         return 0;
     }
 
-    part_length = _mdns_append_fqdn(packet, index, str, 4, MDNS_MAX_PACKET_SIZE);
+    part_length = _mdns_append_labels(packet, index, wire->data);
     if (!part_length) {
         return 0;
     }
@@ -960,26 +1554,19 @@ static uint16_t _mdns_append_txt_record(uint8_t *packet, uint16_t *index, mdns_s
     }
     record_length += part_length;
 
-    uint16_t data_len_location = *index - 2;
-    uint16_t data_len = 0;
-
-    mdns_txt_linked_item_t *txt = service->txt;
-    while (txt) {
-        int l = append_one_txt_record_entry(packet, index, txt);
-        if (l > 0) {
-            data_len += l;
-        } else if (l == 0) { // TXT entry won't fit into the mdns packet
-            return 0;
-        }
-        txt = txt->next;
+    // the items are stored as they are sent, an empty TXT record holds a single empty string
+    uint16_t txt_len = service->txt_len ? service->txt_len : 1;
+    if ((*index + txt_len) >= MDNS_MAX_PACKET_SIZE) {
+        return 0;
     }
-    if (!data_len) {
-        data_len = 1;
+    if (service->txt_len) {
+        memcpy(packet + *index, service->txt, txt_len);
+    } else {
         packet[*index] = 0;
-        *index = *index + 1;
     }
-    _mdns_set_u16(packet, data_len_location, data_len);
-    record_length += data_len;
+    *index += txt_len;
+    _mdns_set_u16(packet, *index - txt_len - 2, txt_len);
+    record_length += txt_len;
     return record_length;
 }
 
@@ -988,31 +1575,21 @@ static uint16_t _mdns_append_txt_record(uint8_t *packet, uint16_t *index, mdns_s
  *
  * @param  packet       MDNS packet
  * @param  index        offset in the packet
- * @param  server       the server that is hosting the service
  * @param  service      the service to add record for
  *
  * @return length of added data: 0 on error or length on success
  */
 static uint16_t _mdns_append_srv_record(uint8_t *packet, uint16_t *index, mdns_service_t *service, bool flush, bool bye)
 {
-    const char *str[4];
     uint16_t record_length = 0;
-    uint8_t part_length;
-
-    if (service == NULL) {
-        return 0;
-    }
-
-    str[0] = _mdns_get_service_instance_name(service);
-    str[1] = service->service;
-    str[2] = service->proto;
-    str[3] = MDNS_DEFAULT_DOMAIN;
+    uint16_t part_length;
 
-    if (!str[0]) {
+    const mdns_service_wire_t *wire = service ? _mdns_get_service_wire(service) : NULL;
+    if (wire == NULL || !wire->srv_len) {
         return 0;
     }
 
-    part_length = _mdns_append_fqdn(packet, index, str, 4, MDNS_MAX_PACKET_SIZE);
+    part_length = _mdns_append_labels(packet, index, wire->data);
     if (!part_length) {
         return 0;
     }
@@ -1026,26 +1603,14 @@ static uint16_t _mdns_append_srv_record(uint8_t *packet, uint16_t *index, mdns_s
 
     uint16_t data_len_location = *index - 2;
 
-    part_length = 0;
-    part_length += _mdns_append_u16(packet, index, service->priority);
-    part_length += _mdns_append_u16(packet, index, service->weight);
-    part_length += _mdns_append_u16(packet, index, service->port);
-    if (part_length != 6) {
-        return 0;
-    }
-
-    if (service->hostname) {
-        str[0] = service->hostname;
-    } else {
-        str[0] = _mdns_server->hostname;
-    }
-    str[1] = MDNS_DEFAULT_DOMAIN;
-
-    if (_str_null_or_empty(str[0])) {
+    // priority, weight and port
+    if ((*index + 6) >= MDNS_MAX_PACKET_SIZE) {
         return 0;
     }
+    memcpy(packet + *index, wire->data + wire->srv_offset, 6);
+    *index += 6;
 
-    part_length = _mdns_append_fqdn(packet, index, str, 2, MDNS_MAX_PACKET_SIZE);
+    part_length = _mdns_append_labels(packet, index, wire->data + wire->srv_offset + 6);
     if (!part_length) {
         return 0;
     }
@@ -1078,7 +1643,7 @@ static uint16_t _mdns_append_a_record(uint8_t *packet, uint16_t *index, const ch
         return 0;
     }
 
-    part_length = _mdns_append_fqdn(packet, index, str, 2, MDNS_MAX_PACKET_SIZE);
+    part_length = _mdns_append_fqdn(packet, index, str, 2);
     if (!part_length) {
         return 0;
     }
@@ -1130,7 +1695,7 @@ static uint16_t _mdns_append_aaaa_record(uint8_t *packet, uint16_t *index, const
     }
 
 
-    part_length = _mdns_append_fqdn(packet, index, str, 2, MDNS_MAX_PACKET_SIZE);
+    part_length = _mdns_append_fqdn(packet, index, str, 2);
     if (!part_length) {
         return 0;
     }
@@ -1186,7 +1751,7 @@ static uint16_t _mdns_append_question(uint8_t *packet, uint16_t *index, mdns_out
         if (q->domain) {
             str[str_index++] = q->domain;
         }
-        part_length = _mdns_append_fqdn(packet, index, str, str_index, MDNS_MAX_PACKET_SIZE);
+        part_length = _mdns_append_fqdn(packet, index, str, str_index);
         if (!part_length) {
             return 0;
         }
@@ -1292,7 +1857,7 @@ static uint8_t _mdns_append_reverse_ptr_record(uint8_t *packet, uint16_t *index,
     uint16_t data_len_location = *index - 2; /* store the position of size (2=16bis) of this record */
     const char *str[2] = { _mdns_self_host.hostname, MDNS_DEFAULT_DOMAIN };
 
-    int part_length = _mdns_append_fqdn(packet, index, str, 2, MDNS_MAX_PACKET_SIZE);
+    int part_length = _mdns_append_fqdn(packet, index, str, 2);
     if (!part_length) {
         return 0;
     }
@@ -1312,18 +1877,15 @@ static uint8_t _mdns_append_service_ptr_answers(uint8_t *packet, uint16_t *index
 {
     uint8_t appended_answers = 0;
 
-    if (_mdns_append_ptr_record(packet, index, _mdns_get_service_instance_name(service), service->service,
-                                service->proto, flush, bye) <= 0) {
+    const mdns_service_wire_t *wire = _mdns_get_service_wire(service);
+    if (!wire || _mdns_append_service_ptr_record(packet, index, wire, NULL, bye) <= 0) {
         return appended_answers;
     }
     appended_answers++;
 
-    mdns_subtype_t *subtype = service->subtype;
-    while (subtype) {
-        appended_answers +=
-            (_mdns_append_subtype_ptr_record(packet, index, _mdns_get_service_instance_name(service), subtype->subtype,
-                                             service->service, service->proto, flush, bye) > 0);
-        subtype = subtype->next;
+    for (const char *subtype = _mdns_service_subtype_next(service, NULL); subtype;
+            subtype = _mdns_service_subtype_next(service, subtype)) {
+        appended_answers += (_mdns_append_service_ptr_record(packet, index, wire, subtype, bye) > 0);
     }
 
     return appended_answers;
@@ -1425,6 +1987,45 @@ static uint8_t _mdns_append_answer(uint8_t *packet, uint16_t *index, mdns_out_an
     return 0;
 }
 
+/**
+ * @brief  sends the encoded packet to the destination of the tx packet
+ */
+static void _mdns_send_tx_buffer(mdns_tx_packet_t *p, uint8_t *packet, uint16_t len)
+{
+#ifdef MDNS_ENABLE_DEBUG
+    _mdns_dbg_printf("\nTX[%u][%u]: ", p->tcpip_if, p->ip_protocol);
+    if (p->dst.type == ESP_IPADDR_TYPE_V4) {
+        _mdns_dbg_printf("To: " IPSTR ":%u, ", IP2STR(&p->dst.u_addr.ip4), p->port);
+    } else {
+        _mdns_dbg_printf("To: " IPV6STR ":%u, ", IPV62STR(p->dst.u_addr.ip6), p->port);
+    }
+    mdns_debug_packet(packet, len);
+#endif
+
+    _mdns_udp_pcb_write(p->tcpip_if, p->ip_protocol, &p->dst, p->port, packet, len);
+}
+
+/**
+ * @brief  starts encoding a packet, in the buffer of the network stack if it provides one
+ *
+ * @param  p       the packet
+ *
+ * @return the buffer with the header set
+ */
+static uint8_t *_mdns_tx_buffer_start(mdns_tx_packet_t *p)
+{
+    static uint8_t buffer[MDNS_MAX_PACKET_SIZE];
+    uint8_t *packet = _mdns_udp_pcb_tx_buffer();
+    if (!packet) {
+        packet = buffer;
+    }
+    memset(packet, 0, MDNS_HEAD_LEN);
+    _mdns_name_dict_reset();
+    _mdns_set_u16(packet, MDNS_HEAD_FLAGS_OFFSET, p->flags);
+    _mdns_set_u16(packet, MDNS_HEAD_ID_OFFSET, p->id);
+    return packet;
+}
+
 /**
  * @brief  sends a packet
  *
@@ -1432,16 +2033,12 @@ static uint8_t _mdns_append_answer(uint8_t *packet, uint16_t *index, mdns_out_an
  */
 static void _mdns_dispatch_tx_packet(mdns_tx_packet_t *p)
 {
-    static uint8_t packet[MDNS_MAX_PACKET_SIZE];
+    uint8_t *packet = _mdns_tx_buffer_start(p);
     uint16_t index = MDNS_HEAD_LEN;
-    memset(packet, 0, MDNS_HEAD_LEN);
     mdns_out_question_t *q;
     mdns_out_answer_t *a;
     uint8_t count;
 
-    _mdns_set_u16(packet, MDNS_HEAD_FLAGS_OFFSET, p->flags);
-    _mdns_set_u16(packet, MDNS_HEAD_ID_OFFSET, p->id);
-
     count = 0;
     q = p->questions;
     while (q) {
@@ -1455,7 +2052,22 @@ static void _mdns_dispatch_tx_packet(mdns_tx_packet_t *p)
     count = 0;
     a = p->answers;
     while (a) {
-        count += _mdns_append_answer(packet, &index, a, p->tcpip_if);
+        uint16_t start = index;
+        uint8_t added = _mdns_append_answer(packet, &index, a, p->tcpip_if);
+        // nothing written either means the record does not apply or that it did not fit
+        if (!added && count && !p->questions
+                && (index != start || MDNS_MAX_PACKET_SIZE - start < MDNS_LABELS_BUF_LEN)) {
+            // send the answers written so far, the rest of them go to another packet
+            _mdns_set_u16(packet, MDNS_HEAD_ANSWERS_OFFSET, count);
+            _mdns_send_tx_buffer(p, packet, start);
+            // the buffer is gone with the packet, the answer that did not fit is encoded again in the next one
+            packet = _mdns_tx_buffer_start(p);
+            index = MDNS_HEAD_LEN;
+            count = 0;
+            continue;
+        }
+        index = added ? index : start;
+        count += added;
         a = a->next;
     }
     _mdns_set_u16(packet, MDNS_HEAD_ANSWERS_OFFSET, count);
@@ -1463,7 +2075,10 @@ static void _mdns_dispatch_tx_packet(mdns_tx_packet_t *p)
     count = 0;
     a = p->servers;
     while (a) {
-        count += _mdns_append_answer(packet, &index, a, p->tcpip_if);
+        uint16_t start = index;
+        uint8_t added = _mdns_append_answer(packet, &index, a, p->tcpip_if);
+        index = added ? index : start;
+        count += added;
         a = a->next;
     }
     _mdns_set_u16(packet, MDNS_HEAD_SERVERS_OFFSET, count);
@@ -1471,22 +2086,15 @@ static void _mdns_dispatch_tx_packet(mdns_tx_packet_t *p)
     count = 0;
     a = p->additional;
     while (a) {
-        count += _mdns_append_answer(packet, &index, a, p->tcpip_if);
+        uint16_t start = index;
+        uint8_t added = _mdns_append_answer(packet, &index, a, p->tcpip_if);
+        index = added ? index : start;
+        count += added;
         a = a->next;
     }
     _mdns_set_u16(packet, MDNS_HEAD_ADDITIONAL_OFFSET, count);
 
-#ifdef MDNS_ENABLE_DEBUG
-    _mdns_dbg_printf("\nTX[%u][%u]: ", p->tcpip_if, p->ip_protocol);
-    if (p->dst.type == ESP_IPADDR_TYPE_V4) {
-        _mdns_dbg_printf("To: " IPSTR ":%u, ", IP2STR(&p->dst.u_addr.ip4), p->port);
-    } else {
-        _mdns_dbg_printf("To: " IPV6STR ":%u, ", IPV62STR(p->dst.u_addr.ip6), p->port);
-    }
-    mdns_debug_packet(packet, index);
-#endif
-
-    _mdns_udp_pcb_write(p->tcpip_if, p->ip_protocol, &p->dst, p->port, packet, index);
+    _mdns_send_tx_buffer(p, packet, index);
 }
 
 /**
@@ -1518,88 +2126,166 @@ static void _mdns_free_tx_packet(mdns_tx_packet_t *packet)
 }
 
 /**
- * @brief  schedules a packet to be sent after given milliseconds
- *
- * @param  packet       the packet
- * @param  ms_after     number of milliseconds after which the packet should be dispatched
+ * @brief  true if packet a is due before packet b, packets scheduled for the same time keep their order
  */
-static void _mdns_schedule_tx_packet(mdns_tx_packet_t *packet, uint32_t ms_after)
+static inline bool _mdns_tx_before(const mdns_tx_packet_t *a, const mdns_tx_packet_t *b)
 {
-    if (!packet) {
-        return;
-    }
-    packet->send_at = (xTaskGetTickCount() * portTICK_PERIOD_MS) + ms_after;
-    packet->next = NULL;
-    if (!_mdns_server->tx_queue_head || _mdns_server->tx_queue_head->send_at > packet->send_at) {
-        packet->next = _mdns_server->tx_queue_head;
-        _mdns_server->tx_queue_head = packet;
-        return;
-    }
-    mdns_tx_packet_t *q = _mdns_server->tx_queue_head;
-    while (q->next && q->next->send_at <= packet->send_at) {
-        q = q->next;
+    int32_t diff = (int32_t)(a->send_at - b->send_at);
+    return diff < 0 || (diff == 0 && (int32_t)(a->seq - b->seq) < 0);
+}
+
+static void _mdns_tx_queue_sift_up(uint16_t i)
+{
+    mdns_tx_packet_t **heap = _mdns_server->tx_queue;
+    mdns_tx_packet_t *p = heap[i];
+    while (i) {
+        uint16_t parent = (i - 1) / 2;
+        if (!_mdns_tx_before(p, heap[parent])) {
+            break;
+        }
+        heap[i] = heap[parent];
+        i = parent;
     }
-    packet->next = q->next;
-    q->next = packet;
+    heap[i] = p;
 }
 
-/**
- * @brief  free all packets scheduled for sending
- */
-static void _mdns_clear_tx_queue_head(void)
+static void _mdns_tx_queue_sift_down(uint16_t i)
 {
-    mdns_tx_packet_t *q;
-    while (_mdns_server->tx_queue_head) {
-        q = _mdns_server->tx_queue_head;
-        _mdns_server->tx_queue_head = _mdns_server->tx_queue_head->next;
-        _mdns_free_tx_packet(q);
+    mdns_tx_packet_t **heap = _mdns_server->tx_queue;
+    uint16_t len = _mdns_server->tx_queue_len;
+    mdns_tx_packet_t *p = heap[i];
+    for (;;) {
+        uint16_t child = 2 * i + 1;
+        if (child >= len) {
+            break;
+        }
+        if (child + 1 < len && _mdns_tx_before(heap[child + 1], heap[child])) {
+            child++;
+        }
+        if (!_mdns_tx_before(heap[child], p)) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
     }
+    heap[i] = p;
 }
 
 /**
- * @brief  clear packets scheduled for sending on a specific interface
- *
- * @param  tcpip_if     the interface
- * @param  ip_protocol     pcb type V4/V6
+ * @brief  removes the slots set to NULL by the caller (after freeing their packets) and restores the heap order
  */
-static void _mdns_clear_pcb_tx_queue_head(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol)
-{
-    mdns_tx_packet_t *q, * p;
-    while (_mdns_server->tx_queue_head && _mdns_server->tx_queue_head->tcpip_if == tcpip_if && _mdns_server->tx_queue_head->ip_protocol == ip_protocol) {
-        q = _mdns_server->tx_queue_head;
-        _mdns_server->tx_queue_head = _mdns_server->tx_queue_head->next;
-        _mdns_free_tx_packet(q);
-    }
-    if (_mdns_server->tx_queue_head) {
-        q = _mdns_server->tx_queue_head;
-        while (q->next) {
-            if (q->next->tcpip_if == tcpip_if && q->next->ip_protocol == ip_protocol) {
-                p = q->next;
-                q->next = p->next;
-                _mdns_free_tx_packet(p);
-            } else {
-                q = q->next;
-            }
+static void _mdns_tx_queue_compact(void)
+{
+    mdns_tx_packet_t **heap = _mdns_server->tx_queue;
+    uint16_t len = 0;
+    for (uint16_t i = 0; i < _mdns_server->tx_queue_len; i++) {
+        if (heap[i]) {
+            heap[len++] = heap[i];
         }
     }
+    _mdns_server->tx_queue_len = len;
+    for (uint16_t i = len / 2; i > 0; i--) {
+        _mdns_tx_queue_sift_down(i - 1);
+    }
 }
 
 /**
- * @brief  get the next packet scheduled for sending on a specific interface
+ * @brief  removes the earliest packet from the tx queue
  *
- * @param  tcpip_if     the interface
- * @param  ip_protocol     pcb type V4/V6
+ * @return the packet or NULL if the queue is empty
  */
-static mdns_tx_packet_t *_mdns_get_next_pcb_packet(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol)
+static mdns_tx_packet_t *_mdns_tx_queue_pop(void)
 {
-    mdns_tx_packet_t *q = _mdns_server->tx_queue_head;
-    while (q) {
+    if (!_mdns_server->tx_queue_len) {
+        return NULL;
+    }
+    mdns_tx_packet_t *p = _mdns_server->tx_queue[0];
+    _mdns_server->tx_queue_len--;
+    if (_mdns_server->tx_queue_len) {
+        _mdns_server->tx_queue[0] = _mdns_server->tx_queue[_mdns_server->tx_queue_len];
+        _mdns_tx_queue_sift_down(0);
+    }
+    return p;
+}
+
+/**
+ * @brief  schedules a packet to be sent after given milliseconds
+ *
+ * @note   the packet is freed if the queue cannot grow
+ *
+ * @param  packet       the packet
+ * @param  ms_after     number of milliseconds after which the packet should be dispatched
+ */
+static void _mdns_schedule_tx_packet(mdns_tx_packet_t *packet, uint32_t ms_after)
+{
+    if (!packet) {
+        return;
+    }
+    if (_mdns_server->tx_queue_len == _mdns_server->tx_queue_size) {
+        uint16_t size = _mdns_server->tx_queue_size ? _mdns_server->tx_queue_size * 2 : MDNS_TX_QUEUE_MIN_SIZE;
+        mdns_tx_packet_t **queue = (mdns_tx_packet_t **)_mdns_realloc(_mdns_server->tx_queue, size * sizeof(mdns_tx_packet_t *));
+        if (!queue) {
+            HOOK_MALLOC_FAILED;
+            _mdns_free_tx_packet(packet);
+            return;
+        }
+        _mdns_server->tx_queue = queue;
+        _mdns_server->tx_queue_size = size;
+    }
+    packet->send_at = (xTaskGetTickCount() * portTICK_PERIOD_MS) + ms_after;
+    packet->seq = _mdns_server->tx_seq++;
+    _mdns_server->tx_queue[_mdns_server->tx_queue_len] = packet;
+    _mdns_tx_queue_sift_up(_mdns_server->tx_queue_len++);
+    if (_mdns_server->tx_queue[0] == packet) {
+        _mdns_timer_rearm();
+    }
+}
+
+/**
+ * @brief  free all packets scheduled for sending
+ */
+static void _mdns_clear_tx_queue(void)
+{
+    for (uint16_t i = 0; i < _mdns_server->tx_queue_len; i++) {
+        _mdns_free_tx_packet(_mdns_server->tx_queue[i]);
+    }
+    _mdns_server->tx_queue_len = 0;
+}
+
+/**
+ * @brief  clear packets scheduled for sending on a specific interface
+ *
+ * @param  tcpip_if     the interface
+ * @param  ip_protocol     pcb type V4/V6
+ */
+static void _mdns_clear_pcb_tx_queue(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol)
+{
+    for (uint16_t i = 0; i < _mdns_server->tx_queue_len; i++) {
+        mdns_tx_packet_t *q = _mdns_server->tx_queue[i];
         if (q->tcpip_if == tcpip_if && q->ip_protocol == ip_protocol) {
-            return q;
+            _mdns_free_tx_packet(q);
+            _mdns_server->tx_queue[i] = NULL;
         }
-        q = q->next;
     }
-    return NULL;
+    _mdns_tx_queue_compact();
+}
+
+/**
+ * @brief  get the next packet scheduled for sending on a specific interface
+ *
+ * @param  tcpip_if     the interface
+ * @param  ip_protocol     pcb type V4/V6
+ */
+static mdns_tx_packet_t *_mdns_get_next_pcb_packet(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol)
+{
+    mdns_tx_packet_t *next = NULL;
+    for (uint16_t i = 0; i < _mdns_server->tx_queue_len; i++) {
+        mdns_tx_packet_t *q = _mdns_server->tx_queue[i];
+        if (q->tcpip_if == tcpip_if && q->ip_protocol == ip_protocol && (!next || _mdns_tx_before(q, next))) {
+            next = q;
+        }
+    }
+    return next;
 }
 
 /**
@@ -1611,8 +2297,8 @@ static void _mdns_remove_scheduled_answer(mdns_if_t tcpip_if, mdns_ip_protocol_t
     if (!service) {
         service = &s;
     }
-    mdns_tx_packet_t *q = _mdns_server->tx_queue_head;
-    while (q) {
+    for (uint16_t i = 0; i < _mdns_server->tx_queue_len; i++) {
+        mdns_tx_packet_t *q = _mdns_server->tx_queue[i];
         if (q->tcpip_if == tcpip_if && q->ip_protocol == ip_protocol && q->distributed) {
             mdns_out_answer_t *a = q->answers;
             if (a) {
@@ -1632,7 +2318,6 @@ static void _mdns_remove_scheduled_answer(mdns_if_t tcpip_if, mdns_ip_protocol_t
                 }
             }
         }
-        q = q->next;
     }
 }
 
@@ -1679,7 +2364,7 @@ static bool _mdns_alloc_answer(mdns_out_answer_t **destination, uint16_t type, m
         d = d->next;
     }
 
-    mdns_out_answer_t *a = (mdns_out_answer_t *)malloc(sizeof(mdns_out_answer_t));
+    mdns_out_answer_t *a = (mdns_out_answer_t *)_mdns_malloc(sizeof(mdns_out_answer_t));
     if (!a) {
         HOOK_MALLOC_FAILED;
         return false;
@@ -1700,7 +2385,7 @@ static bool _mdns_alloc_answer(mdns_out_answer_t **destination, uint16_t type, m
  */
 static mdns_tx_packet_t *_mdns_alloc_packet_default(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol)
 {
-    mdns_tx_packet_t *packet = (mdns_tx_packet_t *)malloc(sizeof(mdns_tx_packet_t));
+    mdns_tx_packet_t *packet = (mdns_tx_packet_t *)_mdns_malloc(sizeof(mdns_tx_packet_t));
     if (!packet) {
         HOOK_MALLOC_FAILED;
         return NULL;
@@ -1776,14 +2461,7 @@ static bool _mdns_service_match_ptr_question(const mdns_service_t *service, cons
     // The question parser stores anything before _type._proto in question->host
     // So the question->host can be subtype or instance name based on its content
     if (question->sub) {
-        mdns_subtype_t *subtype = service->subtype;
-        while (subtype) {
-            if (!strcasecmp(subtype->subtype, question->host)) {
-                return true;
-            }
-            subtype = subtype->next;
-        }
-        return false;
+        return _mdns_service_has_subtype(service, question->host);
     }
     if (question->host) {
         if (strcasecmp(_mdns_get_service_instance_name(service), question->host) != 0) {
@@ -1793,6 +2471,163 @@ static bool _mdns_service_match_ptr_question(const mdns_service_t *service, cons
     return true;
 }
 
+/**
+ * @brief  checks if the answer is a record the querier already knows
+ *
+ * @note   the address records of a host are suppressed together, the querier asks again for a missing one
+ */
+static bool _mdns_answer_is_known(const mdns_out_answer_t *answer, const mdns_known_answer_t *known)
+{
+    if (answer->type != known->type || answer->bye) {
+        return false;
+    }
+    if (answer->type == MDNS_TYPE_A || answer->type == MDNS_TYPE_AAAA) {
+        return answer->host == known->host;
+    }
+    if (answer->type == MDNS_TYPE_SDPTR) {
+        // all the services of the type make the same record
+        return answer->service && !strcasecmp(answer->service->service, known->service->service)
+               && !strcasecmp(answer->service->proto, known->service->proto);
+    }
+    return answer->service == known->service && answer->host == known->host;
+}
+
+/**
+ * @brief  checks if the querier knows the PTR record of the service, then it needs none of its records
+ */
+static bool _mdns_ptr_is_known(const mdns_known_answer_t *known, const mdns_service_t *service)
+{
+    for (; known; known = known->next) {
+        if (known->type == MDNS_TYPE_PTR && known->service == service) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief  removes the answers the querier already knows from the list
+ */
+static void _mdns_remove_known_answers(mdns_out_answer_t **answers, const mdns_known_answer_t *known_answers)
+{
+    for (const mdns_known_answer_t *known = known_answers; known; known = known->next) {
+        mdns_out_answer_t **a = answers;
+        while (*a) {
+            if (_mdns_answer_is_known(*a, known)) {
+                mdns_out_answer_t *b = *a;
+                *a = b->next;
+                free(b);
+                atomic_fetch_add_explicit(&_mdns_stats.suppressed, 1, memory_order_relaxed);
+            } else {
+                a = &(*a)->next;
+            }
+        }
+    }
+}
+
+/**
+ * @brief  moves the answers of the source list to the destination, dropping the ones it already has
+ */
+static void _mdns_merge_answers(mdns_out_answer_t **destination, mdns_out_answer_t **source)
+{
+    mdns_out_answer_t *a = *source;
+    *source = NULL;
+    while (a) {
+        mdns_out_answer_t *next = a->next;
+        mdns_out_answer_t **d = destination;
+        while (*d && !((*d)->type == a->type && (*d)->service == a->service && (*d)->host == a->host)) {
+            d = &(*d)->next;
+        }
+        if (*d) {
+            free(a);
+        } else {
+            a->next = NULL;
+            *d = a;
+        }
+        a = next;
+    }
+}
+
+/**
+ * @brief  merges the records of a response into another one for the same interface and frees it
+ *
+ * @note   the dispatch splits the answers over more packets if they do not fit a single one
+ */
+static void _mdns_merge_response(mdns_tx_packet_t *destination, mdns_tx_packet_t *packet)
+{
+    _mdns_merge_answers(&destination->answers, &packet->answers);
+    _mdns_merge_answers(&destination->servers, &packet->servers);
+    _mdns_merge_answers(&destination->additional, &packet->additional);
+    _mdns_free_tx_packet(packet);
+    atomic_fetch_add_explicit(&_mdns_server->action_queue->stats.coalesced, 1, memory_order_relaxed);
+}
+
+/**
+ * @brief  holds a multicast response until the end of the running batch of actions,
+ *         merging it into the response already held for the same interface
+ *
+ * @return true if the packet was taken
+ */
+static bool _mdns_hold_response(mdns_tx_packet_t *packet, bool shared)
+{
+    mdns_tx_packet_t **held = &_mdns_server->tx_batch[packet->tcpip_if][packet->ip_protocol][shared];
+    if (!*held) {
+        *held = packet;
+        return true;
+    }
+    if ((*held)->id != packet->id || (*held)->distributed != packet->distributed) {
+        return false;
+    }
+    _mdns_merge_response(*held, packet);
+    return true;
+}
+
+/**
+ * @brief  sends a response right away or, if shared, after a random delay
+ *
+ * A shared response is merged into the one already waiting for its delay on the same interface (RFC 6762, 6),
+ * so the queriers asking within the same 25-100 ms window get a single multicast reply.
+ */
+static void _mdns_send_response(mdns_tx_packet_t *packet, bool shared)
+{
+    static uint8_t share_step = 0;
+    if (!shared) {
+        _mdns_dispatch_tx_packet(packet);
+        _mdns_free_tx_packet(packet);
+        return;
+    }
+    if (packet->aggregate) {
+        for (uint16_t i = 0; i < _mdns_server->tx_queue_len; i++) {
+            mdns_tx_packet_t *q = _mdns_server->tx_queue[i];
+            if (q->aggregate && q->tcpip_if == packet->tcpip_if && q->ip_protocol == packet->ip_protocol
+                    && q->id == packet->id && q->distributed == packet->distributed) {
+                _mdns_merge_response(q, packet);
+                return;
+            }
+        }
+    }
+    _mdns_schedule_tx_packet(packet, 25 + (share_step * 25));
+    share_step = (share_step + 1) & 0x03;
+}
+
+/**
+ * @brief  sends the responses held during the batch of actions
+ */
+static void _mdns_flush_held_responses(void)
+{
+    for (int i = 0; i < MDNS_MAX_INTERFACES; i++) {
+        for (int j = 0; j < MDNS_IP_PROTOCOL_MAX; j++) {
+            for (int shared = 0; shared < 2; shared++) {
+                mdns_tx_packet_t *packet = _mdns_server->tx_batch[i][j][shared];
+                if (packet) {
+                    _mdns_server->tx_batch[i][j][shared] = NULL;
+                    _mdns_send_response(packet, shared);
+                }
+            }
+        }
+    }
+}
+
 /**
  * @brief  Create answer packet to questions from parsed packet
  */
@@ -1822,15 +2657,17 @@ static void _mdns_create_answer_from_parsed_packet(mdns_parsed_packet_t *parsed_
                 return;
             }
         } else if (q->service && q->proto) {
-            mdns_srv_item_t *service = _mdns_server->services;
+            mdns_srv_item_t *service = *_mdns_service_type_bucket(q->service, q->proto);
             while (service) {
                 if (_mdns_service_match_ptr_question(service->service, q)) {
-                    if (!_mdns_create_answer_from_service(packet, service->service, q, shared, send_flush)) {
+                    if (q->type == MDNS_TYPE_PTR && _mdns_ptr_is_known(parsed_packet->known_answers, service->service)) {
+                        atomic_fetch_add_explicit(&_mdns_stats.suppressed, 1, memory_order_relaxed);
+                    } else if (!_mdns_create_answer_from_service(packet, service->service, q, shared, send_flush)) {
                         _mdns_free_tx_packet(packet);
                         return;
                     }
                 }
-                service = service->next;
+                service = service->type_next;
             }
         } else if (q->type == MDNS_TYPE_A || q->type == MDNS_TYPE_AAAA) {
             if (!_mdns_create_answer_from_hostname(packet, q->host, send_flush)) {
@@ -1860,44 +2697,52 @@ static void _mdns_create_answer_from_parsed_packet(mdns_parsed_packet_t *parsed_
                  || q->type == MDNS_TYPE_PTR
 #endif /* CONFIG_MDNS_RESPOND_REVERSE_QUERIES */
                 )) {
-            mdns_out_question_t *out_question = malloc(sizeof(mdns_out_question_t));
+            mdns_out_question_t *out_question = _mdns_malloc(sizeof(mdns_out_question_t));
             if (out_question == NULL) {
                 HOOK_MALLOC_FAILED;
                 _mdns_free_tx_packet(packet);
                 return;
             }
+            // the parsed names are released with the parser arena, the packet keeps its own copies
             out_question->type = q->type;
             out_question->unicast = q->unicast;
-            out_question->host = q->host;
-            q->host = NULL;
-            out_question->service = q->service;
-            q->service = NULL;
-            out_question->proto = q->proto;
-            q->proto = NULL;
-            out_question->domain = q->domain;
-            q->domain = NULL;
+            out_question->host = q->host ? _mdns_strdup(q->host) : NULL;
+            out_question->service = q->service ? _mdns_strdup(q->service) : NULL;
+            out_question->proto = q->proto ? _mdns_strdup(q->proto) : NULL;
+            out_question->domain = q->domain ? _mdns_strdup(q->domain) : NULL;
             out_question->next = NULL;
             out_question->own_dynamic_memory = true;
             queueToEnd(mdns_out_question_t, packet->questions, out_question);
+            if ((q->host && !out_question->host) || (q->service && !out_question->service)
+                    || (q->proto && !out_question->proto) || (q->domain && !out_question->domain)) {
+                HOOK_MALLOC_FAILED;
+                _mdns_free_tx_packet(packet);
+                return;
+            }
         }
         if (q->unicast) {
             unicast = true;
         }
         q = q->next;
     }
+    _mdns_remove_known_answers(&packet->answers, parsed_packet->known_answers);
+    _mdns_remove_known_answers(&packet->additional, parsed_packet->known_answers);
+    if (!packet->answers) {
+        // nothing the querier does not know already
+        _mdns_free_tx_packet(packet);
+        return;
+    }
+
     if (unicast || !send_flush) {
         memcpy(&packet->dst, &parsed_packet->src, sizeof(esp_ip_addr_t));
         packet->port = parsed_packet->src_port;
-    }
-
-    static uint8_t share_step = 0;
-    if (shared) {
-        _mdns_schedule_tx_packet(packet, 25 + (share_step * 25));
-        share_step = (share_step + 1) & 0x03;
     } else {
-        _mdns_dispatch_tx_packet(packet);
-        _mdns_free_tx_packet(packet);
+        packet->aggregate = shared;
+        if (_mdns_server->tx_batching && _mdns_hold_response(packet, shared)) {
+            return;
+        }
     }
+    _mdns_send_response(packet, shared);
 }
 
 /**
@@ -1967,7 +2812,7 @@ static bool _mdns_append_host_list(mdns_out_answer_t **destination, bool flush,
 
 static bool _mdns_append_host_question(mdns_out_question_t **questions, const char *hostname, bool unicast)
 {
-    mdns_out_question_t *q = (mdns_out_question_t *)malloc(sizeof(mdns_out_question_t));
+    mdns_out_question_t *q = (mdns_out_question_t *)_mdns_malloc(sizeof(mdns_out_question_t));
     if (!q) {
         HOOK_MALLOC_FAILED;
         return false;
@@ -2005,8 +2850,11 @@ static bool _mdns_append_host_questions_for_services(mdns_out_question_t **quest
 
 /**
  * @brief  Create probe packet for particular services on particular PCB
+ *
+ * The first services and, if first_ip, the host questions are probed for the first time and ask for unicast responses.
  */
-static mdns_tx_packet_t *_mdns_create_probe_packet(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol, mdns_srv_item_t *services[], size_t len, bool first, bool include_ip)
+static mdns_tx_packet_t *_mdns_create_probe_packet(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol, mdns_srv_item_t *services[], size_t len,
+        size_t first, bool include_ip, bool first_ip)
 {
     mdns_tx_packet_t *packet = _mdns_alloc_packet_default(tcpip_if, ip_protocol);
     if (!packet) {
@@ -2015,14 +2863,14 @@ static mdns_tx_packet_t *_mdns_create_probe_packet(mdns_if_t tcpip_if, mdns_ip_p
 
     size_t i;
     for (i = 0; i < len; i++) {
-        mdns_out_question_t *q = (mdns_out_question_t *)malloc(sizeof(mdns_out_question_t));
+        mdns_out_question_t *q = (mdns_out_question_t *)_mdns_malloc(sizeof(mdns_out_question_t));
         if (!q) {
             HOOK_MALLOC_FAILED;
             _mdns_free_tx_packet(packet);
             return NULL;
         }
         q->next = NULL;
-        q->unicast = first;
+        q->unicast = i < first;
         q->type = MDNS_TYPE_ANY;
         q->host = _mdns_get_service_instance_name(services[i]->service);
         q->service = services[i]->service->service;
@@ -2043,7 +2891,7 @@ static mdns_tx_packet_t *_mdns_create_probe_packet(mdns_if_t tcpip_if, mdns_ip_p
     }
 
     if (include_ip) {
-        if (!_mdns_append_host_questions_for_services(&packet->questions, services, len, first)) {
+        if (!_mdns_append_host_questions_for_services(&packet->questions, services, len, first_ip)) {
             _mdns_free_tx_packet(packet);
             return NULL;
         }
@@ -2088,41 +2936,35 @@ static mdns_tx_packet_t *_mdns_create_announce_packet(mdns_if_t tcpip_if, mdns_i
 }
 
 /**
- * @brief  Convert probe packet to announce
+ * @brief  Create the announce of particular PCB for its probed services and host
  */
-static mdns_tx_packet_t *_mdns_create_announce_from_probe(mdns_tx_packet_t *probe)
+static mdns_tx_packet_t *_mdns_create_pcb_announce_packet(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol, const mdns_slots_t *announce)
 {
-    mdns_tx_packet_t *packet = _mdns_alloc_packet_default(probe->tcpip_if, probe->ip_protocol);
+    mdns_srv_item_t *services[MDNS_MAX_SERVICES];
+    size_t len = _mdns_slots_services(announce, services);
+    mdns_tx_packet_t *packet = _mdns_alloc_packet_default(tcpip_if, ip_protocol);
     if (!packet) {
         return NULL;
     }
     packet->flags = MDNS_FLAGS_QR_AUTHORITATIVE;
 
-    mdns_out_answer_t *s = probe->servers;
-    while (s) {
-        if (s->type == MDNS_TYPE_SRV) {
-            if (!_mdns_alloc_answer(&packet->answers, MDNS_TYPE_SDPTR, s->service, NULL, false, false)
-                    || !_mdns_alloc_answer(&packet->answers, MDNS_TYPE_PTR, s->service, NULL, false, false)
-                    || !_mdns_alloc_answer(&packet->answers, MDNS_TYPE_SRV, s->service, NULL, true, false)
-                    || !_mdns_alloc_answer(&packet->answers, MDNS_TYPE_TXT, s->service, NULL, true, false)) {
-                _mdns_free_tx_packet(packet);
-                return NULL;
-            }
-            mdns_host_item_t *host = mdns_get_host_item(s->service->hostname);
-            if (!_mdns_alloc_answer(&packet->answers, MDNS_TYPE_A, NULL, host, true, false)
-                    || !_mdns_alloc_answer(&packet->answers, MDNS_TYPE_AAAA, NULL, host, true, false)) {
-                _mdns_free_tx_packet(packet);
-                return NULL;
-            }
-
-        } else if (s->type == MDNS_TYPE_A || s->type == MDNS_TYPE_AAAA) {
-            if (!_mdns_alloc_answer(&packet->answers, s->type, NULL, s->host, true, false)) {
-                _mdns_free_tx_packet(packet);
-                return NULL;
-            }
+    for (size_t i = 0; i < len; i++) {
+        mdns_service_t *service = services[i]->service;
+        mdns_host_item_t *host = mdns_get_host_item(service->hostname);
+        if (!_mdns_alloc_answer(&packet->answers, MDNS_TYPE_SDPTR, service, NULL, false, false)
+                || !_mdns_alloc_answer(&packet->answers, MDNS_TYPE_PTR, service, NULL, false, false)
+                || !_mdns_alloc_answer(&packet->answers, MDNS_TYPE_SRV, service, NULL, true, false)
+                || !_mdns_alloc_answer(&packet->answers, MDNS_TYPE_TXT, service, NULL, true, false)
+                || !_mdns_alloc_answer(&packet->answers, MDNS_TYPE_A, NULL, host, true, false)
+                || !_mdns_alloc_answer(&packet->answers, MDNS_TYPE_AAAA, NULL, host, true, false)) {
+            _mdns_free_tx_packet(packet);
+            return NULL;
         }
-
-        s = s->next;
+    }
+    if (_mdns_slot_test(announce, MDNS_SLOT_HOST)
+            && !_mdns_append_host_list_in_services(&packet->answers, len ? services : NULL, len, true, false)) {
+        _mdns_free_tx_packet(packet);
+        return NULL;
     }
     return packet;
 }
@@ -2152,98 +2994,172 @@ static void _mdns_pcb_send_bye(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protoco
 }
 
 /**
- * @brief  Send probe for additional services on particular PCB
+ * @brief  Create the probe of particular PCB for its services and host still probing
+ *
+ * Services probed for the first time go first, their questions ask for unicast responses.
  */
-static void _mdns_init_pcb_probe_new_service(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol, mdns_srv_item_t **services, size_t len, bool probe_ip)
+static mdns_tx_packet_t *_mdns_create_pcb_probe_packet(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol, const mdns_slots_t probe[])
 {
-    mdns_pcb_t *pcb = &_mdns_server->interfaces[tcpip_if].pcbs[ip_protocol];
-    size_t services_final_len = len;
+    mdns_srv_item_t *services[MDNS_MAX_SERVICES];
+    size_t len = _mdns_slots_services(&probe[0], services);
+    size_t first = len;
+    bool include_ip = _mdns_slot_test(&probe[0], MDNS_SLOT_HOST);
+    bool first_ip = include_ip;
+    for (size_t k = 1; k < MDNS_PROBE_COUNT; k++) {
+        len += _mdns_slots_services(&probe[k], services + len);
+        include_ip = include_ip || _mdns_slot_test(&probe[k], MDNS_SLOT_HOST);
+    }
+    return _mdns_create_probe_packet(tcpip_if, ip_protocol, len ? services : NULL, len, first, include_ip, first_ip);
+}
 
-    if (PCB_STATE_IS_PROBING(pcb)) {
-        services_final_len += pcb->probe_services_len;
+/**
+ * @brief  Replace the probe scheduled on particular PCB by one for the given probe slots
+ *
+ * The new probe goes out after send_after, or with the scheduled one if that is later, so services
+ * joining a running probing in quick succession are probed together. While probing, the PCB sends
+ * nothing but its probe.
+ */
+static bool _mdns_pcb_probe_schedule(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol, const mdns_slots_t probe[], uint32_t send_after)
+{
+    mdns_tx_packet_t *packet = _mdns_create_pcb_probe_packet(tcpip_if, ip_protocol, probe);
+    if (!packet) {
+        return false;
     }
-    mdns_srv_item_t **_services = NULL;
-    if (services_final_len) {
-        _services = (mdns_srv_item_t **)malloc(sizeof(mdns_srv_item_t *) * services_final_len);
-        if (!_services) {
-            HOOK_MALLOC_FAILED;
-            return;
+    mdns_tx_packet_t *scheduled = _mdns_get_next_pcb_packet(tcpip_if, ip_protocol);
+    if (scheduled) {
+        int32_t left = (int32_t)(scheduled->send_at - xTaskGetTickCount() * portTICK_PERIOD_MS);
+        if (left > 0 && (uint32_t)left > send_after) {
+            send_after = left;
         }
+    }
+    _mdns_clear_pcb_tx_queue(tcpip_if, ip_protocol);
+    _mdns_schedule_tx_packet(packet, send_after);
+    return true;
+}
 
-        size_t i;
-        for (i = 0; i < len; i++) {
-            _services[i] = services[i];
-        }
-        if (pcb->probe_services) {
-            for (i = 0; i < pcb->probe_services_len; i++) {
-                _services[len + i] = pcb->probe_services[i];
-            }
-            free(pcb->probe_services);
+/**
+ * @brief  Finish probing on particular PCB and announce what was probed
+ */
+static bool _mdns_pcb_probe_done(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol, const mdns_slots_t *announce)
+{
+    mdns_pcb_t *pcb = &_mdns_server->interfaces[tcpip_if].pcbs[ip_protocol];
+    if (_mdns_slots_empty(announce)) {
+        _mdns_clear_pcb_tx_queue(tcpip_if, ip_protocol);
+        pcb->state = PCB_RUNNING;
+    } else {
+        mdns_tx_packet_t *packet = _mdns_create_pcb_announce_packet(tcpip_if, ip_protocol, announce);
+        if (!packet) {
+            return false;
         }
+        _mdns_clear_pcb_tx_queue(tcpip_if, ip_protocol);
+        _mdns_schedule_tx_packet(packet, 250);
+        pcb->state = PCB_ANNOUNCE_1;
     }
-
-    probe_ip = pcb->probe_ip || probe_ip;
-
-    pcb->probe_ip = false;
-    pcb->probe_services = NULL;
-    pcb->probe_services_len = 0;
+    memset(pcb->probe, 0, sizeof(pcb->probe));
+    pcb->announce = *announce;
     pcb->probe_running = false;
+    pcb->failed_probes = 0;
+    return true;
+}
 
-    mdns_tx_packet_t *packet = _mdns_create_probe_packet(tcpip_if, ip_protocol, _services, services_final_len, true, probe_ip);
-    if (!packet) {
-        free(_services);
-        return;
+/**
+ * @brief  Move the probing on particular PCB one probe forward after its probe was sent
+ *
+ * Services and host sent their last probe wait for the others to announce together.
+ */
+static bool _mdns_pcb_probe_next(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol)
+{
+    mdns_pcb_t *pcb = &_mdns_server->interfaces[tcpip_if].pcbs[ip_protocol];
+    mdns_slots_t probe[MDNS_PROBE_COUNT];
+    mdns_slots_t announce = pcb->announce;
+    size_t sent = 0;
+
+    _mdns_slots_merge(&announce, &pcb->probe[MDNS_PROBE_COUNT - 1]);
+    memset(&probe[0], 0, sizeof(probe[0]));
+    for (size_t k = 1; k < MDNS_PROBE_COUNT; k++) {
+        probe[k] = pcb->probe[k - 1];
+        if (!_mdns_slots_empty(&probe[k])) {
+            sent = k;
+        }
+    }
+    if (!sent) {
+        return _mdns_pcb_probe_done(tcpip_if, ip_protocol, &announce);
+    }
+    if (!_mdns_pcb_probe_schedule(tcpip_if, ip_protocol, probe, 250)) {
+        return false;
     }
+    memcpy(pcb->probe, probe, sizeof(probe));
+    pcb->announce = announce;
+    pcb->state = (mdns_pcb_state_t)(PCB_PROBE_1 + sent);
+    return true;
+}
 
-    pcb->probe_ip = probe_ip;
-    pcb->probe_services = _services;
-    pcb->probe_services_len = services_final_len;
-    pcb->probe_running = true;
-    _mdns_schedule_tx_packet(packet, ((pcb->failed_probes > 5) ? 1000 : 120) + (esp_random() & 0x7F));
-    pcb->state = PCB_PROBE_1;
+static void _mdns_probe_slot_restart(mdns_slots_t probe[], size_t slot)
+{
+    for (size_t k = 1; k < MDNS_PROBE_COUNT; k++) {
+        _mdns_slot_clear(&probe[k], slot);
+    }
+    _mdns_slot_set(&probe[0], slot);
 }
 
 /**
  * @brief  Send probe for particular services on particular PCB
  *
- * Tests possible duplication on probing service structure and probes only for new entries.
- * - If pcb probing then add only non-probing services and restarts probing
- * - If pcb not probing, run probing for all specified services
+ * The services (and host if probe_ip) start over with their first probe.
+ * - If pcb probing then they join the scheduled probe, pushed back by a random delay, the others
+ *   continue where they are unless their next probe was due later, then they start over as well,
+ *   after too many conflicts the probing resumes after a longer delay
+ * - If pcb not probing, start probing after a random delay, the announcements in flight are
+ *   dropped and sent again once the probing is done
  */
 static void _mdns_init_pcb_probe(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol, mdns_srv_item_t **services, size_t len, bool probe_ip)
 {
     mdns_pcb_t *pcb = &_mdns_server->interfaces[tcpip_if].pcbs[ip_protocol];
 
-    _mdns_clear_pcb_tx_queue_head(tcpip_if, ip_protocol);
-
     if (_str_null_or_empty(_mdns_server->hostname)) {
+        _mdns_clear_pcb_tx_queue(tcpip_if, ip_protocol);
         pcb->state = PCB_RUNNING;
         return;
     }
 
-    if (PCB_STATE_IS_PROBING(pcb)) {
-        // Looking for already probing services to resolve duplications
-        mdns_srv_item_t *new_probe_services[len];
-        int new_probe_service_len = 0;
-        bool found;
-        for (size_t j = 0; j < len; ++j) {
-            found = false;
-            for (int i = 0; i < pcb->probe_services_len; ++i) {
-                if (pcb->probe_services[i] == services[j]) {
-                    found = true;
-                    break;
-                }
-            }
-            if (!found) {
-                new_probe_services[new_probe_service_len++] = services[j];
-            }
-        }
-        // init probing for newly added services
-        _mdns_init_pcb_probe_new_service(tcpip_if, ip_protocol,
-                                         new_probe_service_len ? new_probe_services : NULL, new_probe_service_len, probe_ip);
+    uint32_t send_after = ((pcb->failed_probes > 5) ? 1000 : 120) + (esp_random() & 0x7F);
+    bool restart = false;
+    if (!PCB_STATE_IS_PROBING(pcb) || !pcb->probe_running) {
+        _mdns_clear_pcb_tx_queue(tcpip_if, ip_protocol);
+        memset(pcb->probe, 0, sizeof(pcb->probe));
+    } else if (pcb->failed_probes > 5) {
+        //too many conflicts, hold the running probing back as well
+        _mdns_clear_pcb_tx_queue(tcpip_if, ip_protocol);
     } else {
-        // not probing, so init for all services
-        _mdns_init_pcb_probe_new_service(tcpip_if, ip_protocol, services, len, probe_ip);
+        mdns_tx_packet_t *scheduled = _mdns_get_next_pcb_packet(tcpip_if, ip_protocol);
+        //their next probe is due after the first one of the joining services, start them over with it
+        restart = scheduled && (int32_t)(scheduled->send_at - xTaskGetTickCount() * portTICK_PERIOD_MS - send_after) > 0;
+        if (restart) {
+            _mdns_clear_pcb_tx_queue(tcpip_if, ip_protocol);
+        }
+    }
+    mdns_slots_t probe[MDNS_PROBE_COUNT];
+    memcpy(probe, pcb->probe, sizeof(probe));
+    if (restart) {
+        for (size_t k = 1; k < MDNS_PROBE_COUNT; k++) {
+            _mdns_slots_merge(&probe[0], &probe[k]);
+        }
+        memset(&probe[1], 0, sizeof(probe) - sizeof(probe[0]));
+    }
+    for (size_t j = 0; j < len; ++j) {
+        _mdns_probe_slot_restart(probe, services[j]->slot);
+    }
+    if (probe_ip) {
+        _mdns_probe_slot_restart(probe, MDNS_SLOT_HOST);
+    }
+
+    if (!_mdns_pcb_probe_schedule(tcpip_if, ip_protocol, probe, send_after)) {
+        return;
+    }
+    memcpy(pcb->probe, probe, sizeof(probe));
+    pcb->probe_running = true;
+    if (restart || !PCB_STATE_IS_PROBING(pcb)) {
+        pcb->state = PCB_PROBE_1;
     }
 }
 
@@ -2252,19 +3168,8 @@ static void _mdns_init_pcb_probe(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_proto
  */
 static void _mdns_restart_pcb(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol)
 {
-    size_t srv_count = 0;
-    mdns_srv_item_t *a = _mdns_server->services;
-    while (a) {
-        srv_count++;
-        a = a->next;
-    }
-    mdns_srv_item_t *services[srv_count];
-    size_t i = 0;
-    a = _mdns_server->services;
-    while (a) {
-        services[i++] = a;
-        a = a->next;
-    }
+    mdns_srv_item_t *services[MDNS_MAX_SERVICES];
+    size_t srv_count = _mdns_services_collect(services, false);
     _mdns_init_pcb_probe(tcpip_if, ip_protocol, services, srv_count, true);
 }
 
@@ -2341,9 +3246,8 @@ static void _mdns_probe_all_pcbs(mdns_srv_item_t **services, size_t len, bool pr
             if (mdns_is_netif_ready(i, j)) {
                 mdns_pcb_t *_pcb = &_mdns_server->interfaces[i].pcbs[j];
                 if (clear_old_probe) {
-                    free(_pcb->probe_services);
-                    _pcb->probe_services = NULL;
-                    _pcb->probe_services_len = 0;
+                    memset(_pcb->probe, 0, sizeof(_pcb->probe));
+                    memset(&_pcb->announce, 0, sizeof(_pcb->announce));
                     _pcb->probe_running = false;
                 }
                 _mdns_init_pcb_probe((mdns_if_t)i, (mdns_ip_protocol_t)j, services, len, probe_ip);
@@ -2371,22 +3275,11 @@ static void _mdns_announce_all_pcbs(mdns_srv_item_t **services, size_t len, bool
 static void _mdns_send_final_bye(bool include_ip)
 {
     //collect all services and start probe
-    size_t srv_count = 0;
-    mdns_srv_item_t *a = _mdns_server->services;
-    while (a) {
-        srv_count++;
-        a = a->next;
-    }
+    mdns_srv_item_t *services[MDNS_MAX_SERVICES];
+    size_t srv_count = _mdns_services_collect(services, false);
     if (!srv_count) {
         return;
     }
-    mdns_srv_item_t *services[srv_count];
-    size_t i = 0;
-    a = _mdns_server->services;
-    while (a) {
-        services[i++] = a;
-        a = a->next;
-    }
     _mdns_send_bye(services, srv_count, include_ip);
 }
 
@@ -2395,26 +3288,11 @@ static void _mdns_send_final_bye(bool include_ip)
  */
 static void _mdns_send_bye_all_pcbs_no_instance(bool include_ip)
 {
-    size_t srv_count = 0;
-    mdns_srv_item_t *a = _mdns_server->services;
-    while (a) {
-        if (!a->service->instance) {
-            srv_count++;
-        }
-        a = a->next;
-    }
+    mdns_srv_item_t *services[MDNS_MAX_SERVICES];
+    size_t srv_count = _mdns_services_collect(services, true);
     if (!srv_count) {
         return;
     }
-    mdns_srv_item_t *services[srv_count];
-    size_t i = 0;
-    a = _mdns_server->services;
-    while (a) {
-        if (!a->service->instance) {
-            services[i++] = a;
-        }
-        a = a->next;
-    }
     _mdns_send_bye(services, srv_count, include_ip);
 }
 
@@ -2423,26 +3301,11 @@ static void _mdns_send_bye_all_pcbs_no_instance(bool include_ip)
  */
 static void _mdns_restart_all_pcbs_no_instance(void)
 {
-    size_t srv_count = 0;
-    mdns_srv_item_t *a = _mdns_server->services;
-    while (a) {
-        if (!a->service->instance) {
-            srv_count++;
-        }
-        a = a->next;
-    }
+    mdns_srv_item_t *services[MDNS_MAX_SERVICES];
+    size_t srv_count = _mdns_services_collect(services, true);
     if (!srv_count) {
         return;
     }
-    mdns_srv_item_t *services[srv_count];
-    size_t i = 0;
-    a = _mdns_server->services;
-    while (a) {
-        if (!a->service->instance) {
-            services[i++] = a;
-        }
-        a = a->next;
-    }
     _mdns_probe_all_pcbs(services, srv_count, false, true);
 }
 
@@ -2451,20 +3314,9 @@ static void _mdns_restart_all_pcbs_no_instance(void)
  */
 static void _mdns_restart_all_pcbs(void)
 {
-    _mdns_clear_tx_queue_head();
-    size_t srv_count = 0;
-    mdns_srv_item_t *a = _mdns_server->services;
-    while (a) {
-        srv_count++;
-        a = a->next;
-    }
-    mdns_srv_item_t *services[srv_count];
-    size_t l = 0;
-    a = _mdns_server->services;
-    while (a) {
-        services[l++] = a;
-        a = a->next;
-    }
+    _mdns_clear_tx_queue();
+    mdns_srv_item_t *services[MDNS_MAX_SERVICES];
+    size_t srv_count = _mdns_services_collect(services, false);
 
     _mdns_probe_all_pcbs(services, srv_count, true, true);
 }
@@ -2472,56 +3324,170 @@ static void _mdns_restart_all_pcbs(void)
 
 
 /**
- * @brief  creates/allocates new text item list
+ * @brief  length of a TXT item ("key=value" or "key" without value), without its length byte
+ *
+ * @return the length or -1 if the item does not fit the length byte
+ */
+static int _mdns_txt_item_len(const char *key, const char *value, size_t value_len)
+{
+    size_t len = strlen(key) + (value ? value_len + 1 : 0);
+    return len > UINT8_MAX ? -1 : len;
+}
+
+/**
+ * @brief  writes a TXT item with its length byte, see _mdns_txt_item_len()
+ *
+ * @return the end of the item
+ */
+static uint8_t *_mdns_txt_item_write(uint8_t *data, const char *key, const char *value, uint8_t len)
+{
+    size_t key_len = strlen(key);
+    *data++ = len;
+    memcpy(data, key, key_len);
+    if (value) {
+        data[key_len] = '=';
+        memcpy(data + key_len + 1, value, len - key_len - 1);
+    }
+    return data + len;
+}
+
+/**
+ * @brief  finds the TXT item of a key in TXT record data
+ *
+ * @return offset of the item (its length byte) or -1 if the key is not found
+ */
+static int _mdns_txt_item_find(const uint8_t *txt, uint16_t txt_len, const char *key)
+{
+    size_t key_len = strlen(key);
+    for (uint16_t i = 0; i < txt_len; i += txt[i] + 1) {
+        uint8_t len = txt[i];
+        if (len >= key_len && (len == key_len || txt[i + 1 + key_len] == '=') && !memcmp(txt + i + 1, key, key_len)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief  creates/allocates TXT record data of text items
  * @param  num_items     service number of txt items or 0
  * @param  txt           service txt items array or NULL
+ * @param  data          the TXT data, NULL if there is no valid item
+ * @param  data_len      length of the TXT data
+ *
+ * Items that don't fit their length byte are left out. The items are stored in reverse order,
+ * like the TXT items have always been sent.
  *
- * @return pointer to the linked txt item list or NULL
+ * @return ESP_OK or ESP_ERR_NO_MEM
  */
-static mdns_txt_linked_item_t *_mdns_allocate_txt(size_t num_items, mdns_txt_item_t txt[])
+static esp_err_t _mdns_allocate_txt(size_t num_items, mdns_txt_item_t txt[], uint8_t **data, uint16_t *data_len)
 {
-    mdns_txt_linked_item_t *new_txt = NULL;
-    size_t i = 0;
-    if (num_items) {
-        for (i = 0; i < num_items; i++) {
-            mdns_txt_linked_item_t *new_item = (mdns_txt_linked_item_t *)malloc(sizeof(mdns_txt_linked_item_t));
-            if (!new_item) {
-                HOOK_MALLOC_FAILED;
-                break;
-            }
-            new_item->key = strdup(txt[i].key);
-            if (!new_item->key) {
-                free(new_item);
-                break;
-            }
-            new_item->value = strdup(txt[i].value);
-            if (!new_item->value) {
-                free((char *)new_item->key);
-                free(new_item);
-                break;
-            }
-            new_item->value_len = strlen(new_item->value);
-            new_item->next = new_txt;
-            new_txt = new_item;
+    size_t len = 0;
+    for (size_t i = 0; i < num_items; i++) {
+        int item_len = _mdns_txt_item_len(txt[i].key, txt[i].value, txt[i].value ? strlen(txt[i].value) : 0);
+        if (item_len >= 0) {
+            len += item_len + 1;
+        }
+    }
+    *data = NULL;
+    *data_len = 0;
+    if (!len) {
+        return ESP_OK;
+    }
+    uint8_t *new_txt = (uint8_t *)_mdns_malloc(len);
+    if (!new_txt) {
+        HOOK_MALLOC_FAILED;
+        return ESP_ERR_NO_MEM;
+    }
+    uint8_t *end = new_txt + len;
+    for (size_t i = 0; i < num_items; i++) {
+        int item_len = _mdns_txt_item_len(txt[i].key, txt[i].value, txt[i].value ? strlen(txt[i].value) : 0);
+        if (item_len >= 0) {
+            end -= item_len + 1;
+            _mdns_txt_item_write(end, txt[i].key, txt[i].value, item_len);
         }
     }
-    return new_txt;
+    *data = new_txt;
+    *data_len = len;
+    return ESP_OK;
+}
+
+/**
+ * @brief  sets or removes a TXT item of a service
+ * @param  service       the service
+ * @param  key           the item key
+ * @param  value         the item value, NULL for an item without value
+ * @param  value_len     length of the value
+ * @param  remove        whether to remove the item
+ *
+ * An item that exists keeps its place, a new one goes first. An item that doesn't fit its length byte
+ * is not stored (or removed if the key existed), nor one that would grow the TXT data over 64 kB.
+ *
+ * @return false if out of memory (only when the item is added or grows)
+ */
+static bool _mdns_service_txt_update(mdns_service_t *service, const char *key, const char *value, uint8_t value_len, bool remove)
+{
+    int item_len = remove ? -1 : _mdns_txt_item_len(key, value, value_len);
+    int pos = _mdns_txt_item_find(service->txt, service->txt_len, key);
+    size_t old_len = pos < 0 ? 0 : service->txt[pos] + 1;
+    size_t new_len = item_len < 0 ? 0 : item_len + 1;
+    size_t len = service->txt_len - old_len + new_len;
+    if (pos < 0) {
+        pos = 0;
+    }
+    if (len > UINT16_MAX) {
+        return true;
+    }
+
+    if (!len) {
+        free(service->txt);
+        service->txt = NULL;
+        service->txt_len = 0;
+        return true;
+    }
+
+    // only a growing TXT data is allocated again
+    uint8_t *txt = service->txt;
+    if (len > service->txt_len) {
+        txt = (uint8_t *)_mdns_realloc(service->txt, len);
+        if (!txt) {
+            HOOK_MALLOC_FAILED;
+            return false;
+        }
+    }
+    size_t tail_len = service->txt_len - pos - old_len;
+    if (tail_len) {
+        memmove(txt + pos + new_len, txt + pos + old_len, tail_len);
+    }
+    if (new_len) {
+        _mdns_txt_item_write(txt + pos, key, value, item_len);
+    }
+    service->txt = txt;
+    service->txt_len = len;
+    return true;
 }
 
 /**
- * @brief Deallocate the txt linked list
- * @param txt pointer to the txt pointer to free, noop if txt==NULL
+ * @brief  adds a subtype to a service, in front of the others
+ *
+ * @return false if out of memory
  */
-static void _mdns_free_linked_txt(mdns_txt_linked_item_t *txt)
+static bool _mdns_service_subtype_add(mdns_service_t *service, const char *subtype)
 {
-    mdns_txt_linked_item_t *t;
-    while (txt) {
-        t = txt;
-        txt = txt->next;
-        free((char *)t->value);
-        free((char *)t->key);
-        free(t);
+    size_t len = strlen(subtype) + 1;
+    if (service->subtypes_len + len > UINT16_MAX) {
+        return false;
     }
+    char *subtypes = (char *)_mdns_realloc(service->subtypes, service->subtypes_len + len);
+    if (!subtypes) {
+        HOOK_MALLOC_FAILED;
+        return false;
+    }
+    memmove(subtypes + len, subtypes, service->subtypes_len);
+    memcpy(subtypes, subtype, len);
+    service->subtypes = subtypes;
+    service->subtypes_len += len;
+    return true;
 }
 
 /**
@@ -2534,59 +3500,45 @@ static void _mdns_free_linked_txt(mdns_txt_linked_item_t *txt)
  * @param  num_items     service number of txt items or 0
  * @param  txt           service txt items array or NULL
  *
+ * The names are stored in the same allocation as the service.
+ *
  * @return pointer to the service or NULL on error
  */
 static mdns_service_t *_mdns_create_service(const char *service, const char *proto, const char *hostname,
         uint16_t port, const char *instance, size_t num_items,
         mdns_txt_item_t txt[])
 {
-    mdns_service_t *s = (mdns_service_t *)calloc(1, sizeof(mdns_service_t));
+    size_t service_len = strnlen(service, MDNS_NAME_BUF_LEN - 1) + 1;
+    size_t proto_len = strnlen(proto, MDNS_NAME_BUF_LEN - 1) + 1;
+    size_t instance_len = instance ? strnlen(instance, MDNS_NAME_BUF_LEN - 1) + 1 : 0;
+    size_t hostname_len = hostname ? strnlen(hostname, MDNS_NAME_BUF_LEN - 1) + 1 : 0;
+    size_t names_len = service_len + proto_len + instance_len + hostname_len;
+
+    mdns_service_t *s = (mdns_service_t *)_mdns_calloc(1, sizeof(mdns_service_t) + names_len);
     if (!s) {
         HOOK_MALLOC_FAILED;
         return NULL;
     }
-
-    mdns_txt_linked_item_t *new_txt = _mdns_allocate_txt(num_items, txt);
-    if (num_items && new_txt == NULL) {
-        goto fail;
-    }
-
-    s->priority = 0;
-    s->weight = 0;
-    s->instance = instance ? strndup(instance, MDNS_NAME_BUF_LEN - 1) : NULL;
-    s->txt = new_txt;
-    s->port = port;
-    s->subtype = NULL;
-
-    if (hostname) {
-        s->hostname = strndup(hostname, MDNS_NAME_BUF_LEN - 1);
-        if (!s->hostname) {
-            goto fail;
-        }
-    } else {
-        s->hostname = NULL;
+    if (_mdns_allocate_txt(num_items, txt, &s->txt, &s->txt_len) != ESP_OK) {
+        free(s);
+        return NULL;
     }
 
-    s->service = strndup(service, MDNS_NAME_BUF_LEN - 1);
-    if (!s->service) {
-        goto fail;
+    // the allocation is zeroed, the names are terminated
+    char *names = s->names;
+    s->names_len = names_len;
+    s->service = memcpy(names, service, service_len - 1);
+    s->proto = memcpy(names += service_len, proto, proto_len - 1);
+    names += proto_len;
+    if (instance) {
+        s->instance = memcpy(names, instance, instance_len - 1);
+        names += instance_len;
     }
-
-    s->proto = strndup(proto, MDNS_NAME_BUF_LEN - 1);
-    if (!s->proto) {
-        goto fail;
+    if (hostname) {
+        s->hostname = memcpy(names, hostname, hostname_len - 1);
     }
+    s->port = port;
     return s;
-
-fail:
-    _mdns_free_linked_txt(s->txt);
-    free((char *)s->instance);
-    free((char *)s->service);
-    free((char *)s->proto);
-    free((char *)s->hostname);
-    free(s);
-
-    return NULL;
 }
 
 /**
@@ -2617,69 +3569,33 @@ static void _mdns_dealloc_scheduled_service_answers(mdns_out_answer_t **destinat
 /**
  * @brief  Find, remove and free answers and scheduled packets for service
  */
-static void _mdns_remove_scheduled_service_packets(mdns_service_t *service)
+static void _mdns_remove_scheduled_service_packets(mdns_srv_item_t *item)
 {
-    if (!service) {
+    if (!item) {
         return;
     }
-    mdns_tx_packet_t *p = NULL;
-    mdns_tx_packet_t *q = _mdns_server->tx_queue_head;
-    while (q) {
+    mdns_service_t *service = item->service;
+    for (uint16_t i = 0; i < _mdns_server->tx_queue_len; i++) {
+        mdns_tx_packet_t *q = _mdns_server->tx_queue[i];
         bool had_answers = (q->answers != NULL);
 
         _mdns_dealloc_scheduled_service_answers(&(q->answers), service);
         _mdns_dealloc_scheduled_service_answers(&(q->additional), service);
         _mdns_dealloc_scheduled_service_answers(&(q->servers), service);
 
-
         mdns_pcb_t *_pcb = &_mdns_server->interfaces[q->tcpip_if].pcbs[q->ip_protocol];
         if (mdns_is_netif_ready(q->tcpip_if, q->ip_protocol)) {
             if (PCB_STATE_IS_PROBING(_pcb)) {
-                uint8_t i;
-                //check if we are probing this service
-                for (i = 0; i < _pcb->probe_services_len; i++) {
-                    mdns_srv_item_t *s = _pcb->probe_services[i];
-                    if (s->service == service) {
+                //the probe is rebuilt below, do not leave the question in case that fails
+                mdns_out_question_t **qs = &q->questions;
+                while (*qs) {
+                    if ((*qs)->type == MDNS_TYPE_ANY && (*qs)->service == service->service && (*qs)->proto == service->proto) {
+                        mdns_out_question_t *qsn = *qs;
+                        *qs = qsn->next;
+                        free(qsn);
                         break;
                     }
-                }
-                if (i < _pcb->probe_services_len) {
-                    if (_pcb->probe_services_len > 1) {
-                        uint8_t n;
-                        for (n = (i + 1); n < _pcb->probe_services_len; n++) {
-                            _pcb->probe_services[n - 1] = _pcb->probe_services[n];
-                        }
-                        _pcb->probe_services_len--;
-                    } else {
-                        _pcb->probe_services_len = 0;
-                        free(_pcb->probe_services);
-                        _pcb->probe_services = NULL;
-                        if (!_pcb->probe_ip) {
-                            _pcb->probe_running = false;
-                            _pcb->state = PCB_RUNNING;
-                        }
-                    }
-
-                    if (q->questions) {
-                        mdns_out_question_t *qsn = NULL;
-                        mdns_out_question_t *qs = q->questions;
-                        if (qs->type == MDNS_TYPE_ANY
-                                && qs->service && strcmp(qs->service, service->service) == 0
-                                && qs->proto && strcmp(qs->proto, service->proto) == 0) {
-                            q->questions = q->questions->next;
-                            free(qs);
-                        } else while (qs->next) {
-                                qsn = qs->next;
-                                if (qsn->type == MDNS_TYPE_ANY
-                                        && qsn->service && strcmp(qsn->service, service->service) == 0
-                                        && qsn->proto && strcmp(qsn->proto, service->proto) == 0) {
-                                    qs->next = qsn->next;
-                                    free(qsn);
-                                    break;
-                                }
-                                qs = qs->next;
-                            }
-                    }
+                    qs = &(*qs)->next;
                 }
             } else if (PCB_STATE_IS_ANNOUNCING(_pcb)) {
                 //if answers were cleared, set to running
@@ -2689,11 +3605,33 @@ static void _mdns_remove_scheduled_service_packets(mdns_service_t *service)
             }
         }
 
-        p = q;
-        q = q->next;
-        if (!p->questions && !p->answers && !p->additional && !p->servers) {
-            queueDetach(mdns_tx_packet_t, _mdns_server->tx_queue_head, p);
-            _mdns_free_tx_packet(p);
+        if (!q->questions && !q->answers && !q->additional && !q->servers) {
+            _mdns_free_tx_packet(q);
+            _mdns_server->tx_queue[i] = NULL;
+        }
+    }
+    _mdns_tx_queue_compact();
+
+    for (uint8_t i = 0; i < MDNS_MAX_INTERFACES; i++) {
+        for (uint8_t j = 0; j < MDNS_IP_PROTOCOL_MAX; j++) {
+            mdns_pcb_t *_pcb = &_mdns_server->interfaces[i].pcbs[j];
+            bool probing = false;
+            bool left = false;
+            for (size_t k = 0; k < MDNS_PROBE_COUNT; k++) {
+                probing = probing || _mdns_slot_test(&_pcb->probe[k], item->slot);
+                _mdns_slot_clear(&_pcb->probe[k], item->slot);
+                left = left || !_mdns_slots_empty(&_pcb->probe[k]);
+            }
+            _mdns_slot_clear(&_pcb->announce, item->slot);
+            if (!probing || !PCB_STATE_IS_PROBING(_pcb) || !_pcb->probe_running) {
+                continue;
+            }
+            //probe again for the rest, or announce them if none is left probing
+            if (left) {
+                _mdns_pcb_probe_schedule((mdns_if_t)i, (mdns_ip_protocol_t)j, _pcb->probe, 0);
+            } else {
+                _mdns_pcb_probe_done((mdns_if_t)i, (mdns_ip_protocol_t)j, &_pcb->announce);
+            }
         }
     }
 }
@@ -2708,23 +3646,11 @@ static void _mdns_free_service(mdns_service_t *service)
     if (!service) {
         return;
     }
-    free((char *)service->instance);
-    free((char *)service->service);
-    free((char *)service->proto);
-    free((char *)service->hostname);
-    while (service->txt) {
-        mdns_txt_linked_item_t *s = service->txt;
-        service->txt = service->txt->next;
-        free((char *)s->key);
-        free((char *)s->value);
-        free(s);
-    }
-    while (service->subtype) {
-        mdns_subtype_t *next = service->subtype->next;
-        free((char *)service->subtype->subtype);
-        free(service->subtype);
-        service->subtype = next;
-    }
+    _mdns_service_free_name(service, service->instance);
+    _mdns_service_free_name(service, service->hostname);
+    free(service->wire);
+    free(service->txt);
+    free(service->subtypes);
     free(service);
 }
 
@@ -2804,11 +3730,12 @@ static int _mdns_check_txt_collision(mdns_service_t *service, const uint8_t *dat
         return 0;//same
     }
 
-    mdns_txt_linked_item_t *txt = service->txt;
-    while (txt) {
-        data_len += 1 /* record-len */ + strlen(txt->key) + txt->value_len + (txt->value ? 1 : 0 /* "=" */);
-        txt = txt->next;
+    // compare with the data we send, the TXT record is left out if it does not fit a packet
+    if (service->txt_len >= MDNS_MAX_PACKET_SIZE) {
+        return 0;
     }
+    const uint8_t *txt = service->txt_len ? service->txt : (const uint8_t *)""; // a single empty string
+    data_len = service->txt_len ? service->txt_len : 1;
 
     if (len > data_len) {
         return 1;//they win
@@ -2816,16 +3743,7 @@ static int _mdns_check_txt_collision(mdns_service_t *service, const uint8_t *dat
         return -1;//we win
     }
 
-    uint8_t ours[len];
-    uint16_t index = 0;
-
-    txt = service->txt;
-    while (txt) {
-        append_one_txt_record_entry(ours, &index, txt);
-        txt = txt->next;
-    }
-
-    int ret = memcmp(ours, data, len);
+    int ret = memcmp(txt, data, len);
     if (ret > 0) {
         return -1;//we win
     } else if (ret < 0) {
@@ -2841,11 +3759,9 @@ static esp_err_t mdns_pcb_deinit_local(mdns_if_t tcpip_if, mdns_ip_protocol_t ip
     if (_pcb == NULL || err != ESP_OK) {
         return err;
     }
-    free(_pcb->probe_services);
     _pcb->state = PCB_OFF;
-    _pcb->probe_ip = false;
-    _pcb->probe_services = NULL;
-    _pcb->probe_services_len = 0;
+    memset(_pcb->probe, 0, sizeof(_pcb->probe));
+    memset(&_pcb->announce, 0, sizeof(_pcb->announce));
     _pcb->probe_running = false;
     _pcb->failed_probes = 0;
     return ESP_OK;
@@ -2864,9 +3780,12 @@ static void _mdns_dup_interface(mdns_if_t tcpip_if)
         if (mdns_is_netif_ready(other_if, i)) {
             //stop this interface and mark as dup
             if (mdns_is_netif_ready(tcpip_if, i)) {
-                _mdns_clear_pcb_tx_queue_head(tcpip_if, i);
+                _mdns_clear_pcb_tx_queue(tcpip_if, i);
                 mdns_pcb_deinit_local(tcpip_if, i);
             }
+#if MDNS_CACHE_SIZE
+            _mdns_cache_remove_pcb(tcpip_if, i);
+#endif
             _mdns_server->interfaces[tcpip_if].pcbs[i].state = PCB_DUP;
             _mdns_announce_pcb(other_if, i, NULL, 0, true);
         }
@@ -2973,7 +3892,7 @@ static bool _mdns_delegate_hostname_add(const char *hostname, mdns_ip_addr_t *ad
         return false;
     }
 
-    mdns_host_item_t *host = (mdns_host_item_t *)malloc(sizeof(mdns_host_item_t));
+    mdns_host_item_t *host = (mdns_host_item_t *)_mdns_malloc(sizeof(mdns_host_item_t));
 
     if (host == NULL) {
         return false;
@@ -3020,7 +3939,7 @@ static mdns_ip_addr_t *copy_address_list(const mdns_ip_addr_t *address_list)
     mdns_ip_addr_t *head = NULL;
     mdns_ip_addr_t *tail = NULL;
     while (address_list != NULL) {
-        mdns_ip_addr_t *addr = (mdns_ip_addr_t *)malloc(sizeof(mdns_ip_addr_t));
+        mdns_ip_addr_t *addr = (mdns_ip_addr_t *)_mdns_malloc(sizeof(mdns_ip_addr_t));
         if (addr == NULL) {
             free_address_list(head);
             return NULL;
@@ -3059,7 +3978,8 @@ static bool _mdns_delegate_hostname_remove(const char *hostname)
         if (strcasecmp(srv->service->hostname, hostname) == 0) {
             mdns_srv_item_t *to_free = srv;
             _mdns_send_bye(&srv, 1, false);
-            _mdns_remove_scheduled_service_packets(srv->service);
+            _mdns_remove_scheduled_service_packets(srv);
+            _mdns_service_index_remove(srv);
             if (prev_srv == NULL) {
                 _mdns_server->services = srv->next;
                 srv = srv->next;
@@ -3237,8 +4157,7 @@ static const uint8_t *_mdns_parse_fqdn(const uint8_t *packet, const uint8_t *sta
     name->domain[0] = 0;
     name->invalid = false;
 
-    static char buf[MDNS_NAME_BUF_LEN];
-
+    char buf[MDNS_NAME_BUF_LEN];
     const uint8_t *next_data = (uint8_t *)_mdns_read_fqdn(packet, start, name, buf, packet_len);
     if (!next_data) {
         return 0;
@@ -3261,94 +4180,329 @@ static const uint8_t *_mdns_parse_fqdn(const uint8_t *packet, const uint8_t *sta
     return next_data;
 }
 
+#if MDNS_PARSE_WORKER
 /**
- * @brief  Called from parser to check if question matches particular service
+ * @brief  Decodes the name at start into the next free entry of the names
+ *
+ * @return the data after the name, NULL if it is malformed or the names are full
  */
-static bool _mdns_question_matches(mdns_parsed_question_t *question, uint16_t type, mdns_srv_item_t *service)
+static const uint8_t *_mdns_parse_names_add(mdns_parse_names_t *names, const uint8_t *data, const uint8_t *start, size_t len)
 {
-    if (question->type != type) {
-        return false;
+    if (names->count >= MDNS_PARSE_NAMES_MAX) {
+        return NULL;
     }
-    if (type == MDNS_TYPE_A || type == MDNS_TYPE_AAAA) {
-        return true;
-    } else if (type == MDNS_TYPE_PTR || type == MDNS_TYPE_SDPTR) {
-        if (question->service && question->proto && question->domain
-                && !strcasecmp(service->service->service, question->service)
-                && !strcasecmp(service->service->proto, question->proto)
-                && !strcasecmp(MDNS_DEFAULT_DOMAIN, question->domain)) {
-            return true;
+    const uint8_t *next = _mdns_parse_fqdn(data, start, &names->names[names->count].name, len);
+    names->names[names->count].at = start;
+    names->names[names->count].next = next;
+    names->count++;
+    return next;
+}
+
+/**
+ * @brief  Decodes the names of a received packet the way mdns_parse_packet() walks it
+ *
+ * Reads the packet only, so it needs no service lock. Stops at the first malformed record or once the names
+ * are full, the parser reads the others itself.
+ */
+static void _mdns_parse_names_decode(mdns_parse_names_t *names, const uint8_t *data, size_t len)
+{
+    names->count = 0;
+    if (len <= MDNS_HEAD_ADDITIONAL_OFFSET) {
+        return;
+    }
+    const uint8_t *content = data + MDNS_HEAD_LEN;
+    uint8_t qs = _mdns_read_u16(data, MDNS_HEAD_QUESTIONS_OFFSET);
+    while (qs--) {
+        content = _mdns_parse_names_add(names, data, content, len);
+        if (!content || content + MDNS_CLASS_OFFSET + 1 >= data + len) {
+            return;
         }
-    } else if (service && (type == MDNS_TYPE_SRV || type == MDNS_TYPE_TXT)) {
-        const char *name = _mdns_get_service_instance_name(service->service);
-        if (name && question->host && question->service && question->proto && question->domain
-                && !strcasecmp(name, question->host)
-                && !strcasecmp(service->service->service, question->service)
-                && !strcasecmp(service->service->proto, question->proto)
-                && !strcasecmp(MDNS_DEFAULT_DOMAIN, question->domain)) {
-            return true;
+        content = content + 4;
+    }
+    if (!_mdns_read_u16(data, MDNS_HEAD_ANSWERS_OFFSET) && !_mdns_read_u16(data, MDNS_HEAD_SERVERS_OFFSET)
+            && !_mdns_read_u16(data, MDNS_HEAD_ADDITIONAL_OFFSET)) {
+        return;
+    }
+    while (content < (data + len)) {
+        content = _mdns_parse_names_add(names, data, content, len);
+        if (!content || content + MDNS_LEN_OFFSET + 1 >= data + len) {
+            return;
+        }
+        uint16_t type = _mdns_read_u16(content, MDNS_TYPE_OFFSET);
+        const uint8_t *data_ptr = content + MDNS_DATA_OFFSET;
+        content = data_ptr + _mdns_read_u16(content, MDNS_LEN_OFFSET);
+        if (content > (data + len)) {
+            return;
+        }
+        if (type == MDNS_TYPE_PTR) {
+            _mdns_parse_names_add(names, data, data_ptr, len);
+        } else if (type == MDNS_TYPE_SRV) {
+            _mdns_parse_names_add(names, data, data_ptr + MDNS_SRV_FQDN_OFFSET, len);
         }
     }
+}
+#endif /* MDNS_PARSE_WORKER */
 
-    return false;
+/**
+ * @brief  Reads the name at start of the packet being parsed, taken from the names decoded ahead if one starts there
+ *
+ * @param  scratch      receives the name unless it was decoded ahead
+ * @param  name         set to the name read
+ *
+ * @return the data after the name, NULL if it is malformed
+ */
+static const uint8_t *_mdns_parser_read_fqdn(mdns_parser_t *parser, const uint8_t *data, const uint8_t *start,
+        mdns_name_t *scratch, mdns_name_t **name, size_t len)
+{
+    const mdns_parse_names_t *names = parser->names;
+    if (names) {
+        // the names are read in packet order, the ones the parser had no use for are passed
+        while (parser->names_pos < names->count && names->names[parser->names_pos].at < start) {
+            parser->names_pos++;
+        }
+        if (parser->names_pos < names->count && names->names[parser->names_pos].at == start) {
+            *name = (mdns_name_t *)&names->names[parser->names_pos].name;
+            return names->names[parser->names_pos].next;
+        }
+    }
+    *name = scratch;
+    return _mdns_parse_fqdn(data, start, scratch, len);
 }
 
+#define MDNS_ARENA_ALIGN_UP(size)   (((size) + MDNS_PARSE_ARENA_ALIGN - 1) & ~(size_t)(MDNS_PARSE_ARENA_ALIGN - 1))
+
 /**
- * @brief  Removes saved question from parsed data
+ * @brief  Prepare an empty parser arena
  */
-static void _mdns_remove_parsed_question(mdns_parsed_packet_t *parsed_packet, uint16_t type, mdns_srv_item_t *service)
+static void _mdns_arena_init(mdns_parse_arena_t *arena)
 {
-    mdns_parsed_question_t *q = parsed_packet->questions;
+    arena->head.next = NULL;
+    arena->head.size = sizeof(arena->buf);
+    arena->head.used = 0;
+    arena->head.data = arena->buf;
+    arena->current = &arena->head;
+}
 
-    if (_mdns_question_matches(q, type, service)) {
-        parsed_packet->questions = q->next;
-        free(q->host);
-        free(q->service);
-        free(q->proto);
-        free(q->domain);
-        free(q);
-        return;
+/**
+ * @brief  Free the heap chunks chained from the given one on
+ */
+static void _mdns_chunks_free(mdns_arena_chunk_t *chunk)
+{
+    while (chunk) {
+        mdns_arena_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
     }
+}
 
-    while (q->next) {
-        mdns_parsed_question_t *p = q->next;
-        if (_mdns_question_matches(p, type, service)) {
-            q->next = p->next;
-            free(p->host);
-            free(p->service);
-            free(p->proto);
-            free(p->domain);
-            free(p);
-            return;
+/**
+ * @brief  Allocate zeroed memory from the current chunk, or from a new heap chunk chained after it
+ *
+ * @param  current      chunk being filled, updated when a new chunk is added
+ * @param  chunk_size   size of the new chunk, unless the allocation is bigger
+ */
+static void *_mdns_chunk_alloc(mdns_arena_chunk_t **current, size_t size, size_t chunk_size)
+{
+    size = MDNS_ARENA_ALIGN_UP(size);
+    mdns_arena_chunk_t *chunk = *current;
+    if (chunk->size - chunk->used < size) {
+        chunk_size = MAX(size, chunk_size);
+        chunk = (mdns_arena_chunk_t *)_mdns_malloc(MDNS_ARENA_ALIGN_UP(sizeof(mdns_arena_chunk_t)) + chunk_size);
+        if (!chunk) {
+            HOOK_MALLOC_FAILED;
+            return NULL;
         }
-        q = q->next;
+        chunk->next = NULL;
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        chunk->data = (uint8_t *)chunk + MDNS_ARENA_ALIGN_UP(sizeof(mdns_arena_chunk_t));
+        (*current)->next = chunk;
+        *current = chunk;
     }
+    void *mem = chunk->data + chunk->used;
+    chunk->used += size;
+    memset(mem, 0, size);
+    return mem;
 }
 
 /**
- * @brief  Get number of items in TXT parsed data
+ * @brief  Release everything allocated from the arena
  */
-static int _mdns_txt_items_count_get(const uint8_t *data, size_t len)
+static void _mdns_arena_reset(mdns_parse_arena_t *arena)
 {
-    if (len == 1) {
-        return 0;
+    _mdns_chunks_free(arena->head.next);
+    _mdns_arena_init(arena);
+}
+
+/**
+ * @brief  Allocate zeroed memory from the arena
+ *
+ * Packets which do not fit the static buffer (e.g. many names expanded from compression pointers) continue in heap
+ * chunks, which are freed on reset.
+ */
+static void *_mdns_arena_alloc(mdns_parse_arena_t *arena, size_t size)
+{
+    return _mdns_chunk_alloc(&arena->current, size, MDNS_PARSE_ARENA_SIZE / 2);
+}
+
+/**
+ * @brief  Copy string to the arena or return error, empty strings are stored as NULL
+ */
+static esp_err_t _mdns_arena_strdup_check(mdns_parse_arena_t *arena, const char **out, const char *in)
+{
+    *out = NULL;
+    if (in && in[0]) {
+        size_t len = strlen(in) + 1;
+        char *copy = (char *)_mdns_arena_alloc(arena, len);
+        if (!copy) {
+            return ESP_FAIL;
+        }
+        memcpy(copy, in, len);
+        *out = copy;
     }
+    return ESP_OK;
+}
 
-    int num_items = 0;
-    uint16_t i = 0;
-    size_t partLen = 0;
+/**
+ * @brief  Node of a result allocated by _mdns_result_new()
+ */
+static inline mdns_result_node_t *_mdns_result_node(mdns_result_t *r)
+{
+    return (mdns_result_node_t *)((uint8_t *)r - offsetof(mdns_result_node_t, result));
+}
 
-    while (i < len) {
-        partLen = data[i++];
-        if (!partLen) {
-            break;
+/**
+ * @brief  Allocate zeroed memory from the set of the result, it's freed with the set
+ */
+static void *_mdns_result_alloc(mdns_result_t *r, size_t size)
+{
+    return _mdns_chunk_alloc(&_mdns_result_node(r)->set->current, size, MDNS_RESULT_SLAB_SIZE);
+}
+
+/**
+ * @brief  Add an empty result to the head of the list, allocated from the set of the list
+ *
+ * The first result of a list creates its set, mdns_query_results_free() frees it with the last result of the list.
+ *
+ * @return the result or NULL if out of memory
+ */
+static mdns_result_t *_mdns_result_new(mdns_result_t **list)
+{
+    mdns_result_set_t *set;
+    if (*list) {
+        set = _mdns_result_node(*list)->set;
+    } else {
+        set = (mdns_result_set_t *)_mdns_malloc(sizeof(mdns_result_set_t));
+        if (!set) {
+            HOOK_MALLOC_FAILED;
+            return NULL;
         }
-        if ((i + partLen) > len) {
-            return -1;//error
+        memset(set, 0, offsetof(mdns_result_set_t, buf));
+        set->head.size = sizeof(set->buf);
+        set->head.data = set->buf;
+        set->current = &set->head;
+    }
+    mdns_result_node_t *node = (mdns_result_node_t *)_mdns_chunk_alloc(&set->current, sizeof(mdns_result_node_t),
+                               MDNS_RESULT_SLAB_SIZE);
+    if (!node) {
+        if (!*list) {
+            free(set);
         }
-        i += partLen;
-        num_items++;
+        return NULL;
     }
-    return num_items;
+    node->set = set;
+    node->seq = ++set->seq;
+    set->live++;
+    node->result.next = *list;
+    *list = &node->result;
+    return &node->result;
+}
+
+/**
+ * @brief  Copy the string to the set of the result
+ *
+ * @return the copy, NULL if out of memory or str is NULL
+ */
+static char *_mdns_result_strdup(mdns_result_t *r, const char *str)
+{
+    if (!str) {
+        return NULL;
+    }
+    size_t len = strlen(str) + 1;
+    char *copy = (char *)_mdns_result_alloc(r, len);
+    if (copy) {
+        memcpy(copy, str, len);
+    }
+    return copy;
+}
+
+/**
+ * @brief  Set the instance name of a new result and add it to the instances lookup table
+ *
+ * @return false if out of memory
+ */
+static bool _mdns_result_set_instance(mdns_result_t *r, const char *instance)
+{
+    r->instance_name = _mdns_result_strdup(r, instance);
+    if (!r->instance_name) {
+        return false;
+    }
+    mdns_result_node_t *node = _mdns_result_node(r);
+    node->instance_hash = _mdns_hash_name(2166136261u, instance);
+    mdns_result_node_t **bucket = &node->set->instances[node->instance_hash & (MDNS_RESULT_SET_SIZE - 1)];
+    node->instance_next = *bucket;
+    *bucket = node;
+    return true;
+}
+
+/**
+ * @brief  Set the host name of a result without one and add it to the hosts lookup table
+ *
+ * @return false if out of memory
+ */
+static bool _mdns_result_set_hostname(mdns_result_t *r, const char *hostname)
+{
+    r->hostname = _mdns_result_strdup(r, hostname);
+    if (!r->hostname) {
+        return false;
+    }
+    mdns_result_node_t *node = _mdns_result_node(r);
+    node->host_hash = _mdns_hash_name(2166136261u, hostname);
+    mdns_result_node_t **bucket = &node->set->hosts[node->host_hash & (MDNS_RESULT_SET_SIZE - 1)];
+    node->host_next = *bucket;
+    *bucket = node;
+    return true;
+}
+
+/**
+ * @brief  Find the result of the interface with the instance or host name, the first one in the list order
+ *
+ * @param  host     look up the host name, the instance name otherwise
+ * @param  exact    names compare case-sensitive, an empty name only matches an empty one this way
+ */
+static mdns_result_t *_mdns_result_find(mdns_result_t *list, bool host, const char *name, bool exact,
+                                        esp_netif_t *esp_netif, mdns_ip_protocol_t ip_protocol)
+{
+    if (!list || !name || (!exact && !*name)) {
+        return NULL;
+    }
+    mdns_result_set_t *set = _mdns_result_node(list)->set;
+    uint32_t hash = _mdns_hash_name(2166136261u, name);
+    mdns_result_node_t *found = NULL;
+    mdns_result_node_t *node = host ? set->hosts[hash & (MDNS_RESULT_SET_SIZE - 1)]
+                               : set->instances[hash & (MDNS_RESULT_SET_SIZE - 1)];
+    for (; node; node = host ? node->host_next : node->instance_next) {
+        mdns_result_t *r = &node->result;
+        if ((host ? node->host_hash : node->instance_hash) != hash || r->esp_netif != esp_netif
+                || r->ip_protocol != ip_protocol || (found && found->seq > node->seq)) {
+            continue;
+        }
+        const char *other = host ? r->hostname : r->instance_name;
+        if (exact ? !strcmp(name, other) : !strcasecmp(name, other)) {
+            found = node;
+        }
+    }
+    return found ? &found->result : NULL;
 }
 
 /**
@@ -3368,129 +4522,389 @@ static int _mdns_txt_item_name_get_len(const uint8_t *data, size_t len)
 }
 
 /**
- * @brief  Create TXT result array from parsed TXT data
+ * @brief  Get number of items with a key in TXT parsed data
+ *
+ * @return number of items or -1 if the data is malformed
  */
-static void _mdns_result_txt_create(const uint8_t *data, size_t len, mdns_txt_item_t **out_txt, uint8_t **out_value_len,
-                                    size_t *out_count)
+static int _mdns_txt_items_count_get(const uint8_t *data, size_t len)
 {
-    *out_txt = NULL;
-    *out_count = 0;
-    uint16_t i = 0, y;
-    size_t partLen = 0;
-    int num_items = _mdns_txt_items_count_get(data, len);
-    if (num_items < 0) {
-        return;//error
+    if (len == 1) {
+        return 0;
     }
 
-    if (!num_items) {
-        return;
+    int num_items = 0;
+    uint16_t i = 0;
+    size_t partLen = 0;
+
+    while (i < len) {
+        partLen = data[i++];
+        if (!partLen) {
+            break;
+        }
+        if ((i + partLen) > len) {
+            return -1;//error
+        }
+        if (_mdns_txt_item_name_get_len(data + i, partLen) >= 0) {
+            num_items++;
+        }
+        i += partLen;
     }
+    return num_items;
+}
 
-    mdns_txt_item_t *txt = (mdns_txt_item_t *)malloc(sizeof(mdns_txt_item_t) * num_items);
-    if (!txt) {
-        HOOK_MALLOC_FAILED;
+/**
+ * @brief  Create TXT result array from parsed TXT data, in the set of the result
+ *
+ * The result is left without TXT if the data has no valid item or out of memory.
+ */
+static void _mdns_result_txt_create(mdns_result_t *r, const uint8_t *data, size_t len)
+{
+    int num_items = _mdns_txt_items_count_get(data, len);
+    if (num_items <= 0) {
         return;
     }
-    uint8_t *txt_value_len = (uint8_t *)malloc(num_items);
-    if (!txt_value_len) {
-        free(txt);
-        HOOK_MALLOC_FAILED;
+
+    mdns_txt_item_t *txt = (mdns_txt_item_t *)_mdns_result_alloc(r, sizeof(mdns_txt_item_t) * num_items);
+    uint8_t *txt_value_len = (uint8_t *)_mdns_result_alloc(r, num_items);
+    if (!txt || !txt_value_len) {
         return;
     }
-    memset(txt, 0, sizeof(mdns_txt_item_t) * num_items);
-    memset(txt_value_len, 0, num_items);
     size_t txt_num = 0;
+    uint16_t i = 0;
 
+    // the items were checked by _mdns_txt_items_count_get()
     while (i < len) {
-        partLen = data[i++];
+        size_t partLen = data[i++];
         if (!partLen) {
             break;
         }
-
-        if ((i + partLen) > len) {
-            goto handle_error;//error
-        }
-
         int name_len = _mdns_txt_item_name_get_len(data + i, partLen);
-        if (name_len < 0) {//invalid item (no name)
-            i += partLen;
-            continue;
-        }
-        char *key = (char *)malloc(name_len + 1);
-        if (!key) {
-            HOOK_MALLOC_FAILED;
-            goto handle_error;//error
+        if (name_len >= 0) {
+            char *key = (char *)_mdns_result_alloc(r, name_len + 1);
+            if (!key) {
+                return;
+            }
+            memcpy(key, data + i, name_len);
+            txt[txt_num].key = key;
+
+            int value_len = partLen - name_len - 1;
+            if (value_len > 0) {
+                char *value = (char *)_mdns_result_alloc(r, value_len + 1);
+                if (!value) {
+                    return;
+                }
+                memcpy(value, data + i + name_len + 1, value_len);
+                txt[txt_num].value = value;
+                txt_value_len[txt_num] = value_len;
+            }
+            txt_num++;
         }
+        i += partLen;
+    }
 
-        mdns_txt_item_t *t = &txt[txt_num];
-        uint8_t *value_len = &txt_value_len[txt_num];
-        txt_num++;
+    r->txt = txt;
+    r->txt_value_len = txt_value_len;
+    r->txt_count = txt_num;
+}
 
-        memcpy(key, data + i, name_len);
-        key[name_len] = 0;
-        i += name_len + 1;
-        t->key = key;
+/**
+ * @brief  Create linked IP (copy) from parsed one, in the set of the result
+ */
+static mdns_ip_addr_t *_mdns_result_addr_create_ip(mdns_result_t *r, const esp_ip_addr_t *ip)
+{
+    mdns_ip_addr_t *a = (mdns_ip_addr_t *)_mdns_result_alloc(r, sizeof(mdns_ip_addr_t));
+    if (!a) {
+        return NULL;
+    }
+    a->addr.type = ip->type;
+    if (ip->type == ESP_IPADDR_TYPE_V6) {
+        memcpy(a->addr.u_addr.ip6.addr, ip->u_addr.ip6.addr, 16);
+    } else {
+        a->addr.u_addr.ip4.addr = ip->u_addr.ip4.addr;
+    }
+    return a;
+}
 
-        int new_value_len = partLen - name_len - 1;
-        if (new_value_len > 0) {
-            char *value = (char *)malloc(new_value_len + 1);
-            if (!value) {
-                HOOK_MALLOC_FAILED;
-                goto handle_error;//error
-            }
-            memcpy(value, data + i, new_value_len);
-            value[new_value_len] = 0;
-            *value_len = new_value_len;
-            i += new_value_len;
-            t->value = value;
+#if MDNS_CACHE_SIZE
+/**
+ * @brief  Bucket of the cached records with the type and owner name
+ */
+static mdns_cache_entry_t **_mdns_cache_bucket(uint16_t type, const char *host, const char *service, const char *proto)
+{
+    uint32_t hash = _mdns_hash_name(_mdns_hash_name(_mdns_hash_name((2166136261u ^ type) * 16777619, host), service), proto);
+    return &_mdns_server->cache.index[hash & (MDNS_CACHE_INDEX_SIZE - 1)];
+}
+
+static void _mdns_cache_unlink_lru(mdns_cache_entry_t *entry)
+{
+    mdns_cache_t *cache = &_mdns_server->cache;
+    if (entry->newer) {
+        entry->newer->older = entry->older;
+    } else {
+        cache->newest = entry->older;
+    }
+    if (entry->older) {
+        entry->older->newer = entry->newer;
+    } else {
+        cache->oldest = entry->newer;
+    }
+}
+
+static void _mdns_cache_link_lru(mdns_cache_entry_t *entry)
+{
+    mdns_cache_t *cache = &_mdns_server->cache;
+    entry->newer = NULL;
+    entry->older = cache->newest;
+    if (cache->newest) {
+        cache->newest->newer = entry;
+    } else {
+        cache->oldest = entry;
+    }
+    cache->newest = entry;
+}
+
+/**
+ * @brief  Mark the entry as the most recently used one
+ */
+static void _mdns_cache_touch(mdns_cache_entry_t *entry)
+{
+    if (_mdns_server->cache.newest != entry) {
+        _mdns_cache_unlink_lru(entry);
+        _mdns_cache_link_lru(entry);
+    }
+}
+
+static void _mdns_cache_remove(mdns_cache_entry_t *entry)
+{
+    mdns_cache_entry_t **p = _mdns_cache_bucket(entry->type, entry->host, entry->service, entry->proto);
+    while (*p && *p != entry) {
+        p = &(*p)->hash_next;
+    }
+    if (*p) {
+        *p = entry->hash_next;
+    }
+    _mdns_cache_unlink_lru(entry);
+    _mdns_server->cache.count--;
+    free(entry);
+}
+
+/**
+ * @brief  Drop the records received on the interface, they may not be reachable anymore
+ */
+static void _mdns_cache_remove_pcb(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol)
+{
+    mdns_cache_entry_t *entry = _mdns_server->cache.newest;
+    while (entry) {
+        mdns_cache_entry_t *older = entry->older;
+        if (entry->tcpip_if == tcpip_if && entry->ip_protocol == ip_protocol) {
+            _mdns_cache_remove(entry);
         }
+        entry = older;
     }
+}
 
-    *out_txt = txt;
-    *out_count = txt_num;
-    *out_value_len = txt_value_len;
-    return;
+static void _mdns_cache_clear(void)
+{
+    while (_mdns_server->cache.newest) {
+        _mdns_cache_remove(_mdns_server->cache.newest);
+    }
+}
 
-handle_error :
-    for (y = 0; y < txt_num; y++) {
-        mdns_txt_item_t *t = &txt[y];
-        free((char *)t->key);
-        free((char *)t->value);
+/**
+ * @brief  Next unexpired entry with the type and owner name in the bucket chain, starting at the entry,
+ *         expired entries found on the way are removed
+ */
+static mdns_cache_entry_t *_mdns_cache_scan(mdns_cache_entry_t *entry, uint16_t type, const char *host,
+        const char *service, const char *proto, uint32_t now)
+{
+    while (entry) {
+        mdns_cache_entry_t *next = entry->hash_next;
+        if ((int32_t)(entry->expires_at - now) <= 0) {
+            _mdns_cache_remove(entry);
+        } else if (entry->type == type && !strcasecmp(entry->host, host)
+                   && !strcasecmp(entry->service, service) && !strcasecmp(entry->proto, proto)) {
+            return entry;
+        }
+        entry = next;
     }
-    free(txt_value_len);
-    free(txt);
+    return NULL;
 }
 
 /**
- * @brief  Duplicate string or return error
+ * @brief  Remaining TTL of the entry in seconds
  */
-static esp_err_t _mdns_strdup_check(char **out, char *in)
+static uint32_t _mdns_cache_ttl(mdns_cache_entry_t *entry, uint32_t now)
 {
-    if (in && in[0]) {
-        *out = strdup(in);
-        if (!*out) {
-            return ESP_FAIL;
+    uint32_t ttl = (entry->expires_at - now) / 1000;
+    return ttl ? ttl : 1;
+}
+
+/**
+ * @brief  Adds, refreshes or removes (TTL 0) a record received from another host
+ *
+ * @param  parser       reads the names of the record data
+ * @param  owner        the owner name of the record
+ * @param  flush        the cache-flush bit of the record is set
+ * @param  data         the packet, for the names of the record data
+ * @param  data_ptr     the record data
+ */
+static void _mdns_cache_add(mdns_parser_t *parser, mdns_rx_packet_t *packet, mdns_name_t *owner, uint16_t type,
+                            uint32_t ttl, bool flush, const uint8_t *data, size_t len, const uint8_t *data_ptr, uint16_t data_len)
+{
+    mdns_name_t *name = NULL;
+    const char *target = "";
+    uint16_t port = 0;
+    esp_ip_addr_t addr;
+    memset(&addr, 0, sizeof(esp_ip_addr_t));
+
+    if (owner->sub || strcasecmp(owner->domain, MDNS_DEFAULT_DOMAIN)) {
+        return;
+    }
+    if (type == MDNS_TYPE_A) {
+        if (data_len != sizeof(esp_ip4_addr_t)) {
+            return;
         }
-        return ESP_OK;
+        addr.type = ESP_IPADDR_TYPE_V4;
+        memcpy(&addr.u_addr.ip4.addr, data_ptr, sizeof(esp_ip4_addr_t));
+    } else if (type == MDNS_TYPE_AAAA) {
+        if (data_len != MDNS_ANSWER_AAAA_SIZE) {
+            return;
+        }
+        addr.type = ESP_IPADDR_TYPE_V6;
+        memcpy(addr.u_addr.ip6.addr, data_ptr, MDNS_ANSWER_AAAA_SIZE);
+    } else if (type == MDNS_TYPE_PTR) {
+        // only the service instances of other hosts, the instance name must belong to the service type
+        if (owner->host[0] || !owner->service[0] || !_mdns_parser_read_fqdn(parser, data, data_ptr, &parser->data_name, &name, len)
+                || !name->host[0] || strcasecmp(name->service, owner->service) || strcasecmp(name->proto, owner->proto)
+                || _mdns_name_is_ours(name)) {
+            return;
+        }
+        target = name->host;
+    } else if (type == MDNS_TYPE_SRV) {
+        if (data_len <= MDNS_SRV_FQDN_OFFSET || !owner->service[0]
+                || !_mdns_parser_read_fqdn(parser, data, data_ptr + MDNS_SRV_FQDN_OFFSET, &parser->data_name, &name, len)
+                || !name->host[0]) {
+            return;
+        }
+        target = name->host;
+        port = _mdns_read_u16(data_ptr, MDNS_SRV_PORT_OFFSET);
+    } else if (type == MDNS_TYPE_TXT) {
+        if (!owner->service[0] || data_len > MDNS_TXT_MAX_LEN) {
+            return;
+        }
+    } else {
+        return;
+    }
+
+    uint32_t now = xTaskGetTickCount() * portTICK_PERIOD_MS;
+    mdns_cache_entry_t **bucket = _mdns_cache_bucket(type, owner->host, owner->service, owner->proto);
+    mdns_cache_entry_t *found = NULL;
+    mdns_cache_entry_t *entry = _mdns_cache_scan(*bucket, type, owner->host, owner->service, owner->proto, now);
+    while (entry) {
+        mdns_cache_entry_t *next = _mdns_cache_scan(entry->hash_next, type, owner->host, owner->service, owner->proto, now);
+        if (entry->tcpip_if == packet->tcpip_if && entry->ip_protocol == packet->ip_protocol) {
+            bool same;
+            if (type == MDNS_TYPE_A || type == MDNS_TYPE_AAAA) {
+                same = !memcmp(&entry->addr, &addr, sizeof(esp_ip_addr_t));
+            } else if (type == MDNS_TYPE_TXT) {
+                same = entry->txt_len == data_len && !memcmp(entry->txt, data_ptr, data_len);
+            } else {
+                same = entry->port == port && !strcasecmp(entry->target, target);
+            }
+            if (same && ttl) {
+                found = entry;
+            } else if (same || (ttl && (type == MDNS_TYPE_SRV || type == MDNS_TYPE_TXT
+                                        || (flush && now - entry->received_at > MDNS_CACHE_FLUSH_DELAY_MS)))) {
+                // goodbye, replaced unique record or flushed by the owner
+                _mdns_cache_remove(entry);
+            }
+        }
+        entry = next;
+    }
+    if (!ttl) {
+        return;
+    }
+    ttl = ttl < MDNS_CACHE_MAX_TTL ? ttl : MDNS_CACHE_MAX_TTL;
+    if (found) {
+        found->received_at = now;
+        found->expires_at = now + ttl * 1000;
+        _mdns_cache_touch(found);
+        return;
+    }
+
+    size_t host_len = strlen(owner->host) + 1;
+    size_t service_len = strlen(owner->service) + 1;
+    size_t proto_len = strlen(owner->proto) + 1;
+    size_t target_len = strlen(target) + 1;
+    size_t txt_len = type == MDNS_TYPE_TXT ? data_len : 0;
+    entry = (mdns_cache_entry_t *)_mdns_malloc(sizeof(mdns_cache_entry_t) + host_len + service_len + proto_len + target_len + txt_len);
+    if (!entry) {
+        HOOK_MALLOC_FAILED;
+        return;
+    }
+    if (_mdns_server->cache.count >= MDNS_CACHE_SIZE) {
+        _mdns_cache_remove(_mdns_server->cache.oldest);
+    }
+    char *strings = entry->strings;
+    entry->host = memcpy(strings, owner->host, host_len);
+    entry->service = memcpy(strings += host_len, owner->service, service_len);
+    entry->proto = memcpy(strings += service_len, owner->proto, proto_len);
+    entry->target = memcpy(strings += proto_len, target, target_len);
+    entry->txt = memcpy(strings += target_len, data_ptr, txt_len);
+    entry->txt_len = txt_len;
+    entry->port = port;
+    entry->addr = addr;
+    entry->type = type;
+    entry->tcpip_if = packet->tcpip_if;
+    entry->ip_protocol = packet->ip_protocol;
+    entry->received_at = now;
+    entry->expires_at = now + ttl * 1000;
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    _mdns_cache_link_lru(entry);
+    _mdns_server->cache.count++;
+}
+#endif /* MDNS_CACHE_SIZE */
+
+/**
+ * @brief  Remembers a record of ours listed in the answers of the query,
+ *         unless its TTL is below half of ours and the querier needs a fresh copy (RFC 6762, 7.1)
+ */
+static void _mdns_add_known_answer(mdns_parse_arena_t *arena, mdns_parsed_packet_t *parsed_packet, uint16_t type,
+                                   mdns_service_t *service, mdns_host_item_t *host, uint32_t ttl, uint32_t our_ttl)
+{
+    if (ttl < our_ttl / 2 || (!service && !host)) {
+        return;
     }
-    *out = NULL;
-    return ESP_OK;
+    mdns_known_answer_t *known = (mdns_known_answer_t *)_mdns_arena_alloc(arena, sizeof(mdns_known_answer_t));
+    if (!known) {
+        return;
+    }
+    known->type = type;
+    known->service = service;
+    known->host = host;
+    known->next = parsed_packet->known_answers;
+    parsed_packet->known_answers = known;
 }
 
 /**
  * @brief  main packet parser
  *
+ * Runs with the service lock, the scratch state is the caller's so that the packets can be decoded elsewhere.
+ *
+ * @param  parser       scratch state of the calling task
  * @param  packet       the packet
+ * @param  names        names of the packet decoded ahead by _mdns_parse_names_decode(), NULL if none
  */
-void mdns_parse_packet(mdns_rx_packet_t *packet)
+void mdns_parse_packet(mdns_parser_t *parser, mdns_rx_packet_t *packet, const mdns_parse_names_t *names)
 {
-    static mdns_name_t n;
     mdns_header_t header;
     const uint8_t *data = _mdns_get_packet_data(packet);
     size_t len = _mdns_get_packet_len(packet);
     const uint8_t *content = data + MDNS_HEAD_LEN;
     bool do_not_reply = false;
     mdns_search_once_t *search_result = NULL;
+    mdns_parse_arena_t *arena = &parser->arena;
 
 #ifdef MDNS_ENABLE_DEBUG
     _mdns_dbg_printf("\nRX[%u][%u]: ", packet->tcpip_if, (uint32_t)packet->ip_protocol);
@@ -3526,15 +4940,10 @@ void mdns_parse_packet(mdns_rx_packet_t *packet)
         return;
     }
 
-    mdns_parsed_packet_t *parsed_packet = (mdns_parsed_packet_t *)malloc(sizeof(mdns_parsed_packet_t));
-    if (!parsed_packet) {
-        HOOK_MALLOC_FAILED;
-        return;
-    }
-    memset(parsed_packet, 0, sizeof(mdns_parsed_packet_t));
-
-    mdns_name_t *name = &n;
+    mdns_name_t *name = &parser->name;
     memset(name, 0, sizeof(mdns_name_t));
+    parser->names = names;
+    parser->names_pos = 0;
 
     header.id = _mdns_read_u16(data, MDNS_HEAD_ID_OFFSET);
     header.flags = _mdns_read_u16(data, MDNS_HEAD_FLAGS_OFFSET);
@@ -3544,13 +4953,17 @@ void mdns_parse_packet(mdns_rx_packet_t *packet)
     header.additional = _mdns_read_u16(data, MDNS_HEAD_ADDITIONAL_OFFSET);
 
     if (header.flags == MDNS_FLAGS_QR_AUTHORITATIVE && packet->src_port != MDNS_SERVICE_PORT) {
-        free(parsed_packet);
         return;
     }
 
     //if we have not set the hostname, we can not answer questions
     if (header.questions && !header.answers && _str_null_or_empty(_mdns_server->hostname)) {
-        free(parsed_packet);
+        return;
+    }
+
+    // the parsed packet, its questions and names live in the arena until the end of this function
+    mdns_parsed_packet_t *parsed_packet = (mdns_parsed_packet_t *)_mdns_arena_alloc(arena, sizeof(mdns_parsed_packet_t));
+    if (!parsed_packet) {
         return;
     }
 
@@ -3567,7 +4980,7 @@ void mdns_parse_packet(mdns_rx_packet_t *packet)
         uint8_t qs = header.questions;
 
         while (qs--) {
-            content = _mdns_parse_fqdn(data, content, name, len);
+            content = _mdns_parser_read_fqdn(parser, data, content, &parser->name, &name, len);
             if (!content) {
                 header.answers = 0;
                 header.additional = 0;
@@ -3593,23 +5006,20 @@ void mdns_parse_packet(mdns_rx_packet_t *packet)
                 parsed_packet->discovery = true;
                 mdns_srv_item_t *a = _mdns_server->services;
                 while (a) {
-                    mdns_parsed_question_t *question = (mdns_parsed_question_t *)calloc(1, sizeof(mdns_parsed_question_t));
+                    mdns_parsed_question_t *question = (mdns_parsed_question_t *)_mdns_arena_alloc(arena, sizeof(mdns_parsed_question_t));
                     if (!question) {
-                        HOOK_MALLOC_FAILED;
                         goto clear_rx_packet;
                     }
                     question->next = parsed_packet->questions;
                     parsed_packet->questions = question;
 
+                    // services cannot change while the packet is being parsed, refer to their names
                     question->unicast = unicast;
                     question->type = MDNS_TYPE_SDPTR;
                     question->host = NULL;
-                    question->service = strdup(a->service->service);
-                    question->proto = strdup(a->service->proto);
-                    question->domain = strdup(MDNS_DEFAULT_DOMAIN);
-                    if (!question->service || !question->proto || !question->domain) {
-                        goto clear_rx_packet;
-                    }
+                    question->service = a->service->service;
+                    question->proto = a->service->proto;
+                    question->domain = MDNS_DEFAULT_DOMAIN;
                     a = a->next;
                 }
                 continue;
@@ -3622,9 +5032,8 @@ void mdns_parse_packet(mdns_rx_packet_t *packet)
                 parsed_packet->probe = true;
             }
 
-            mdns_parsed_question_t *question = (mdns_parsed_question_t *)calloc(1, sizeof(mdns_parsed_question_t));
+            mdns_parsed_question_t *question = (mdns_parsed_question_t *)_mdns_arena_alloc(arena, sizeof(mdns_parsed_question_t));
             if (!question) {
-                HOOK_MALLOC_FAILED;
                 goto clear_rx_packet;
             }
             question->next = parsed_packet->questions;
@@ -3633,10 +5042,10 @@ void mdns_parse_packet(mdns_rx_packet_t *packet)
             question->unicast = unicast;
             question->type = type;
             question->sub = name->sub;
-            if (_mdns_strdup_check(&(question->host), name->host)
-                    || _mdns_strdup_check(&(question->service), name->service)
-                    || _mdns_strdup_check(&(question->proto), name->proto)
-                    || _mdns_strdup_check(&(question->domain), name->domain)) {
+            if (_mdns_arena_strdup_check(arena, &(question->host), name->host)
+                    || _mdns_arena_strdup_check(arena, &(question->service), name->service)
+                    || _mdns_arena_strdup_check(arena, &(question->proto), name->proto)
+                    || _mdns_arena_strdup_check(arena, &(question->domain), name->domain)) {
                 goto clear_rx_packet;
             }
         }
@@ -3649,7 +5058,7 @@ void mdns_parse_packet(mdns_rx_packet_t *packet)
 
         while (content < (data + len)) {
 
-            content = _mdns_parse_fqdn(data, content, name, len);
+            content = _mdns_parser_read_fqdn(parser, data, content, &parser->name, &name, len);
             if (!content) {
                 goto clear_rx_packet;//error
             }
@@ -3662,6 +5071,9 @@ void mdns_parse_packet(mdns_rx_packet_t *packet)
             uint32_t ttl = _mdns_read_u32(content, MDNS_TTL_OFFSET);
             uint16_t data_len = _mdns_read_u16(content, MDNS_LEN_OFFSET);
             const uint8_t *data_ptr = content + MDNS_DATA_OFFSET;
+#if MDNS_CACHE_SIZE
+            bool flush = mdns_class & 0x8000;
+#endif
             mdns_class &= 0x7FFF;
 
             content = data_ptr + data_len;
@@ -3691,18 +5103,25 @@ void mdns_parse_packet(mdns_rx_packet_t *packet)
             } else if (!name->sub && _mdns_name_is_ours(name)) {
                 ours = true;
                 if (name->service[0] && name->proto[0]) {
-                    service = _mdns_get_service_item(name->service, name->proto, NULL);
+                    service = _mdns_get_service_item_instance(name->host[0] ? name->host : NULL, name->service, name->proto, NULL);
                 }
             } else {
                 if ((header.flags & MDNS_FLAGS_QUERY_REPSONSE) == 0 || record_type == MDNS_NS) {
                     //skip this record
                     continue;
                 }
-                search_result = _mdns_search_find_from(_mdns_server->search_once, name, type, packet->tcpip_if, packet->ip_protocol);
+                search_result = _mdns_search_find_next(NULL, name, type, packet->tcpip_if, packet->ip_protocol);
+            }
+#if MDNS_CACHE_SIZE
+            // records of other hosts, the service types we have may list their instances too
+            if ((header.flags & MDNS_FLAGS_QUERY_REPSONSE) && record_type != MDNS_NS && !discovery
+                    && (!ours || type == MDNS_TYPE_PTR)) {
+                _mdns_cache_add(parser, packet, name, type, ttl, flush, data, len, data_ptr, data_len);
             }
+#endif
 
             if (type == MDNS_TYPE_PTR) {
-                if (!_mdns_parse_fqdn(data, data_ptr, name, len)) {
+                if (!_mdns_parser_read_fqdn(parser, data, data_ptr, &parser->name, &name, len)) {
                     continue;//error
                 }
                 if (search_result) {
@@ -3710,9 +5129,13 @@ void mdns_parse_packet(mdns_rx_packet_t *packet)
                                                 packet->tcpip_if, packet->ip_protocol, ttl);
                 } else if ((discovery || ours) && !name->sub && _mdns_name_is_ours(name)) {
                     if (discovery && (service = _mdns_get_service_item(name->service, name->proto, NULL))) {
-                        _mdns_remove_parsed_question(parsed_packet, MDNS_TYPE_SDPTR, service);
+                        _mdns_add_known_answer(arena, parsed_packet, MDNS_TYPE_SDPTR, service->service, NULL, ttl, MDNS_ANSWER_PTR_TTL);
                     } else if (service && parsed_packet->questions && !parsed_packet->probe) {
-                        _mdns_remove_parsed_question(parsed_packet, type, service);
+                        // the record names the instance the querier knows about
+                        service = _mdns_get_service_item_instance(name->host, name->service, name->proto, NULL);
+                        if (service) {
+                            _mdns_add_known_answer(arena, parsed_packet, type, service->service, NULL, ttl, MDNS_ANSWER_PTR_TTL);
+                        }
                     } else if (service) {
                         //check if TTL is more than half of the full TTL value (4500)
                         if (ttl > (MDNS_ANSWER_PTR_TTL / 2)) {
@@ -3723,15 +5146,8 @@ void mdns_parse_packet(mdns_rx_packet_t *packet)
             } else if (type == MDNS_TYPE_SRV) {
                 mdns_result_t *result = NULL;
                 if (search_result && search_result->type == MDNS_TYPE_PTR) {
-                    result = search_result->result;
-                    while (result) {
-                        if (_mdns_get_esp_netif(packet->tcpip_if) == result->esp_netif
-                                && packet->ip_protocol == result->ip_protocol
-                                && result->instance_name && !strcmp(name->host, result->instance_name)) {
-                            break;
-                        }
-                        result = result->next;
-                    }
+                    result = _mdns_result_find(search_result->result, false, name->host, true,
+                                               _mdns_get_esp_netif(packet->tcpip_if), packet->ip_protocol);
                     if (!result) {
                         result = _mdns_search_result_add_ptr(search_result, name->host, name->service, name->proto,
                                                              packet->tcpip_if, packet->ip_protocol, ttl);
@@ -3741,7 +5157,7 @@ void mdns_parse_packet(mdns_rx_packet_t *packet)
                     }
                 }
                 bool is_selfhosted = _mdns_name_is_selfhosted(name);
-                if (!_mdns_parse_fqdn(data, data_ptr + MDNS_SRV_FQDN_OFFSET, name, len)) {
+                if (!_mdns_parser_read_fqdn(parser, data, data_ptr + MDNS_SRV_FQDN_OFFSET, &parser->name, &name, len)) {
                     continue;//error
                 }
                 if (data_ptr + MDNS_SRV_PORT_OFFSET + 1 >= data + len) {
@@ -3755,14 +5171,18 @@ void mdns_parse_packet(mdns_rx_packet_t *packet)
                     if (search_result->type == MDNS_TYPE_PTR) {
                         if (!result->hostname) { // assign host/port for this entry only if not previously set
                             result->port = port;
-                            result->hostname = strdup(name->host);
+                            if (_mdns_result_set_hostname(result, name->host)) {
+                                _mdns_search_host_add(search_result, result);
+                            }
                         }
                     } else {
                         _mdns_search_result_add_srv(search_result, name->host, port, packet->tcpip_if, packet->ip_protocol, ttl);
                     }
                 } else if (ours) {
                     if (parsed_packet->questions && !parsed_packet->probe) {
-                        _mdns_remove_parsed_question(parsed_packet, type, service);
+                        if (service) {
+                            _mdns_add_known_answer(arena, parsed_packet, type, service->service, NULL, ttl, MDNS_ANSWER_SRV_TTL);
+                        }
                         continue;
                     } else if (parsed_packet->distributed) {
                         _mdns_remove_scheduled_answer(packet->tcpip_if, packet->ip_protocol, type, service);
@@ -3788,8 +5208,7 @@ void mdns_parse_packet(mdns_rx_packet_t *packet)
                                 if (!_str_null_or_empty(service->service->instance)) {
                                     char *new_instance = _mdns_mangle_name((char *)service->service->instance);
                                     if (new_instance) {
-                                        free((char *)service->service->instance);
-                                        service->service->instance = new_instance;
+                                        _mdns_service_set_instance(service, new_instance);
                                     }
                                     _mdns_probe_all_pcbs(&service, 1, false, false);
                                 } else if (!_str_null_or_empty(_mdns_server->instance)) {
@@ -3797,6 +5216,7 @@ void mdns_parse_packet(mdns_rx_packet_t *packet)
                                     if (new_instance) {
                                         free((char *)_mdns_server->instance);
                                         _mdns_server->instance = new_instance;
+                                        _mdns_wire_invalidate();
                                     }
                                     _mdns_restart_all_pcbs_no_instance();
                                 } else {
@@ -3806,6 +5226,7 @@ void mdns_parse_packet(mdns_rx_packet_t *packet)
                                         free((char *)_mdns_server->hostname);
                                         _mdns_server->hostname = new_host;
                                         _mdns_self_host.hostname = new_host;
+                                        _mdns_wire_invalidate();
                                     }
                                     _mdns_restart_all_pcbs();
                                 }
@@ -3820,21 +5241,10 @@ void mdns_parse_packet(mdns_rx_packet_t *packet)
                 }
             } else if (type == MDNS_TYPE_TXT) {
                 if (search_result) {
-                    mdns_txt_item_t *txt = NULL;
-                    uint8_t *txt_value_len = NULL;
-                    size_t txt_count = 0;
-
                     mdns_result_t *result = NULL;
                     if (search_result->type == MDNS_TYPE_PTR) {
-                        result = search_result->result;
-                        while (result) {
-                            if (_mdns_get_esp_netif(packet->tcpip_if) == result->esp_netif
-                                    && packet->ip_protocol == result->ip_protocol
-                                    && result->instance_name && !strcmp(name->host, result->instance_name)) {
-                                break;
-                            }
-                            result = result->next;
-                        }
+                        result = _mdns_result_find(search_result->result, false, name->host, true,
+                                                   _mdns_get_esp_netif(packet->tcpip_if), packet->ip_protocol);
                         if (!result) {
                             result = _mdns_search_result_add_ptr(search_result, name->host, name->service, name->proto,
                                                                  packet->tcpip_if, packet->ip_protocol, ttl);
@@ -3843,22 +5253,14 @@ void mdns_parse_packet(mdns_rx_packet_t *packet)
                             }
                         }
                         if (!result->txt) {
-                            _mdns_result_txt_create(data_ptr, data_len, &txt, &txt_value_len, &txt_count);
-                            if (txt_count) {
-                                result->txt = txt;
-                                result->txt_count = txt_count;
-                                result->txt_value_len = txt_value_len;
-                            }
+                            _mdns_result_txt_create(result, data_ptr, data_len);
                         }
                     } else {
-                        _mdns_result_txt_create(data_ptr, data_len, &txt, &txt_value_len, &txt_count);
-                        if (txt_count) {
-                            _mdns_search_result_add_txt(search_result, txt, txt_value_len, txt_count, packet->tcpip_if, packet->ip_protocol, ttl);
-                        }
+                        _mdns_search_result_add_txt(search_result, data_ptr, data_len, packet->tcpip_if, packet->ip_protocol, ttl);
                     }
                 } else if (ours) {
                     if (parsed_packet->questions && !parsed_packet->probe && service) {
-                        _mdns_remove_parsed_question(parsed_packet, type, service);
+                        _mdns_add_known_answer(arena, parsed_packet, type, service->service, NULL, ttl, MDNS_ANSWER_TXT_TTL);
                         continue;
                     }
                     if (!_mdns_name_is_selfhosted(name)) {
@@ -3891,11 +5293,11 @@ void mdns_parse_packet(mdns_rx_packet_t *packet)
                     //check for more applicable searches (PTR & A/AAAA at the same time)
                     while (search_result) {
                         _mdns_search_result_add_ip(search_result, name->host, &ip6, packet->tcpip_if, packet->ip_protocol, ttl);
-                        search_result = _mdns_search_find_from(search_result->next, name, type, packet->tcpip_if, packet->ip_protocol);
+                        search_result = _mdns_search_find_next(search_result, name, type, packet->tcpip_if, packet->ip_protocol);
                     }
                 } else if (ours) {
                     if (parsed_packet->questions && !parsed_packet->probe) {
-                        _mdns_remove_parsed_question(parsed_packet, type, NULL);
+                        _mdns_add_known_answer(arena, parsed_packet, type, NULL, mdns_get_host_item(name->host), ttl, MDNS_ANSWER_AAAA_TTL);
                         continue;
                     }
                     if (!_mdns_name_is_selfhosted(name)) {
@@ -3923,6 +5325,7 @@ void mdns_parse_packet(mdns_rx_packet_t *packet)
                                     free((char *)_mdns_server->hostname);
                                     _mdns_server->hostname = new_host;
                                     _mdns_self_host.hostname = new_host;
+                                    _mdns_wire_invalidate();
                                 }
                                 _mdns_restart_all_pcbs();
                             }
@@ -3944,11 +5347,11 @@ void mdns_parse_packet(mdns_rx_packet_t *packet)
                     //check for more applicable searches (PTR & A/AAAA at the same time)
                     while (search_result) {
                         _mdns_search_result_add_ip(search_result, name->host, &ip, packet->tcpip_if, packet->ip_protocol, ttl);
-                        search_result = _mdns_search_find_from(search_result->next, name, type, packet->tcpip_if, packet->ip_protocol);
+                        search_result = _mdns_search_find_next(search_result, name, type, packet->tcpip_if, packet->ip_protocol);
                     }
                 } else if (ours) {
                     if (parsed_packet->questions && !parsed_packet->probe) {
-                        _mdns_remove_parsed_question(parsed_packet, type, NULL);
+                        _mdns_add_known_answer(arena, parsed_packet, type, NULL, mdns_get_host_item(name->host), ttl, MDNS_ANSWER_A_TTL);
                         continue;
                     }
                     if (!_mdns_name_is_selfhosted(name)) {
@@ -3976,6 +5379,7 @@ void mdns_parse_packet(mdns_rx_packet_t *packet)
                                     free((char *)_mdns_server->hostname);
                                     _mdns_server->hostname = new_host;
                                     _mdns_self_host.hostname = new_host;
+                                    _mdns_wire_invalidate();
                                 }
                                 _mdns_restart_all_pcbs();
                             }
@@ -4001,24 +5405,7 @@ void mdns_parse_packet(mdns_rx_packet_t *packet)
 
 
 clear_rx_packet:
-    while (parsed_packet->questions) {
-        mdns_parsed_question_t *question = parsed_packet->questions;
-        parsed_packet->questions = parsed_packet->questions->next;
-        if (question->host) {
-            free(question->host);
-        }
-        if (question->service) {
-            free(question->service);
-        }
-        if (question->proto) {
-            free(question->proto);
-        }
-        if (question->domain) {
-            free(question->domain);
-        }
-        free(question);
-    }
-    free(parsed_packet);
+    _mdns_arena_reset(arena);
 }
 
 /**
@@ -4042,8 +5429,11 @@ void _mdns_disable_pcb(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol)
 {
     _mdns_clean_netif_ptr(tcpip_if);
 
+#if MDNS_CACHE_SIZE
+    _mdns_cache_remove_pcb(tcpip_if, ip_protocol);
+#endif
     if (mdns_is_netif_ready(tcpip_if, ip_protocol)) {
-        _mdns_clear_pcb_tx_queue_head(tcpip_if, ip_protocol);
+        _mdns_clear_pcb_tx_queue(tcpip_if, ip_protocol);
         mdns_pcb_deinit_local(tcpip_if, ip_protocol);
         mdns_if_t other_if = _mdns_get_other_if (tcpip_if);
         if (other_if != MDNS_MAX_INTERFACES && _mdns_server->interfaces[other_if].pcbs[ip_protocol].state == PCB_DUP) {
@@ -4110,7 +5500,7 @@ static void perform_event_action(mdns_if_t mdns_if, mdns_event_actions_t action)
             uint8_t *paddr = (uint8_t *)&addr6.addr;
             const char sub[] = "ip6";
             const size_t query_name_size = 4 * sizeof(addr6.addr) /* (2 nibbles + 2 dots)/per byte of IP address */ + sizeof(sub);
-            char *reverse_query_name = malloc(query_name_size);
+            char *reverse_query_name = _mdns_malloc(query_name_size);
             if (reverse_query_name) {
                 char *ptr = &reverse_query_name[query_name_size];   // point to the end
                 memcpy(ptr - sizeof(sub), sub, sizeof(sub));        // copy the IP sub-domain
@@ -4253,7 +5643,7 @@ static void _mdns_search_free(mdns_search_once_t *search)
 static mdns_search_once_t *_mdns_search_init(const char *name, const char *service, const char *proto, uint16_t type, bool unicast,
         uint32_t timeout, uint8_t max_results, mdns_query_notify_t notifier)
 {
-    mdns_search_once_t *search = (mdns_search_once_t *)malloc(sizeof(mdns_search_once_t));
+    mdns_search_once_t *search = (mdns_search_once_t *)_mdns_malloc(sizeof(mdns_search_once_t));
     if (!search) {
         HOOK_MALLOC_FAILED;
         return NULL;
@@ -4267,7 +5657,7 @@ static mdns_search_once_t *_mdns_search_init(const char *name, const char *servi
     }
 
     if (!_str_null_or_empty(name)) {
-        search->instance = strndup(name, MDNS_NAME_BUF_LEN - 1);
+        search->instance = _mdns_strndup(name, MDNS_NAME_BUF_LEN - 1);
         if (!search->instance) {
             _mdns_search_free(search);
             return NULL;
@@ -4275,7 +5665,7 @@ static mdns_search_once_t *_mdns_search_init(const char *name, const char *servi
     }
 
     if (!_str_null_or_empty(service)) {
-        search->service = strndup(service, MDNS_NAME_BUF_LEN - 1);
+        search->service = _mdns_strndup(service, MDNS_NAME_BUF_LEN - 1);
         if (!search->service) {
             _mdns_search_free(search);
             return NULL;
@@ -4283,7 +5673,7 @@ static mdns_search_once_t *_mdns_search_init(const char *name, const char *servi
     }
 
     if (!_str_null_or_empty(proto)) {
-        search->proto = strndup(proto, MDNS_NAME_BUF_LEN - 1);
+        search->proto = _mdns_strndup(proto, MDNS_NAME_BUF_LEN - 1);
         if (!search->proto) {
             _mdns_search_free(search);
             return NULL;
@@ -4305,13 +5695,123 @@ static mdns_search_once_t *_mdns_search_init(const char *name, const char *servi
     return search;
 }
 
+#define MDNS_SEARCH_KEY_HOST        1   // A/AAAA searches and ANY searches without service look for a host
+#define MDNS_SEARCH_KEY_TYPE        2   // PTR searches for the instances of a service type
+#define MDNS_SEARCH_KEY_INSTANCE    3   // SRV/TXT searches and ANY searches with service for an instance
+
+/**
+ * @brief  Hash of the name the records matching a search have, case-insensitive like the name comparisons
+ */
+static uint32_t _mdns_search_key(uint8_t kind, const char *instance, const char *service, const char *proto)
+{
+    return _mdns_hash_name(_mdns_hash_name(_mdns_hash_name((2166136261u ^ kind) * 16777619, instance), service), proto);
+}
+
+/**
+ * @brief  Kind of the name the records matching the search have
+ *
+ * @return MDNS_SEARCH_KEY_ kind or 0 if the search does not name enough to match any record
+ */
+static uint8_t _mdns_search_key_kind(const mdns_search_once_t *search)
+{
+    switch (search->type) {
+    case MDNS_TYPE_ANY:
+        if (!search->service) {
+            return search->instance ? MDNS_SEARCH_KEY_HOST : 0;
+        }
+    // fallthrough
+    case MDNS_TYPE_SRV:
+    case MDNS_TYPE_TXT:
+        return search->instance && search->service && search->proto ? MDNS_SEARCH_KEY_INSTANCE : 0;
+    case MDNS_TYPE_A:
+    case MDNS_TYPE_AAAA:
+        return search->instance ? MDNS_SEARCH_KEY_HOST : 0;
+    case MDNS_TYPE_PTR:
+        return search->service && search->proto ? MDNS_SEARCH_KEY_TYPE : 0;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief  Add a search to the lookup tables, it must be added to the head of the search list as well
+ */
+static void _mdns_search_index_add(mdns_search_once_t *search)
+{
+    search->seq = ++_mdns_server->search_seq;
+    uint8_t kind = _mdns_search_key_kind(search);
+    if (!kind) {
+        return;
+    }
+    search->key = _mdns_search_key(kind, search->instance, search->service, search->proto);
+    mdns_search_once_t **bucket = &_mdns_server->search_index[search->key & (MDNS_SEARCH_INDEX_SIZE - 1)];
+    search->index_next = *bucket;
+    *bucket = search;
+}
+
+/**
+ * @brief  Remove a search and the host names of its results from the lookup tables
+ */
+static void _mdns_search_index_remove(mdns_search_once_t *search)
+{
+    if (!search->seq) {
+        return;
+    }
+    search->seq = 0;
+    mdns_search_once_t **p = &_mdns_server->search_index[search->key & (MDNS_SEARCH_INDEX_SIZE - 1)];
+    while (*p && *p != search) {
+        p = &(*p)->index_next;
+    }
+    if (*p) {
+        *p = search->index_next;
+    }
+    while (search->hosts) {
+        mdns_search_host_t *host = search->hosts;
+        search->hosts = host->search_next;
+        mdns_search_host_t **h = &_mdns_server->search_hosts[host->hash & (MDNS_SEARCH_INDEX_SIZE - 1)];
+        while (*h && *h != host) {
+            h = &(*h)->next;
+        }
+        if (*h) {
+            *h = host->next;
+        }
+    }
+}
+
+/**
+ * @brief  Add the host name of a result of a running PTR/SRV search to the lookup tables, its A/AAAA records then match
+ */
+static void _mdns_search_host_add(mdns_search_once_t *search, mdns_result_t *r)
+{
+    if (!search->seq || (search->type != MDNS_TYPE_PTR && search->type != MDNS_TYPE_SRV) || _str_null_or_empty(r->hostname)) {
+        return;
+    }
+    // the results outlive the lookup tables
+    mdns_search_host_t *host = (mdns_search_host_t *)_mdns_result_alloc(r, sizeof(mdns_search_host_t));
+    if (!host) {
+        return;
+    }
+    host->hash = _mdns_search_key(MDNS_SEARCH_KEY_HOST, r->hostname, NULL, NULL);
+    host->search = search;
+    host->result = r;
+    host->search_next = search->hosts;
+    search->hosts = host;
+    mdns_search_host_t **bucket = &_mdns_server->search_hosts[host->hash & (MDNS_SEARCH_INDEX_SIZE - 1)];
+    host->next = *bucket;
+    *bucket = host;
+}
+
 /**
  * @brief  Mark search as finished and remove it from search chain
  */
 static void _mdns_search_finish(mdns_search_once_t *search)
 {
     search->state = SEARCH_OFF;
+    _mdns_search_index_remove(search);
     queueDetach(mdns_search_once_t, _mdns_server->search_once, search);
+    if (!_mdns_server->search_once) {
+        _mdns_server->search_pending = false;
+    }
     if (search->notifier) {
         search->notifier(search);
     }
@@ -4325,6 +5825,26 @@ static void _mdns_search_add(mdns_search_once_t *search)
 {
     search->next = _mdns_server->search_once;
     _mdns_server->search_once = search;
+    _mdns_search_index_add(search);
+    atomic_fetch_add_explicit(&_mdns_stats.searches, 1, memory_order_relaxed);
+    // the new search sends its first query right away
+    uint32_t now = xTaskGetTickCount() * portTICK_PERIOD_MS;
+    if (!_mdns_server->search_pending || (int32_t)(now - _mdns_server->search_at) < 0) {
+        _mdns_server->search_at = now;
+        _mdns_server->search_pending = true;
+    }
+    _mdns_timer_rearm();
+}
+
+/**
+ * @brief  Count a new result of the search, flags the running search to finish if it has enough of them
+ */
+static inline void _mdns_search_count_result(mdns_search_once_t *search)
+{
+    search->num_results++;
+    if (search->seq && search->max_results && search->num_results >= search->max_results) {
+        _mdns_server->search_done = true;
+    }
 }
 
 /**
@@ -4334,6 +5854,10 @@ static void _mdns_search_finish_done(void)
 {
     mdns_search_once_t *search = _mdns_server->search_once;
     mdns_search_once_t *s = NULL;
+    if (!_mdns_server->search_done) {
+        return;
+    }
+    _mdns_server->search_done = false;
     while (search) {
         s = search;
         search = search->next;
@@ -4343,26 +5867,6 @@ static void _mdns_search_finish_done(void)
     }
 }
 
-/**
- * @brief  Create linked IP (copy) from parsed one
- */
-static mdns_ip_addr_t *_mdns_result_addr_create_ip(esp_ip_addr_t *ip)
-{
-    mdns_ip_addr_t *a = (mdns_ip_addr_t *)malloc(sizeof(mdns_ip_addr_t));
-    if (!a) {
-        HOOK_MALLOC_FAILED;
-        return NULL;
-    }
-    memset(a, 0, sizeof(mdns_ip_addr_t));
-    a->addr.type = ip->type;
-    if (ip->type == ESP_IPADDR_TYPE_V6) {
-        memcpy(a->addr.u_addr.ip6.addr, ip->u_addr.ip6.addr, 16);
-    } else {
-        a->addr.u_addr.ip4.addr = ip->u_addr.ip4.addr;
-    }
-    return a;
-}
-
 static inline void _mdns_result_update_ttl(mdns_result_t *r, uint32_t ttl)
 {
     r->ttl = r->ttl < ttl ? r->ttl : ttl;
@@ -4385,7 +5889,7 @@ static void _mdns_result_add_ip(mdns_result_t *r, esp_ip_addr_t *ip)
         }
         a = a->next;
     }
-    a = _mdns_result_addr_create_ip(ip);
+    a = _mdns_result_addr_create_ip(r, ip);
     if (!a) {
         return;
     }
@@ -4400,14 +5904,15 @@ static void _mdns_search_result_add_ip(mdns_search_once_t *search, const char *h
                                        mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol, uint32_t ttl)
 {
     mdns_result_t *r = NULL;
-    mdns_ip_addr_t *a = NULL;
+    esp_netif_t *esp_netif = _mdns_get_esp_netif(tcpip_if);
 
     if ((search->type == MDNS_TYPE_A && ip->type == ESP_IPADDR_TYPE_V4)
             || (search->type == MDNS_TYPE_AAAA && ip->type == ESP_IPADDR_TYPE_V6)
             || search->type == MDNS_TYPE_ANY) {
+        // a host search has a result per interface, at most
         r = search->result;
         while (r) {
-            if (r->esp_netif == _mdns_get_esp_netif(tcpip_if) && r->ip_protocol == ip_protocol) {
+            if (r->esp_netif == esp_netif && r->ip_protocol == ip_protocol) {
                 _mdns_result_add_ip(r, ip);
                 _mdns_result_update_ttl(r, ttl);
                 return;
@@ -4415,38 +5920,22 @@ static void _mdns_search_result_add_ip(mdns_search_once_t *search, const char *h
             r = r->next;
         }
         if (!search->max_results || search->num_results < search->max_results) {
-            r = (mdns_result_t *)malloc(sizeof(mdns_result_t));
+            r = _mdns_result_new(&search->result);
             if (!r) {
-                HOOK_MALLOC_FAILED;
-                return;
-            }
-
-            memset(r, 0, sizeof(mdns_result_t));
-
-            a = _mdns_result_addr_create_ip(ip);
-            if (!a) {
-                free(r);
                 return;
             }
-            a->next = r->addr;
-            r->hostname = strdup(hostname);
-            r->addr = a;
-            r->esp_netif = _mdns_get_esp_netif(tcpip_if);
+            r->esp_netif = esp_netif;
             r->ip_protocol = ip_protocol;
-            r->next = search->result;
             r->ttl = ttl;
-            search->result = r;
-            search->num_results++;
+            _mdns_search_count_result(search);
+            _mdns_result_set_hostname(r, hostname);
+            r->addr = _mdns_result_addr_create_ip(r, ip);
         }
     } else if (search->type == MDNS_TYPE_PTR || search->type == MDNS_TYPE_SRV) {
-        r = search->result;
-        while (r) {
-            if (r->esp_netif == _mdns_get_esp_netif(tcpip_if) && r->ip_protocol == ip_protocol && !_str_null_or_empty(r->hostname) && !strcasecmp(hostname, r->hostname)) {
-                _mdns_result_add_ip(r, ip);
-                _mdns_result_update_ttl(r, ttl);
-                break;
-            }
-            r = r->next;
+        r = _mdns_result_find(search->result, true, hostname, false, esp_netif, ip_protocol);
+        if (r) {
+            _mdns_result_add_ip(r, ip);
+            _mdns_result_update_ttl(r, ttl);
         }
     }
 }
@@ -4458,36 +5947,26 @@ static mdns_result_t *_mdns_search_result_add_ptr(mdns_search_once_t *search, co
         const char *service_type, const char *proto, mdns_if_t tcpip_if,
         mdns_ip_protocol_t ip_protocol, uint32_t ttl)
 {
-    mdns_result_t *r = search->result;
-    while (r) {
-        if (r->esp_netif == _mdns_get_esp_netif(tcpip_if) && r->ip_protocol == ip_protocol && !_str_null_or_empty(r->instance_name) && !strcasecmp(instance, r->instance_name)) {
-            _mdns_result_update_ttl(r, ttl);
-            return r;
-        }
-        r = r->next;
+    esp_netif_t *esp_netif = _mdns_get_esp_netif(tcpip_if);
+    mdns_result_t *r = _mdns_result_find(search->result, false, instance, false, esp_netif, ip_protocol);
+    if (r) {
+        _mdns_result_update_ttl(r, ttl);
+        return r;
     }
     if (!search->max_results || search->num_results < search->max_results) {
-        r = (mdns_result_t *)malloc(sizeof(mdns_result_t));
+        r = _mdns_result_new(&search->result);
         if (!r) {
-            HOOK_MALLOC_FAILED;
-            return NULL;
-        }
-
-        memset(r, 0, sizeof(mdns_result_t));
-        r->instance_name = strdup(instance);
-        r->service_type = strdup(service_type);
-        r->proto = strdup(proto);
-        if (!r->instance_name) {
-            free(r);
             return NULL;
         }
-
-        r->esp_netif = _mdns_get_esp_netif(tcpip_if);
+        r->esp_netif = esp_netif;
         r->ip_protocol = ip_protocol;
         r->ttl = ttl;
-        r->next = search->result;
-        search->result = r;
-        search->num_results++;
+        _mdns_search_count_result(search);
+        if (!_mdns_result_set_instance(r, instance)) {
+            return NULL;
+        }
+        r->service_type = _mdns_result_strdup(r, service_type);
+        r->proto = _mdns_result_strdup(r, proto);
         return r;
     }
     return NULL;
@@ -4499,156 +5978,262 @@ static mdns_result_t *_mdns_search_result_add_ptr(mdns_search_once_t *search, co
 static void _mdns_search_result_add_srv(mdns_search_once_t *search, const char *hostname, uint16_t port,
                                         mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol, uint32_t ttl)
 {
-    mdns_result_t *r = search->result;
-    while (r) {
-        if (r->esp_netif == _mdns_get_esp_netif(tcpip_if) && r->ip_protocol == ip_protocol && !_str_null_or_empty(r->hostname) && !strcasecmp(hostname, r->hostname)) {
-            _mdns_result_update_ttl(r, ttl);
-            return;
-        }
-        r = r->next;
+    esp_netif_t *esp_netif = _mdns_get_esp_netif(tcpip_if);
+    mdns_result_t *r = _mdns_result_find(search->result, true, hostname, false, esp_netif, ip_protocol);
+    if (r) {
+        _mdns_result_update_ttl(r, ttl);
+        return;
     }
     if (!search->max_results || search->num_results < search->max_results) {
-        r = (mdns_result_t *)malloc(sizeof(mdns_result_t));
+        r = _mdns_result_new(&search->result);
         if (!r) {
-            HOOK_MALLOC_FAILED;
             return;
         }
-
-        memset(r, 0, sizeof(mdns_result_t));
-        r->hostname = strdup(hostname);
-        if (!r->hostname) {
-            free(r);
+        r->port = port;
+        r->esp_netif = esp_netif;
+        r->ip_protocol = ip_protocol;
+        r->ttl = ttl;
+        _mdns_search_count_result(search);
+        if (!_mdns_result_set_hostname(r, hostname)) {
             return;
         }
         if (search->instance) {
-            r->instance_name = strdup(search->instance);
+            _mdns_result_set_instance(r, search->instance);
         }
-        r->service_type = strdup(search->service);
-        r->proto = strdup(search->proto);
-        r->port = port;
-        r->esp_netif = _mdns_get_esp_netif(tcpip_if);
-        r->ip_protocol = ip_protocol;
-        r->ttl = ttl;
-        r->next = search->result;
-        search->result = r;
-        search->num_results++;
+        r->service_type = _mdns_result_strdup(r, search->service);
+        r->proto = _mdns_result_strdup(r, search->proto);
+        _mdns_search_host_add(search, r);
     }
 }
 
 /**
  * @brief  Called from parser to add TXT data to search result
  */
-static void _mdns_search_result_add_txt(mdns_search_once_t *search, mdns_txt_item_t *txt, uint8_t *txt_value_len,
-                                        size_t txt_count, mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol,
-                                        uint32_t ttl)
+static void _mdns_search_result_add_txt(mdns_search_once_t *search, const uint8_t *data, size_t len,
+                                        mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol, uint32_t ttl)
 {
+    if (_mdns_txt_items_count_get(data, len) <= 0) {
+        return;
+    }
+    esp_netif_t *esp_netif = _mdns_get_esp_netif(tcpip_if);
+    // an instance search has a result per interface, at most
     mdns_result_t *r = search->result;
     while (r) {
-        if (r->esp_netif == _mdns_get_esp_netif(tcpip_if) && r->ip_protocol == ip_protocol) {
-            if (r->txt) {
-                goto free_txt;
+        if (r->esp_netif == esp_netif && r->ip_protocol == ip_protocol) {
+            if (!r->txt) {
+                _mdns_result_txt_create(r, data, len);
+                _mdns_result_update_ttl(r, ttl);
             }
-            r->txt = txt;
-            r->txt_value_len = txt_value_len;
-            r->txt_count = txt_count;
-            _mdns_result_update_ttl(r, ttl);
             return;
         }
         r = r->next;
     }
     if (!search->max_results || search->num_results < search->max_results) {
-        r = (mdns_result_t *)malloc(sizeof(mdns_result_t));
+        r = _mdns_result_new(&search->result);
         if (!r) {
-            HOOK_MALLOC_FAILED;
-            goto free_txt;
+            return;
         }
-
-        memset(r, 0, sizeof(mdns_result_t));
-        r->txt = txt;
-        r->txt_value_len = txt_value_len;
-        r->txt_count = txt_count;
-        r->esp_netif = _mdns_get_esp_netif(tcpip_if);
+        r->esp_netif = esp_netif;
         r->ip_protocol = ip_protocol;
         r->ttl = ttl;
-        r->next = search->result;
-        search->result = r;
-        search->num_results++;
-    }
-    return;
-
-free_txt:
-    for (size_t i = 0; i < txt_count; i++) {
-        free((char *)(txt[i].key));
-        free((char *)(txt[i].value));
+        _mdns_search_count_result(search);
+        _mdns_result_txt_create(r, data, len);
     }
-    free(txt);
 }
 
+#if MDNS_CACHE_SIZE
 /**
- * @brief  Called from packet parser to find matching running search
+ * @brief  Adds the cached addresses of the host to the search results
  */
-static mdns_search_once_t *_mdns_search_find_from(mdns_search_once_t *s, mdns_name_t *name, uint16_t type, mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol)
+static void _mdns_cache_add_addresses(mdns_search_once_t *search, const char *host, uint32_t now)
 {
-    mdns_result_t *r = NULL;
-    while (s) {
-        if (s->state == SEARCH_OFF) {
-            s = s->next;
-            continue;
+    uint16_t types[] = { MDNS_TYPE_A, MDNS_TYPE_AAAA };
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        mdns_cache_entry_t *entry = _mdns_cache_scan(*_mdns_cache_bucket(types[i], host, "", ""), types[i], host, "", "", now);
+        for (; entry; entry = _mdns_cache_scan(entry->hash_next, types[i], host, "", "", now)) {
+            _mdns_search_result_add_ip(search, entry->host, &entry->addr, entry->tcpip_if, entry->ip_protocol,
+                                       _mdns_cache_ttl(entry, now));
+            _mdns_cache_touch(entry);
         }
+    }
+}
 
-        if (type == MDNS_TYPE_A || type == MDNS_TYPE_AAAA) {
-            if ((s->type == MDNS_TYPE_ANY && s->service != NULL)
-                    || (s->type != MDNS_TYPE_ANY && s->type != type && s->type != MDNS_TYPE_PTR && s->type != MDNS_TYPE_SRV)) {
-                s = s->next;
-                continue;
-            }
-            if (s->type != MDNS_TYPE_PTR && s->type != MDNS_TYPE_SRV) {
-                if (!strcasecmp(name->host, s->instance)) {
-                    return s;
-                }
-                s = s->next;
+/**
+ * @brief  Fills the search results of the instance from its cached SRV, TXT and addresses
+ *
+ * @return true if the SRV record and an address of its host are cached
+ */
+static bool _mdns_cache_complete_instance(mdns_search_once_t *search, mdns_result_t *r, mdns_if_t tcpip_if,
+        mdns_ip_protocol_t ip_protocol, uint32_t now)
+{
+    if (!r->service_type || !r->proto) {
+        return false;
+    }
+    uint16_t types[] = { MDNS_TYPE_SRV, MDNS_TYPE_TXT };
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        mdns_cache_entry_t *entry = _mdns_cache_scan(*_mdns_cache_bucket(types[i], r->instance_name, r->service_type, r->proto),
+                                    types[i], r->instance_name, r->service_type, r->proto, now);
+        for (; entry; entry = _mdns_cache_scan(entry->hash_next, types[i], r->instance_name, r->service_type, r->proto, now)) {
+            if (entry->tcpip_if != tcpip_if || entry->ip_protocol != ip_protocol) {
                 continue;
             }
-            r = s->result;
-            while (r) {
-                if (r->esp_netif == _mdns_get_esp_netif(tcpip_if) && r->ip_protocol == ip_protocol && !_str_null_or_empty(r->hostname) && !strcasecmp(name->host, r->hostname)) {
-                    return s;
-                }
-                r = r->next;
+            if (types[i] == MDNS_TYPE_SRV && !r->hostname) {
+                _mdns_result_set_hostname(r, entry->target);
+                r->port = entry->port;
+            } else if (types[i] == MDNS_TYPE_TXT && !r->txt) {
+                _mdns_result_txt_create(r, entry->txt, entry->txt_len);
             }
-            s = s->next;
-            continue;
+            _mdns_result_update_ttl(r, _mdns_cache_ttl(entry, now));
+            _mdns_cache_touch(entry);
         }
+    }
+    if (!r->hostname) {
+        return false;
+    }
+    _mdns_cache_add_addresses(search, r->hostname, now);
+    return r->addr != NULL;
+}
 
-        if (type == MDNS_TYPE_SRV || type == MDNS_TYPE_TXT) {
-            if ((s->type == MDNS_TYPE_ANY && s->service == NULL)
-                    || (s->type != MDNS_TYPE_ANY && s->type != type && s->type != MDNS_TYPE_PTR)) {
-                s = s->next;
-                continue;
+/**
+ * @brief  Answers a query from the cached records
+ *
+ * Host, SRV and TXT queries need the record of any interface, service queries need max_results
+ * instances with their SRV record and an address of their host, to not cut the discovery short.
+ *
+ * @param  num_results set to the number of results found, can be NULL
+ *
+ * @return true if the results were found in the cache
+ */
+static bool _mdns_cache_lookup(const char *name, const char *service, const char *proto, uint16_t type,
+                               size_t max_results, mdns_result_t **results, uint8_t *num_results)
+{
+    mdns_search_once_t search;
+    memset(&search, 0, sizeof(mdns_search_once_t));
+    search.type = type;
+    search.max_results = max_results;
+    search.instance = (char *)name;
+    search.service = (char *)service;
+    search.proto = (char *)proto;
+
+    uint32_t now = xTaskGetTickCount() * portTICK_PERIOD_MS;
+    bool hit = false;
+    mdns_cache_entry_t *entry = NULL;
+    if ((type == MDNS_TYPE_A || type == MDNS_TYPE_AAAA) && !_str_null_or_empty(name) && _str_null_or_empty(service)) {
+        entry = _mdns_cache_scan(*_mdns_cache_bucket(type, name, "", ""), type, name, "", "", now);
+        for (; entry; entry = _mdns_cache_scan(entry->hash_next, type, name, "", "", now)) {
+            _mdns_search_result_add_ip(&search, entry->host, &entry->addr, entry->tcpip_if, entry->ip_protocol,
+                                       _mdns_cache_ttl(entry, now));
+            _mdns_cache_touch(entry);
+        }
+        hit = search.result != NULL;
+    } else if ((type == MDNS_TYPE_SRV || type == MDNS_TYPE_TXT) && !_str_null_or_empty(name) && !_str_null_or_empty(service)) {
+        entry = _mdns_cache_scan(*_mdns_cache_bucket(type, name, service, proto), type, name, service, proto, now);
+        for (; entry; entry = _mdns_cache_scan(entry->hash_next, type, name, service, proto, now)) {
+            if (type == MDNS_TYPE_SRV) {
+                _mdns_search_result_add_srv(&search, entry->target, entry->port, entry->tcpip_if, entry->ip_protocol,
+                                            _mdns_cache_ttl(entry, now));
+                _mdns_cache_add_addresses(&search, entry->target, now);
+            } else {
+                _mdns_search_result_add_txt(&search, entry->txt, entry->txt_len, entry->tcpip_if, entry->ip_protocol,
+                                            _mdns_cache_ttl(entry, now));
             }
-            if (strcasecmp(name->service, s->service)
-                    || strcasecmp(name->proto, s->proto)) {
-                s = s->next;
-                continue;
+            _mdns_cache_touch(entry);
+        }
+        hit = search.result != NULL;
+    } else if (type == MDNS_TYPE_PTR && _str_null_or_empty(name) && !_str_null_or_empty(service) && max_results) {
+        hit = true;
+        entry = _mdns_cache_scan(*_mdns_cache_bucket(type, "", service, proto), type, "", service, proto, now);
+        for (; entry && search.num_results < max_results;
+                entry = _mdns_cache_scan(entry->hash_next, type, "", service, proto, now)) {
+            mdns_result_t *r = _mdns_search_result_add_ptr(&search, entry->target, entry->service, entry->proto,
+                               entry->tcpip_if, entry->ip_protocol, _mdns_cache_ttl(entry, now));
+            if (!r || !_mdns_cache_complete_instance(&search, r, entry->tcpip_if, entry->ip_protocol, now)) {
+                hit = false;
+                break;
             }
-            if (s->type != MDNS_TYPE_PTR) {
-                if (s->instance && strcasecmp(name->host, s->instance) == 0) {
-                    return s;
-                }
-                s = s->next;
-                continue;
+            _mdns_cache_touch(entry);
+        }
+        hit = hit && search.num_results >= max_results;
+    }
+
+    if (!hit) {
+        mdns_query_results_free(search.result);
+        return false;
+    }
+    *results = search.result;
+    if (num_results) {
+        *num_results = search.num_results;
+    }
+    return true;
+}
+#endif /* MDNS_CACHE_SIZE */
+
+/**
+ * @brief  True if the running search comes next in the search list order: before the previous match, newest first
+ */
+static inline bool _mdns_search_is_next(const mdns_search_once_t *s, uint32_t before, const mdns_search_once_t *found)
+{
+    return s->state != SEARCH_OFF && s->seq < before && (!found || s->seq > found->seq);
+}
+
+/**
+ * @brief  Called from packet parser to find the running searches matching a record
+ *
+ * The searches are looked up by the name of the record, A/AAAA records also by the host names of the PTR
+ * and SRV search results. They are returned in the order of the search list.
+ *
+ * @param  prev     the previous match or NULL for the first one
+ *
+ * @return the next matching search or NULL
+ */
+static mdns_search_once_t *_mdns_search_find_next(mdns_search_once_t *prev, mdns_name_t *name, uint16_t type, mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol)
+{
+    uint32_t before = prev ? prev->seq : UINT32_MAX;
+    mdns_search_once_t *found = NULL;
+    mdns_search_once_t *s;
+    uint32_t key;
+
+    if (type == MDNS_TYPE_A || type == MDNS_TYPE_AAAA) {
+        key = _mdns_search_key(MDNS_SEARCH_KEY_HOST, name->host, NULL, NULL);
+        for (s = _mdns_server->search_index[key & (MDNS_SEARCH_INDEX_SIZE - 1)]; s; s = s->index_next) {
+            if (s->key == key && (s->type == type || s->type == MDNS_TYPE_ANY) && _mdns_search_is_next(s, before, found)
+                    && !strcasecmp(name->host, s->instance)) {
+                found = s;
+            }
+        }
+        esp_netif_t *netif = _mdns_get_esp_netif(tcpip_if);
+        for (mdns_search_host_t *h = _mdns_server->search_hosts[key & (MDNS_SEARCH_INDEX_SIZE - 1)]; h; h = h->next) {
+            mdns_result_t *r = h->result;
+            if (h->hash == key && r->esp_netif == netif && r->ip_protocol == ip_protocol
+                    && _mdns_search_is_next(h->search, before, found) && !strcasecmp(name->host, r->hostname)) {
+                found = h->search;
             }
-            return s;
         }
+        return found;
+    }
 
-        if (type == MDNS_TYPE_PTR && type == s->type && !strcasecmp(name->service, s->service) && !strcasecmp(name->proto, s->proto)) {
-            return s;
+    if (type == MDNS_TYPE_SRV || type == MDNS_TYPE_TXT || type == MDNS_TYPE_PTR) {
+        key = _mdns_search_key(MDNS_SEARCH_KEY_TYPE, NULL, name->service, name->proto);
+        for (s = _mdns_server->search_index[key & (MDNS_SEARCH_INDEX_SIZE - 1)]; s; s = s->index_next) {
+            if (s->key == key && s->type == MDNS_TYPE_PTR && _mdns_search_is_next(s, before, found)
+                    && !strcasecmp(name->service, s->service) && !strcasecmp(name->proto, s->proto)) {
+                found = s;
+            }
         }
+    }
 
-        s = s->next;
+    if (type == MDNS_TYPE_SRV || type == MDNS_TYPE_TXT) {
+        key = _mdns_search_key(MDNS_SEARCH_KEY_INSTANCE, name->host, name->service, name->proto);
+        for (s = _mdns_server->search_index[key & (MDNS_SEARCH_INDEX_SIZE - 1)]; s; s = s->index_next) {
+            if (s->key == key && (s->type == type || s->type == MDNS_TYPE_ANY) && _mdns_search_is_next(s, before, found)
+                    && !strcasecmp(name->host, s->instance) && !strcasecmp(name->service, s->service)
+                    && !strcasecmp(name->proto, s->proto)) {
+                found = s;
+            }
+        }
     }
 
-    return NULL;
+    return found;
 }
 
 /**
@@ -4662,7 +6247,7 @@ static mdns_tx_packet_t *_mdns_create_search_packet(mdns_search_once_t *search,
         return NULL;
     }
 
-    mdns_out_question_t *q = (mdns_out_question_t *)malloc(sizeof(mdns_out_question_t));
+    mdns_out_question_t *q = (mdns_out_question_t *)_mdns_malloc(sizeof(mdns_out_question_t));
     if (!q) {
         HOOK_MALLOC_FAILED;
         _mdns_free_tx_packet(packet);
@@ -4686,7 +6271,7 @@ static mdns_tx_packet_t *_mdns_create_search_packet(mdns_search_once_t *search,
                 r = r->next;
                 continue;
             }
-            mdns_out_answer_t *a = (mdns_out_answer_t *)malloc(sizeof(mdns_out_answer_t));
+            mdns_out_answer_t *a = (mdns_out_answer_t *)_mdns_malloc(sizeof(mdns_out_answer_t));
             if (!a) {
                 HOOK_MALLOC_FAILED;
                 _mdns_free_tx_packet(packet);
@@ -4755,10 +6340,7 @@ static void _mdns_search_send(mdns_search_once_t *search)
 
 static void _mdns_tx_handle_packet(mdns_tx_packet_t *p)
 {
-    mdns_tx_packet_t *a = NULL;
-    mdns_out_question_t *q = NULL;
     mdns_pcb_t *pcb = &_mdns_server->interfaces[p->tcpip_if].pcbs[p->ip_protocol];
-    uint32_t send_after = 1000;
 
     if (pcb->state == PCB_OFF) {
         _mdns_free_tx_packet(p);
@@ -4768,40 +6350,26 @@ static void _mdns_tx_handle_packet(mdns_tx_packet_t *p)
 
     switch (pcb->state) {
     case PCB_PROBE_1:
-        q = p->questions;
-        while (q) {
-            q->unicast = false;
-            q = q->next;
-        }
-    //fallthrough
     case PCB_PROBE_2:
-        _mdns_schedule_tx_packet(p, 250);
-        pcb->state = (mdns_pcb_state_t)((uint8_t)(pcb->state) + 1);
-        break;
     case PCB_PROBE_3:
-        a = _mdns_create_announce_from_probe(p);
-        if (!a) {
+        if (!pcb->probe_running) {
+            _mdns_free_tx_packet(p);
+        } else if (_mdns_pcb_probe_next(p->tcpip_if, p->ip_protocol)) {
+            _mdns_free_tx_packet(p);
+        } else {
+            //out of memory, send the same probe again
             _mdns_schedule_tx_packet(p, 250);
-            break;
         }
-        pcb->probe_running = false;
-        pcb->probe_ip = false;
-        pcb->probe_services_len = 0;
-        pcb->failed_probes = 0;
-        free(pcb->probe_services);
-        pcb->probe_services = NULL;
-        _mdns_free_tx_packet(p);
-        p = a;
-        send_after = 250;
-    //fallthrough
+        break;
     case PCB_ANNOUNCE_1:
     //fallthrough
     case PCB_ANNOUNCE_2:
-        _mdns_schedule_tx_packet(p, send_after);
+        _mdns_schedule_tx_packet(p, 1000);
         pcb->state = (mdns_pcb_state_t)((uint8_t)(pcb->state) + 1);
         break;
     case PCB_ANNOUNCE_3:
         pcb->state = PCB_RUNNING;
+        memset(&pcb->announce, 0, sizeof(pcb->announce));
         _mdns_free_tx_packet(p);
         break;
     default:
@@ -4817,8 +6385,8 @@ static void _mdns_remap_self_service_hostname(const char *old_hostname, const ch
     while (service) {
         if (service->service->hostname &&
                 strcmp(service->service->hostname, old_hostname) == 0) {
-            free((char *)service->service->hostname);
-            service->service->hostname = strdup(new_hostname);
+            _mdns_service_free_name(service->service, service->service->hostname);
+            service->service->hostname = _mdns_strdup(new_hostname);
         }
         service = service->next;
     }
@@ -4844,7 +6412,7 @@ static void _mdns_free_action(mdns_action_t *action)
         free(action->data.srv_instance.instance);
         break;
     case ACTION_SERVICE_TXT_REPLACE:
-        _mdns_free_linked_txt(action->data.srv_txt_replace.txt);
+        free(action->data.srv_txt_replace.txt);
         break;
     case ACTION_SERVICE_TXT_SET:
         free(action->data.srv_txt_set.key);
@@ -4864,10 +6432,13 @@ static void _mdns_free_action(mdns_action_t *action)
         _mdns_search_free(action->data.search_add.search);
         break;
     case ACTION_TX_HANDLE:
-        _mdns_free_tx_packet(action->data.tx_handle.packet);
-        break;
+        _mdns_server->tx_action_queued = false;
+        return; // not allocated, see _mdns_scheduler_run()
     case ACTION_RX_HANDLE:
         _mdns_packet_free(action->data.rx_handle.packet);
+#if MDNS_PARSE_WORKER
+        _mdns_parse_names_release(action->data.rx_handle.names);
+#endif
         break;
     case ACTION_DELEGATE_HOSTNAME_SET_ADDR:
     case ACTION_DELEGATE_HOSTNAME_ADD:
@@ -4880,7 +6451,19 @@ static void _mdns_free_action(mdns_action_t *action)
     default:
         break;
     }
-    free(action);
+    _mdns_action_release(action);
+}
+
+/**
+ * @brief  Count a received packet in the parse time histogram, by the power of two of the microseconds
+ */
+static void _mdns_stats_parse_time(uint32_t us)
+{
+    uint32_t bucket = 0;
+    if (us >= 16) {
+        bucket = MIN(32 - __builtin_clz(us) - 4, MDNS_STATS_PARSE_BUCKETS - 1);
+    }
+    atomic_fetch_add_explicit(&_mdns_stats.parse_time[bucket], 1, memory_order_relaxed);
 }
 
 /**
@@ -4891,10 +6474,7 @@ static void _mdns_execute_action(mdns_action_t *action)
     mdns_srv_item_t *a = NULL;
     mdns_service_t *service;
     char *key;
-    char *value;
-    char *subtype;
-    mdns_subtype_t *subtype_item;
-    mdns_txt_linked_item_t *txt, * t;
+    int64_t parse_started;
 
     switch (action->type) {
     case ACTION_SYSTEM_EVENT:
@@ -4906,6 +6486,7 @@ static void _mdns_execute_action(mdns_action_t *action)
         free((char *)_mdns_server->hostname);
         _mdns_server->hostname = action->data.hostname_set.hostname;
         _mdns_self_host.hostname = action->data.hostname_set.hostname;
+        _mdns_wire_invalidate();
         _mdns_restart_all_pcbs();
         xSemaphoreGive(_mdns_server->action_sema);
         break;
@@ -4913,65 +6494,51 @@ static void _mdns_execute_action(mdns_action_t *action)
         _mdns_send_bye_all_pcbs_no_instance(false);
         free((char *)_mdns_server->instance);
         _mdns_server->instance = action->data.instance;
+        _mdns_wire_invalidate();
         _mdns_restart_all_pcbs_no_instance();
 
         break;
     case ACTION_SERVICE_ADD:
+        if (!_mdns_service_slot_alloc(action->data.srv_add.service)) {
+            _mdns_free_action(action);
+            return;
+        }
         action->data.srv_add.service->next = _mdns_server->services;
         _mdns_server->services = action->data.srv_add.service;
+        _mdns_service_index_add(action->data.srv_add.service);
         _mdns_probe_all_pcbs(&action->data.srv_add.service, 1, false, false);
         break;
     case ACTION_SERVICE_INSTANCE_SET:
         if (action->data.srv_instance.service->service->instance) {
             _mdns_send_bye(&action->data.srv_instance.service, 1, false);
-            free((char *)action->data.srv_instance.service->service->instance);
         }
-        action->data.srv_instance.service->service->instance = action->data.srv_instance.instance;
+        _mdns_service_set_instance(action->data.srv_instance.service, action->data.srv_instance.instance);
         _mdns_probe_all_pcbs(&action->data.srv_instance.service, 1, false, false);
 
         break;
     case ACTION_SERVICE_PORT_SET:
         action->data.srv_port.service->service->port = action->data.srv_port.port;
+        _mdns_wire_invalidate();
         _mdns_announce_all_pcbs(&action->data.srv_port.service, 1, true);
 
         break;
     case ACTION_SERVICE_TXT_REPLACE:
         service = action->data.srv_txt_replace.service->service;
-        txt = service->txt;
-        service->txt = NULL;
-        _mdns_free_linked_txt(txt);
+        free(service->txt);
         service->txt = action->data.srv_txt_replace.txt;
+        service->txt_len = action->data.srv_txt_replace.txt_len;
         _mdns_announce_all_pcbs(&action->data.srv_txt_replace.service, 1, false);
 
         break;
     case ACTION_SERVICE_TXT_SET:
         service = action->data.srv_txt_set.service->service;
-        key = action->data.srv_txt_set.key;
-        value = action->data.srv_txt_set.value;
-        txt = service->txt;
-        while (txt) {
-            if (strcmp(txt->key, key) == 0) {
-                free((char *)txt->value);
-                free(key);
-                txt->value = value;
-                txt->value_len = action->data.srv_txt_set.value_len;
-                break;
-            }
-            txt = txt->next;
-        }
-        if (!txt) {
-            txt = (mdns_txt_linked_item_t *)malloc(sizeof(mdns_txt_linked_item_t));
-            if (!txt) {
-                HOOK_MALLOC_FAILED;
-                _mdns_free_action(action);
-                return;
-            }
-            txt->key = key;
-            txt->value = value;
-            txt->value_len = action->data.srv_txt_set.value_len;
-            txt->next = service->txt;
-            service->txt = txt;
+        if (!_mdns_service_txt_update(service, action->data.srv_txt_set.key, action->data.srv_txt_set.value,
+                                      action->data.srv_txt_set.value_len, false)) {
+            _mdns_free_action(action);
+            return;
         }
+        free(action->data.srv_txt_set.key);
+        free(action->data.srv_txt_set.value);
 
         _mdns_announce_all_pcbs(&action->data.srv_txt_set.service, 1, false);
 
@@ -4979,29 +6546,11 @@ static void _mdns_execute_action(mdns_action_t *action)
     case ACTION_SERVICE_TXT_DEL:
         service = action->data.srv_txt_del.service->service;
         key = action->data.srv_txt_del.key;
-        txt = service->txt;
-        if (!txt) {
+        if (!service->txt) {
+            free(key);
             break;
         }
-        if (strcmp(txt->key, key) == 0) {
-            service->txt = txt->next;
-            free((char *)txt->key);
-            free((char *)txt->value);
-            free(txt);
-        } else {
-            while (txt->next) {
-                if (strcmp(txt->next->key, key) == 0) {
-                    t = txt->next;
-                    txt->next = t->next;
-                    free((char *)t->key);
-                    free((char *)t->value);
-                    free(t);
-                    break;
-                } else {
-                    txt = txt->next;
-                }
-            }
-        }
+        _mdns_service_txt_update(service, key, NULL, 0, true);
         free(key);
 
         _mdns_announce_all_pcbs(&action->data.srv_txt_set.service, 1, false);
@@ -5009,24 +6558,20 @@ static void _mdns_execute_action(mdns_action_t *action)
         break;
     case ACTION_SERVICE_SUBTYPE_ADD:
         service = action->data.srv_subtype_add.service->service;
-        subtype = action->data.srv_subtype_add.subtype;
-        subtype_item = (mdns_subtype_t *)malloc(sizeof(mdns_subtype_t));
-        if (!subtype_item) {
-            HOOK_MALLOC_FAILED;
+        if (!_mdns_service_subtype_add(service, action->data.srv_subtype_add.subtype)) {
             _mdns_free_action(action);
             return;
         }
-        subtype_item->subtype = subtype;
-        subtype_item->next = service->subtype;
-        service->subtype = subtype_item;
+        free(action->data.srv_subtype_add.subtype);
         break;
     case ACTION_SERVICE_DEL:
         a = _mdns_server->services;
         if (action->data.srv_del.service) {
             if (_mdns_server->services == action->data.srv_del.service) {
                 _mdns_server->services = a->next;
+                _mdns_service_index_remove(a);
                 _mdns_send_bye(&a, 1, false);
-                _mdns_remove_scheduled_service_packets(a->service);
+                _mdns_remove_scheduled_service_packets(a);
                 _mdns_free_service(a->service);
                 free(a);
             } else {
@@ -5036,8 +6581,9 @@ static void _mdns_execute_action(mdns_action_t *action)
                 if (a->next == action->data.srv_del.service) {
                     mdns_srv_item_t *b = a->next;
                     a->next = a->next->next;
+                    _mdns_service_index_remove(b);
                     _mdns_send_bye(&b, 1, false);
-                    _mdns_remove_scheduled_service_packets(b->service);
+                    _mdns_remove_scheduled_service_packets(b);
                     _mdns_free_service(b->service);
                     free(b);
                 }
@@ -5049,10 +6595,13 @@ static void _mdns_execute_action(mdns_action_t *action)
         _mdns_send_final_bye(false);
         a = _mdns_server->services;
         _mdns_server->services = NULL;
+        memset(_mdns_server->service_types, 0, sizeof(_mdns_server->service_types));
+        memset(_mdns_server->service_instances, 0, sizeof(_mdns_server->service_instances));
         while (a) {
             mdns_srv_item_t *s = a;
             a = a->next;
-            _mdns_remove_scheduled_service_packets(s->service);
+            _mdns_remove_scheduled_service_packets(s);
+            _mdns_server->service_slots[s->slot] = NULL;
             _mdns_free_service(s->service);
             free(s);
         }
@@ -5068,20 +6617,23 @@ static void _mdns_execute_action(mdns_action_t *action)
         _mdns_search_finish(action->data.search_add.search);
         break;
     case ACTION_TX_HANDLE: {
-        mdns_tx_packet_t *p = _mdns_server->tx_queue_head;
-        // packet to be handled should be at tx head, but must be consistent with the one pushed to action queue
-        if (p && p == action->data.tx_handle.packet && p->queued) {
-            p->queued = false; // clearing, as the packet might be reused (pushed and transmitted again)
-            _mdns_server->tx_queue_head = p->next;
-            _mdns_tx_handle_packet(p);
-        } else {
-            ESP_LOGD(TAG, "Skipping transmit of an unexpected packet!");
+        _mdns_server->tx_action_queued = false;
+        uint32_t now = xTaskGetTickCount() * portTICK_PERIOD_MS;
+        // handled packets might be scheduled again, but never to be sent right away
+        while (_mdns_server->tx_queue_len && (int32_t)(_mdns_server->tx_queue[0]->send_at - now) < 0) {
+            _mdns_tx_handle_packet(_mdns_tx_queue_pop());
         }
+        _mdns_timer_rearm();
     }
-    break;
+    return; // not allocated, see _mdns_scheduler_run()
     case ACTION_RX_HANDLE:
-        mdns_parse_packet(action->data.rx_handle.packet);
+        parse_started = esp_timer_get_time();
+        mdns_parse_packet(&_mdns_server->parser, action->data.rx_handle.packet, action->data.rx_handle.names);
+        _mdns_stats_parse_time((uint32_t)(esp_timer_get_time() - parse_started));
         _mdns_packet_free(action->data.rx_handle.packet);
+#if MDNS_PARSE_WORKER
+        _mdns_parse_names_release(action->data.rx_handle.names);
+#endif
         break;
     case ACTION_DELEGATE_HOSTNAME_ADD:
         if (!_mdns_delegate_hostname_add(action->data.delegate_hostname.hostname,
@@ -5104,7 +6656,7 @@ static void _mdns_execute_action(mdns_action_t *action)
     default:
         break;
     }
-    free(action);
+    _mdns_action_release(action);
 }
 
 /**
@@ -5114,16 +6666,15 @@ static esp_err_t _mdns_send_search_action(mdns_action_type_t type, mdns_search_o
 {
     mdns_action_t *action = NULL;
 
-    action = (mdns_action_t *)malloc(sizeof(mdns_action_t));
+    action = _mdns_action_alloc();
     if (!action) {
-        HOOK_MALLOC_FAILED;
         return ESP_ERR_NO_MEM;
     }
 
     action->type = type;
     action->data.search_add.search = search;
-    if (xQueueSend(_mdns_server->action_queue, &action, (TickType_t)0) != pdPASS) {
-        free(action);
+    if (!_mdns_action_post(action)) {
+        _mdns_action_release(action);
         return ESP_ERR_NO_MEM;
     }
     return ESP_OK;
@@ -5132,72 +6683,116 @@ static esp_err_t _mdns_send_search_action(mdns_action_type_t type, mdns_search_o
 /**
  * @brief  Called from timer task to run mDNS responder
  *
- * periodically checks first unqueued packet (from tx head).
- * if it is scheduled to be transmitted, then pushes the packet to action queue to be handled.
- *
+ * if the first packet of the tx queue is due, posts the tx action, which sends all due packets.
+ * There is a single tx action, it is not allocated and is posted again only after it has been handled.
  */
 static void _mdns_scheduler_run(void)
 {
-    MDNS_SERVICE_LOCK();
-    mdns_tx_packet_t *p = _mdns_server->tx_queue_head;
-    mdns_action_t *action = NULL;
+    static mdns_action_t tx_action = { .type = ACTION_TX_HANDLE };
 
-    // find first unqueued packet
-    while (p && p->queued) {
-        p = p->next;
-    }
-    if (!p) {
-        MDNS_SERVICE_UNLOCK();
+    if (!_mdns_server->tx_queue_len || _mdns_server->tx_action_queued) {
         return;
     }
-    if ((int32_t)(p->send_at - (xTaskGetTickCount() * portTICK_PERIOD_MS)) < 0) {
-        action = (mdns_action_t *)malloc(sizeof(mdns_action_t));
-        if (action) {
-            action->type = ACTION_TX_HANDLE;
-            action->data.tx_handle.packet = p;
-            p->queued = true;
-            if (xQueueSend(_mdns_server->action_queue, &action, (TickType_t)0) != pdPASS) {
-                free(action);
-                p->queued = false;
-            }
-        } else {
-            HOOK_MALLOC_FAILED;
-            // continue
+    if ((int32_t)(_mdns_server->tx_queue[0]->send_at - (xTaskGetTickCount() * portTICK_PERIOD_MS)) < 0) {
+        if (_mdns_action_post(&tx_action)) {
+            _mdns_server->tx_action_queued = true;
         }
     }
-    MDNS_SERVICE_UNLOCK();
+}
+
+/**
+ * @brief  Time of the next resend or the timeout of a running search, whichever comes first
+ */
+static uint32_t _mdns_search_deadline(mdns_search_once_t *s)
+{
+    // both are due once the time has passed them
+    uint32_t resend_at = s->sent_at + MDNS_SEARCH_RESEND_MS + 1;
+    uint32_t end_at = s->started_at + s->timeout + 1;
+    return (int32_t)(end_at - resend_at) < 0 ? end_at : resend_at;
 }
 
 /**
  * @brief  Called from timer task to run active searches
+ *
+ * Sends the due queries, ends the timed out searches and records when the next one is due.
  */
 static void _mdns_search_run(void)
 {
-    MDNS_SERVICE_LOCK();
     mdns_search_once_t *s = _mdns_server->search_once;
     uint32_t now = xTaskGetTickCount() * portTICK_PERIOD_MS;
-    if (!s) {
-        MDNS_SERVICE_UNLOCK();
-        return;
-    }
+    uint32_t next_at = 0;
+    bool pending = false;
+
     while (s) {
         if (s->state != SEARCH_OFF) {
+            bool retry = false;
             if (now > (s->started_at + s->timeout)) {
                 s->state = SEARCH_OFF;
                 if (_mdns_send_search_action(ACTION_SEARCH_END, s) != ESP_OK) {
                     s->state = SEARCH_RUNNING;
+                    retry = true;
                 }
-            } else if (s->state == SEARCH_INIT || (now - s->sent_at) > 1000) {
+            } else if (s->state == SEARCH_INIT || (now - s->sent_at) > MDNS_SEARCH_RESEND_MS) {
                 s->state = SEARCH_RUNNING;
                 s->sent_at = now;
                 if (_mdns_send_search_action(ACTION_SEARCH_SEND, s) != ESP_OK) {
-                    s->sent_at -= 1000;
+                    s->sent_at -= MDNS_SEARCH_RESEND_MS;
+                    retry = true;
                 }
             }
+            if (s->state != SEARCH_OFF) {
+                // an action the queue had no room for is posted again after a timer period
+                uint32_t at = retry ? now + CONFIG_MDNS_TIMER_PERIOD_MS : _mdns_search_deadline(s);
+                if (!pending || (int32_t)(at - next_at) < 0) {
+                    next_at = at;
+                }
+                pending = true;
+            }
         }
         s = s->next;
     }
-    MDNS_SERVICE_UNLOCK();
+    _mdns_server->search_at = next_at;
+    _mdns_server->search_pending = pending;
+}
+
+/**
+ * @brief  Arms the one-shot timer for the next scheduled packet or the next resend or timeout of a search
+ *
+ * Called with the service lock. The timer is left alone if it already fires earlier, it then re-arms itself.
+ * Nothing to send and no searches means no timer wake-ups at all.
+ */
+static void _mdns_timer_rearm(void)
+{
+    uint32_t now = xTaskGetTickCount() * portTICK_PERIOD_MS;
+    uint32_t at = 0;
+    bool pending = false;
+
+    if (!_mdns_server->timer_handle) {
+        return;
+    }
+    // while the tx action waits in the queue the head is already due, handling the action re-arms the timer
+    if (_mdns_server->tx_queue_len && !_mdns_server->tx_action_queued) {
+        // a packet is due once the time has passed send_at
+        at = _mdns_server->tx_queue[0]->send_at + 1;
+        pending = true;
+    }
+    if (_mdns_server->search_pending) {
+        if (!pending || (int32_t)(_mdns_server->search_at - at) < 0) {
+            at = _mdns_server->search_at;
+        }
+        pending = true;
+    }
+    if (!pending || (_mdns_server->timer_armed && (int32_t)(at - _mdns_server->timer_at) >= 0)) {
+        return;
+    }
+    // the tick count lags behind the real time by up to one tick
+    int32_t delay_ms = (int32_t)(at - now);
+    delay_ms = (delay_ms > 0 ? delay_ms : 0) + portTICK_PERIOD_MS;
+    esp_timer_stop(_mdns_server->timer_handle);
+    if (esp_timer_start_once(_mdns_server->timer_handle, (uint64_t)delay_ms * 1000) == ESP_OK) {
+        _mdns_server->timer_armed = true;
+        _mdns_server->timer_at = at;
+    }
 }
 
 /**
@@ -5206,15 +6801,40 @@ static void _mdns_search_run(void)
 static void _mdns_service_task(void *pvParameters)
 {
     mdns_action_t *a = NULL;
+    // published before looking at the ring, pairs with the fence in _mdns_action_post()
+    _mdns_service_task_handle = xTaskGetCurrentTaskHandle();
+    atomic_thread_fence(memory_order_seq_cst);
     for (;;) {
         if (_mdns_server && _mdns_server->action_queue) {
-            if (xQueueReceive(_mdns_server->action_queue, &a, portMAX_DELAY) == pdTRUE) {
-                if (a && a->type == ACTION_TASK_STOP) {
-                    break;
+            a = _mdns_action_take();
+            if (!a) {
+                ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+                continue;
+            }
+            if (a->type == ACTION_TASK_STOP) {
+                break;
+            }
+            // run the pending actions under a single lock, the responses they trigger are coalesced per interface
+            // and all the packets they send go out together
+            uint8_t batch = 0;
+            MDNS_SERVICE_LOCK();
+            _mdns_server->tx_batching = true;
+            _mdns_udp_pcb_hold();
+            do {
+                if (a->type != ACTION_RX_HANDLE) {
+                    // the action may free services and hosts the held responses refer to
+                    _mdns_flush_held_responses();
                 }
-                MDNS_SERVICE_LOCK();
                 _mdns_execute_action(a);
-                MDNS_SERVICE_UNLOCK();
+                a = ++batch < MDNS_ACTION_BATCH_MAX ? _mdns_action_take() : NULL;
+            } while (a && a->type != ACTION_TASK_STOP);
+            _mdns_flush_held_responses();
+            _mdns_udp_pcb_flush();
+            _mdns_server->tx_batching = false;
+            MDNS_SERVICE_UNLOCK();
+            atomic_fetch_add_explicit(&_mdns_server->action_queue->stats.batches[batch - 1], 1, memory_order_relaxed);
+            if (a) {
+                break;
             }
         } else {
             vTaskDelay(500 * portTICK_PERIOD_MS);
@@ -5224,10 +6844,108 @@ static void _mdns_service_task(void *pvParameters)
     vTaskDelete(NULL);
 }
 
+#if MDNS_PARSE_WORKER
+/**
+ * @brief  Returns names decoded by the parse worker once their packet is parsed
+ */
+static void _mdns_parse_names_release(mdns_parse_names_t *names)
+{
+    if (names) {
+        xQueueSend(_mdns_server->parse_free, &names, 0);
+    }
+}
+
+/**
+ * @brief  The parse worker, decodes the names of the received packets before the service task parses them
+ *
+ * Runs on the other core than the service task and takes no lock, so the service task only applies the packets.
+ * A packet gets no names when all of them are in use, the service task then reads its names itself.
+ */
+static void _mdns_parse_worker_task(void *pvParameters)
+{
+    mdns_rx_packet_t *packet = NULL;
+    while (xQueueReceive(_mdns_server->parse_queue, &packet, portMAX_DELAY) == pdTRUE && packet) {
+        mdns_parse_names_t *names = NULL;
+        if (xQueueReceive(_mdns_server->parse_free, &names, 0) == pdTRUE) {
+            _mdns_parse_names_decode(names, _mdns_get_packet_data(packet), _mdns_get_packet_len(packet));
+        }
+        if (_mdns_post_rx_action(packet, names) != ESP_OK) {
+            _mdns_parse_names_release(names);
+            _mdns_packet_free(packet);
+        }
+    }
+    _mdns_parse_worker_handle = NULL;
+    vTaskDelete(NULL);
+}
+
+/**
+ * @brief  Free the parse worker queues, with the packets still queued to it
+ */
+static void _mdns_parse_worker_free(void)
+{
+    if (_mdns_server->parse_queue) {
+        mdns_rx_packet_t *packet = NULL;
+        while (xQueueReceive(_mdns_server->parse_queue, &packet, 0) == pdTRUE) {
+            if (packet) {
+                _mdns_packet_free(packet);
+            }
+        }
+        vQueueDelete(_mdns_server->parse_queue);
+    }
+    if (_mdns_server->parse_free) {
+        vQueueDelete(_mdns_server->parse_free);
+    }
+    free(_mdns_server->parse_slots);
+    _mdns_server->parse_queue = NULL;
+    _mdns_server->parse_free = NULL;
+    _mdns_server->parse_slots = NULL;
+}
+
+/**
+ * @brief  Start the parse worker, the service task decodes the packets itself if it cannot
+ */
+static void _mdns_parse_worker_start(void)
+{
+    if (!_mdns_server->parse_slots) {
+        _mdns_server->parse_slots = (mdns_parse_names_t *)_mdns_malloc(MDNS_PARSE_WORKER_SLOTS * sizeof(mdns_parse_names_t));
+        _mdns_server->parse_queue = xQueueCreate(MDNS_PACKET_QUEUE_LEN, sizeof(mdns_rx_packet_t *));
+        _mdns_server->parse_free = xQueueCreate(MDNS_PARSE_WORKER_SLOTS, sizeof(mdns_parse_names_t *));
+        if (!_mdns_server->parse_slots || !_mdns_server->parse_queue || !_mdns_server->parse_free) {
+            HOOK_MALLOC_FAILED;
+            _mdns_parse_worker_free();
+            return;
+        }
+        for (size_t i = 0; i < MDNS_PARSE_WORKER_SLOTS; i++) {
+            _mdns_parse_names_release(&_mdns_server->parse_slots[i]);
+        }
+    }
+    xTaskCreatePinnedToCore(_mdns_parse_worker_task, "mdns_parse", MDNS_SERVICE_STACK_DEPTH, NULL, MDNS_TASK_PRIORITY,
+                            (TaskHandle_t *const)(&_mdns_parse_worker_handle), MDNS_PARSE_WORKER_AFFINITY);
+}
+
+/**
+ * @brief  Stop the parse worker, the packets received meanwhile go to the service task
+ */
+static void _mdns_parse_worker_stop(void)
+{
+    if (_mdns_parse_worker_handle) {
+        mdns_rx_packet_t *stop = NULL;
+        xQueueSend(_mdns_server->parse_queue, &stop, portMAX_DELAY);
+        while (_mdns_parse_worker_handle) {
+            vTaskDelay(10 / portTICK_PERIOD_MS);
+        }
+    }
+}
+#endif /* MDNS_PARSE_WORKER */
+
 static void _mdns_timer_cb(void *arg)
 {
+    MDNS_SERVICE_LOCK();
+    _mdns_server->timer_armed = false;
     _mdns_scheduler_run();
     _mdns_search_run();
+    _mdns_timer_rearm();
+    MDNS_SERVICE_UNLOCK();
 }
 
 static esp_err_t _mdns_start_timer(void)
@@ -5242,18 +6960,18 @@ static esp_err_t _mdns_start_timer(void)
     if (err) {
         return err;
     }
-    return esp_timer_start_periodic(_mdns_server->timer_handle, MDNS_TIMER_PERIOD_US);
+    _mdns_server->timer_armed = false;
+    _mdns_timer_rearm();
+    return ESP_OK;
 }
 
 static esp_err_t _mdns_stop_timer(void)
 {
     esp_err_t err = ESP_OK;
     if (_mdns_server->timer_handle) {
-        err = esp_timer_stop(_mdns_server->timer_handle);
-        if (err) {
-            return err;
-        }
+        esp_timer_stop(_mdns_server->timer_handle); // fails if the one-shot timer is not armed
         err = esp_timer_delete(_mdns_server->timer_handle);
+        _mdns_server->timer_handle = NULL;
     }
     return err;
 }
@@ -5289,6 +7007,11 @@ static esp_err_t _mdns_service_task_start(void)
             return ESP_FAIL;
         }
     }
+#if MDNS_PARSE_WORKER
+    if (!_mdns_parse_worker_handle) {
+        _mdns_parse_worker_start();
+    }
+#endif
     MDNS_SERVICE_UNLOCK();
     return ESP_OK;
 }
@@ -5302,11 +7025,13 @@ static esp_err_t _mdns_service_task_start(void)
 static esp_err_t _mdns_service_task_stop(void)
 {
     _mdns_stop_timer();
+#if MDNS_PARSE_WORKER
+    _mdns_parse_worker_stop();
+#endif
     if (_mdns_service_task_handle) {
         mdns_action_t action;
-        mdns_action_t *a = &action;
         action.type = ACTION_TASK_STOP;
-        if (xQueueSend(_mdns_server->action_queue, &a, (TickType_t)0) != pdPASS) {
+        if (!_mdns_action_post(&action)) {
             vTaskDelete(_mdns_service_task_handle);
             _mdns_service_task_handle = NULL;
         }
@@ -5325,17 +7050,16 @@ static esp_err_t mdns_post_custom_action_tcpip_if(mdns_if_t mdns_if, mdns_event_
         return ESP_ERR_INVALID_STATE;
     }
 
-    mdns_action_t *action = (mdns_action_t *)calloc(1, sizeof(mdns_action_t));
+    mdns_action_t *action = _mdns_action_alloc();
     if (!action) {
-        HOOK_MALLOC_FAILED;
         return ESP_ERR_NO_MEM;
     }
     action->type = ACTION_SYSTEM_EVENT;
     action->data.sys_event.event_action = event_action;
     action->data.sys_event.interface = mdns_if;
 
-    if (xQueueSend(_mdns_server->action_queue, &action, (TickType_t)0) != pdPASS) {
-        free(action);
+    if (!_mdns_action_post(action)) {
+        _mdns_action_release(action);
     }
     return ESP_OK;
 }
@@ -5425,6 +7149,108 @@ esp_err_t mdns_unregister_netif(esp_netif_t *esp_netif)
     return err;
 }
 
+/**
+ * @brief  Zero the engine counters, the transmit counters of the networking count on from where they are
+ */
+static void _mdns_stats_clear(void)
+{
+    for (mdns_if_t i = 0; i < MDNS_MAX_INTERFACES; ++i) {
+        _mdns_udp_pcb_get_counters(i, &_mdns_stats_tx_reset[i]);
+        atomic_store_explicit(&_mdns_stats.rx_packets[i], 0, memory_order_relaxed);
+        atomic_store_explicit(&_mdns_stats.rx_bytes[i], 0, memory_order_relaxed);
+        atomic_store_explicit(&_mdns_stats.rx_dropped[i], 0, memory_order_relaxed);
+    }
+    for (size_t i = 0; i < MDNS_STATS_PARSE_BUCKETS; ++i) {
+        atomic_store_explicit(&_mdns_stats.parse_time[i], 0, memory_order_relaxed);
+    }
+    atomic_store_explicit(&_mdns_stats.allocs, 0, memory_order_relaxed);
+    atomic_store_explicit(&_mdns_stats.alloc_failures, 0, memory_order_relaxed);
+    atomic_store_explicit(&_mdns_stats.suppressed, 0, memory_order_relaxed);
+    atomic_store_explicit(&_mdns_stats.searches, 0, memory_order_relaxed);
+    atomic_store_explicit(&_mdns_stats.lock_taken, 0, memory_order_relaxed);
+    atomic_store_explicit(&_mdns_stats.lock_time_us, 0, memory_order_relaxed);
+    atomic_store_explicit(&_mdns_stats.lock_max_us, 0, memory_order_relaxed);
+}
+
+esp_err_t mdns_stats_get(mdns_stats_t *stats)
+{
+    if (!_mdns_server) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (!stats) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    mdns_action_stats_t *actions = &_mdns_server->action_queue->stats;
+    stats->actions = atomic_load_explicit(&actions->posted, memory_order_relaxed);
+    stats->actions_dropped = atomic_load_explicit(&actions->dropped, memory_order_relaxed);
+    stats->action_queue_high_water = atomic_load_explicit(&actions->high_water, memory_order_relaxed);
+    for (size_t i = 0; i < MDNS_STATS_PARSE_BUCKETS; ++i) {
+        stats->parse_time[i] = atomic_load_explicit(&_mdns_stats.parse_time[i], memory_order_relaxed);
+    }
+    stats->answers_suppressed = atomic_load_explicit(&_mdns_stats.suppressed, memory_order_relaxed);
+    stats->responses_coalesced = atomic_load_explicit(&actions->coalesced, memory_order_relaxed);
+    stats->searches = atomic_load_explicit(&_mdns_stats.searches, memory_order_relaxed);
+#if MDNS_CACHE_SIZE
+    MDNS_SERVICE_LOCK();
+    stats->cache_entries = _mdns_server->cache.count;
+    MDNS_SERVICE_UNLOCK();
+#else
+    stats->cache_entries = 0;
+#endif
+    stats->allocs = atomic_load_explicit(&_mdns_stats.allocs, memory_order_relaxed);
+    stats->alloc_failures = atomic_load_explicit(&_mdns_stats.alloc_failures, memory_order_relaxed);
+    stats->lock_taken = atomic_load_explicit(&_mdns_stats.lock_taken, memory_order_relaxed);
+    stats->lock_time_us = atomic_load_explicit(&_mdns_stats.lock_time_us, memory_order_relaxed);
+    stats->lock_max_us = atomic_load_explicit(&_mdns_stats.lock_max_us, memory_order_relaxed);
+    return ESP_OK;
+}
+
+esp_err_t mdns_stats_get_netifs(mdns_netif_stats_t stats[], size_t *num_netifs)
+{
+    if (!_mdns_server) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (!stats || !num_netifs) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    size_t n = 0;
+    for (mdns_if_t i = 0; i < MDNS_MAX_INTERFACES && n < *num_netifs; ++i) {
+        esp_netif_t *esp_netif = _mdns_get_esp_netif(i);
+        if (!esp_netif) {
+            continue;
+        }
+        mdns_tx_counters_t tx;
+        _mdns_udp_pcb_get_counters(i, &tx);
+        stats[n].esp_netif = esp_netif;
+        stats[n].rx_packets = atomic_load_explicit(&_mdns_stats.rx_packets[i], memory_order_relaxed);
+        stats[n].rx_bytes = atomic_load_explicit(&_mdns_stats.rx_bytes[i], memory_order_relaxed);
+        stats[n].rx_dropped = atomic_load_explicit(&_mdns_stats.rx_dropped[i], memory_order_relaxed);
+        stats[n].tx_packets = tx.packets - _mdns_stats_tx_reset[i].packets;
+        stats[n].tx_bytes = tx.bytes - _mdns_stats_tx_reset[i].bytes;
+        stats[n].tx_errors = tx.errors - _mdns_stats_tx_reset[i].errors;
+        n++;
+    }
+    *num_netifs = n;
+    return ESP_OK;
+}
+
+esp_err_t mdns_stats_reset(void)
+{
+    if (!_mdns_server) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    mdns_action_stats_t *actions = &_mdns_server->action_queue->stats;
+    atomic_store_explicit(&actions->posted, 0, memory_order_relaxed);
+    atomic_store_explicit(&actions->dropped, 0, memory_order_relaxed);
+    atomic_store_explicit(&actions->rx_dropped, 0, memory_order_relaxed);
+    atomic_store_explicit(&actions->high_water, 0, memory_order_relaxed);
+    atomic_store_explicit(&actions->coalesced, 0, memory_order_relaxed);
+    for (size_t i = 0; i < MDNS_ACTION_BATCH_MAX; ++i) {
+        atomic_store_explicit(&actions->batches[i], 0, memory_order_relaxed);
+    }
+    _mdns_stats_clear();
+    return ESP_OK;
+}
 
 esp_err_t mdns_init(void)
 {
@@ -5433,19 +7259,21 @@ esp_err_t mdns_init(void)
     if (_mdns_server) {
         return err;
     }
+    _mdns_stats_clear();
 
-    _mdns_server = (mdns_server_t *)malloc(sizeof(mdns_server_t));
+    _mdns_server = (mdns_server_t *)_mdns_malloc(sizeof(mdns_server_t));
     if (!_mdns_server) {
         HOOK_MALLOC_FAILED;
         return ESP_ERR_NO_MEM;
     }
     memset((uint8_t *)_mdns_server, 0, sizeof(mdns_server_t));
+    _mdns_arena_init(&_mdns_server->parser.arena);
     // zero-out local copy of netifs to initiate a fresh search by interface key whenever a netif ptr is needed
     for (mdns_if_t i = 0; i < MDNS_MAX_INTERFACES; ++i) {
         s_esp_netifs[i].netif = NULL;
     }
 
-    _mdns_server->action_queue = xQueueCreate(MDNS_ACTION_QUEUE_LEN, sizeof(mdns_action_t *));
+    _mdns_server->action_queue = _mdns_action_queue_create();
     if (!_mdns_server->action_queue) {
         err = ESP_ERR_NO_MEM;
         goto free_server;
@@ -5514,7 +7342,7 @@ free_event_handlers:
 #endif
     vSemaphoreDelete(_mdns_server->action_sema);
 free_queue:
-    vQueueDelete(_mdns_server->action_queue);
+    free(_mdns_server->action_queue);
 free_server:
     free(_mdns_server);
     _mdns_server = NULL;
@@ -5543,15 +7371,23 @@ void mdns_free(void)
     free((char *)_mdns_server->instance);
     if (_mdns_server->action_queue) {
         mdns_action_t *c;
-        while (xQueueReceive(_mdns_server->action_queue, &c, 0) == pdTRUE) {
+        while ((c = _mdns_action_take())) {
             _mdns_free_action(c);
         }
-        vQueueDelete(_mdns_server->action_queue);
+        free(_mdns_server->action_queue);
     }
-    _mdns_clear_tx_queue_head();
+#if MDNS_PARSE_WORKER
+    _mdns_parse_worker_free();
+#endif
+    _mdns_clear_tx_queue();
+    free(_mdns_server->tx_queue);
+#if MDNS_CACHE_SIZE
+    _mdns_cache_clear();
+#endif
     while (_mdns_server->search_once) {
         mdns_search_once_t *h = _mdns_server->search_once;
         _mdns_server->search_once = h->next;
+        _mdns_search_index_remove(h);
         free(h->instance);
         free(h->service);
         free(h->proto);
@@ -5574,22 +7410,21 @@ esp_err_t mdns_hostname_set(const char *hostname)
     if (_str_null_or_empty(hostname) || strlen(hostname) > (MDNS_NAME_BUF_LEN - 1)) {
         return ESP_ERR_INVALID_ARG;
     }
-    char *new_hostname = strndup(hostname, MDNS_NAME_BUF_LEN - 1);
+    char *new_hostname = _mdns_strndup(hostname, MDNS_NAME_BUF_LEN - 1);
     if (!new_hostname) {
         return ESP_ERR_NO_MEM;
     }
 
-    mdns_action_t *action = (mdns_action_t *)malloc(sizeof(mdns_action_t));
+    mdns_action_t *action = _mdns_action_alloc();
     if (!action) {
-        HOOK_MALLOC_FAILED;
         free(new_hostname);
         return ESP_ERR_NO_MEM;
     }
     action->type = ACTION_HOSTNAME_SET;
     action->data.hostname_set.hostname = new_hostname;
-    if (xQueueSend(_mdns_server->action_queue, &action, (TickType_t)0) != pdPASS) {
+    if (!_mdns_action_post(action)) {
         free(new_hostname);
-        free(action);
+        _mdns_action_release(action);
         return ESP_ERR_NO_MEM;
     }
     xSemaphoreTake(_mdns_server->action_sema, portMAX_DELAY);
@@ -5615,23 +7450,22 @@ esp_err_t mdns_delegate_hostname_add(const char *hostname, const mdns_ip_addr_t
     if (_str_null_or_empty(hostname) || strlen(hostname) > (MDNS_NAME_BUF_LEN - 1)) {
         return ESP_ERR_INVALID_ARG;
     }
-    char *new_hostname = strndup(hostname, MDNS_NAME_BUF_LEN - 1);
+    char *new_hostname = _mdns_strndup(hostname, MDNS_NAME_BUF_LEN - 1);
     if (!new_hostname) {
         return ESP_ERR_NO_MEM;
     }
 
-    mdns_action_t *action = (mdns_action_t *)malloc(sizeof(mdns_action_t));
+    mdns_action_t *action = _mdns_action_alloc();
     if (!action) {
-        HOOK_MALLOC_FAILED;
         free(new_hostname);
         return ESP_ERR_NO_MEM;
     }
     action->type = ACTION_DELEGATE_HOSTNAME_ADD;
     action->data.delegate_hostname.hostname = new_hostname;
     action->data.delegate_hostname.address_list = copy_address_list(address_list);
-    if (xQueueSend(_mdns_server->action_queue, &action, (TickType_t)0) != pdPASS) {
+    if (!_mdns_action_post(action)) {
         free(new_hostname);
-        free(action);
+        _mdns_action_release(action);
         return ESP_ERR_NO_MEM;
     }
     return ESP_OK;
@@ -5645,22 +7479,21 @@ esp_err_t mdns_delegate_hostname_remove(const char *hostname)
     if (_str_null_or_empty(hostname) || strlen(hostname) > (MDNS_NAME_BUF_LEN - 1)) {
         return ESP_ERR_INVALID_ARG;
     }
-    char *new_hostname = strndup(hostname, MDNS_NAME_BUF_LEN - 1);
+    char *new_hostname = _mdns_strndup(hostname, MDNS_NAME_BUF_LEN - 1);
     if (!new_hostname) {
         return ESP_ERR_NO_MEM;
     }
 
-    mdns_action_t *action = (mdns_action_t *)malloc(sizeof(mdns_action_t));
+    mdns_action_t *action = _mdns_action_alloc();
     if (!action) {
-        HOOK_MALLOC_FAILED;
         free(new_hostname);
         return ESP_ERR_NO_MEM;
     }
     action->type = ACTION_DELEGATE_HOSTNAME_REMOVE;
     action->data.delegate_hostname.hostname = new_hostname;
-    if (xQueueSend(_mdns_server->action_queue, &action, (TickType_t)0) != pdPASS) {
+    if (!_mdns_action_post(action)) {
         free(new_hostname);
-        free(action);
+        _mdns_action_release(action);
         return ESP_ERR_NO_MEM;
     }
     return ESP_OK;
@@ -5674,23 +7507,22 @@ esp_err_t mdns_delegate_hostname_set_address(const char *hostname, const mdns_ip
     if (_str_null_or_empty(hostname) || strlen(hostname) > (MDNS_NAME_BUF_LEN - 1)) {
         return ESP_ERR_INVALID_ARG;
     }
-    char *new_hostname = strndup(hostname, MDNS_NAME_BUF_LEN - 1);
+    char *new_hostname = _mdns_strndup(hostname, MDNS_NAME_BUF_LEN - 1);
     if (!new_hostname) {
         return ESP_ERR_NO_MEM;
     }
 
-    mdns_action_t *action = (mdns_action_t *)malloc(sizeof(mdns_action_t));
+    mdns_action_t *action = _mdns_action_alloc();
     if (!action) {
-        HOOK_MALLOC_FAILED;
         free(new_hostname);
         return ESP_ERR_NO_MEM;
     }
     action->type = ACTION_DELEGATE_HOSTNAME_SET_ADDR;
     action->data.delegate_hostname.hostname = new_hostname;
     action->data.delegate_hostname.address_list = copy_address_list(address_list);
-    if (xQueueSend(_mdns_server->action_queue, &action, (TickType_t)0) != pdPASS) {
+    if (!_mdns_action_post(action)) {
         free(new_hostname);
-        free(action);
+        _mdns_action_release(action);
         return ESP_ERR_NO_MEM;
     }
     return ESP_OK;
@@ -5709,22 +7541,21 @@ esp_err_t mdns_instance_name_set(const char *instance)
     if (_str_null_or_empty(instance) || _mdns_server->hostname == NULL || strlen(instance) > (MDNS_NAME_BUF_LEN - 1)) {
         return ESP_ERR_INVALID_ARG;
     }
-    char *new_instance = strndup(instance, MDNS_NAME_BUF_LEN - 1);
+    char *new_instance = _mdns_strndup(instance, MDNS_NAME_BUF_LEN - 1);
     if (!new_instance) {
         return ESP_ERR_NO_MEM;
     }
 
-    mdns_action_t *action = (mdns_action_t *)malloc(sizeof(mdns_action_t));
+    mdns_action_t *action = _mdns_action_alloc();
     if (!action) {
-        HOOK_MALLOC_FAILED;
         free(new_instance);
         return ESP_ERR_NO_MEM;
     }
     action->type = ACTION_INSTANCE_SET;
     action->data.instance = new_instance;
-    if (xQueueSend(_mdns_server->action_queue, &action, (TickType_t)0) != pdPASS) {
+    if (!_mdns_action_post(action)) {
         free(new_instance);
-        free(action);
+        _mdns_action_release(action);
         return ESP_ERR_NO_MEM;
     }
     return ESP_OK;
@@ -5755,7 +7586,7 @@ esp_err_t mdns_service_add_for_host(const char *instance, const char *service, c
         return ESP_ERR_NO_MEM;
     }
 
-    item = (mdns_srv_item_t *)malloc(sizeof(mdns_srv_item_t));
+    item = (mdns_srv_item_t *)_mdns_malloc(sizeof(mdns_srv_item_t));
     if (!item) {
         HOOK_MALLOC_FAILED;
         _mdns_free_service(s);
@@ -5764,20 +7595,22 @@ esp_err_t mdns_service_add_for_host(const char *instance, const char *service, c
 
     item->service = s;
     item->next = NULL;
+    item->type_next = NULL;
+    item->instance_next = NULL;
+    item->seq = 0;
 
-    mdns_action_t *action = (mdns_action_t *)malloc(sizeof(mdns_action_t));
+    mdns_action_t *action = _mdns_action_alloc();
     if (!action) {
-        HOOK_MALLOC_FAILED;
         _mdns_free_service(s);
         free(item);
         return ESP_ERR_NO_MEM;
     }
     action->type = ACTION_SERVICE_ADD;
     action->data.srv_add.service = item;
-    if (xQueueSend(_mdns_server->action_queue, &action, (TickType_t)0) != pdPASS) {
+    if (!_mdns_action_post(action)) {
         _mdns_free_service(s);
         free(item);
-        free(action);
+        _mdns_action_release(action);
         return ESP_ERR_NO_MEM;
     }
 
@@ -5814,64 +7647,71 @@ bool mdns_service_exists_with_instance(const char *instance, const char *service
     return _mdns_get_service_item_instance(instance, service_type, proto, hostname) != NULL;
 }
 
-static mdns_txt_item_t *_copy_mdns_txt_items(mdns_txt_linked_item_t *items, uint8_t **txt_value_len, size_t *txt_count)
+/**
+ * @brief  Copy the TXT items of a service to the set of the result
+ *
+ * @return false if out of memory
+ */
+static bool _mdns_result_txt_copy(mdns_result_t *r, const mdns_service_t *service)
 {
-    mdns_txt_item_t *ret = NULL;
-    size_t ret_index = 0;
-    for (mdns_txt_linked_item_t *tmp = items; tmp != NULL; tmp = tmp->next) {
-        ret_index++;
+    size_t count = 0;
+    for (uint16_t i = 0; i < service->txt_len; i += service->txt[i] + 1) {
+        count++;
     }
-    *txt_count = ret_index;
-    ret = (mdns_txt_item_t *)calloc(ret_index, sizeof(mdns_txt_item_t));
-    *txt_value_len = (uint8_t *)calloc(ret_index, sizeof(uint8_t));
-    if (!ret || !(*txt_value_len)) {
-        HOOK_MALLOC_FAILED;
-        goto handle_error;
+    if (!count) {
+        return true;
     }
-    ret_index = 0;
-    for (mdns_txt_linked_item_t *tmp = items; tmp != NULL; tmp = tmp->next) {
-        size_t key_len = strlen(tmp->key);
-        char *key = (char *)malloc(key_len + 1);
-        if (!key) {
-            HOOK_MALLOC_FAILED;
-            goto handle_error;
-        }
-        memcpy(key, tmp->key, key_len);
-        key[key_len] = 0;
-        ret[ret_index].key = key;
-        char *value = (char *)malloc(tmp->value_len + 1);
-        if (!value) {
-            HOOK_MALLOC_FAILED;
-            goto handle_error;
-        }
-        memcpy(value, tmp->value, tmp->value_len);
-        value[tmp->value_len] = 0;
-        ret[ret_index].value = value;
-        (*txt_value_len)[ret_index] = tmp->value_len;
-        ret_index++;
+    mdns_txt_item_t *txt = (mdns_txt_item_t *)_mdns_result_alloc(r, count * sizeof(mdns_txt_item_t));
+    uint8_t *txt_value_len = (uint8_t *)_mdns_result_alloc(r, count);
+    if (!txt || !txt_value_len) {
+        return false;
     }
-    return ret;
-
-handle_error:
-    for (size_t y = 0; y < ret_index + 1 && ret != NULL; y++) {
-        mdns_txt_item_t *t = &ret[y];
-        free((char *)t->key);
-        free((char *)t->value);
+    size_t n = 0;
+    for (uint16_t i = 0; i < service->txt_len; i += service->txt[i] + 1, n++) {
+        const uint8_t *item = service->txt + i + 1;
+        uint8_t item_len = service->txt[i];
+        const uint8_t *eq = (const uint8_t *)memchr(item, '=', item_len);
+        size_t key_len = eq ? eq - item : item_len;
+        size_t value_len = eq ? item_len - key_len - 1 : 0;
+        char *key = (char *)_mdns_result_alloc(r, key_len + 1);
+        char *value = (char *)_mdns_result_alloc(r, value_len + 1);
+        if (!key || !value) {
+            return false;
+        }
+        memcpy(key, item, key_len);
+        memcpy(value, item + key_len + 1, value_len);
+        txt[n].key = key;
+        txt[n].value = value;
+        txt_value_len[n] = value_len;
     }
-    free(*txt_value_len);
-    free(ret);
-    return NULL;
+    r->txt = txt;
+    r->txt_value_len = txt_value_len;
+    r->txt_count = count;
+    return true;
 }
 
-static mdns_ip_addr_t *_copy_delegated_host_address_list(char *hostname)
-{
-    mdns_host_item_t *host = _mdns_host_list;
-    while (host) {
-        if (strcasecmp(host->hostname, hostname) == 0) {
-            return copy_address_list(host->address_list);
+/**
+ * @brief  Copy the addresses of the delegated host of the result to its set, in order
+ *
+ * @return false if the host is not delegated, has no address or out of memory
+ */
+static bool _mdns_result_copy_delegated_addresses(mdns_result_t *r)
+{
+    for (mdns_host_item_t *host = _mdns_host_list; host; host = host->next) {
+        if (strcasecmp(host->hostname, r->hostname) == 0) {
+            mdns_ip_addr_t **tail = &r->addr;
+            for (const mdns_ip_addr_t *a = host->address_list; a; a = a->next) {
+                *tail = (mdns_ip_addr_t *)_mdns_result_alloc(r, sizeof(mdns_ip_addr_t));
+                if (!*tail) {
+                    return false;
+                }
+                (*tail)->addr = a->addr;
+                tail = &(*tail)->next;
+            }
+            return r->addr != NULL;
         }
     }
-    return NULL;
+    return false;
 }
 
 static mdns_result_t *_mdns_lookup_service(const char *instance, const char *service, const char *proto, size_t max_results, bool selfhost)
@@ -5881,11 +7721,11 @@ static mdns_result_t *_mdns_lookup_service(const char *instance, const char *ser
     }
     mdns_result_t *results = NULL;
     size_t num_results = 0;
-    mdns_srv_item_t *s = _mdns_server->services;
+    mdns_srv_item_t *s = *_mdns_service_type_bucket(service, proto);
     while (s) {
         mdns_service_t *srv = s->service;
         if (!srv || !srv->hostname) {
-            s = s->next;
+            s = s->type_next;
             continue;
         }
         bool is_service_selfhosted = !_str_null_or_empty(_mdns_server->hostname) && !strcasecmp(_mdns_server->hostname, srv->hostname);
@@ -5893,46 +7733,26 @@ static mdns_result_t *_mdns_lookup_service(const char *instance, const char *ser
         if ((selfhost && is_service_selfhosted) || (!selfhost && is_service_delegated)) {
             if (!strcasecmp(srv->service, service) && !strcasecmp(srv->proto, proto) &&
                     (_str_null_or_empty(instance) || _mdns_instance_name_match(srv->instance, instance))) {
-                mdns_result_t *item = (mdns_result_t *)malloc(sizeof(mdns_result_t));
+                mdns_result_t *item = _mdns_result_new(&results);
                 if (!item) {
-                    HOOK_MALLOC_FAILED;
                     goto handle_error;
                 }
-                item->next = results;
-                results = item;
                 item->esp_netif = NULL;
                 item->ttl = _str_null_or_empty(instance) ? MDNS_ANSWER_PTR_TTL : MDNS_ANSWER_SRV_TTL;
                 item->ip_protocol = MDNS_IP_PROTOCOL_MAX;
-                item->instance_name = strndup(srv->instance, MDNS_NAME_BUF_LEN - 1);
-                if (!item->instance_name) {
-                    HOOK_MALLOC_FAILED;
-                    goto handle_error;
-                }
-                item->service_type = strndup(srv->service, MDNS_NAME_BUF_LEN - 1);
-                if (!item->service_type) {
-                    HOOK_MALLOC_FAILED;
+                item->service_type = _mdns_result_strdup(item, srv->service);
+                item->proto = _mdns_result_strdup(item, srv->proto);
+                if (!_mdns_result_set_instance(item, _mdns_get_service_instance_name(srv)) || !item->service_type || !item->proto
+                        || !_mdns_result_set_hostname(item, srv->hostname)) {
                     goto handle_error;
                 }
-                item->proto = strndup(srv->proto, MDNS_NAME_BUF_LEN - 1);
-                if (!item->proto) {
-                    HOOK_MALLOC_FAILED;
-                    goto handle_error;
-                }
-                item->hostname = strndup(srv->hostname, MDNS_NAME_BUF_LEN - 1);
-                if (!item->hostname) {
-                    HOOK_MALLOC_FAILED;
+                item->port = srv->port;
+                if (!_mdns_result_txt_copy(item, srv)) {
                     goto handle_error;
                 }
-                item->port = srv->port;
-                item->txt = _copy_mdns_txt_items(srv->txt, &(item->txt_value_len), &(item->txt_count));
                 // We should not append addresses for selfhost lookup result as we don't know which interface's address to append.
-                if (selfhost) {
-                    item->addr = NULL;
-                } else {
-                    item->addr = _copy_delegated_host_address_list(item->hostname);
-                    if (!item->addr) {
-                        goto handle_error;
-                    }
+                if (!selfhost && !_mdns_result_copy_delegated_addresses(item)) {
+                    goto handle_error;
                 }
                 if (num_results < max_results) {
                     num_results++;
@@ -5942,7 +7762,7 @@ static mdns_result_t *_mdns_lookup_service(const char *instance, const char *ser
                 }
             }
         }
-        s = s->next;
+        s = s->type_next;
     }
     return results;
 handle_error:
@@ -5960,16 +7780,15 @@ esp_err_t mdns_service_port_set_for_host(const char *instance, const char *servi
         return ESP_ERR_NOT_FOUND;
     }
 
-    mdns_action_t *action = (mdns_action_t *)malloc(sizeof(mdns_action_t));
+    mdns_action_t *action = _mdns_action_alloc();
     if (!action) {
-        HOOK_MALLOC_FAILED;
         return ESP_ERR_NO_MEM;
     }
     action->type = ACTION_SERVICE_PORT_SET;
     action->data.srv_port.service = s;
     action->data.srv_port.port = port;
-    if (xQueueSend(_mdns_server->action_queue, &action, (TickType_t)0) != pdPASS) {
-        free(action);
+    if (!_mdns_action_post(action)) {
+        _mdns_action_release(action);
         return ESP_ERR_NO_MEM;
     }
     return ESP_OK;
@@ -5994,27 +7813,25 @@ esp_err_t mdns_service_txt_set_for_host(const char *instance, const char *servic
         return ESP_ERR_NOT_FOUND;
     }
 
-    mdns_txt_linked_item_t *new_txt = NULL;
-    if (num_items) {
-        new_txt = _mdns_allocate_txt(num_items, txt);
-        if (!new_txt) {
-            return ESP_ERR_NO_MEM;
-        }
+    uint8_t *new_txt;
+    uint16_t new_txt_len;
+    if (_mdns_allocate_txt(num_items, txt, &new_txt, &new_txt_len) != ESP_OK) {
+        return ESP_ERR_NO_MEM;
     }
 
-    mdns_action_t *action = (mdns_action_t *)malloc(sizeof(mdns_action_t));
+    mdns_action_t *action = _mdns_action_alloc();
     if (!action) {
-        HOOK_MALLOC_FAILED;
-        _mdns_free_linked_txt(new_txt);
+        free(new_txt);
         return ESP_ERR_NO_MEM;
     }
     action->type = ACTION_SERVICE_TXT_REPLACE;
     action->data.srv_txt_replace.service = s;
     action->data.srv_txt_replace.txt = new_txt;
+    action->data.srv_txt_replace.txt_len = new_txt_len;
 
-    if (xQueueSend(_mdns_server->action_queue, &action, (TickType_t)0) != pdPASS) {
-        _mdns_free_linked_txt(new_txt);
-        free(action);
+    if (!_mdns_action_post(action)) {
+        free(new_txt);
+        _mdns_action_release(action);
         return ESP_ERR_NO_MEM;
     }
     return ESP_OK;
@@ -6040,24 +7857,23 @@ esp_err_t mdns_service_txt_item_set_for_host_with_explicit_value_len(const char
     if (!s) {
         return ESP_ERR_NOT_FOUND;
     }
-    mdns_action_t *action = (mdns_action_t *)malloc(sizeof(mdns_action_t));
+    mdns_action_t *action = _mdns_action_alloc();
     if (!action) {
-        HOOK_MALLOC_FAILED;
         return ESP_ERR_NO_MEM;
     }
 
     action->type = ACTION_SERVICE_TXT_SET;
     action->data.srv_txt_set.service = s;
-    action->data.srv_txt_set.key = strdup(key);
+    action->data.srv_txt_set.key = _mdns_strdup(key);
     if (!action->data.srv_txt_set.key) {
-        free(action);
+        _mdns_action_release(action);
         return ESP_ERR_NO_MEM;
     }
     if (value_len > 0) {
-        action->data.srv_txt_set.value = (char *)malloc(value_len);
+        action->data.srv_txt_set.value = (char *)_mdns_malloc(value_len);
         if (!action->data.srv_txt_set.value) {
             free(action->data.srv_txt_set.key);
-            free(action);
+            _mdns_action_release(action);
             return ESP_ERR_NO_MEM;
         }
         memcpy(action->data.srv_txt_set.value, value, value_len);
@@ -6066,10 +7882,10 @@ esp_err_t mdns_service_txt_item_set_for_host_with_explicit_value_len(const char
         action->data.srv_txt_set.value = NULL;
         action->data.srv_txt_set.value_len = 0;
     }
-    if (xQueueSend(_mdns_server->action_queue, &action, (TickType_t)0) != pdPASS) {
+    if (!_mdns_action_post(action)) {
         free(action->data.srv_txt_set.key);
         free(action->data.srv_txt_set.value);
-        free(action);
+        _mdns_action_release(action);
         return ESP_ERR_NO_MEM;
     }
     return ESP_OK;
@@ -6112,22 +7928,21 @@ esp_err_t mdns_service_txt_item_remove_for_host(const char *instance, const char
     if (!s) {
         return ESP_ERR_NOT_FOUND;
     }
-    mdns_action_t *action = (mdns_action_t *)malloc(sizeof(mdns_action_t));
+    mdns_action_t *action = _mdns_action_alloc();
     if (!action) {
-        HOOK_MALLOC_FAILED;
         return ESP_ERR_NO_MEM;
     }
 
     action->type = ACTION_SERVICE_TXT_DEL;
     action->data.srv_txt_del.service = s;
-    action->data.srv_txt_del.key = strdup(key);
+    action->data.srv_txt_del.key = _mdns_strdup(key);
     if (!action->data.srv_txt_del.key) {
-        free(action);
+        _mdns_action_release(action);
         return ESP_ERR_NO_MEM;
     }
-    if (xQueueSend(_mdns_server->action_queue, &action, (TickType_t)0) != pdPASS) {
+    if (!_mdns_action_post(action)) {
         free(action->data.srv_txt_del.key);
-        free(action);
+        _mdns_action_release(action);
         return ESP_ERR_NO_MEM;
     }
     return ESP_OK;
@@ -6152,23 +7967,22 @@ esp_err_t mdns_service_subtype_add_for_host(const char *instance_name, const cha
     if (!s) {
         return ESP_ERR_NOT_FOUND;
     }
-    mdns_action_t *action = (mdns_action_t *)malloc(sizeof(mdns_action_t));
+    mdns_action_t *action = _mdns_action_alloc();
     if (!action) {
-        HOOK_MALLOC_FAILED;
         return ESP_ERR_NO_MEM;
     }
 
     action->type = ACTION_SERVICE_SUBTYPE_ADD;
     action->data.srv_subtype_add.service = s;
-    action->data.srv_subtype_add.subtype = strdup(subtype);
+    action->data.srv_subtype_add.subtype = _mdns_strdup(subtype);
 
     if (!action->data.srv_subtype_add.subtype) {
-        free(action);
+        _mdns_action_release(action);
         return ESP_ERR_NO_MEM;
     }
-    if (xQueueSend(_mdns_server->action_queue, &action, (TickType_t)0) != pdPASS) {
+    if (!_mdns_action_post(action)) {
         free(action->data.srv_subtype_add.subtype);
-        free(action);
+        _mdns_action_release(action);
         return ESP_ERR_NO_MEM;
     }
     return ESP_OK;
@@ -6187,23 +8001,22 @@ esp_err_t mdns_service_instance_name_set_for_host(const char *instance_old, cons
     if (!s) {
         return ESP_ERR_NOT_FOUND;
     }
-    char *new_instance = strndup(instance, MDNS_NAME_BUF_LEN - 1);
+    char *new_instance = _mdns_strndup(instance, MDNS_NAME_BUF_LEN - 1);
     if (!new_instance) {
         return ESP_ERR_NO_MEM;
     }
 
-    mdns_action_t *action = (mdns_action_t *)malloc(sizeof(mdns_action_t));
+    mdns_action_t *action = _mdns_action_alloc();
     if (!action) {
-        HOOK_MALLOC_FAILED;
         free(new_instance);
         return ESP_ERR_NO_MEM;
     }
     action->type = ACTION_SERVICE_INSTANCE_SET;
     action->data.srv_instance.service = s;
     action->data.srv_instance.instance = new_instance;
-    if (xQueueSend(_mdns_server->action_queue, &action, (TickType_t)0) != pdPASS) {
+    if (!_mdns_action_post(action)) {
         free(new_instance);
-        free(action);
+        _mdns_action_release(action);
         return ESP_ERR_NO_MEM;
     }
     return ESP_OK;
@@ -6227,15 +8040,14 @@ esp_err_t mdns_service_remove_for_host(const char *instance, const char *service
         return ESP_ERR_NOT_FOUND;
     }
 
-    mdns_action_t *action = (mdns_action_t *)malloc(sizeof(mdns_action_t));
+    mdns_action_t *action = _mdns_action_alloc();
     if (!action) {
-        HOOK_MALLOC_FAILED;
         return ESP_ERR_NO_MEM;
     }
     action->type = ACTION_SERVICE_DEL;
     action->data.srv_del.service = s;
-    if (xQueueSend(_mdns_server->action_queue, &action, (TickType_t)0) != pdPASS) {
-        free(action);
+    if (!_mdns_action_post(action)) {
+        _mdns_action_release(action);
         return ESP_ERR_NO_MEM;
     }
     return ESP_OK;
@@ -6258,14 +8070,13 @@ esp_err_t mdns_service_remove_all(void)
         return ESP_OK;
     }
 
-    mdns_action_t *action = (mdns_action_t *)malloc(sizeof(mdns_action_t));
+    mdns_action_t *action = _mdns_action_alloc();
     if (!action) {
-        HOOK_MALLOC_FAILED;
         return ESP_ERR_NO_MEM;
     }
     action->type = ACTION_SERVICES_CLEAR;
-    if (xQueueSend(_mdns_server->action_queue, &action, (TickType_t)0) != pdPASS) {
-        free(action);
+    if (!_mdns_action_post(action)) {
+        _mdns_action_release(action);
         return ESP_ERR_NO_MEM;
     }
     return ESP_OK;
@@ -6277,32 +8088,18 @@ esp_err_t mdns_service_remove_all(void)
 
 void mdns_query_results_free(mdns_result_t *results)
 {
-    mdns_result_t *r;
-    mdns_ip_addr_t *a;
-
-    while (results) {
-        r = results;
-
-        free((char *)(r->hostname));
-        free((char *)(r->instance_name));
-        free((char *)(r->service_type));
-        free((char *)(r->proto));
-
-        for (size_t i = 0; i < r->txt_count; i++) {
-            free((char *)(r->txt[i].key));
-            free((char *)(r->txt[i].value));
-        }
-        free(r->txt);
-        free(r->txt_value_len);
-
-        while (r->addr) {
-            a = r->addr;
-            r->addr = r->addr->next;
-            free(a);
-        }
-
-        results = results->next;
-        free(r);
+    if (!results) {
+        return;
+    }
+    // the results, their names, addresses and TXT items are in the set of the list, freeing the tail of a list
+    // leaves the results before it valid, so the set goes once every result of the list is freed
+    mdns_result_set_t *set = _mdns_result_node(results)->set;
+    for (mdns_result_t *r = results; r; r = r->next) {
+        set->live--;
+    }
+    if (!set->live) {
+        _mdns_chunks_free(set->head.next);
+        free(set);
     }
 }
 
@@ -6322,6 +8119,28 @@ esp_err_t mdns_query_async_delete(mdns_search_once_t *search)
     return ESP_OK;
 }
 
+esp_err_t mdns_query_async_cancel(mdns_search_once_t *search)
+{
+    if (!search) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    MDNS_SERVICE_LOCK();
+    if (search->state != SEARCH_OFF) {
+        // the timer ends it as timed out on its next run, a search not added yet ends on its first run
+        uint32_t now = xTaskGetTickCount() * portTICK_PERIOD_MS;
+        search->timeout = now - search->started_at;
+        if (!_mdns_server->search_pending || (int32_t)(now - _mdns_server->search_at) < 0) {
+            _mdns_server->search_at = now;
+            _mdns_server->search_pending = true;
+        }
+        _mdns_timer_rearm();
+    }
+    MDNS_SERVICE_UNLOCK();
+
+    return ESP_OK;
+}
+
 bool mdns_query_async_get_results(mdns_search_once_t *search, uint32_t timeout, mdns_result_t **results, uint8_t *num_results)
 {
     if (xSemaphoreTake(search->done_semaphore, pdMS_TO_TICKS(timeout)) == pdTRUE) {
@@ -6350,7 +8169,18 @@ mdns_search_once_t *mdns_query_async_new(const char *name, const char *service,
         return NULL;
     }
 
-    if (_mdns_send_search_action(ACTION_SEARCH_ADD, search)) {
+    mdns_action_type_t action = ACTION_SEARCH_ADD;
+#if MDNS_CACHE_SIZE
+    // answered from the cache like mdns_query_generic(), the service task then ends it without sending anything
+    MDNS_SERVICE_LOCK();
+    if (_mdns_cache_lookup(name, service, proto, type, max_results, &search->result, &search->num_results)) {
+        action = ACTION_SEARCH_END;
+    }
+    MDNS_SERVICE_UNLOCK();
+#endif
+
+    if (_mdns_send_search_action(action, search)) {
+        mdns_query_results_free(search->result);
         _mdns_search_free(search);
         return NULL;
     }
@@ -6372,6 +8202,15 @@ esp_err_t mdns_query_generic(const char *name, const char *service, const char *
         return ESP_ERR_INVALID_ARG;
     }
 
+#if MDNS_CACHE_SIZE
+    MDNS_SERVICE_LOCK();
+    bool cached = _mdns_cache_lookup(name, service, proto, type, max_results, results, NULL);
+    MDNS_SERVICE_UNLOCK();
+    if (cached) {
+        return ESP_OK;
+    }
+#endif
+
     search = _mdns_search_init(name, service, proto, type, transmission_type == MDNS_QUERY_UNICAST, timeout, max_results, NULL);
     if (!search) {
         return ESP_ERR_NO_MEM;
@@ -6531,7 +8370,7 @@ esp_err_t mdns_query_aaaa(const char *name, uint32_t timeout, esp_ip6_addr_t *ad
 
 void mdns_debug_packet(const uint8_t *data, size_t len)
 {
-    static mdns_name_t n;
+    mdns_name_t n;
     mdns_header_t header;
     const uint8_t *content = data + MDNS_HEAD_LEN;
     uint32_t t = xTaskGetTickCount() * portTICK_PERIOD_MS;
@@ -5,6 +5,8 @@
  */
 #include <stdio.h>
 #include <string.h>
+#include <inttypes.h>
+#include "sdkconfig.h"
 #include "esp_console.h"
 #include "argtable3/argtable3.h"
 #include "mdns.h"
@@ -1027,6 +1029,71 @@ static void register_mdns_service_remove_all(void)
     ESP_ERROR_CHECK( esp_console_cmd_register(&cmd_free) );
 }
 
+static struct {
+    struct arg_lit *reset;
+    struct arg_end *end;
+} mdns_stats_args;
+
+static int cmd_mdns_stats(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **) &mdns_stats_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, mdns_stats_args.end, argv[0]);
+        return 1;
+    }
+
+    mdns_stats_t stats;
+    mdns_netif_stats_t netifs[CONFIG_MDNS_MAX_INTERFACES];
+    size_t num_netifs = CONFIG_MDNS_MAX_INTERFACES;
+    if (mdns_stats_get(&stats) || mdns_stats_get_netifs(netifs, &num_netifs)) {
+        printf("ERROR: MDNS is not running\n");
+        return 1;
+    }
+
+    for (size_t i = 0; i < num_netifs; i++) {
+        printf("Interface %s: RX %" PRIu32 " packets, %" PRIu32 " bytes, %" PRIu32 " dropped; TX %" PRIu32 " packets, %" PRIu32 " bytes, %" PRIu32 " errors\n",
+               esp_netif_get_ifkey(netifs[i].esp_netif), netifs[i].rx_packets, netifs[i].rx_bytes, netifs[i].rx_dropped,
+               netifs[i].tx_packets, netifs[i].tx_bytes, netifs[i].tx_errors);
+    }
+    printf("Actions: %" PRIu32 " posted, %" PRIu32 " dropped, %" PRIu32 " queued at most\n",
+           stats.actions, stats.actions_dropped, stats.action_queue_high_water);
+    printf("Parse time:");
+    for (size_t i = 0; i < MDNS_STATS_PARSE_BUCKETS; i++) {
+        if (i < MDNS_STATS_PARSE_BUCKETS - 1) {
+            printf("%s <%uus: %" PRIu32, i ? "," : "", 16u << i, stats.parse_time[i]);
+        } else {
+            printf(", more: %" PRIu32, stats.parse_time[i]);
+        }
+    }
+    printf("\n");
+    printf("Answers suppressed: %" PRIu32 ", responses coalesced: %" PRIu32 "\n", stats.answers_suppressed, stats.responses_coalesced);
+    printf("Searches: %" PRIu32 ", cache entries: %" PRIu32 "\n", stats.searches, stats.cache_entries);
+    printf("Allocations: %" PRIu32 ", failed: %" PRIu32 "\n", stats.allocs, stats.alloc_failures);
+    printf("Service lock: taken %" PRIu32 " times, held %" PRIu64 " us in total, %" PRIu32 " us at most\n",
+           stats.lock_taken, stats.lock_time_us, stats.lock_max_us);
+
+    if (mdns_stats_args.reset->count) {
+        mdns_stats_reset();
+    }
+    return 0;
+}
+
+static void register_mdns_stats(void)
+{
+    mdns_stats_args.reset = arg_lit0("r", "reset", "Reset the counters once printed");
+    mdns_stats_args.end = arg_end(2);
+
+    const esp_console_cmd_t cmd_stats = {
+        .command = "mdns_stats",
+        .help = "Print the counters of the MDNS engine",
+        .hint = NULL,
+        .func = &cmd_mdns_stats,
+        .argtable = &mdns_stats_args
+    };
+
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd_stats) );
+}
+
 void mdns_console_register(void)
 {
     register_mdns_init();
@@ -1052,4 +1119,6 @@ void mdns_console_register(void)
 
     register_mdns_query_ip();
     register_mdns_query_svc();
+
+    register_mdns_stats();
 }
@@ -25,6 +25,8 @@
  * MDNS Server Networking
  *
  */
+#define MDNS_TX_BATCH_MAX   8       // Packets sent by one call into the tcpip thread
+
 enum interface_protocol {
     PROTO_IPV4 = 1 << MDNS_IP_PROTOCOL_V4,
     PROTO_IPV6 = 1 << MDNS_IP_PROTOCOL_V6
@@ -33,12 +35,33 @@ enum interface_protocol {
 typedef struct interfaces {
     bool ready;
     int proto;
+    struct netif *netif;    // set while any protocol runs, read by the tcpip thread only
+    mdns_tx_stats_t tx;
 } interfaces_t;
 
+/**
+ * @brief Packet written while the service task holds the transmit
+ */
+typedef struct {
+    struct pbuf *pbt;
+    size_t len;
+    ip_addr_t ip;
+    uint16_t port;
+    mdns_if_t tcpip_if;
+    mdns_ip_protocol_t ip_protocol;
+    err_t err;
+} tx_held_t;
+
 static interfaces_t s_interfaces[MDNS_MAX_INTERFACES];
 
 static struct udp_pcb *_pcb_main = NULL;
 
+// with the service lock
+static struct pbuf *s_tx_pbuf;      // the engine builds the next packet in it, sent without a copy
+static tx_held_t s_tx_held[MDNS_TX_BATCH_MAX];
+static int s_tx_held_count;
+static bool s_tx_holding;
+
 static const char *TAG = "mdns_networking";
 
 static void _udp_recv(void *arg, struct udp_pcb *upcb, struct pbuf *pb, const ip_addr_t *raddr, uint16_t rport);
@@ -128,81 +151,100 @@ static esp_err_t _udp_join_group(mdns_if_t if_inx, mdns_ip_protocol_t ip_protoco
     return ESP_OK;
 }
 
+/**
+ * @brief  Find the interface the datagram being received came from
+ *
+ * lwip does not return the proper pcb if you have more than one for the same multicast address (but different
+ * interfaces). Interfaces mDNS does not run on, e.g. the duplicate of another one on the same subnet, are not found.
+ *
+ * @return the interface or MDNS_MAX_INTERFACES to drop the datagram
+ */
+static mdns_if_t _udp_input_if(const ip_addr_t *raddr)
+{
+    struct netif *input = ip_current_input_netif();
+    for (int i = 0; i < MDNS_MAX_INTERFACES; i++) {
+        struct netif *netif = s_interfaces[i].netif;
+        if (!s_interfaces[i].proto || netif != input) {
+            continue;
+        }
+        if (IP_IS_V4(raddr)) {
+#if CONFIG_LWIP_IPV6
+            if ((raddr->u_addr.ip4.addr & netif->netmask.u_addr.ip4.addr) != (netif->ip_addr.u_addr.ip4.addr & netif->netmask.u_addr.ip4.addr)) {
+#else
+            if ((raddr->addr & netif->netmask.addr) != (netif->ip_addr.addr & netif->netmask.addr)) {
+#endif          //packet source is not in the same subnet
+                return MDNS_MAX_INTERFACES;
+            }
+        }
+        return (mdns_if_t)i;
+    }
+    return MDNS_MAX_INTERFACES;
+}
+
 /**
  * @brief  the receive callback of the raw udp api. Packets are received here
  *
+ * The pbuf of the datagram is handed over to the service task as is, unless it is a chain: the parser needs
+ * the packet contiguous.
  */
 static void _udp_recv(void *arg, struct udp_pcb *upcb, struct pbuf *pb, const ip_addr_t *raddr, uint16_t rport)
 {
+    mdns_if_t tcpip_if = _udp_input_if(raddr);
+    if (tcpip_if == MDNS_MAX_INTERFACES) {
+        pbuf_free(pb);
+        return;
+    }
 
-    uint8_t i;
-    while (pb != NULL) {
-        struct pbuf *this_pb = pb;
-        pb = pb->next;
-        this_pb->next = NULL;
-
-        mdns_rx_packet_t *packet = (mdns_rx_packet_t *)malloc(sizeof(mdns_rx_packet_t));
-        if (!packet) {
-            HOOK_MALLOC_FAILED;
-            //missed packet - no memory
-            pbuf_free(this_pb);
-            continue;
-        }
+    mdns_rx_packet_t *packet = (mdns_rx_packet_t *)malloc(sizeof(mdns_rx_packet_t));
+    if (!packet) {
+        HOOK_MALLOC_FAILED;
+        //missed packet - no memory
+        pbuf_free(pb);
+        return;
+    }
 
-        packet->tcpip_if = MDNS_MAX_INTERFACES;
-        packet->pb = this_pb;
-        packet->src_port = rport;
+    packet->tcpip_if = tcpip_if;
+    packet->pb = pb;
+    packet->src_port = rport;
 #if CONFIG_LWIP_IPV6
-        packet->src.type = raddr->type;
-        memcpy(&packet->src.u_addr, &raddr->u_addr, sizeof(raddr->u_addr));
+    packet->src.type = raddr->type;
+    memcpy(&packet->src.u_addr, &raddr->u_addr, sizeof(raddr->u_addr));
 #else
-        packet->src.type = IPADDR_TYPE_V4;
-        memcpy(&packet->src.u_addr.ip4, &raddr->addr, sizeof(ip_addr_t));
+    packet->src.type = IPADDR_TYPE_V4;
+    memcpy(&packet->src.u_addr.ip4, &raddr->addr, sizeof(ip_addr_t));
 #endif
-        packet->dest.type = packet->src.type;
-
-        if (packet->src.type == IPADDR_TYPE_V4) {
-            packet->ip_protocol = MDNS_IP_PROTOCOL_V4;
-            struct ip_hdr *iphdr = (struct ip_hdr *)(((uint8_t *)(packet->pb->payload)) - UDP_HLEN - IP_HLEN);
-            packet->dest.u_addr.ip4.addr = iphdr->dest.addr;
-            packet->multicast = ip4_addr_ismulticast(&(packet->dest.u_addr.ip4));
-        }
+    packet->dest.type = packet->src.type;
+
+    // the headers precede the payload of the first pbuf
+    if (packet->src.type == IPADDR_TYPE_V4) {
+        packet->ip_protocol = MDNS_IP_PROTOCOL_V4;
+        struct ip_hdr *iphdr = (struct ip_hdr *)(((uint8_t *)(pb->payload)) - UDP_HLEN - IP_HLEN);
+        packet->dest.u_addr.ip4.addr = iphdr->dest.addr;
+        packet->multicast = ip4_addr_ismulticast(&(packet->dest.u_addr.ip4));
+    }
 #if CONFIG_LWIP_IPV6
-        else {
-            packet->ip_protocol = MDNS_IP_PROTOCOL_V6;
-            struct ip6_hdr *ip6hdr = (struct ip6_hdr *)(((uint8_t *)(packet->pb->payload)) - UDP_HLEN - IP6_HLEN);
-            memcpy(&packet->dest.u_addr.ip6.addr, (uint8_t *)ip6hdr->dest.addr, 16);
-            packet->multicast = ip6_addr_ismulticast(&(packet->dest.u_addr.ip6));
-        }
+    else {
+        packet->ip_protocol = MDNS_IP_PROTOCOL_V6;
+        struct ip6_hdr *ip6hdr = (struct ip6_hdr *)(((uint8_t *)(pb->payload)) - UDP_HLEN - IP6_HLEN);
+        memcpy(&packet->dest.u_addr.ip6.addr, (uint8_t *)ip6hdr->dest.addr, 16);
+        packet->multicast = ip6_addr_ismulticast(&(packet->dest.u_addr.ip6));
+    }
 #endif
 
-        //lwip does not return the proper pcb if you have more than one for the same multicast address (but different interfaces)
-        struct netif *netif = NULL;
-        bool found = false;
-        for (i = 0; i < MDNS_MAX_INTERFACES; i++) {
-            netif = esp_netif_get_netif_impl(_mdns_get_esp_netif(i));
-            if (s_interfaces[i].proto && netif && netif == ip_current_input_netif ()) {
-                if (packet->src.type == IPADDR_TYPE_V4) {
-#if CONFIG_LWIP_IPV6
-                    if ((packet->src.u_addr.ip4.addr & netif->netmask.u_addr.ip4.addr) != (netif->ip_addr.u_addr.ip4.addr & netif->netmask.u_addr.ip4.addr)) {
-#else
-                    if ((packet->src.u_addr.ip4.addr & netif->netmask.addr) != (netif->ip_addr.addr & netif->netmask.addr)) {
-#endif                  //packet source is not in the same subnet
-                        break;
-                    }
-                }
-                packet->tcpip_if = i;
-                found = true;
-                break;
-            }
-        }
-
-        if (!found || _mdns_send_rx_action(packet) != ESP_OK) {
-            pbuf_free(this_pb);
+    if (pb->next) {
+        packet->pb = pbuf_clone(PBUF_RAW, PBUF_RAM, pb);
+        pbuf_free(pb);
+        if (!packet->pb) {
+            HOOK_MALLOC_FAILED;
             free(packet);
+            return;
         }
     }
 
+    if (_mdns_send_rx_action(packet) != ESP_OK) {
+        pbuf_free(packet->pb);
+        free(packet);
+    }
 }
 
 bool mdns_is_netif_ready(mdns_if_t netif, mdns_ip_protocol_t ip_proto)
@@ -235,6 +277,7 @@ static void _udp_pcb_deinit(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol)
     s_interfaces[tcpip_if].proto &= ~(ip_protocol == MDNS_IP_PROTOCOL_V4 ? PROTO_IPV4 : PROTO_IPV6);
     if (s_interfaces[tcpip_if].proto == 0) {
         s_interfaces[tcpip_if].ready = false;
+        s_interfaces[tcpip_if].netif = NULL;
         _udp_join_group(tcpip_if, ip_protocol, false);
         if (!_udp_pcb_is_in_use()) {
             _udp_pcb_main_deinit();
@@ -262,6 +305,7 @@ static esp_err_t _udp_pcb_init(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protoco
     }
     s_interfaces[tcpip_if].proto |= (ip_protocol == MDNS_IP_PROTOCOL_V4 ? PROTO_IPV4 : PROTO_IPV6);
     s_interfaces[tcpip_if].ready = true;
+    s_interfaces[tcpip_if].netif = esp_netif_get_netif_impl(_mdns_get_esp_netif(tcpip_if));
 
     return ESP_OK;
 }
@@ -322,29 +366,97 @@ esp_err_t _mdns_pcb_deinit(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol)
     return msg.err;
 }
 
+/**
+ * @brief  Send a packet from the lwip thread, the pbuf is freed
+ */
+static err_t _udp_send(tx_held_t *held)
+{
+    struct netif *nif = s_interfaces[held->tcpip_if].netif;
+    if (!nif || !mdns_is_netif_ready(held->tcpip_if, held->ip_protocol) || _pcb_main == NULL) {
+        held->err = ERR_IF;
+    } else {
+        held->err = udp_sendto_if (_pcb_main, held->pbt, &held->ip, held->port, nif);
+    }
+    pbuf_free(held->pbt);
+    return held->err;
+}
+
 static err_t _mdns_udp_pcb_write_api(struct tcpip_api_call_data *api_call_msg)
 {
-    void *nif = NULL;
     mdns_api_call_t *msg = (mdns_api_call_t *)api_call_msg;
-    nif = esp_netif_get_netif_impl(_mdns_get_esp_netif(msg->tcpip_if));
-    if (!nif || !mdns_is_netif_ready(msg->tcpip_if, msg->ip_protocol) || _pcb_main == NULL) {
-        pbuf_free(msg->pbt);
-        msg->err = ERR_IF;
-        return ERR_IF;
+    tx_held_t held = {
+        .pbt = msg->pbt,
+        .ip = *msg->ip,
+        .port = msg->port,
+        .tcpip_if = msg->tcpip_if,
+        .ip_protocol = msg->ip_protocol,
+    };
+    msg->err = _udp_send(&held);
+    return msg->err;
+}
+
+/**
+ * @brief  Send the held packets from the lwip thread
+ */
+static err_t _mdns_udp_pcb_flush_api(struct tcpip_api_call_data *api_call_msg)
+{
+    for (int i = 0; i < s_tx_held_count; i++) {
+        _udp_send(&s_tx_held[i]);
+    }
+    return ERR_OK;
+}
+
+/**
+ * @brief  Send the held packets with a single call into the lwip thread
+ */
+static void _udp_send_held(void)
+{
+    if (!s_tx_held_count) {
+        return;
+    }
+    struct tcpip_api_call_data call = { 0 };
+    tcpip_api_call(_mdns_udp_pcb_flush_api, &call);
+
+    bool called[MDNS_MAX_INTERFACES] = { false };
+    for (int i = 0; i < s_tx_held_count; i++) {
+        mdns_tx_stats_t *tx = &s_interfaces[s_tx_held[i].tcpip_if].tx;
+        if (!called[s_tx_held[i].tcpip_if]) {
+            called[s_tx_held[i].tcpip_if] = true;
+            _mdns_tx_stats_add(&tx->calls, 1);
+        }
+        if (s_tx_held[i].err) {
+            _mdns_tx_stats_add(&tx->errors, 1);
+        } else {
+            _mdns_tx_stats_add(&tx->packets, 1);
+            _mdns_tx_stats_add(&tx->bytes, s_tx_held[i].len);
+        }
+    }
+    s_tx_held_count = 0;
+}
+
+uint8_t *_mdns_udp_pcb_tx_buffer(void)
+{
+    if (!s_tx_pbuf) {
+        s_tx_pbuf = pbuf_alloc(PBUF_TRANSPORT, MDNS_MAX_PACKET_SIZE, PBUF_RAM);
     }
-    esp_err_t err = udp_sendto_if (_pcb_main, msg->pbt, msg->ip, msg->port, (struct netif *)nif);
-    pbuf_free(msg->pbt);
-    msg->err = err;
-    return err;
+    return s_tx_pbuf ? (uint8_t *)s_tx_pbuf->payload : NULL;
 }
 
 size_t _mdns_udp_pcb_write(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol, const esp_ip_addr_t *ip, uint16_t port, uint8_t *data, size_t len)
 {
-    struct pbuf *pbt = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
-    if (pbt == NULL) {
-        return 0;
+    struct pbuf *pbt;
+    if (s_tx_pbuf && data == s_tx_pbuf->payload) {
+        // built in place, the pbuf is handed over and the next packet gets a new one
+        pbt = s_tx_pbuf;
+        s_tx_pbuf = NULL;
+        pbuf_realloc(pbt, len);
+    } else {
+        pbt = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+        if (pbt == NULL) {
+            return 0;
+        }
+        memcpy((uint8_t *)pbt->payload, data, len);
     }
-    memcpy((uint8_t *)pbt->payload, data, len);
 
     ip_addr_t ip_add_copy;
 #if CONFIG_LWIP_IPV6
@@ -354,6 +466,21 @@ size_t _mdns_udp_pcb_write(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol, c
     memcpy(&(ip_add_copy.addr), &(ip->u_addr), sizeof(ip_add_copy.addr));
 #endif // CONFIG_LWIP_IPV6
 
+    if (s_tx_holding) {
+        if (s_tx_held_count == MDNS_TX_BATCH_MAX) {
+            _udp_send_held();
+        }
+        tx_held_t *held = &s_tx_held[s_tx_held_count++];
+        held->pbt = pbt;
+        held->len = len;
+        held->ip = ip_add_copy;
+        held->port = port;
+        held->tcpip_if = tcpip_if;
+        held->ip_protocol = ip_protocol;
+        held->err = ERR_OK;
+        return len;
+    }
+
     mdns_api_call_t msg = {
         .tcpip_if = tcpip_if,
         .ip_protocol = ip_protocol,
@@ -363,12 +490,33 @@ size_t _mdns_udp_pcb_write(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol, c
     };
     tcpip_api_call(_mdns_udp_pcb_write_api, &msg.call);
 
+    mdns_tx_stats_t *tx = &s_interfaces[tcpip_if].tx;
+    _mdns_tx_stats_add(&tx->calls, 1);
     if (msg.err) {
+        _mdns_tx_stats_add(&tx->errors, 1);
         return 0;
     }
+    _mdns_tx_stats_add(&tx->packets, 1);
+    _mdns_tx_stats_add(&tx->bytes, len);
     return len;
 }
 
+void _mdns_udp_pcb_hold(void)
+{
+    s_tx_holding = true;
+}
+
+void _mdns_udp_pcb_flush(void)
+{
+    _udp_send_held();
+    s_tx_holding = false;
+}
+
+void _mdns_udp_pcb_get_counters(mdns_if_t tcpip_if, mdns_tx_counters_t *counters)
+{
+    _mdns_tx_stats_load(&s_interfaces[tcpip_if].tx, counters);
+}
+
 void *_mdns_get_packet_data(mdns_rx_packet_t *packet)
 {
     return packet->pb->payload;
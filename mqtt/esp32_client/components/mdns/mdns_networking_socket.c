@@ -8,6 +8,9 @@
  * @brief MDNS Server Networking module implemented using BSD sockets
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // recvmmsg(), sendmmsg()
+#endif
 #include <string.h>
 #include "esp_event.h"
 #include "mdns_networking.h"
@@ -20,13 +23,19 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/param.h>
+#include <stdatomic.h>
 #include "esp_log.h"
 
 #if defined(CONFIG_IDF_TARGET_LINUX)
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
 #include <net/if.h>
 #endif
 
+#define MDNS_RX_POOL_SIZE   (MDNS_PACKET_QUEUE_LEN + MDNS_ACTION_BATCH_MAX) // Packets queued or in the batch being run
+#define MDNS_RX_BATCH_MAX   8                       // Datagrams read by one recvmmsg() call
+#define MDNS_TX_BATCH_MAX   8                       // Datagrams held for one sendmmsg() call
+
 enum interface_protocol {
     PROTO_IPV4 = 1 << MDNS_IP_PROTOCOL_V4,
     PROTO_IPV6 = 1 << MDNS_IP_PROTOCOL_V6
@@ -35,6 +44,7 @@ enum interface_protocol {
 typedef struct interfaces {
     int sock;
     int proto;
+    mdns_tx_stats_t tx;
 } interfaces_t;
 
 static interfaces_t s_interfaces[MDNS_MAX_INTERFACES];
@@ -57,6 +67,43 @@ struct pbuf  {
 #define s6_addr32 un.u32_addr
 #endif // CONFIG_IDF_TARGET_LINUX
 
+/**
+ * @brief Received packet with its buffer, allocated once and reused
+ *
+ * The receive task takes the slots, the engine gives them back with _mdns_packet_free() once parsed.
+ */
+typedef struct rx_slot {
+    mdns_rx_packet_t packet;                // first member, the engine only knows the packet
+    struct pbuf pb;
+    struct rx_slot *next;                   // free list link
+    struct sockaddr_storage src;
+    uint8_t payload[MDNS_MAX_PACKET_SIZE];
+} rx_slot_t;
+
+static rx_slot_t *s_rx_free;                // free slots, receive task only
+static _Atomic(rx_slot_t *) s_rx_released;  // slots given back by the engine, taken all at once by the receive task
+static int s_rx_slots;                      // slots allocated so far, up to MDNS_RX_POOL_SIZE
+#if defined(CONFIG_IDF_TARGET_LINUX)
+static int s_epoll_fd = -1;                 // the interface sockets, kept for the lifetime of the process
+
+/**
+ * @brief Packet written while the service task holds the transmit
+ */
+typedef struct {
+    mdns_if_t tcpip_if;
+    int sock;
+    socklen_t dst_len;
+    struct sockaddr_storage dst;
+    size_t len;
+    uint8_t data[MDNS_MAX_PACKET_SIZE];
+} tx_held_t;
+
+static tx_held_t s_tx_held[MDNS_TX_BATCH_MAX];
+static int s_tx_held_count;
+static bool s_tx_holding;                   // service task only, with the service lock
+static void tx_send_held(void);
+#endif
+
 static void __attribute__((constructor)) ctor_networking_socket(void)
 {
     for (int i = 0; i < sizeof(s_interfaces) / sizeof(s_interfaces[0]); ++i) {
@@ -85,11 +132,56 @@ size_t _mdns_get_packet_len(mdns_rx_packet_t *packet)
     return packet->pb->len;
 }
 
+/**
+ * @brief  Take a free slot, the pool grows up to MDNS_RX_POOL_SIZE slots
+ *
+ * @return the slot or NULL if all of them are waiting for the engine
+ */
+static rx_slot_t *rx_slot_take(void)
+{
+    if (!s_rx_free) {
+        s_rx_free = atomic_exchange_explicit(&s_rx_released, NULL, memory_order_acquire);
+    }
+    rx_slot_t *slot = s_rx_free;
+    if (slot) {
+        s_rx_free = slot->next;
+        return slot;
+    }
+    if (s_rx_slots >= MDNS_RX_POOL_SIZE) {
+        return NULL;
+    }
+    slot = (rx_slot_t *)malloc(sizeof(rx_slot_t));
+    if (!slot) {
+        HOOK_MALLOC_FAILED;
+        return NULL;
+    }
+    s_rx_slots++;
+    return slot;
+}
+
+/**
+ * @brief  Put a slot taken by the receive task back, unused
+ */
+static void rx_slot_put_back(rx_slot_t *slot)
+{
+    slot->next = s_rx_free;
+    s_rx_free = slot;
+}
+
+/**
+ * @brief  Give a slot back to the receive task, from any task
+ */
+static void rx_slot_release(rx_slot_t *slot)
+{
+    rx_slot_t *head = atomic_load_explicit(&s_rx_released, memory_order_relaxed);
+    do {
+        slot->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&s_rx_released, &head, slot, memory_order_release, memory_order_relaxed));
+}
+
 void _mdns_packet_free(mdns_rx_packet_t *packet)
 {
-    free(packet->pb->payload);
-    free(packet->pb);
-    free(packet);
+    rx_slot_release((rx_slot_t *)packet);
 }
 
 esp_err_t _mdns_pcb_deinit(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol)
@@ -98,7 +190,12 @@ esp_err_t _mdns_pcb_deinit(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol)
     if (s_interfaces[tcpip_if].proto == 0) {
         // if the interface for both protocols uninitialized, close the interface socket
         if (s_interfaces[tcpip_if].sock >= 0) {
+#if defined(CONFIG_IDF_TARGET_LINUX)
+            // the held packets must not outlive their socket
+            tx_send_held();
+#endif
             delete_socket(s_interfaces[tcpip_if].sock);
+            s_interfaces[tcpip_if].sock = -1;
         }
     }
 
@@ -203,13 +300,133 @@ size_t _mdns_udp_pcb_write(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol, c
         return 0;
     }
     ESP_LOGD(TAG, "[sock=%d]: Sending to IP %s port %d", sock, get_string_address(&in_addr), port);
+#if defined(CONFIG_IDF_TARGET_LINUX)
+    if (s_tx_holding && len <= MDNS_MAX_PACKET_SIZE) {
+        if (s_tx_held_count == MDNS_TX_BATCH_MAX) {
+            tx_send_held();
+        }
+        tx_held_t *held = &s_tx_held[s_tx_held_count++];
+        held->tcpip_if = tcpip_if;
+        held->sock = sock;
+        held->dst_len = ss_size;
+        memcpy(&held->dst, &in_addr, ss_size);
+        held->len = len;
+        if (data != held->data) {
+            memcpy(held->data, data, len);
+        }
+        return len;
+    }
+#endif
+    mdns_tx_stats_t *tx = &s_interfaces[tcpip_if].tx;
     ssize_t actual_len = sendto(sock, data, len, 0, (struct sockaddr *)&in_addr, ss_size);
+    _mdns_tx_stats_add(&tx->calls, 1);
     if (actual_len < 0) {
         ESP_LOGE(TAG, "[sock=%d]: _mdns_udp_pcb_write sendto() has failed\n errno=%d: %s", sock, errno, strerror(errno));
+        _mdns_tx_stats_add(&tx->errors, 1);
+    } else {
+        _mdns_tx_stats_add(&tx->packets, 1);
+        _mdns_tx_stats_add(&tx->bytes, actual_len);
     }
     return actual_len;
 }
 
+#if defined(CONFIG_IDF_TARGET_LINUX)
+/**
+ * @brief  Send the held packets, with one sendmmsg() per socket as long as it succeeds
+ */
+static void tx_send_held(void)
+{
+    struct mmsghdr msgs[MDNS_TX_BATCH_MAX];
+    struct iovec iov[MDNS_TX_BATCH_MAX];
+    bool taken[MDNS_TX_BATCH_MAX] = { false };
+
+    for (int first = 0; first < s_tx_held_count; first++) {
+        if (taken[first]) {
+            continue;
+        }
+        // the packets of the socket in the order they were written, a socket serves a single interface
+        int sock = s_tx_held[first].sock;
+        mdns_tx_stats_t *tx = &s_interfaces[s_tx_held[first].tcpip_if].tx;
+        int count = 0;
+        for (int i = first; i < s_tx_held_count; i++) {
+            if (taken[i] || s_tx_held[i].sock != sock) {
+                continue;
+            }
+            taken[i] = true;
+            iov[count].iov_base = s_tx_held[i].data;
+            iov[count].iov_len = s_tx_held[i].len;
+            memset(&msgs[count], 0, sizeof(struct mmsghdr));
+            msgs[count].msg_hdr.msg_name = &s_tx_held[i].dst;
+            msgs[count].msg_hdr.msg_namelen = s_tx_held[i].dst_len;
+            msgs[count].msg_hdr.msg_iov = &iov[count];
+            msgs[count].msg_hdr.msg_iovlen = 1;
+            count++;
+        }
+
+        int offset = 0;
+        while (offset < count) {
+            int sent = sendmmsg(sock, msgs + offset, count - offset, 0);
+            _mdns_tx_stats_add(&tx->calls, 1);
+            if (sent <= 0) {
+                // the first packet has failed, go on with the next one
+                ESP_LOGE(TAG, "[sock=%d]: _mdns_udp_pcb_write sendmmsg() has failed\n errno=%d: %s", sock, errno, strerror(errno));
+                _mdns_tx_stats_add(&tx->errors, 1);
+                offset++;
+                continue;
+            }
+            for (int i = offset; i < offset + sent; i++) {
+                _mdns_tx_stats_add(&tx->packets, 1);
+                _mdns_tx_stats_add(&tx->bytes, msgs[i].msg_len);
+            }
+            offset += sent;
+        }
+    }
+    s_tx_held_count = 0;
+}
+
+uint8_t *_mdns_udp_pcb_tx_buffer(void)
+{
+    if (!s_tx_holding) {
+        return NULL;
+    }
+    if (s_tx_held_count == MDNS_TX_BATCH_MAX) {
+        tx_send_held();
+    }
+    // the slot the next held packet goes to
+    return s_tx_held[s_tx_held_count].data;
+}
+
+void _mdns_udp_pcb_hold(void)
+{
+    s_tx_holding = true;
+}
+
+void _mdns_udp_pcb_flush(void)
+{
+    tx_send_held();
+    s_tx_holding = false;
+}
+#else
+uint8_t *_mdns_udp_pcb_tx_buffer(void)
+{
+    return NULL;
+}
+
+void _mdns_udp_pcb_hold(void)
+{
+    // no batched transmit with lwip sockets, the packets are sent right away
+}
+
+void _mdns_udp_pcb_flush(void)
+{
+}
+#endif // CONFIG_IDF_TARGET_LINUX
+
+void _mdns_udp_pcb_get_counters(mdns_if_t tcpip_if, mdns_tx_counters_t *counters)
+{
+    _mdns_tx_stats_load(&s_interfaces[tcpip_if].tx, counters);
+}
+
 static inline void inet_to_espaddr(const struct sockaddr_storage *in_addr, esp_ip_addr_t *addr, uint16_t *port)
 {
     if (in_addr->ss_family == PF_INET) {
@@ -240,6 +457,142 @@ static inline void inet_to_espaddr(const struct sockaddr_storage *in_addr, esp_i
 #endif // CONFIG_LWIP_IPV6
 }
 
+/**
+ * @brief  Pass a datagram received into the slot to the engine
+ */
+static void rx_slot_post(rx_slot_t *slot, mdns_if_t tcpip_if, size_t len)
+{
+    uint16_t port = 0;
+    esp_ip_addr_t addr = {0};
+    ESP_LOGD(TAG, "[sock=%d]: Received from IP:%s", s_interfaces[tcpip_if].sock, get_string_address(&slot->src));
+    ESP_LOG_BUFFER_HEXDUMP(TAG, slot->payload, len, ESP_LOG_VERBOSE);
+    inet_to_espaddr(&slot->src, &addr, &port);
+
+    mdns_rx_packet_t *packet = &slot->packet;
+    memset(packet, 0, sizeof(mdns_rx_packet_t));
+    slot->pb.next = NULL;
+    slot->pb.payload = slot->payload;
+    slot->pb.tot_len = len;
+    slot->pb.len = len;
+    packet->tcpip_if = tcpip_if;
+    packet->pb = &slot->pb;
+    packet->src_port = ntohs(port);
+    memcpy(&packet->src, &addr, sizeof(esp_ip_addr_t));
+    // TODO(IDF-3651): Add the correct dest addr -- for mdns to decide multicast/unicast
+    // Currently it's enough to assume the packet is multicast and mdns to check the source port of the packet
+    packet->multicast = 1;
+    packet->dest.type = packet->src.type;
+    packet->ip_protocol =
+        packet->src.type == ESP_IPADDR_TYPE_V4 ? MDNS_IP_PROTOCOL_V4 : MDNS_IP_PROTOCOL_V6;
+    if (_mdns_send_rx_action(packet) != ESP_OK) {
+        ESP_LOGE(TAG, "_mdns_send_rx_action failed!");
+        rx_slot_put_back(slot);
+    }
+}
+
+/**
+ * @brief  Discard a datagram the pool has no room for, so that the socket does not stay readable
+ */
+static void rx_drop(int sock)
+{
+    uint8_t byte;
+    if (recv(sock, &byte, sizeof(byte), MSG_DONTWAIT) >= 0) {
+        ESP_LOGD(TAG, "[sock=%d]: All the packets wait for the engine, dropped one", sock);
+    }
+}
+
+#if defined(CONFIG_IDF_TARGET_LINUX)
+/**
+ * @brief  Read the pending datagrams of the socket into pool slots, up to MDNS_RX_BATCH_MAX per call
+ */
+static void sock_recv_batch(mdns_if_t tcpip_if, int sock)
+{
+    rx_slot_t *slots[MDNS_RX_BATCH_MAX];
+    struct iovec iov[MDNS_RX_BATCH_MAX];
+    struct mmsghdr msgs[MDNS_RX_BATCH_MAX];
+    int count = 0;
+    while (count < MDNS_RX_BATCH_MAX && (slots[count] = rx_slot_take()) != NULL) {
+        iov[count].iov_base = slots[count]->payload;
+        iov[count].iov_len = sizeof(slots[count]->payload);
+        memset(&msgs[count], 0, sizeof(struct mmsghdr));
+        msgs[count].msg_hdr.msg_name = &slots[count]->src;
+        msgs[count].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+        msgs[count].msg_hdr.msg_iov = &iov[count];
+        msgs[count].msg_hdr.msg_iovlen = 1;
+        count++;
+    }
+    if (!count) {
+        rx_drop(sock);
+        return;
+    }
+
+    int received = recvmmsg(sock, msgs, count, MSG_DONTWAIT, NULL);
+    if (received < 0) {
+        received = 0;
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            ESP_LOGE(TAG, "multicast recvmmsg failed. errno=%d: %s", errno, strerror(errno));
+        }
+    }
+    for (int i = 0; i < received; i++) {
+        rx_slot_post(slots[i], tcpip_if, msgs[i].msg_len);
+    }
+    for (int i = count - 1; i >= received; i--) {
+        rx_slot_put_back(slots[i]);
+    }
+}
+
+/**
+ * @brief  Add the socket of the interface to the sockets the receive task waits for
+ */
+static bool sock_watch(mdns_if_t tcpip_if, int sock)
+{
+    if (s_epoll_fd < 0) {
+        s_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (s_epoll_fd < 0) {
+            ESP_LOGE(TAG, "Failed to create epoll. errno=%d: %s", errno, strerror(errno));
+            return false;
+        }
+    }
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.u32 = tcpip_if,
+    };
+    if (epoll_ctl(s_epoll_fd, EPOLL_CTL_ADD, sock, &event) < 0) {
+        ESP_LOGE(TAG, "[sock=%d]: Failed to add the socket to epoll. errno=%d: %s", sock, errno, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void sock_recv_task(void *arg)
+{
+    // closed sockets leave the epoll set by themselves
+    struct epoll_event events[MDNS_MAX_INTERFACES];
+    while (s_run_sock_recv_task) {
+        int n = epoll_wait(s_epoll_fd, events, MDNS_MAX_INTERFACES, 1000);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ESP_LOGE(TAG, "epoll_wait failed. errno=%d: %s", errno, strerror(errno));
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            mdns_if_t tcpip_if = events[i].data.u32;
+            int sock = s_interfaces[tcpip_if].sock;
+            if (sock >= 0) {
+                sock_recv_batch(tcpip_if, sock);
+            }
+        }
+    }
+    vTaskDelete(NULL);
+}
+#else
+static bool sock_watch(mdns_if_t tcpip_if, int sock)
+{
+    return true;
+}
+
 void sock_recv_task(void *arg)
 {
     while (s_run_sock_recv_task) {
@@ -274,62 +627,28 @@ void sock_recv_task(void *arg)
                     continue;
                 }
                 if (FD_ISSET(sock, &rfds)) {
-                    static char recvbuf[MDNS_MAX_PACKET_SIZE];
-                    uint16_t port = 0;
-
-                    struct sockaddr_storage raddr; // Large enough for both IPv4 or IPv6
+                    // received directly into a pool slot, the engine gives it back when parsed
+                    rx_slot_t *slot = rx_slot_take();
+                    if (!slot) {
+                        rx_drop(sock);
+                        continue;
+                    }
                     socklen_t socklen = sizeof(struct sockaddr_storage);
-                    esp_ip_addr_t addr = {0};
-                    int len = recvfrom(sock, recvbuf, sizeof(recvbuf), 0,
-                                       (struct sockaddr *) &raddr, &socklen);
+                    int len = recvfrom(sock, slot->payload, sizeof(slot->payload), 0,
+                                       (struct sockaddr *) &slot->src, &socklen);
                     if (len < 0) {
                         ESP_LOGE(TAG, "multicast recvfrom failed. errno=%d: %s", errno, strerror(errno));
+                        rx_slot_put_back(slot);
                         break;
                     }
-                    ESP_LOGD(TAG, "[sock=%d]: Received from IP:%s", sock, get_string_address(&raddr));
-                    ESP_LOG_BUFFER_HEXDUMP(TAG, recvbuf, len, ESP_LOG_VERBOSE);
-                    inet_to_espaddr(&raddr, &addr, &port);
-
-                    // Allocate the packet structure and pass it to the mdns main engine
-                    mdns_rx_packet_t *packet = (mdns_rx_packet_t *) calloc(1, sizeof(mdns_rx_packet_t));
-                    struct pbuf *packet_pbuf = calloc(1, sizeof(struct pbuf));
-                    uint8_t *buf = malloc(len);
-                    if (packet == NULL || packet_pbuf == NULL || buf == NULL ) {
-                        free(buf);
-                        free(packet_pbuf);
-                        free(packet);
-                        HOOK_MALLOC_FAILED;
-                        ESP_LOGE(TAG, "Failed to allocate the mdns packet");
-                        continue;
-                    }
-                    memcpy(buf, recvbuf, len);
-                    packet_pbuf->next = NULL;
-                    packet_pbuf->payload = buf;
-                    packet_pbuf->tot_len = len;
-                    packet_pbuf->len = len;
-                    packet->tcpip_if = tcpip_if;
-                    packet->pb = packet_pbuf;
-                    packet->src_port = ntohs(port);
-                    memcpy(&packet->src, &addr, sizeof(esp_ip_addr_t));
-                    // TODO(IDF-3651): Add the correct dest addr -- for mdns to decide multicast/unicast
-                    // Currently it's enough to assume the packet is multicast and mdns to check the source port of the packet
-                    memset(&packet->dest, 0, sizeof(esp_ip_addr_t));
-                    packet->multicast = 1;
-                    packet->dest.type = packet->src.type;
-                    packet->ip_protocol =
-                        packet->src.type == ESP_IPADDR_TYPE_V4 ? MDNS_IP_PROTOCOL_V4 : MDNS_IP_PROTOCOL_V6;
-                    if (_mdns_send_rx_action(packet) != ESP_OK) {
-                        ESP_LOGE(TAG, "_mdns_send_rx_action failed!");
-                        free(packet->pb->payload);
-                        free(packet->pb);
-                        free(packet);
-                    }
+                    rx_slot_post(slot, tcpip_if, len);
                 }
             }
         }
     }
     vTaskDelete(NULL);
 }
+#endif // CONFIG_IDF_TARGET_LINUX
 
 static void mdns_networking_init(void)
 {
@@ -361,6 +680,10 @@ static bool create_pcb(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol)
         ESP_LOGE(TAG, "Failed to create the socket!");
         return false;
     }
+    if (!sock_watch(tcpip_if, sock)) {
+        delete_socket(sock);
+        return false;
+    }
     int err = join_mdns_multicast_group(sock, netif, ip_protocol);
     if (err < 0) {
         ESP_LOGE(TAG, "Failed to add ipv6 multicast group for protocol %d", ip_protocol);
@@ -372,7 +695,7 @@ static bool create_pcb(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol)
 
 esp_err_t _mdns_pcb_init(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol)
 {
-    ESP_LOGI(TAG, "_mdns_pcb_init(tcpip_if=%d, ip_protocol=%d)", tcpip_if, ip_protocol);
+    ESP_LOGI(TAG, "_mdns_pcb_init(tcpip_if=%lu, ip_protocol=%d)", (unsigned long)tcpip_if, ip_protocol);
     if (!create_pcb(tcpip_if, ip_protocol)) {
         return ESP_FAIL;
     }
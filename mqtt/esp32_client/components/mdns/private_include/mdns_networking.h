@@ -31,6 +31,16 @@ esp_err_t _mdns_pcb_init(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol);
  */
 esp_err_t _mdns_pcb_deinit(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol);
 
+/**
+ * @brief  Gets a buffer of MDNS_MAX_PACKET_SIZE bytes to build the next packet in
+ *
+ * Writing the packet from this buffer saves the copy into the network stack. The buffer stays reserved
+ * until a packet is written from it. Called with the service lock.
+ *
+ * @return the buffer or NULL if the caller has to use its own
+ */
+uint8_t *_mdns_udp_pcb_tx_buffer(void);
+
 /**
  * @brief  send packet over UDP
  *
@@ -42,6 +52,57 @@ esp_err_t _mdns_pcb_deinit(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol);
  */
 size_t _mdns_udp_pcb_write(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol, const esp_ip_addr_t *ip, uint16_t port, uint8_t *data, size_t len);
 
+/**
+ * @brief  Hold the packets written from now on, to send them together with _mdns_udp_pcb_flush()
+ *
+ * The written data is copied, the buffer can be reused right away. Backends without batched
+ * transmit send the packets immediately. Called by the service task with the service lock.
+ */
+void _mdns_udp_pcb_hold(void);
+
+/**
+ * @brief  Send the packets held since _mdns_udp_pcb_hold() and stop holding them
+ */
+void _mdns_udp_pcb_flush(void);
+
+/**
+ * @brief  Transmit counters of an interface, since the start of the process
+ */
+typedef struct {
+    uint32_t packets;       // packets handed over to the network stack
+    uint32_t bytes;
+    uint32_t errors;        // packets the network stack refused
+    uint32_t calls;         // calls to the network stack (system calls on Linux), batched packets share one
+} mdns_tx_counters_t;
+
+/**
+ * @brief  Transmit counters as the backends keep them, read by _mdns_udp_pcb_get_counters() from any task
+ */
+typedef struct {
+    _Atomic uint32_t packets;
+    _Atomic uint32_t bytes;
+    _Atomic uint32_t errors;
+    _Atomic uint32_t calls;
+} mdns_tx_stats_t;
+
+static inline void _mdns_tx_stats_add(_Atomic uint32_t *counter, uint32_t n)
+{
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+static inline void _mdns_tx_stats_load(const mdns_tx_stats_t *stats, mdns_tx_counters_t *counters)
+{
+    counters->packets = atomic_load_explicit(&stats->packets, memory_order_relaxed);
+    counters->bytes = atomic_load_explicit(&stats->bytes, memory_order_relaxed);
+    counters->errors = atomic_load_explicit(&stats->errors, memory_order_relaxed);
+    counters->calls = atomic_load_explicit(&stats->calls, memory_order_relaxed);
+}
+
+/**
+ * @brief  Gets the transmit counters of the interface
+ */
+void _mdns_udp_pcb_get_counters(mdns_if_t tcpip_if, mdns_tx_counters_t *counters);
+
 /**
  * @brief  Gets data pointer to the mDNS packet
  */
@@ -0,0 +1,1373 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+/**
+ * @brief Host fuzz and benchmark harness for the mDNS packet parser
+ *
+ * The engine is compiled into this translation unit to reach its internals. FreeRTOS and esp_netif are
+ * emulated (see stubs/), the socket backend is linked but only the rx and tx modes open a socket: the interface 0
+ * pcbs are forced to the running state so received questions are answered. The answers are counted and dropped
+ * (printed in hex if MDNS_HOST_TEST_DUMP_TX is set in the environment).
+ *
+ * Built with libFuzzer (MDNS_HOST_FUZZER) it provides the fuzz target, otherwise a command line driver:
+ *
+ *     mdns_host_test bench [seconds] [n]   parser throughput over the built-in corpus (n more services), cached queries
+ *     mdns_host_test searches [seconds] [n] parser throughput with n more running searches of other names
+ *     mdns_host_test browse [seconds] [n]  cpu time per instance browsing n instances, responses repeated once
+ *     mdns_host_test mutate [iterations]   random mutations of the corpus (run it under sanitizers)
+ *     mdns_host_test corpus <dir>          write the corpus as libFuzzer seeds
+ *     mdns_host_test replay <files...>     parse packet files, in batches as the service task does
+ *     mdns_host_test busy [seconds] [n]    n queriers repeating browse queries every second, sent packets/s
+ *     mdns_host_test rx [seconds] [rate]   packets/s and cpu time per packet receiving from a loopback multicast sender
+ *     mdns_host_test tx [seconds] [burst]  cpu time per packet sending bursts over the loopback, one by one and batched
+ *     mdns_host_test workers [seconds]     parser cost per packet for one task and split with the parse worker
+ *     mdns_host_test startup [n] [ms] [runs] time until n services added ms apart are announced on all pcbs
+ *
+ * Built with CONFIG_MDNS_PARSE_WORKER, the parsed packets go through the names decoded ahead.
+ */
+#include "mdns.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+// Same layout as the socket backend receive buffer
+struct pbuf {
+    struct pbuf *next;
+    void *payload;
+    size_t tot_len;
+    size_t len;
+};
+
+extern bool host_test_timers_enabled;
+extern bool host_test_netif_loopback;
+
+#define HOST_TEST_HOSTNAME      "esp32-mdns"
+#define HOST_TEST_MAX_PACKET    9000        // jumbo frames may reach the socket backend
+
+typedef struct {
+    const char *name;
+    uint16_t src_port;
+    uint8_t data[MDNS_MAX_PACKET_SIZE];
+    size_t len;
+} corpus_packet_t;
+
+static esp_netif_t *s_netif;
+static mdns_search_once_t *s_searches[3];
+static uint32_t s_tx_packets;
+static uint64_t s_tx_bytes;
+static bool s_dump_tx;
+static bool s_real_tx;      // the tx mode sends through the socket backend
+static uint32_t s_tx_probes;
+static bool s_startup;      // the startup mode brings all pcbs up without sockets
+static bool s_startup_ready[MDNS_MAX_INTERFACES][MDNS_IP_PROTOCOL_MAX];
+
+size_t __real__mdns_udp_pcb_write(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol, const esp_ip_addr_t *ip,
+                                  uint16_t port, uint8_t *data, size_t len);
+
+/**
+ * @brief Replaces the socket backend write (linked with --wrap=_mdns_udp_pcb_write)
+ */
+size_t __wrap__mdns_udp_pcb_write(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol, const esp_ip_addr_t *ip,
+                                  uint16_t port, uint8_t *data, size_t len)
+{
+    if (s_real_tx) {
+        return __real__mdns_udp_pcb_write(tcpip_if, ip_protocol, ip, port, data, len);
+    }
+    s_tx_packets++;
+    s_tx_bytes += len;
+    // queries (the probes) have the QR bit clear and questions
+    if (len > 5 && !(data[2] & 0x80) && (data[4] || data[5])) {
+        s_tx_probes++;
+    }
+    if (s_dump_tx) {
+        printf("TX %zu %d %u ", tcpip_if, ip_protocol, port);
+        for (size_t i = 0; i < len; i++) {
+            printf("%02x", data[i]);
+        }
+        printf("\n");
+    }
+    return len;
+}
+
+bool __real_mdns_is_netif_ready(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol);
+esp_err_t __real__mdns_pcb_init(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol);
+
+/**
+ * @brief Replace the pcb state of the socket backend in the startup mode (--wrap=mdns_is_netif_ready)
+ */
+bool __wrap_mdns_is_netif_ready(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol)
+{
+    if (s_startup) {
+        return s_startup_ready[tcpip_if][ip_protocol];
+    }
+    return __real_mdns_is_netif_ready(tcpip_if, ip_protocol);
+}
+
+/**
+ * @brief Open no socket in the startup mode (--wrap=_mdns_pcb_init)
+ */
+esp_err_t __wrap__mdns_pcb_init(mdns_if_t tcpip_if, mdns_ip_protocol_t ip_protocol)
+{
+    if (s_startup) {
+        s_startup_ready[tcpip_if][ip_protocol] = true;
+        return ESP_OK;
+    }
+    return __real__mdns_pcb_init(tcpip_if, ip_protocol);
+}
+
+/**
+ * @brief Wait for the service task to run the queued actions
+ */
+static void wait_actions(void)
+{
+    mdns_action_queue_t *queue = _mdns_server->action_queue;
+    while (atomic_load(&queue->ring_tail) != atomic_load(&queue->ring_head)) {
+        vTaskDelay(1);
+    }
+    MDNS_SERVICE_LOCK();
+    MDNS_SERVICE_UNLOCK();
+}
+
+static void host_test_setup(void)
+{
+    static bool initialized;
+    if (initialized) {
+        return;
+    }
+    initialized = true;
+
+    // the scheduler would keep retransmitting, the harness drives the engine itself
+    host_test_timers_enabled = false;
+    s_dump_tx = getenv("MDNS_HOST_TEST_DUMP_TX") != NULL;
+
+    ESP_ERROR_CHECK(mdns_init());
+    s_netif = esp_netif_get_handle_from_ifkey("HOST_DEF");
+    ESP_ERROR_CHECK(mdns_register_netif(s_netif));
+    ESP_ERROR_CHECK(mdns_hostname_set(HOST_TEST_HOSTNAME));
+    ESP_ERROR_CHECK(mdns_instance_name_set("ESP32 mDNS host test"));
+
+    mdns_txt_item_t txt[] = {
+        {"board", "esp32"},
+        {"path", "/"},
+        {"version", "1.2.1"},
+    };
+    ESP_ERROR_CHECK(mdns_service_add(NULL, "_http", "_tcp", 80, txt, sizeof(txt) / sizeof(txt[0])));
+    ESP_ERROR_CHECK(mdns_service_add("Broker", "_mqtt", "_tcp", 1883, NULL, 0));
+    ESP_ERROR_CHECK(mdns_service_add(NULL, "_arduino", "_tcp", 3232, txt, 1));
+    ESP_ERROR_CHECK(mdns_service_subtype_add_for_host(NULL, "_http", "_tcp", NULL, "_printer"));
+
+    mdns_ip_addr_t delegated = {
+        .addr = ESP_IP4ADDR_INIT(192, 168, 0, 30),
+    };
+    ESP_ERROR_CHECK(mdns_delegate_hostname_add("delegated", &delegated));
+    ESP_ERROR_CHECK(mdns_service_add_for_host("Delegated", "_http", "_tcp", "delegated", 8080, NULL, 0));
+
+    // concurrent searches, matched against the received records
+    s_searches[0] = mdns_query_async_new(NULL, "_http", "_tcp", MDNS_TYPE_PTR, UINT32_MAX, 20, NULL);
+    s_searches[1] = mdns_query_async_new("broker", NULL, NULL, MDNS_TYPE_A, UINT32_MAX, 1, NULL);
+    s_searches[2] = mdns_query_async_new(NULL, "_airplay", "_tcp", MDNS_TYPE_PTR, UINT32_MAX, 20, NULL);
+    wait_actions();
+
+    MDNS_SERVICE_LOCK();
+    for (int i = 0; i < MDNS_IP_PROTOCOL_MAX; ++i) {
+        _mdns_server->interfaces[0].pcbs[i].state = PCB_RUNNING;
+    }
+    MDNS_SERVICE_UNLOCK();
+}
+
+/**
+ * @brief Start a batch of received packets, like the service task does for the pending actions
+ */
+static void host_test_batch_begin(void)
+{
+    MDNS_SERVICE_LOCK();
+    _mdns_server->tx_batching = true;
+}
+
+/**
+ * @brief Send the scheduled packets, all of them or only the ones due, like the tx action does
+ */
+static void host_test_send_scheduled(bool all)
+{
+    uint32_t now = xTaskGetTickCount() * portTICK_PERIOD_MS;
+    while (_mdns_server->tx_queue_len && (all || (int32_t)(_mdns_server->tx_queue[0]->send_at - now) <= 0)) {
+        mdns_tx_packet_t *p = _mdns_tx_queue_pop();
+        _mdns_dispatch_tx_packet(p);
+        _mdns_free_tx_packet(p);
+    }
+}
+
+/**
+ * @brief Finish the batch sending the held answers, the delayed ones right away or when due
+ */
+static void host_test_batch_end(bool keep_delays)
+{
+    _mdns_flush_held_responses();
+    _mdns_server->tx_batching = false;
+    host_test_send_scheduled(!keep_delays);
+    MDNS_SERVICE_UNLOCK();
+}
+
+/**
+ * @brief Parse a packet as received on interface 0 over IPv4, within a batch, with its names decoded ahead or not
+ */
+static void host_test_receive_names(const uint8_t *data, size_t len, uint16_t src_port, const mdns_parse_names_t *names)
+{
+    struct pbuf pb = {
+        .payload = (void *)data,
+        .tot_len = len,
+        .len = len,
+    };
+    mdns_rx_packet_t packet = {
+        .tcpip_if = 0,
+        .ip_protocol = MDNS_IP_PROTOCOL_V4,
+        .pb = &pb,
+        .src = ESP_IP4ADDR_INIT(192, 168, 0, 20),
+        .dest = ESP_IP4ADDR_INIT(224, 0, 0, 251),
+        .src_port = src_port,
+        .multicast = 1,
+    };
+    mdns_parse_packet(&_mdns_server->parser, &packet, names);
+}
+
+/**
+ * @brief Parse a packet as received on interface 0 over IPv4, within a batch
+ *
+ * Built with the parse worker, the names are decoded ahead as the worker does.
+ */
+static void host_test_receive(const uint8_t *data, size_t len, uint16_t src_port)
+{
+#if MDNS_PARSE_WORKER
+    static mdns_parse_names_t names;
+    _mdns_parse_names_decode(&names, data, len);
+    host_test_receive_names(data, len, src_port, &names);
+#else
+    host_test_receive_names(data, len, src_port, NULL);
+#endif
+}
+
+/**
+ * @brief Parse a packet in a batch of its own
+ */
+static void host_test_parse(const uint8_t *data, size_t len, uint16_t src_port)
+{
+    host_test_batch_begin();
+    host_test_receive(data, len, src_port);
+    host_test_batch_end(false);
+}
+
+#ifdef MDNS_HOST_FUZZER
+
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+    host_test_setup();
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if (size > HOST_TEST_MAX_PACKET) {
+        return 0;
+    }
+    // odd ids come from one-shot queriers, to cover the legacy unicast paths as well
+    uint16_t src_port = size > 1 && (data[1] & 1) ? 49152 : MDNS_SERVICE_PORT;
+    host_test_parse(data, size, src_port);
+    return 0;
+}
+
+#else
+
+static void host_test_teardown(void)
+{
+    // finished searches are handed over to the caller, mdns_free() takes care of the running ones
+    for (int i = 0; i < sizeof(s_searches) / sizeof(s_searches[0]); ++i) {
+        mdns_result_t *results;
+        if (mdns_query_async_get_results(s_searches[i], 0, &results, NULL)) {
+            mdns_query_results_free(results);
+            mdns_query_async_delete(s_searches[i]);
+        }
+    }
+    mdns_free();
+}
+
+/**
+ * @brief Register more services on the delegated host, every 4th is an _http._tcp instance and the others get own types
+ */
+static void host_test_add_services(int count)
+{
+    for (int i = 0; i < count; ++i) {
+        char instance[32], type[32];
+        snprintf(instance, sizeof(instance), "Device %d", i);
+        snprintf(type, sizeof(type), "_svc%d", i);
+        if (i % 4 == 0) {
+            ESP_ERROR_CHECK(mdns_service_add_for_host(instance, "_http", "_tcp", "delegated", 9000 + i, NULL, 0));
+        } else {
+            ESP_ERROR_CHECK(mdns_service_add_for_host(NULL, type, "_tcp", "delegated", 9000 + i, NULL, 0));
+        }
+    }
+}
+
+/**
+ * @brief Check that every registered service is found by its own name through the lookup tables
+ */
+static void host_test_check_services(void)
+{
+    wait_actions();
+    MDNS_SERVICE_LOCK();
+    for (mdns_srv_item_t *s = _mdns_server->services; s; s = s->next) {
+        mdns_service_t *srv = s->service;
+        assert(_mdns_get_service_item_instance(_mdns_get_service_instance_name(srv), srv->service, srv->proto,
+                                               srv->hostname) == s);
+        assert(_mdns_get_service_item(srv->service, srv->proto, srv->hostname));
+    }
+    MDNS_SERVICE_UNLOCK();
+}
+
+/**
+ * @brief Start more searches that the corpus records do not match, for other types, instances and hosts
+ *
+ * mdns_free() deletes them at teardown.
+ */
+static void host_test_add_searches(int count)
+{
+    for (int i = 0; i < count; ++i) {
+        char name[32], type[32];
+        snprintf(name, sizeof(name), "other-%d", i);
+        snprintf(type, sizeof(type), "_other%d", i);
+        mdns_search_once_t *search;
+        switch (i % 4) {
+        case 0:
+            search = mdns_query_async_new(NULL, type, "_tcp", MDNS_TYPE_PTR, UINT32_MAX, 20, NULL);
+            break;
+        case 1:
+            search = mdns_query_async_new(name, NULL, NULL, MDNS_TYPE_A, UINT32_MAX, 1, NULL);
+            break;
+        case 2:
+            search = mdns_query_async_new(name, "_http", "_tcp", MDNS_TYPE_SRV, UINT32_MAX, 1, NULL);
+            break;
+        default:
+            search = mdns_query_async_new(name, NULL, NULL, MDNS_TYPE_AAAA, UINT32_MAX, 1, NULL);
+            break;
+        }
+        assert(search);
+        (void)search;
+        if (i % 8 == 7) {
+            wait_actions();     // do not overflow the action queue
+        }
+    }
+    wait_actions();
+}
+
+/*
+ * Corpus builder, DNS wire format
+ */
+
+static void put_u16(corpus_packet_t *p, uint16_t v)
+{
+    assert(p->len + 2 <= sizeof(p->data));
+    p->data[p->len++] = v >> 8;
+    p->data[p->len++] = v & 0xff;
+}
+
+static void put_u32(corpus_packet_t *p, uint32_t v)
+{
+    put_u16(p, v >> 16);
+    put_u16(p, v & 0xffff);
+}
+
+static void put_bytes(corpus_packet_t *p, const void *data, size_t len)
+{
+    assert(p->len + len <= sizeof(p->data));
+    memcpy(p->data + p->len, data, len);
+    p->len += len;
+}
+
+/**
+ * @brief Append a dotted name, the labels from `tail` on are replaced by a pointer to `tail_offset`
+ *
+ * @return offset of the name
+ */
+static uint16_t put_name(corpus_packet_t *p, const char *name, const char *tail, uint16_t tail_offset)
+{
+    uint16_t offset = p->len;
+    while (*name) {
+        if (tail && strcmp(name, tail) == 0) {
+            put_u16(p, MDNS_NAME_REF | tail_offset);
+            return offset;
+        }
+        const char *dot = strchr(name, '.');
+        size_t label = dot ? (size_t)(dot - name) : strlen(name);
+        put_bytes(p, (uint8_t[]) {
+            label
+        }, 1);
+        put_bytes(p, name, label);
+        name += label + (dot ? 1 : 0);
+    }
+    p->data[p->len++] = 0;
+    return offset;
+}
+
+static void put_header(corpus_packet_t *p, uint16_t flags, uint16_t qd, uint16_t an, uint16_t ns, uint16_t ar)
+{
+    p->len = 0;
+    put_u16(p, 0);
+    put_u16(p, flags);
+    put_u16(p, qd);
+    put_u16(p, an);
+    put_u16(p, ns);
+    put_u16(p, ar);
+}
+
+static void put_question(corpus_packet_t *p, const char *name, uint16_t type, bool unicast)
+{
+    put_name(p, name, NULL, 0);
+    put_u16(p, type);
+    put_u16(p, MDNS_CLASS_IN | (unicast ? 0x8000 : 0));
+}
+
+/**
+ * @brief Append a record header, the caller appends rdlength bytes of data
+ */
+static void put_record(corpus_packet_t *p, const char *name, const char *tail, uint16_t tail_offset,
+                       uint16_t type, uint16_t clas, uint32_t ttl, uint16_t rdlength)
+{
+    put_name(p, name, tail, tail_offset);
+    put_u16(p, type);
+    put_u16(p, clas);
+    put_u32(p, ttl);
+    put_u16(p, rdlength);
+}
+
+static void put_txt(corpus_packet_t *p, const char *const *items, size_t count)
+{
+    size_t len = 0;
+    for (size_t i = 0; i < count; ++i) {
+        len += 1 + strlen(items[i]);
+    }
+    put_u16(p, len);
+    for (size_t i = 0; i < count; ++i) {
+        p->data[p->len++] = strlen(items[i]);
+        put_bytes(p, items[i], strlen(items[i]));
+    }
+}
+
+/**
+ * @brief PTR + SRV + TXT + A + AAAA answer block for a service instance, as sent by most responders
+ */
+static void put_instance(corpus_packet_t *p, const char *instance, const char *type, const char *host,
+                         const char *const *txt, size_t txt_count, uint8_t ip_last)
+{
+    char fqdn[MDNS_NAME_BUF_LEN * 2];
+    char host_fqdn[MDNS_NAME_BUF_LEN * 2];
+    snprintf(fqdn, sizeof(fqdn), "%s.%s", instance, type);
+    snprintf(host_fqdn, sizeof(host_fqdn), "%s.local", host);
+
+    uint16_t type_offset = p->len;
+    put_name(p, type, NULL, 0);
+    put_u16(p, MDNS_TYPE_PTR);
+    put_u16(p, MDNS_CLASS_IN);
+    put_u32(p, MDNS_ANSWER_PTR_TTL);
+    uint16_t rdlength_offset = p->len;
+    put_u16(p, 0);
+    uint16_t instance_offset = p->len;
+    put_name(p, fqdn, type, type_offset);
+    uint16_t rdlength = p->len - instance_offset;
+    p->data[rdlength_offset] = rdlength >> 8;
+    p->data[rdlength_offset + 1] = rdlength & 0xff;
+
+    // SRV, the target host is written once and referenced by the address records
+    put_u16(p, MDNS_NAME_REF | instance_offset);
+    put_u16(p, MDNS_TYPE_SRV);
+    put_u16(p, MDNS_CLASS_IN_FLUSH_CACHE);
+    put_u32(p, MDNS_ANSWER_SRV_TTL);
+    rdlength_offset = p->len;
+    put_u16(p, 0);
+    put_u16(p, 0);
+    put_u16(p, 0);
+    put_u16(p, 8000 + ip_last);
+    uint16_t host_offset = p->len;
+    put_name(p, host_fqdn, "local", type_offset + strlen(type) - strlen("local"));
+    rdlength = p->len - rdlength_offset - 2;
+    p->data[rdlength_offset] = rdlength >> 8;
+    p->data[rdlength_offset + 1] = rdlength & 0xff;
+
+    put_u16(p, MDNS_NAME_REF | instance_offset);
+    put_u16(p, MDNS_TYPE_TXT);
+    put_u16(p, MDNS_CLASS_IN_FLUSH_CACHE);
+    put_u32(p, MDNS_ANSWER_TXT_TTL);
+    put_txt(p, txt, txt_count);
+
+    put_u16(p, MDNS_NAME_REF | host_offset);
+    put_u16(p, MDNS_TYPE_A);
+    put_u16(p, MDNS_CLASS_IN_FLUSH_CACHE);
+    put_u32(p, MDNS_ANSWER_A_TTL);
+    put_u16(p, 4);
+    const uint8_t ip4[4] = {192, 168, 0, ip_last};
+    put_bytes(p, ip4, sizeof(ip4));
+
+    put_u16(p, MDNS_NAME_REF | host_offset);
+    put_u16(p, MDNS_TYPE_AAAA);
+    put_u16(p, MDNS_CLASS_IN_FLUSH_CACHE);
+    put_u32(p, MDNS_ANSWER_AAAA_TTL);
+    put_u16(p, MDNS_ANSWER_AAAA_SIZE);
+    uint8_t ip6[MDNS_ANSWER_AAAA_SIZE] = {0xfe, 0x80};
+    ip6[15] = ip_last;
+    put_bytes(p, ip6, sizeof(ip6));
+}
+
+static size_t build_corpus(corpus_packet_t *corpus)
+{
+    size_t n = 0;
+    corpus_packet_t *p;
+    static const char *const printer_txt[] = {"txtvers=1", "qtotal=1", "rp=printers/office", "ty=Office Printer",
+                                              "pdl=application/pdf,image/urf", "Color=T", "Duplex=T"
+                                             };
+    static const char *const airplay_txt[] = {"acl=0", "deviceid=AA:BB:CC:DD:EE:FF", "features=0x5A7FFFF7,0x1E",
+                                              "flags=0x4", "model=AppleTV6,2", "pk=0123456789abcdef0123456789abcdef",
+                                              "pi=2e388006-13ba-4041-9a67-25dd4a43d536", "srcvers=366.0", "vv=2"
+                                             };
+
+    p = &corpus[n++];
+    p->name = "query PTR (ours)";
+    p->src_port = MDNS_SERVICE_PORT;
+    put_header(p, 0, 1, 0, 0, 0);
+    put_question(p, "_http._tcp.local", MDNS_TYPE_PTR, false);
+
+    p = &corpus[n++];
+    p->name = "query service discovery";
+    p->src_port = MDNS_SERVICE_PORT;
+    put_header(p, 0, 1, 0, 0, 0);
+    put_question(p, "_services._dns-sd._udp.local", MDNS_TYPE_PTR, false);
+
+    p = &corpus[n++];
+    p->name = "query A+AAAA (ours)";
+    p->src_port = MDNS_SERVICE_PORT;
+    put_header(p, 0, 2, 0, 0, 0);
+    put_question(p, HOST_TEST_HOSTNAME ".local", MDNS_TYPE_A, false);
+    put_question(p, HOST_TEST_HOSTNAME ".local", MDNS_TYPE_AAAA, false);
+
+    p = &corpus[n++];
+    p->name = "query SRV+TXT one-shot";
+    p->src_port = 49152;
+    put_header(p, 0, 2, 0, 0, 0);
+    put_question(p, "Broker._mqtt._tcp.local", MDNS_TYPE_SRV, true);
+    put_question(p, "Broker._mqtt._tcp.local", MDNS_TYPE_TXT, true);
+
+    p = &corpus[n++];
+    p->name = "query SRV (added services)";
+    p->src_port = MDNS_SERVICE_PORT;
+    put_header(p, 0, 1, 0, 0, 0);
+    put_question(p, "Device 8._http._tcp.local", MDNS_TYPE_SRV, false);
+
+    p = &corpus[n++];
+    p->name = "query subtype PTR";
+    p->src_port = MDNS_SERVICE_PORT;
+    put_header(p, 0, 1, 0, 0, 0);
+    put_question(p, "_printer._sub._http._tcp.local", MDNS_TYPE_PTR, false);
+
+    p = &corpus[n++];
+    p->name = "query PTR with known answer";
+    p->src_port = MDNS_SERVICE_PORT;
+    put_header(p, 0, 1, 1, 0, 0);
+    put_question(p, "_http._tcp.local", MDNS_TYPE_PTR, false);
+    put_record(p, "_http._tcp.local", NULL, 0, MDNS_TYPE_PTR, MDNS_CLASS_IN, MDNS_ANSWER_PTR_TTL, 0);
+    p->len -= 2;
+    uint16_t rd = p->len;
+    put_u16(p, 0);
+    put_name(p, "ESP32 mDNS host test._http._tcp.local", "_http._tcp.local", MDNS_HEAD_LEN);
+    p->data[rd + 1] = p->len - rd - 2;
+
+    p = &corpus[n++];
+    p->name = "query foreign PTR (busy LAN)";
+    p->src_port = MDNS_SERVICE_PORT;
+    put_header(p, 0, 4, 0, 0, 0);
+    put_question(p, "_airplay._tcp.local", MDNS_TYPE_PTR, false);
+    put_question(p, "_raop._tcp.local", MDNS_TYPE_PTR, false);
+    put_question(p, "_googlecast._tcp.local", MDNS_TYPE_PTR, false);
+    put_question(p, "_companion-link._tcp.local", MDNS_TYPE_PTR, false);
+
+    p = &corpus[n++];
+    p->name = "probe ANY (foreign host)";
+    p->src_port = MDNS_SERVICE_PORT;
+    put_header(p, 0, 1, 0, 1, 0);
+    put_question(p, "android-4f3a.local", MDNS_TYPE_ANY, true);
+    put_record(p, "android-4f3a.local", NULL, 0, MDNS_TYPE_A, MDNS_CLASS_IN, MDNS_ANSWER_A_TTL, 4);
+    put_bytes(p, (const uint8_t[]) {
+        192, 168, 0, 77
+    }, 4);
+
+    p = &corpus[n++];
+    p->name = "response A (searched)";
+    p->src_port = MDNS_SERVICE_PORT;
+    put_header(p, MDNS_FLAGS_QR_AUTHORITATIVE, 0, 1, 0, 0);
+    put_record(p, "broker.local", NULL, 0, MDNS_TYPE_A, MDNS_CLASS_IN_FLUSH_CACHE, MDNS_ANSWER_A_TTL, 4);
+    put_bytes(p, (const uint8_t[]) {
+        192, 168, 0, 40
+    }, 4);
+
+    p = &corpus[n++];
+    p->name = "response AAAA (foreign)";
+    p->src_port = MDNS_SERVICE_PORT;
+    put_header(p, MDNS_FLAGS_QR_AUTHORITATIVE, 0, 1, 0, 0);
+    put_record(p, "macbook.local", NULL, 0, MDNS_TYPE_AAAA, MDNS_CLASS_IN_FLUSH_CACHE, MDNS_ANSWER_AAAA_TTL,
+               MDNS_ANSWER_AAAA_SIZE);
+    put_bytes(p, (const uint8_t[MDNS_ANSWER_AAAA_SIZE]) {
+        0xfe, 0x80, [15] = 0x42
+    }, MDNS_ANSWER_AAAA_SIZE);
+
+    p = &corpus[n++];
+    p->name = "response PTR/SRV/TXT/A/AAAA (searched)";
+    p->src_port = MDNS_SERVICE_PORT;
+    put_header(p, MDNS_FLAGS_QR_AUTHORITATIVE, 0, 5, 0, 0);
+    put_instance(p, "Office Printer", "_http._tcp.local", "printer", printer_txt,
+                 sizeof(printer_txt) / sizeof(printer_txt[0]), 50);
+
+    p = &corpus[n++];
+    p->name = "response 4 instances (searched)";
+    p->src_port = MDNS_SERVICE_PORT;
+    put_header(p, MDNS_FLAGS_QR_AUTHORITATIVE, 0, 20, 0, 0);
+    for (int i = 0; i < 4; ++i) {
+        char instance[32], host[32];
+        snprintf(instance, sizeof(instance), "Living Room %d", i);
+        snprintf(host, sizeof(host), "appletv-%d", i);
+        put_instance(p, instance, "_airplay._tcp.local", host, airplay_txt,
+                     sizeof(airplay_txt) / sizeof(airplay_txt[0]), 60 + i);
+    }
+
+    p = &corpus[n++];
+    p->name = "response 4 instances (foreign)";
+    p->src_port = MDNS_SERVICE_PORT;
+    put_header(p, MDNS_FLAGS_QR_AUTHORITATIVE, 0, 20, 0, 0);
+    for (int i = 0; i < 4; ++i) {
+        char instance[32], host[32];
+        snprintf(instance, sizeof(instance), "Speaker %d", i);
+        snprintf(host, sizeof(host), "speaker-%d", i);
+        put_instance(p, instance, "_googlecast._tcp.local", host, airplay_txt, 4, 80 + i);
+    }
+
+    return n;
+}
+
+/*
+ * Drivers
+ */
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t cpu_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#if MDNS_CACHE_SIZE
+/**
+ * @brief Blocking queries answered from the records cached while parsing the corpus
+ */
+static int run_bench_cache(double seconds)
+{
+    static const struct {
+        const char *name;
+        const char *instance;
+        const char *service;
+        uint16_t type;
+        size_t max_results;
+    } queries[] = {
+        {"cached query A", "broker", NULL, MDNS_TYPE_A, 1},
+        {"cached query SRV", "Office Printer", "_http", MDNS_TYPE_SRV, 1},
+        {"cached query PTR (4 instances)", NULL, "_airplay", MDNS_TYPE_PTR, 4},
+    };
+
+    printf("%-40s %6s %12s %10s\n", "query", "", "queries/s", "ns/query");
+    for (size_t i = 0; i < sizeof(queries) / sizeof(queries[0]); ++i) {
+        const char *proto = queries[i].service ? "_tcp" : NULL;
+        mdns_result_t *results = NULL;
+        // a miss would block on the network the harness does not have
+        MDNS_SERVICE_LOCK();
+        bool cached = _mdns_cache_lookup(queries[i].instance, queries[i].service, proto, queries[i].type,
+                                         queries[i].max_results, &results, NULL);
+        MDNS_SERVICE_UNLOCK();
+        if (!cached) {
+            printf("%s: not cached\n", queries[i].name);
+            return 1;
+        }
+        size_t count = 0;
+        for (mdns_result_t *r = results; r; r = r->next, ++count) {
+            if (!r->addr || (queries[i].type == MDNS_TYPE_SRV && r->port != 8050)) {
+                printf("%s: incomplete result\n", queries[i].name);
+                return 1;
+            }
+        }
+        mdns_query_results_free(results);
+        if (count != queries[i].max_results) {
+            printf("%s: %zu results\n", queries[i].name, count);
+            return 1;
+        }
+
+        uint64_t n = 0, start = now_ns(), elapsed;
+        do {
+            ESP_ERROR_CHECK(mdns_query(queries[i].instance, queries[i].service, proto, queries[i].type, 2000,
+                                       queries[i].max_results, &results));
+            mdns_query_results_free(results);
+            elapsed = now_ns() - start;
+        } while (++n < 16 || elapsed < seconds * 1e9);
+        printf("%-40s %6s %12.0f %10.0f\n", queries[i].name, "", n * 1e9 / elapsed, (double)elapsed / n);
+    }
+
+    esp_ip4_addr_t addr;
+    ESP_ERROR_CHECK(mdns_query_a("broker", 2000, &addr));
+    if (addr.addr != ESP_IP4TOADDR(192, 168, 0, 40)) {
+        printf("cached query A: wrong address\n");
+        return 1;
+    }
+    return 0;
+}
+#else
+static int run_bench_cache(double seconds)
+{
+    return 0;
+}
+#endif
+
+static int run_bench(double seconds)
+{
+    static corpus_packet_t corpus[20];
+    size_t n = build_corpus(corpus);
+
+    // warm up: first round fills the search results
+    for (size_t i = 0; i < n; ++i) {
+        host_test_parse(corpus[i].data, corpus[i].len, corpus[i].src_port);
+    }
+
+    printf("%-40s %6s %12s %10s\n", "packet", "bytes", "packets/s", "ns/packet");
+    uint64_t total_ns = 0, total_packets = 0;
+    uint64_t per_packet_ns = (uint64_t)(seconds * 1e9 / n);
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t count = 0, start = now_ns(), elapsed;
+        do {
+            for (int j = 0; j < 64; ++j) {
+                host_test_parse(corpus[i].data, corpus[i].len, corpus[i].src_port);
+            }
+            count += 64;
+            elapsed = now_ns() - start;
+        } while (elapsed < per_packet_ns);
+        printf("%-40s %6zu %12.0f %10.0f\n", corpus[i].name, corpus[i].len, count * 1e9 / elapsed,
+               (double)elapsed / count);
+        total_ns += elapsed / count;
+        total_packets++;
+    }
+    printf("%-40s %6s %12.0f %10.0f\n", "corpus mix", "", total_packets * 1e9 / total_ns,
+           (double)total_ns / total_packets);
+    return run_bench_cache(seconds / n);
+}
+
+#if MDNS_PARSE_WORKER
+/**
+ * @brief Time one parser stage over a packet: the whole parse (no names), the worker's decoding or the rest
+ */
+static double workers_stage_ns(const corpus_packet_t *p, const mdns_parse_names_t *names, bool decode, uint64_t budget_ns)
+{
+    static mdns_parse_names_t decoded;
+    uint64_t count = 0, start = now_ns(), elapsed;
+    do {
+        for (int j = 0; j < 64; ++j) {
+            if (decode) {
+                _mdns_parse_names_decode(&decoded, p->data, p->len);
+            } else {
+                host_test_batch_begin();
+                host_test_receive_names(p->data, p->len, p->src_port, names);
+                host_test_batch_end(false);
+            }
+        }
+        count += 64;
+        elapsed = now_ns() - start;
+    } while (elapsed < budget_ns);
+    return (double)elapsed / count;
+}
+
+/**
+ * @brief Parser cost per corpus packet with one task and split between the parse worker and the service task
+ *
+ * With the worker on the other core the packets/s is bound by the slower stage, the service task's share is what
+ * the service lock is held for.
+ */
+static int run_workers(double seconds)
+{
+    static corpus_packet_t corpus[20];
+    static mdns_parse_names_t names;
+    size_t n = build_corpus(corpus);
+    uint64_t budget_ns = (uint64_t)(seconds * 1e9 / n / 3);
+
+    for (size_t i = 0; i < n; ++i) {
+        host_test_parse(corpus[i].data, corpus[i].len, corpus[i].src_port);
+    }
+
+    printf("%-40s %10s %10s %10s %10s\n", "packet", "1 task ns", "decode ns", "apply ns", "speedup");
+    double one_total = 0, decode_total = 0, apply_total = 0;
+    for (size_t i = 0; i < n; ++i) {
+        _mdns_parse_names_decode(&names, corpus[i].data, corpus[i].len);
+        double one = workers_stage_ns(&corpus[i], NULL, false, budget_ns);
+        double decode = workers_stage_ns(&corpus[i], NULL, true, budget_ns);
+        double apply = workers_stage_ns(&corpus[i], &names, false, budget_ns);
+        printf("%-40s %10.0f %10.0f %10.0f %9.2fx\n", corpus[i].name, one, decode, apply, one / MAX(decode, apply));
+        one_total += one;
+        decode_total += decode;
+        apply_total += apply;
+    }
+    printf("%-40s %10.0f %10.0f %10.0f %9.2fx\n", "corpus mix", one_total / n, decode_total / n, apply_total / n,
+           one_total / MAX(decode_total, apply_total));
+    printf("corpus mix packets/s: 1 worker %.0f, 2 workers %.0f\n", n * 1e9 / one_total,
+           n * 1e9 / MAX(decode_total, apply_total));
+    return 0;
+}
+#else
+static int run_workers(double seconds)
+{
+    printf("built without CONFIG_MDNS_PARSE_WORKER\n");
+    return 1;
+}
+#endif
+
+static int run_mutate(unsigned long iterations)
+{
+    static corpus_packet_t corpus[20];
+    static uint8_t buf[MDNS_MAX_PACKET_SIZE];
+    size_t n = build_corpus(corpus);
+    srand(1);
+
+    for (unsigned long it = 0; it < iterations; ++it) {
+        // batches of up to MDNS_ACTION_BATCH_MAX packets, their answers are coalesced
+        if (it % MDNS_ACTION_BATCH_MAX == 0) {
+            host_test_batch_begin();
+        }
+        const corpus_packet_t *p = &corpus[rand() % n];
+        size_t len = p->len;
+        memcpy(buf, p->data, len);
+        int mutations = 1 + rand() % 8;
+        while (mutations--) {
+            switch (rand() % 4) {
+            case 0: // bit flip
+                buf[rand() % len] ^= 1 << (rand() % 8);
+                break;
+            case 1: // interesting byte
+                buf[rand() % len] = (const uint8_t[]) {
+                    0, 1, 0x3f, 0x40, 0x7f, 0x80, 0xc0, 0xff
+                }[rand() % 8];
+                break;
+            case 2: // truncate
+                len = 1 + rand() % len;
+                break;
+            default: { // splice from another packet
+                const corpus_packet_t *o = &corpus[rand() % n];
+                size_t from = rand() % o->len, to = rand() % len;
+                size_t count = MIN(o->len - from, sizeof(buf) - to);
+                memcpy(buf + to, o->data + from, count);
+                len = MAX(len, to + count);
+                break;
+            }
+            }
+        }
+        host_test_receive(buf, len, (it & 1) ? 49152 : MDNS_SERVICE_PORT);
+        if (it % MDNS_ACTION_BATCH_MAX == MDNS_ACTION_BATCH_MAX - 1 || it + 1 == iterations) {
+            host_test_batch_end(false);
+        }
+    }
+    // rename and remove services, the lookup tables have to follow
+    host_test_add_services(40);
+    for (int i = 0; i < 40; i += 4) {
+        char instance[32], renamed[32];
+        snprintf(instance, sizeof(instance), "Device %d", i);
+        snprintf(renamed, sizeof(renamed), "Renamed %d", i);
+        ESP_ERROR_CHECK(mdns_service_instance_name_set_for_host(instance, "_http", "_tcp", "delegated", renamed));
+    }
+    wait_actions();
+    ESP_ERROR_CHECK(mdns_service_remove_for_host(NULL, "_svc5", "_tcp", "delegated"));
+    ESP_ERROR_CHECK(mdns_service_remove_for_host("Renamed 8", "_http", "_tcp", "delegated"));
+    host_test_check_services();
+
+    printf("%lu mutated packets parsed\n", iterations);
+    return 0;
+}
+
+/**
+ * @brief Browse a service type with n instances, from the first result to the freed result list
+ *
+ * The instances come with their SRV, TXT and address records, 4 per response, every response is received twice
+ * the way repeated queries are answered.
+ */
+static int run_browse(double seconds, int instances)
+{
+    static const char *const txt[] = {"txtvers=1", "model=host-test", "path=/", "version=1.2.1"};
+    int count = (instances + 3) / 4;
+    corpus_packet_t *responses = calloc(count, sizeof(corpus_packet_t));
+    assert(responses && instances > 0 && instances <= UINT8_MAX);
+    for (int i = 0; i < count; ++i) {
+        int first = i * 4, last = MIN(first + 4, instances);
+        put_header(&responses[i], MDNS_FLAGS_QR_AUTHORITATIVE, 0, 5 * (last - first), 0, 0);
+        for (int j = first; j < last; ++j) {
+            char instance[32], host[32];
+            snprintf(instance, sizeof(instance), "Device %d", j);
+            snprintf(host, sizeof(host), "device-%d", j);
+            put_instance(&responses[i], instance, "_browse._tcp.local", host, txt, sizeof(txt) / sizeof(txt[0]), j);
+        }
+    }
+
+    uint64_t rounds = 0, busy_ns = 0, start = now_ns();
+    do {
+        mdns_search_once_t *search = mdns_query_async_new(NULL, "_browse", "_tcp", MDNS_TYPE_PTR, UINT32_MAX,
+                                     instances, NULL);
+        assert(search);
+        wait_actions();
+        uint64_t round_start = cpu_ns(CLOCK_THREAD_CPUTIME_ID);
+        host_test_batch_begin();
+        for (int repeat = 0; repeat < 2; ++repeat) {
+            for (int i = 0; i < count; ++i) {
+                host_test_receive(responses[i].data, responses[i].len, MDNS_SERVICE_PORT);
+            }
+        }
+        host_test_batch_end(false);
+        mdns_result_t *results = NULL;
+        uint8_t num_results = 0;
+        bool done = mdns_query_async_get_results(search, 0, &results, &num_results);
+        assert(done && num_results == instances);
+        (void)done;
+        mdns_query_results_free(results);
+        busy_ns += cpu_ns(CLOCK_THREAD_CPUTIME_ID) - round_start;
+        mdns_query_async_delete(search);
+        rounds++;
+    } while (now_ns() - start < seconds * 1e9);
+    free(responses);
+
+    printf("%d instances, %llu browses: %.0f ns per instance\n", instances, (unsigned long long)rounds,
+           (double)busy_ns / rounds / instances);
+    return 0;
+}
+
+/**
+ * @brief Replay a busy LAN in real time and count the sent packets
+ *
+ * Each querier sends one packet of the corpus every second, at its own phase, mostly browse queries the way
+ * phones and laptops repeat them, some of them listing known answers, the rest foreign queries and responses.
+ */
+static int run_busy(double seconds, int queriers)
+{
+    static corpus_packet_t corpus[20];
+    static const struct {
+        const char *name;
+        int weight;
+    } mix[] = {
+        {"query PTR (ours)", 30},
+        {"query PTR with known answer", 20},
+        {"query service discovery", 15},
+        {"query A+AAAA (ours)", 10},
+        {"query foreign PTR (busy LAN)", 15},
+        {"response 4 instances (foreign)", 10},
+    };
+    size_t n = build_corpus(corpus);
+    int weights = 0;
+    for (size_t i = 0; i < sizeof(mix) / sizeof(mix[0]); ++i) {
+        weights += mix[i].weight;
+    }
+    srand(1);
+    int *phase = calloc(queriers, sizeof(int));
+    assert(phase);
+    for (int q = 0; q < queriers; ++q) {
+        phase[q] = rand() % 1000;
+    }
+
+    uint32_t rx = 0, tx_start = s_tx_packets;
+    uint64_t tx_bytes_start = s_tx_bytes;
+    uint32_t coalesced_start = atomic_load(&_mdns_server->action_queue->stats.coalesced);
+    uint32_t duration = seconds * 1000;
+    uint64_t start = now_ns();
+    for (uint32_t ms = 0; ms < duration; ++ms) {
+        while ((now_ns() - start) / 1000000 < ms) {
+            usleep(200);
+        }
+        host_test_batch_begin();
+        for (int q = 0; q < queriers; ++q) {
+            if (phase[q] != ms % 1000) {
+                continue;
+            }
+            int pick = rand() % weights;
+            size_t m = 0;
+            while (pick >= mix[m].weight) {
+                pick -= mix[m++].weight;
+            }
+            for (size_t i = 0; i < n; ++i) {
+                if (strcmp(corpus[i].name, mix[m].name) == 0) {
+                    host_test_receive(corpus[i].data, corpus[i].len, corpus[i].src_port);
+                    rx++;
+                }
+            }
+        }
+        host_test_batch_end(true);
+    }
+    MDNS_SERVICE_LOCK();
+    host_test_send_scheduled(true);
+    MDNS_SERVICE_UNLOCK();
+    free(phase);
+
+    double elapsed = (now_ns() - start) / 1e9;
+    printf("%d queriers, %.1f s: rx %.0f packets/s, tx %.1f packets/s %.0f bytes/s, %u responses coalesced\n",
+           queriers, elapsed, rx / elapsed, (s_tx_packets - tx_start) / elapsed, (s_tx_bytes - tx_bytes_start) / elapsed,
+           (unsigned)(atomic_load(&_mdns_server->action_queue->stats.coalesced) - coalesced_start));
+    return 0;
+}
+
+/**
+ * @brief Open the interface 0 socket of the backend on the loopback, IPv4 only
+ */
+static bool host_test_open_loopback(void)
+{
+    host_test_netif_loopback = true;
+    MDNS_SERVICE_LOCK();
+    esp_err_t err = _mdns_pcb_init(0, MDNS_IP_PROTOCOL_V4);
+    MDNS_SERVICE_UNLOCK();
+    if (err != ESP_OK) {
+        printf("cannot open the socket (SO_BINDTODEVICE needs root)\n");
+        return false;
+    }
+    return true;
+}
+
+typedef struct {
+    const corpus_packet_t *packet;
+    double seconds;
+    unsigned rate;                          // packets/s, 0 floods
+    uint64_t sent;
+    uint64_t cpu_ns;
+} rx_sender_t;
+
+/**
+ * @brief Send the packet to the mDNS group from 127.0.0.2:5353 at the given rate
+ */
+static void *rx_sender(void *arg)
+{
+    rx_sender_t *sender = arg;
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    assert(sock >= 0);
+    int on = 1, off = 0;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    // the sender is bound to the mDNS port too, it must not get the group traffic
+    setsockopt(sock, IPPROTO_IP, IP_MULTICAST_ALL, &off, sizeof(off));
+    struct in_addr loopback = { .s_addr = htonl(INADDR_LOOPBACK) };
+    setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &loopback, sizeof(loopback));
+    struct sockaddr_in src = {
+        .sin_family = AF_INET,
+        .sin_port = htons(MDNS_SERVICE_PORT),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1),
+    };
+    if (bind(sock, (struct sockaddr *)&src, sizeof(src)) < 0) {
+        perror("bind");
+        close(sock);
+        return NULL;
+    }
+    struct sockaddr_in group = {
+        .sin_family = AF_INET,
+        .sin_port = htons(MDNS_SERVICE_PORT),
+        .sin_addr.s_addr = inet_addr("224.0.0.251"),
+    };
+
+    struct iovec iov = { .iov_base = (void *)sender->packet->data, .iov_len = sender->packet->len };
+    struct mmsghdr msgs[32];
+    for (size_t i = 0; i < sizeof(msgs) / sizeof(msgs[0]); ++i) {
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_name = &group;
+        msgs[i].msg_hdr.msg_namelen = sizeof(group);
+        msgs[i].msg_hdr.msg_iov = &iov;
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    uint64_t cpu_start = cpu_ns(CLOCK_THREAD_CPUTIME_ID);
+    uint64_t start = now_ns();
+    uint64_t elapsed;
+    while ((elapsed = now_ns() - start) < sender->seconds * 1e9) {
+        size_t burst = sizeof(msgs) / sizeof(msgs[0]);
+        if (sender->rate) {
+            uint64_t due = elapsed * sender->rate / 1000000000ull;
+            if (due <= sender->sent) {
+                usleep(1000);
+                continue;
+            }
+            burst = due - sender->sent < burst ? due - sender->sent : burst;
+        }
+        int n = sendmmsg(sock, msgs, burst, 0);
+        if (n > 0) {
+            sender->sent += n;
+        }
+    }
+    sender->cpu_ns = cpu_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+    close(sock);
+    return NULL;
+}
+
+/**
+ * @brief Receive cheap to parse packets through the socket backend and count the ones posted to the engine
+ *
+ * The interface 0 socket is opened on the loopback (run it as root for SO_BINDTODEVICE) and a sender thread sends
+ * a foreign response to the group. The cpu time of the process minus the sender's, per received packet, is the cost
+ * of the receive path plus the parser; a flood measures the capacity instead.
+ */
+static int run_rx(double seconds, unsigned rate)
+{
+    static corpus_packet_t corpus[20];
+    size_t n = build_corpus(corpus);
+    rx_sender_t sender = { .seconds = seconds, .rate = rate };
+    for (size_t i = 0; i < n; ++i) {
+        if (strcmp(corpus[i].name, "response AAAA (foreign)") == 0) {
+            sender.packet = &corpus[i];
+        }
+    }
+    assert(sender.packet);
+    if (!host_test_open_loopback()) {
+        return 1;
+    }
+
+    mdns_action_stats_t *stats = &_mdns_server->action_queue->stats;
+    mdns_stats_reset();
+    uint32_t posted = atomic_load(&stats->posted);
+    uint32_t dropped = atomic_load(&stats->rx_dropped);
+    pthread_t thread;
+    uint64_t cpu_start = cpu_ns(CLOCK_PROCESS_CPUTIME_ID);
+    uint64_t start = now_ns();
+    pthread_create(&thread, NULL, rx_sender, &sender);
+    pthread_join(thread, NULL);
+    double elapsed = (now_ns() - start) / 1e9;
+    usleep(200000);
+    uint64_t cpu = cpu_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu_start - sender.cpu_ns;
+    posted = atomic_load(&stats->posted) - posted;
+    dropped = atomic_load(&stats->rx_dropped) - dropped;
+
+    printf("%.1f s: sent %.0f packets/s, received %.0f packets/s (%.2f us cpu each), %u dropped by the engine\n",
+           elapsed, sender.sent / elapsed, posted / elapsed, posted ? cpu / 1e3 / posted : 0.0, (unsigned)dropped);
+
+    mdns_stats_t engine;
+    mdns_stats_get(&engine);
+    printf("parse time (us): <16 %u, <32 %u, <64 %u, <128 %u, <256 %u, <512 %u, <1024 %u, more %u\n",
+           engine.parse_time[0], engine.parse_time[1], engine.parse_time[2], engine.parse_time[3],
+           engine.parse_time[4], engine.parse_time[5], engine.parse_time[6], engine.parse_time[7]);
+    printf("service lock held %u times, %.2f us each, %u us at most, %.2f allocations per packet\n",
+           engine.lock_taken, engine.lock_taken ? (double)engine.lock_time_us / engine.lock_taken : 0.0,
+           engine.lock_max_us, posted ? (double)engine.allocs / posted : 0.0);
+    return posted ? 0 : 1;
+}
+
+/**
+ * @brief Send bursts of the packet through the socket backend, each packet on its own then held and flushed
+ *
+ * The bursts go to the discard port of the loopback, nobody receives them. A burst stands for the packets
+ * one batch of actions sends on an interface, e.g. the v4 and v6 answers or the announces due together.
+ */
+static int run_tx(double seconds, int burst)
+{
+    static corpus_packet_t corpus[20];
+    size_t n = build_corpus(corpus);
+    const corpus_packet_t *packet = NULL;
+    for (size_t i = 0; i < n; ++i) {
+        if (strcmp(corpus[i].name, "response PTR/SRV/TXT/A/AAAA (searched)") == 0) {
+            packet = &corpus[i];
+        }
+    }
+    assert(packet);
+    if (burst < 1 || !host_test_open_loopback()) {
+        return 1;
+    }
+    esp_ip_addr_t dst = { .type = ESP_IPADDR_TYPE_V4, .u_addr.ip4.addr = ESP_IP4TOADDR(127, 0, 0, 1) };
+    uint8_t data[MDNS_MAX_PACKET_SIZE];
+    memcpy(data, packet->data, packet->len);
+
+    s_real_tx = true;
+    for (int held = 0; held < 2; held++) {
+        mdns_tx_counters_t before, after;
+        _mdns_udp_pcb_get_counters(0, &before);
+        uint64_t cpu_start = cpu_ns(CLOCK_THREAD_CPUTIME_ID);
+        uint64_t start = now_ns();
+        while (now_ns() - start < seconds / 2 * 1e9) {
+            MDNS_SERVICE_LOCK();
+            if (held) {
+                _mdns_udp_pcb_hold();
+            }
+            for (int i = 0; i < burst; i++) {
+                _mdns_udp_pcb_write(0, MDNS_IP_PROTOCOL_V4, &dst, 9, data, packet->len);
+            }
+            if (held) {
+                _mdns_udp_pcb_flush();
+            }
+            MDNS_SERVICE_UNLOCK();
+        }
+        uint64_t cpu = cpu_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+        _mdns_udp_pcb_get_counters(0, &after);
+        uint32_t packets = after.packets - before.packets;
+        printf("bursts of %d, %-12s %6.2f us cpu per packet, %.2f calls per packet, %u errors\n", burst,
+               held ? "batched:" : "one by one:", packets ? cpu / 1e3 / packets : 0.0,
+               packets ? (double)(after.calls - before.calls) / packets : 0.0, (unsigned)(after.errors - before.errors));
+        if (!packets) {
+            s_real_tx = false;
+            return 1;
+        }
+    }
+    s_real_tx = false;
+    return 0;
+}
+
+static bool startup_announced(void)
+{
+    bool announced = true;
+    MDNS_SERVICE_LOCK();
+    for (int i = 0; i < MDNS_MAX_INTERFACES; ++i) {
+        for (int j = 0; j < MDNS_IP_PROTOCOL_MAX; ++j) {
+            announced = announced && _mdns_server->interfaces[i].pcbs[j].state == PCB_RUNNING;
+        }
+    }
+    MDNS_SERVICE_UNLOCK();
+    return announced;
+}
+
+/**
+ * @brief Time from mdns_init() until all pcbs announced the services added ms apart, with the scheduler running
+ *
+ * All interfaces come up for IPv4 and IPv6 first, then the services are added one by one, each with a subtype.
+ * Runs without host_test_setup(), the sent packets are counted and dropped.
+ */
+static int run_startup(int services, int spacing_ms, int runs)
+{
+    mdns_txt_item_t txt[] = {
+        {"board", "esp32"},
+        {"path", "/"},
+    };
+    uint64_t total_ns = 0;
+    uint32_t total_packets = 0, total_probes = 0;
+    s_startup = true;
+    for (int run = 0; run < runs; ++run) {
+        memset(s_startup_ready, 0, sizeof(s_startup_ready));
+        s_tx_packets = 0;
+        s_tx_probes = 0;
+        uint64_t start = now_ns();
+        ESP_ERROR_CHECK(mdns_init());
+        ESP_ERROR_CHECK(mdns_hostname_set("startup"));
+        ESP_ERROR_CHECK(mdns_instance_name_set("Startup test"));
+        for (int i = 0; i < MDNS_MAX_INTERFACES; ++i) {
+            ESP_ERROR_CHECK(mdns_post_custom_action_tcpip_if(i, MDNS_EVENT_ENABLE_IP4 | MDNS_EVENT_ENABLE_IP6));
+        }
+        for (int i = 0; i < services; ++i) {
+            char type[16];
+            snprintf(type, sizeof(type), "_svc%d", i);
+            ESP_ERROR_CHECK(mdns_service_add(NULL, type, "_tcp", 1000 + i, txt, sizeof(txt) / sizeof(txt[0])));
+            ESP_ERROR_CHECK(mdns_service_subtype_add_for_host(NULL, type, "_tcp", NULL, "_sub"));
+            usleep(spacing_ms * 1000);
+        }
+        wait_actions();
+        while (!startup_announced()) {
+            usleep(1000);
+        }
+        total_ns += now_ns() - start;
+        total_packets += s_tx_packets;
+        total_probes += s_tx_probes;
+        mdns_free();
+    }
+    s_startup = false;
+    printf("%d services %d ms apart, mean of %d: announced after %.0f ms, %.1f packets (%.1f probes)\n", services,
+           spacing_ms, runs, total_ns / 1e6 / runs, (double)total_packets / runs, (double)total_probes / runs);
+    return 0;
+}
+
+static int write_corpus(const char *dir)
+{
+    static corpus_packet_t corpus[20];
+    size_t n = build_corpus(corpus);
+    for (size_t i = 0; i < n; ++i) {
+        char path[256];
+        snprintf(path, sizeof(path), "%s/packet_%02zu.bin", dir, i);
+        FILE *f = fopen(path, "wb");
+        if (!f || fwrite(corpus[i].data, 1, corpus[i].len, f) != corpus[i].len) {
+            fprintf(stderr, "Cannot write %s\n", path);
+            return 1;
+        }
+        fclose(f);
+    }
+    printf("%zu packets written to %s\n", n, dir);
+    return 0;
+}
+
+static int replay(int count, char **files)
+{
+    static uint8_t buf[HOST_TEST_MAX_PACKET];
+    for (int i = 0; i < count; ++i) {
+        FILE *f = fopen(files[i], "rb");
+        if (!f) {
+            fprintf(stderr, "Cannot open %s\n", files[i]);
+            return 1;
+        }
+        size_t len = fread(buf, 1, sizeof(buf), f);
+        fclose(f);
+        if (i % MDNS_ACTION_BATCH_MAX == 0) {
+            host_test_batch_begin();
+        }
+        host_test_receive(buf, len, MDNS_SERVICE_PORT);
+        if (i % MDNS_ACTION_BATCH_MAX == MDNS_ACTION_BATCH_MAX - 1 || i + 1 == count) {
+            host_test_batch_end(false);
+        }
+    }
+    printf("%d packets replayed in batches of %d, %u responses coalesced\n", count, MDNS_ACTION_BATCH_MAX,
+           (unsigned)atomic_load(&_mdns_server->action_queue->stats.coalesced));
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *mode = argc > 1 ? argv[1] : "bench";
+    if (strcmp(mode, "corpus") == 0) {
+        return argc > 2 ? write_corpus(argv[2]) : 1;
+    }
+    if (strcmp(mode, "startup") == 0) {
+        return run_startup(argc > 2 ? atoi(argv[2]) : 8, argc > 3 ? atoi(argv[3]) : 0, argc > 4 ? atoi(argv[4]) : 3);
+    }
+
+    int ret = -1;
+    host_test_setup();
+    if (strcmp(mode, "bench") == 0) {
+        if (argc > 3) {
+            host_test_add_services(atoi(argv[3]));
+            host_test_check_services();
+        }
+        ret = run_bench(argc > 2 ? atof(argv[2]) : 5.0);
+    } else if (strcmp(mode, "searches") == 0) {
+        host_test_add_searches(argc > 3 ? atoi(argv[3]) : 60);
+        ret = run_bench(argc > 2 ? atof(argv[2]) : 5.0);
+    } else if (strcmp(mode, "browse") == 0) {
+        ret = run_browse(argc > 2 ? atof(argv[2]) : 5.0, argc > 3 ? atoi(argv[3]) : 200);
+    } else if (strcmp(mode, "mutate") == 0) {
+        ret = run_mutate(argc > 2 ? strtoul(argv[2], NULL, 0) : 100000);
+    } else if (strcmp(mode, "replay") == 0) {
+        ret = replay(argc - 2, argv + 2);
+    } else if (strcmp(mode, "busy") == 0) {
+        ret = run_busy(argc > 2 ? atof(argv[2]) : 5.0, argc > 3 ? atoi(argv[3]) : 30);
+    } else if (strcmp(mode, "rx") == 0) {
+        ret = run_rx(argc > 2 ? atof(argv[2]) : 5.0, argc > 3 ? atoi(argv[3]) : 0);
+    } else if (strcmp(mode, "tx") == 0) {
+        ret = run_tx(argc > 2 ? atof(argv[2]) : 4.0, argc > 3 ? atoi(argv[3]) : 4);
+    } else if (strcmp(mode, "workers") == 0) {
+        ret = run_workers(argc > 2 ? atof(argv[2]) : 5.0);
+    }
+    host_test_teardown();
+    if (ret >= 0) {
+        return ret;
+    }
+    fprintf(stderr, "Usage: %s bench [seconds] [services] | mutate [iterations] | searches [seconds] [searches] | browse [seconds] [instances] | corpus <dir> | replay <files...> | "
+            "busy [seconds] [queriers] | rx [seconds] [rate] | tx [seconds] [burst] | workers [seconds] | startup [services] [ms] [runs]\n", argv[0]);
+    return 1;
+}
+
+#endif // MDNS_HOST_FUZZER
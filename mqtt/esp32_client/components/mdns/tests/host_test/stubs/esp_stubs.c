@@ -0,0 +1,260 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "esp_err.h"
+#include "esp_event.h"
+#include "esp_log.h"
+#include "esp_netif.h"
+#include "esp_random.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+
+esp_log_level_t host_test_log_level = ESP_LOG_ERROR;
+
+esp_event_base_t const IP_EVENT = "IP_EVENT";
+
+// The only interface, 192.168.0.10 / fe80::10
+struct esp_netif_obj {
+    const char *if_key;
+};
+
+static esp_netif_t s_host_netif = { .if_key = "HOST_DEF" };
+
+// The interface gets the loopback address when the harness opens real sockets ("lo" is their device)
+bool host_test_netif_loopback = false;
+
+const char *esp_err_to_name(esp_err_t code)
+{
+    return code == ESP_OK ? "ESP_OK" : "ERROR";
+}
+
+uint32_t esp_get_free_heap_size(void)
+{
+    return 0;
+}
+
+uint32_t esp_random(void)
+{
+    return (uint32_t)rand();
+}
+
+esp_err_t esp_event_handler_register(esp_event_base_t base, int32_t id, esp_event_handler_t handler, void *arg)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_event_handler_unregister(esp_event_base_t base, int32_t id, esp_event_handler_t handler)
+{
+    return ESP_OK;
+}
+
+esp_netif_t *esp_netif_get_handle_from_ifkey(const char *if_key)
+{
+    return if_key && strcmp(if_key, s_host_netif.if_key) == 0 ? &s_host_netif : NULL;
+}
+
+esp_err_t esp_netif_get_ip_info(esp_netif_t *esp_netif, esp_netif_ip_info_t *ip_info)
+{
+    if (esp_netif != &s_host_netif) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(ip_info, 0, sizeof(esp_netif_ip_info_t));
+    if (host_test_netif_loopback) {
+        ip_info->ip.addr = ESP_IP4TOADDR(127, 0, 0, 1);
+        ip_info->netmask.addr = ESP_IP4TOADDR(255, 0, 0, 0);
+        return ESP_OK;
+    }
+    ip_info->ip.addr = ESP_IP4TOADDR(192, 168, 0, 10);
+    ip_info->netmask.addr = ESP_IP4TOADDR(255, 255, 255, 0);
+    ip_info->gw.addr = ESP_IP4TOADDR(192, 168, 0, 1);
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_get_ip6_linklocal(esp_netif_t *esp_netif, esp_ip6_addr_t *if_ip6)
+{
+    if (esp_netif != &s_host_netif) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(if_ip6, 0, sizeof(esp_ip6_addr_t));
+    if_ip6->addr[0] = htonl(0xfe800000);
+    if_ip6->addr[3] = htonl(0x10);
+    return ESP_OK;
+}
+
+int esp_netif_get_all_ip6(esp_netif_t *esp_netif, esp_ip6_addr_t if_ip6[])
+{
+    return esp_netif_get_ip6_linklocal(esp_netif, &if_ip6[0]) == ESP_OK ? 1 : 0;
+}
+
+esp_err_t esp_netif_dhcpc_get_status(esp_netif_t *esp_netif, esp_netif_dhcp_status_t *status)
+{
+    *status = ESP_NETIF_DHCP_STOPPED;
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_get_netif_impl_name(esp_netif_t *esp_netif, char *name)
+{
+    strcpy(name, "lo");
+    return ESP_OK;
+}
+
+int esp_netif_get_netif_impl_index(esp_netif_t *esp_netif)
+{
+    return 1;
+}
+
+const char *esp_netif_get_desc(esp_netif_t *esp_netif)
+{
+    return "lo";
+}
+
+struct esp_timer {
+    esp_timer_cb_t callback;
+    void *arg;
+    uint64_t period_us;
+    bool periodic;
+    uint64_t generation;
+    bool armed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t thread;
+    bool exit;
+};
+
+// Timers are disabled when the harness drives the engine synchronously
+bool host_test_timers_enabled = true;
+
+int64_t esp_timer_get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void *timer_thread(void *arg)
+{
+    struct esp_timer *timer = arg;
+    pthread_mutex_lock(&timer->lock);
+    while (!timer->exit) {
+        if (!timer->armed) {
+            pthread_cond_wait(&timer->changed, &timer->lock);
+            continue;
+        }
+        uint64_t generation = timer->generation;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        uint64_t ns = (uint64_t)ts.tv_nsec + timer->period_us * 1000;
+        ts.tv_sec += ns / 1000000000;
+        ts.tv_nsec = ns % 1000000000;
+        if (pthread_cond_timedwait(&timer->changed, &timer->lock, &ts) == 0 || generation != timer->generation
+                || !timer->armed || timer->exit) {
+            continue; // re-armed, stopped or deleted meanwhile
+        }
+        timer->armed = timer->periodic;
+        pthread_mutex_unlock(&timer->lock);
+        timer->callback(timer->arg);
+        pthread_mutex_lock(&timer->lock);
+    }
+    pthread_mutex_unlock(&timer->lock);
+    return NULL;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *out_handle)
+{
+    struct esp_timer *timer = calloc(1, sizeof(struct esp_timer));
+    if (!timer) {
+        return ESP_ERR_NO_MEM;
+    }
+    timer->callback = args->callback;
+    timer->arg = args->arg;
+    pthread_mutex_init(&timer->lock, NULL);
+    pthread_cond_init(&timer->changed, NULL);
+    if (pthread_create(&timer->thread, NULL, timer_thread, timer)) {
+        free(timer);
+        return ESP_FAIL;
+    }
+    *out_handle = timer;
+    return ESP_OK;
+}
+
+static esp_err_t timer_arm(esp_timer_handle_t timer, uint64_t period_us, bool periodic)
+{
+    if (!host_test_timers_enabled) {
+        return ESP_OK;
+    }
+    pthread_mutex_lock(&timer->lock);
+    if (timer->armed) {
+        pthread_mutex_unlock(&timer->lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->period_us = period_us;
+    timer->periodic = periodic;
+    timer->armed = true;
+    timer->generation++;
+    pthread_cond_broadcast(&timer->changed);
+    pthread_mutex_unlock(&timer->lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    return timer_arm(timer, timeout_us, false);
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period)
+{
+    return timer_arm(timer, period, true);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    pthread_mutex_lock(&timer->lock);
+    if (!timer->armed) {
+        pthread_mutex_unlock(&timer->lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->armed = false;
+    timer->generation++;
+    pthread_cond_broadcast(&timer->changed);
+    pthread_mutex_unlock(&timer->lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+{
+    pthread_mutex_lock(&timer->lock);
+    timer->exit = true;
+    pthread_cond_broadcast(&timer->changed);
+    pthread_mutex_unlock(&timer->lock);
+    if (!pthread_equal(pthread_self(), timer->thread)) {
+        pthread_join(timer->thread, NULL);
+    }
+    free(timer);
+    return ESP_OK;
+}
+
+// glibc before 2.38 lacks them, the linux target links libbsd instead
+__attribute__((weak)) size_t strlcpy(char *dst, const char *src, size_t size)
+{
+    size_t len = strlen(src);
+    if (size) {
+        size_t n = len < size - 1 ? len : size - 1;
+        memcpy(dst, src, n);
+        dst[n] = '\0';
+    }
+    return len;
+}
+
+__attribute__((weak)) size_t strlcat(char *dst, const char *src, size_t size)
+{
+    size_t len = strnlen(dst, size);
+    if (len == size) {
+        return len + strlen(src);
+    }
+    return len + strlcpy(dst + len, src, size - len);
+}
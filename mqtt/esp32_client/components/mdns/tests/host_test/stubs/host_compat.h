@@ -0,0 +1,16 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#pragma once
+
+// Forced include: declarations the engine gets transitively from the IDF headers or newlib
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // included ahead of the sources, which define it for recvmmsg() themselves
+#endif
+#include <assert.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+
+size_t strlcat(char *dst, const char *src, size_t size);
+size_t strlcpy(char *dst, const char *src, size_t size);
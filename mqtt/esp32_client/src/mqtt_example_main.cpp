@@ -6,8 +6,12 @@
    software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
    CONDITIONS OF ANY KIND, either express or implied.
 */
+#include <atomic>
+#include <mutex>
 #include <stdio.h>
+#include <string.h>
 #include <string>
+#include <string_view>
 
 // BEWARE: This influences all component headers
 #include "sdkconfig.h"
@@ -25,22 +29,48 @@
 
 #include "nvs_flash.h"
 
-#include "lwip/netdb.h"
-
 // External dependency
 #include "mdns.h"
 
+#include "broker_cache.h"
 #include "ethernet_init.h"
+#include "host_resolver.h"
 #include "mqtt_client.h"
+#include "topic_router.h"
 
 static const char *ETH_TAG = "eth_log";
 static const char *MDNS_TAG = "mDNS_log";
 static const char *TAG = "MQTT_EXAMPLE";
 
+static const char *subscriber_topic = "esp32/subscribe";
+static const char *publisher_topic = "esp32/publish";
+
 // MQTT client handle
 static esp_mqtt_client_handle_t mqtt_client = nullptr;
 static bool mqtt_connected = false;
 
+// Broker address the client is configured with, may be a cached one pending revalidation
+static constexpr size_t broker_address_len = 64;
+static char broker_address[broker_address_len] = "";
+static std::mutex broker_lock;
+static std::atomic<bool> broker_resolving{false};
+static constexpr uint32_t broker_resolve_timeout_ms = 2000;
+// Address the client connected to, stored in NVS by the main task
+static char broker_connected_address[broker_address_len] = "";
+static std::atomic<bool> broker_connected_pending{false};
+// Resolution outcome, handed from the resolver task to the main task
+static host_resolver_cb_t broker_resolved_cb = nullptr;
+static bool broker_resolved_found = false;
+static esp_ip_addr_t broker_resolved_addr{};
+static std::atomic<bool> broker_resolved_pending{false};
+
+// Runs the broker work posted by other tasks
+static TaskHandle_t main_task = nullptr;
+
+// Incoming topics dispatch table
+static topic_router mqtt_router;
+static topic_reassembler mqtt_fragments;
+
 static void log_error_if_nonzero(const char *message, int error_code)
 {
     if (error_code != 0) {
@@ -48,6 +78,21 @@ static void log_error_if_nonzero(const char *message, int error_code)
     }
 }
 
+// Show the received text data
+static void on_text_data(std::string_view topic, const uint8_t* data, size_t len)
+{
+    printf("DATA=%.*s\r\n", (int)len, (const char*)data);
+}
+
+// Populate the dispatch table with the handled topics
+static void setup_mqtt_routes()
+{
+    if (!mqtt_router.add(subscriber_topic, on_text_data))
+    {
+        ESP_LOGE(TAG, "Invalid topic filter %s", subscriber_topic);
+    }
+}
+
 /*
  * @brief Event handler registered to receive MQTT events
  *
@@ -71,11 +116,22 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 
         if (!msg_id)
         {
-            msg_id = esp_mqtt_client_subscribe(mqtt_client, "esp32/subscribe", 0);
-            ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
+            for (const auto& filter : mqtt_router.filters())
+            {
+                msg_id = esp_mqtt_client_subscribe(mqtt_client, filter.c_str(), 0);
+                ESP_LOGI(TAG, "sent subscribe %s successful, msg_id=%d", filter.c_str(), msg_id);
+            }
         }
 
         mqtt_connected = true;
+
+        {
+            // remember the last-good address for the next boot, flash writes are left to the main task
+            std::lock_guard<std::mutex> lock(broker_lock);
+            memcpy(broker_connected_address, broker_address, sizeof(broker_address));
+        }
+        broker_connected_pending = true;
+        xTaskNotifyGive(main_task);
         break;
 
     case MQTT_EVENT_DISCONNECTED:
@@ -110,8 +166,19 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 
     case MQTT_EVENT_DATA:
         ESP_LOGI(TAG, "MQTT_EVENT_DATA");
-        printf("TOPIC=%.*s\r\n", event->topic_len, event->topic);
-        printf("DATA=%.*s\r\n", event->data_len, event->data);
+
+        // Large messages arrive in several events, only the first one carries the topic
+        if (mqtt_fragments.feed({event->topic, (size_t)event->topic_len}, (const uint8_t*)event->data,
+                                event->data_len, event->current_data_offset, event->total_data_len))
+        {
+            std::string_view topic = mqtt_fragments.topic();
+            printf("TOPIC=%.*s\r\n", (int)topic.size(), topic.data());
+
+            if (!mqtt_router.dispatch(topic, mqtt_fragments.data(), mqtt_fragments.size()))
+            {
+                ESP_LOGI(TAG, "Unknown topic detected is %.*s", (int)topic.size(), topic.data());
+            }
+        }
         break;
 
     default:
@@ -134,50 +201,217 @@ void start_mdns_service()
     mdns_hostname_set("esp32-mqtt-test");
 }
 
-const char* resolveHostAndLog(const char* host_name);
-const char* resolve_mdns_host(const char * host_name);
-
-static void mqtt_app_start(void)
+// Point the client at a new address, starting it the first time
+static void connect_broker(const char* address)
 {
-    const char* address = nullptr;
-
-    // try actual network framework
-    address = resolveHostAndLog(CONFIG_BROKER_HOSTNAME);
-    if ( nullptr == address )
+    bool changed;
     {
-        // Because internal mDNS is broken and cannot listen multicast fallback to the external one
-        address = resolve_mdns_host(CONFIG_BROKER_HOSTNAME);
-
-        if ( nullptr == address )
-            address = CONFIG_BROKER_HOSTNAME; // fallback to mqtt
+        // not held across client calls, the MQTT task takes it while dispatching events
+        std::lock_guard<std::mutex> lock(broker_lock);
+        changed = strcmp(broker_address, address) != 0;
+        snprintf(broker_address, sizeof(broker_address), "%s", address);
     }
 
+    esp_mqtt_client_config_t mqtt_cfg = {
+        .broker {
+            .address {
+                .hostname = address,
+                .transport = MQTT_TRANSPORT_OVER_TCP,
+                .port = CONFIG_BROKER_PORT
+            },
+        },
+    };
+
     if ( nullptr == mqtt_client)
     {
-        esp_mqtt_client_config_t mqtt_cfg = {
-            .broker {
-                .address {
-                    .hostname = address,
-                    .transport = MQTT_TRANSPORT_OVER_TCP,
-                    .port = CONFIG_BROKER_PORT
-                },
-            },
-        };
         mqtt_client = esp_mqtt_client_init(&mqtt_cfg);
 
         /* The last argument may be used to pass data to the event handler, in this example mqtt_event_handler */
         esp_mqtt_client_register_event(mqtt_client, MQTT_EVENT_ANY, mqtt_event_handler, NULL);
 
-        ESP_LOGI(TAG, "Start MQTT client loop");
+        ESP_LOGI(TAG, "Start MQTT client loop on %s", address);
         esp_mqtt_client_start(mqtt_client);
     }
     else
     {
-        ESP_LOGI(TAG, "Reconnect MQTT client loop");
+        if (changed)
+        {
+            esp_mqtt_set_config(mqtt_client, &mqtt_cfg);
+        }
+
+        ESP_LOGI(TAG, "Reconnect MQTT client loop on %s", address);
         esp_mqtt_client_reconnect(mqtt_client);
     }
 }
 
+// Format a resolved address as the client broker hostname
+static void format_address(const esp_ip_addr_t* addr, char* address, size_t len)
+{
+    if (ESP_IPADDR_TYPE_V6 == addr->type)
+    {
+        snprintf(address, len, IPV6STR, IPV62STR(addr->u_addr.ip6));
+    }
+    else
+    {
+        snprintf(address, len, IPSTR, IP2STR(&addr->u_addr.ip4));
+    }
+}
+
+// First resolution, connects to whatever the fastest resolver found
+static void on_broker_resolved(const char* hostname, const esp_ip_addr_t* addr, void*)
+{
+    char address[broker_address_len];
+    if (addr)
+    {
+        format_address(addr, address, sizeof(address));
+        ESP_LOGI(TAG, "Broker %s resolved to %s", hostname, address);
+    }
+    else
+    {
+        ESP_LOGI(TAG, "Cannot resolve broker %s", CONFIG_BROKER_HOSTNAME);
+        snprintf(address, sizeof(address), "%s", CONFIG_BROKER_HOSTNAME); // fallback to mqtt
+    }
+
+    broker_resolving = false;
+    connect_broker(address);
+}
+
+// Resolution after connecting with a cached address, only acts if the broker moved
+static void on_broker_revalidated(const char* hostname, const esp_ip_addr_t* addr, void*)
+{
+    broker_resolving = false;
+
+    if (!addr)
+    {
+        ESP_LOGI(TAG, "Cannot revalidate broker address, keeping the cached one");
+        return;
+    }
+
+    char address[broker_address_len];
+    format_address(addr, address, sizeof(address));
+
+    bool changed;
+    {
+        std::lock_guard<std::mutex> lock(broker_lock);
+        changed = strcmp(broker_address, address) != 0;
+    }
+
+    if (changed)
+    {
+        ESP_LOGI(TAG, "Broker %s moved to %s", hostname, address);
+        connect_broker(address);
+    }
+}
+
+// Resolver callback, runs on a resolver task with a small stack: the main task connects
+static void post_broker_resolution(const char*, const esp_ip_addr_t* addr, void*)
+{
+    {
+        std::lock_guard<std::mutex> lock(broker_lock);
+        broker_resolved_found = addr != nullptr;
+        if (addr)
+        {
+            broker_resolved_addr = *addr;
+        }
+    }
+    broker_resolved_pending = true;
+    xTaskNotifyGive(main_task);
+}
+
+// Race DNS against mDNS for the broker hostname, the callback runs on the main task
+static void resolve_broker(host_resolver_cb_t cb)
+{
+    static const char* const candidates[] = { CONFIG_BROKER_HOSTNAME };
+
+    if (broker_resolving.exchange(true))
+    {
+        return; // a lookup is already running and will connect
+    }
+
+    broker_resolved_cb = cb;
+    esp_err_t err = host_resolver_start(candidates, sizeof(candidates) / sizeof(*candidates),
+                                        broker_resolve_timeout_ms, post_broker_resolution, nullptr);
+    if (ESP_OK != err)
+    {
+        ESP_LOGI(TAG, "Cannot start broker resolution: %s", esp_err_to_name(err));
+        post_broker_resolution(nullptr, nullptr, nullptr);
+    }
+}
+
+// Hand the resolution outcome, if any, to the callback the lookup was started with
+static void run_broker_resolution()
+{
+    if (!broker_resolved_pending.exchange(false))
+    {
+        return;
+    }
+
+    bool found;
+    esp_ip_addr_t addr;
+    {
+        std::lock_guard<std::mutex> lock(broker_lock);
+        found = broker_resolved_found;
+        addr = broker_resolved_addr;
+    }
+
+    broker_resolved_cb(CONFIG_BROKER_HOSTNAME, found ? &addr : nullptr, nullptr);
+}
+
+// Store the address the client connected to, if any, out of the MQTT task and the broker lock
+static void cache_broker_address()
+{
+    if (!broker_connected_pending.exchange(false))
+    {
+        return;
+    }
+
+    char address[broker_address_len];
+    {
+        std::lock_guard<std::mutex> lock(broker_lock);
+        memcpy(address, broker_connected_address, sizeof(address));
+    }
+
+    if (address[0] && strcmp(address, CONFIG_BROKER_HOSTNAME))
+    {
+        broker_cache_set(CONFIG_BROKER_HOSTNAME, address);
+    }
+}
+
+// Sleep for the given time running the broker work other tasks post meanwhile
+static void main_task_wait(TickType_t delay)
+{
+    TickType_t start = xTaskGetTickCount();
+    TickType_t elapsed = 0;
+    do
+    {
+        // like vTaskDelay(0) a zero delay still yields
+        if (!ulTaskNotifyTake(pdTRUE, delay - elapsed) && !delay)
+        {
+            taskYIELD();
+        }
+        run_broker_resolution();
+        cache_broker_address();
+    }
+    while ((elapsed = xTaskGetTickCount() - start) < delay);
+}
+
+static void mqtt_app_start(void)
+{
+    char address[broker_address_len];
+
+    // a last-good address lets us connect without waiting for the resolvers
+    if (ESP_OK == broker_cache_get(CONFIG_BROKER_HOSTNAME, address, sizeof(address)))
+    {
+        ESP_LOGI(TAG, "Using cached address %s for %s", address, CONFIG_BROKER_HOSTNAME);
+        connect_broker(address);
+        resolve_broker(on_broker_revalidated);
+    }
+    else
+    {
+        resolve_broker(on_broker_resolved);
+    }
+}
+
 void eth_check_and_set_dns(const char* new_dns)
 {
     // count the interfaces
@@ -225,74 +459,6 @@ void eth_check_and_set_dns(const char* new_dns)
     }
 }
 
-const char* resolve_mdns_host(const char * host_name)
-{
-    ESP_LOGI(MDNS_TAG, "Query A: %s.local", host_name);
-
-    esp_ip4_addr_t addr{};
-
-    esp_err_t err = mdns_query_a(host_name, 2000,  &addr);
-    if(err){
-        if(err == ESP_ERR_NOT_FOUND){
-            ESP_LOGI(MDNS_TAG, "Host was not found!");
-            return nullptr;
-        }
-        ESP_LOGI(MDNS_TAG,"Query Failed");
-        return nullptr;
-    }
-
-    ESP_LOGI(MDNS_TAG,"Hostname: %s resolved via mDNS to " IPSTR, host_name, IP2STR(&addr));
-    return inet_ntoa(addr);
-}
-
-const char* resolveHostAndLog(const char* host_name)
-{
-    hostent* remoteHost;
-    ESP_LOGI(TAG, "Calling gethostbyname with %s", host_name);
-    remoteHost = lwip_gethostbyname(host_name);
-
-    if (nullptr == remoteHost) {
-        ESP_LOGI(TAG, "gethostbyname call failed");
-        return nullptr;
-    }
-
-    ESP_LOGI(TAG, "Function returned:");
-    ESP_LOGI(TAG, "\tOfficial name: %s", remoteHost->h_name);
-
-    int i = 0;
-    for (auto pAlias = remoteHost->h_aliases; *pAlias != 0; pAlias++) {
-        ESP_LOGI(TAG,"\tAlternate name #%d: %s", ++i, *pAlias);
-    }
-    ESP_LOGI(TAG,"\tAddress type: ");
-    switch (remoteHost->h_addrtype) {
-    case AF_INET:
-        ESP_LOGI(TAG,"AF_INET");
-        break;
-    default:
-        ESP_LOGI(TAG," %d", remoteHost->h_addrtype);
-        break;
-    }
-    ESP_LOGI(TAG,"\tAddress length: %d", remoteHost->h_length);
-
-    i = 0;
-    const char* address = nullptr;
-    if (remoteHost->h_addrtype == AF_INET)
-    {
-        while (remoteHost->h_addr_list[i] != 0) {
-            ip4_addr_t ip{};
-            ip.addr = *(u_long *) remoteHost->h_addr_list[i++];
-            const char* itaddress = inet_ntoa(ip);
-            ESP_LOGI(TAG,"\tIP Address #%d: %s", i, itaddress);
-            if (nullptr == address && nullptr != itaddress)
-            {   // keep the first valid one
-                address = itaddress;
-            }
-        }
-    }
-
-    return address;
-}
-
 /** Event handler for Ethernet events */
 static void eth_event_handler(void *arg, esp_event_base_t event_base,
                               int32_t event_id, void *event_data)
@@ -357,17 +523,6 @@ static void got_ip_event_handler(void *arg, esp_event_base_t event_base,
     // Initialize mDNS
     start_mdns_service();
 
-/*
-    // Testing resolution
-    resolve_mdns_host("DESKTOP-Barro");
-
-    // .local is case sensitive
-    resolveHostAndLog("DESKTOP-Barro.local");
-
-    resolveHostAndLog("localhost");
-    resolveHostAndLog("google.com");
-*/
-
     // Start MQTT client loop
     mqtt_app_start();
 }
@@ -446,6 +601,12 @@ extern "C" void app_main(void)
     ESP_ERROR_CHECK(esp_netif_init());
     ESP_ERROR_CHECK(esp_event_loop_create_default());
 
+    // Resolutions started from the event handlers connect from here
+    main_task = xTaskGetCurrentTaskHandle();
+
+    // Routes must be ready before the client connects
+    setup_mqtt_routes();
+
     // Start Ethernet driver state machine
     ethernet_app_start();
 
@@ -453,11 +614,11 @@ extern "C" void app_main(void)
     int counter = 0;
     while(true)
     {
-        vTaskDelay(1000 / portTICK_PERIOD_MS);
+        main_task_wait(pdMS_TO_TICKS(1000));
         if (mqtt_client && mqtt_connected)
         {
             ESP_LOGI(TAG, "publishing data");
-            esp_mqtt_client_publish(mqtt_client, "esp32/publish", std::to_string(counter).c_str(), 0, 1, 0);
+            esp_mqtt_client_publish(mqtt_client, publisher_topic, std::to_string(counter).c_str(), 0, 1, 0);
         }
         else if(mqtt_client)
         {
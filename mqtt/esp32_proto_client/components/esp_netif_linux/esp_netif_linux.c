@@ -0,0 +1,218 @@
+/*
+ * Minimal esp_netif implementation over the host network interfaces
+ *
+ * It allows running the mDNS socket backend and the examples on the linux target. Each esp_netif object maps a host
+ * interface whose name is given by the esp_netif description (if_desc), addresses are queried to the OS on demand.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "esp_netif.h"
+#include "esp_log.h"
+
+#define MAX_HOST_NETIFS 4
+
+#ifdef CONFIG_LWIP_IPV6_NUM_ADDRESSES
+#define MAX_IP6_ADDRESSES CONFIG_LWIP_IPV6_NUM_ADDRESSES
+#else
+#define MAX_IP6_ADDRESSES 3
+#endif
+
+struct esp_netif_obj {
+    char *if_key;
+    char *if_desc;
+};
+
+static const char *TAG = "esp_netif_linux";
+static esp_netif_t *s_netifs[MAX_HOST_NETIFS];
+
+esp_err_t esp_netif_init(void)
+{
+    return ESP_OK;
+}
+
+esp_netif_t *esp_netif_new(const esp_netif_config_t *config)
+{
+    if (config == NULL || config->base == NULL || config->base->if_key == NULL || config->base->if_desc == NULL) {
+        return NULL;
+    }
+
+    for (int i = 0; i < MAX_HOST_NETIFS; ++i) {
+        if (s_netifs[i] == NULL) {
+            esp_netif_t *netif = calloc(1, sizeof(esp_netif_t));
+            if (netif == NULL) {
+                return NULL;
+            }
+            netif->if_key = strdup(config->base->if_key);
+            netif->if_desc = strdup(config->base->if_desc);
+            if (netif->if_key == NULL || netif->if_desc == NULL) {
+                free(netif->if_key);
+                free(netif->if_desc);
+                free(netif);
+                return NULL;
+            }
+            ESP_LOGI(TAG, "Host interface %s registered as %s", netif->if_desc, netif->if_key);
+            s_netifs[i] = netif;
+            return netif;
+        }
+    }
+
+    ESP_LOGE(TAG, "No room for more than %d host interfaces", MAX_HOST_NETIFS);
+    return NULL;
+}
+
+void esp_netif_destroy(esp_netif_t *esp_netif)
+{
+    for (int i = 0; i < MAX_HOST_NETIFS; ++i) {
+        if (s_netifs[i] == esp_netif) {
+            s_netifs[i] = NULL;
+        }
+    }
+
+    if (esp_netif) {
+        free(esp_netif->if_key);
+        free(esp_netif->if_desc);
+        free(esp_netif);
+    }
+}
+
+esp_netif_t *esp_netif_get_handle_from_ifkey(const char *if_key)
+{
+    for (int i = 0; i < MAX_HOST_NETIFS; ++i) {
+        if (s_netifs[i] && strcmp(s_netifs[i]->if_key, if_key) == 0) {
+            return s_netifs[i];
+        }
+    }
+    return NULL;
+}
+
+esp_netif_t *esp_netif_next(esp_netif_t *esp_netif)
+{
+    int i = 0;
+    if (esp_netif) {
+        while (i < MAX_HOST_NETIFS && s_netifs[i] != esp_netif) {
+            ++i;
+        }
+        ++i;
+    }
+    while (i < MAX_HOST_NETIFS && s_netifs[i] == NULL) {
+        ++i;
+    }
+    return i < MAX_HOST_NETIFS ? s_netifs[i] : NULL;
+}
+
+size_t esp_netif_get_nr_of_ifs(void)
+{
+    size_t count = 0;
+    for (int i = 0; i < MAX_HOST_NETIFS; ++i) {
+        count += s_netifs[i] != NULL;
+    }
+    return count;
+}
+
+const char *esp_netif_get_desc(esp_netif_t *esp_netif)
+{
+    return esp_netif ? esp_netif->if_desc : NULL;
+}
+
+const char *esp_netif_get_ifkey(esp_netif_t *esp_netif)
+{
+    return esp_netif ? esp_netif->if_key : NULL;
+}
+
+esp_err_t esp_netif_get_netif_impl_name(esp_netif_t *esp_netif, char *name)
+{
+    if (esp_netif == NULL || name == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    strncpy(name, esp_netif->if_desc, IFNAMSIZ - 1);
+    name[IFNAMSIZ - 1] = '\0';
+    return ESP_OK;
+}
+
+int esp_netif_get_netif_impl_index(esp_netif_t *esp_netif)
+{
+    return esp_netif ? (int)if_nametoindex(esp_netif->if_desc) : -1;
+}
+
+esp_err_t esp_netif_get_ip_info(esp_netif_t *esp_netif, esp_netif_ip_info_t *ip_info)
+{
+    if (esp_netif == NULL || ip_info == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    struct ifaddrs *addrs;
+    if (getifaddrs(&addrs) != 0) {
+        return ESP_FAIL;
+    }
+
+    esp_err_t ret = ESP_FAIL;
+    memset(ip_info, 0, sizeof(esp_netif_ip_info_t));
+    for (struct ifaddrs *it = addrs; it; it = it->ifa_next) {
+        if (it->ifa_addr && it->ifa_addr->sa_family == AF_INET && strcmp(it->ifa_name, esp_netif->if_desc) == 0) {
+            ip_info->ip.addr = ((struct sockaddr_in *)it->ifa_addr)->sin_addr.s_addr;
+            if (it->ifa_netmask) {
+                ip_info->netmask.addr = ((struct sockaddr_in *)it->ifa_netmask)->sin_addr.s_addr;
+            }
+            ret = ESP_OK;
+            break;
+        }
+    }
+
+    freeifaddrs(addrs);
+    return ret;
+}
+
+/*
+ * @brief Copy the interface IPv6 addresses, link local only if requested
+ *
+ * @return number of addresses copied
+ */
+static int get_ip6_addresses(esp_netif_t *esp_netif, esp_ip6_addr_t *if_ip6, int max, bool link_local)
+{
+    struct ifaddrs *addrs;
+    if (esp_netif == NULL || if_ip6 == NULL || getifaddrs(&addrs) != 0) {
+        return 0;
+    }
+
+    int count = 0;
+    for (struct ifaddrs *it = addrs; it && count < max; it = it->ifa_next) {
+        if (it->ifa_addr && it->ifa_addr->sa_family == AF_INET6 && strcmp(it->ifa_name, esp_netif->if_desc) == 0) {
+            struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)it->ifa_addr;
+            if (link_local && !IN6_IS_ADDR_LINKLOCAL(&in6->sin6_addr)) {
+                continue;
+            }
+            memset(&if_ip6[count], 0, sizeof(esp_ip6_addr_t));
+            memcpy(if_ip6[count].addr, &in6->sin6_addr, sizeof(if_ip6[count].addr));
+            if_ip6[count].zone = in6->sin6_scope_id;
+            ++count;
+        }
+    }
+
+    freeifaddrs(addrs);
+    return count;
+}
+
+esp_err_t esp_netif_get_ip6_linklocal(esp_netif_t *esp_netif, esp_ip6_addr_t *if_ip6)
+{
+    return get_ip6_addresses(esp_netif, if_ip6, 1, true) ? ESP_OK : ESP_FAIL;
+}
+
+int esp_netif_get_all_ip6(esp_netif_t *esp_netif, esp_ip6_addr_t if_ip6[])
+{
+    return get_ip6_addresses(esp_netif, if_ip6, MAX_IP6_ADDRESSES, false);
+}
+
+esp_err_t esp_netif_dhcpc_get_status(esp_netif_t *esp_netif, esp_netif_dhcp_status_t *status)
+{
+    // the host network is already configured
+    if (esp_netif == NULL || status == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    *status = ESP_NETIF_DHCP_STOPPED;
+    return ESP_OK;
+}
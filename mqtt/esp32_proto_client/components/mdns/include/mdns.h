@@ -96,6 +96,43 @@ typedef struct mdns_result_s {
     mdns_ip_addr_t *addr;                   /*!< linked list of IP addresses found */
 } mdns_result_t;
 
+/** Buckets of the parse time histogram: below 16 us, below 32 us, ... below 1024 us and the rest */
+#define MDNS_STATS_PARSE_BUCKETS    8
+
+/**
+ * @brief   mDNS engine counters, since mdns_init() or the last mdns_stats_reset()
+ *
+ * The totals are free running 32 bit counters, compare two readings for rates.
+ */
+typedef struct {
+    uint32_t actions;                       /*!< actions posted to the service task */
+    uint32_t actions_dropped;               /*!< actions refused as the action queue was full */
+    uint32_t action_queue_high_water;       /*!< most actions waiting in the queue at once */
+    uint32_t parse_time[MDNS_STATS_PARSE_BUCKETS];  /*!< received packets by the time to parse and answer them */
+    uint32_t answers_suppressed;            /*!< answers left out as the querier listed them as known */
+    uint32_t responses_coalesced;           /*!< responses merged into another one */
+    uint32_t searches;                      /*!< searches started */
+    uint32_t cache_entries;                 /*!< records of other hosts in the cache, now */
+    uint32_t allocs;                        /*!< heap allocations of the engine */
+    uint32_t alloc_failures;                /*!< heap allocations that failed */
+    uint32_t lock_taken;                    /*!< times the service lock was taken */
+    uint64_t lock_time_us;                  /*!< total time the service lock was held */
+    uint32_t lock_max_us;                   /*!< longest time the service lock was held at once */
+} mdns_stats_t;
+
+/**
+ * @brief   mDNS counters of an interface, both IP protocols together
+ */
+typedef struct {
+    esp_netif_t *esp_netif;                 /*!< ptr to corresponding esp-netif */
+    uint32_t rx_packets;                    /*!< packets received */
+    uint32_t rx_bytes;                      /*!< bytes received */
+    uint32_t rx_dropped;                    /*!< received packets dropped as the engine was busy */
+    uint32_t tx_packets;                    /*!< packets sent */
+    uint32_t tx_bytes;                      /*!< bytes sent */
+    uint32_t tx_errors;                     /*!< packets the network stack refused */
+} mdns_netif_stats_t;
+
 typedef void (*mdns_query_notify_t)(mdns_search_once_t *search);
 
 /**
@@ -576,6 +613,20 @@ esp_err_t mdns_service_remove_all(void);
  */
 esp_err_t mdns_query_async_delete(mdns_search_once_t *search);
 
+/**
+ * @brief Stop a running query before its timeout
+ *
+ * The query ends as if it had timed out, keeping the results collected so far, so that
+ * `mdns_query_async_get_results` returns shortly after. The search object still has to be deleted.
+ *
+ * @param search pointer to search object
+ *
+ * @return
+ *     - ESP_OK success, also if the search had already ended
+ *     - ESP_ERR_INVALID_ARG    pointer to search object is NULL
+ */
+esp_err_t mdns_query_async_cancel(mdns_search_once_t *search);
+
 /**
  * @brief Get results from search pointer. Results available as a pointer to the output parameter.
  *        Pointer to search object has to be deleted via `mdns_query_async_delete` once the query has finished.
@@ -595,6 +646,7 @@ bool mdns_query_async_get_results(mdns_search_once_t *search, uint32_t timeout,
 /**
  * @brief  Query mDNS for host or service asynchronousely.
  *         Search has to be tested for progress and deleted manually!
+ *         A query the record cache can answer finishes without sending anything (see mdns_query_generic()).
  *
  * @param  name         service instance or host name (NULL for PTR queries)
  * @param  service_type service type (_http, _arduino, _ftp etc.) (NULL for host queries)
@@ -614,6 +666,11 @@ mdns_search_once_t *mdns_query_async_new(const char *name, const char *service_t
  * @brief  Generic mDNS query
  *         All following query methods are derived from this one
  *
+ * Records received from other hosts are cached (CONFIG_MDNS_CACHE_SIZE) until their TTL expires. The query returns
+ * the cached results without sending a query if the cache holds the host, SRV or TXT record, or max_results service
+ * instances with their SRV record and an address of their host. Asynchronous queries are answered from the cache
+ * the same way, they finish right away without querying the network.
+ *
  * @param  name         service instance or host name (NULL for PTR queries)
  * @param  service_type service type (_http, _arduino, _ftp etc.) (NULL for host queries)
  * @param  proto        service protocol (_tcp, _udp, etc.) (NULL for host queries)
@@ -658,6 +715,9 @@ esp_err_t mdns_query(const char *name, const char *service_type, const char *pro
 /**
  * @brief  Free query results
  *
+ * Frees results and the results following it in the list. The results before it stay valid, the memory of
+ * the list is released once all of its results are freed.
+ *
  * @param  results      linked list of results to be freed
  */
 void mdns_query_results_free(mdns_result_t *results);
@@ -830,6 +890,40 @@ esp_err_t mdns_unregister_netif(esp_netif_t *esp_netif);
  */
 esp_err_t mdns_netif_action(esp_netif_t *esp_netif, mdns_event_actions_t event_action);
 
+/**
+ * @brief   Get the counters of the mDNS engine
+ *
+ * The counters are updated without locks, reading them does not hold the service back.
+ *
+ * @param   stats  the counters
+ * @return
+ *     - ESP_OK success
+ *     - ESP_ERR_INVALID_STATE  mDNS is not running
+ *     - ESP_ERR_INVALID_ARG    stats is NULL
+ */
+esp_err_t mdns_stats_get(mdns_stats_t *stats);
+
+/**
+ * @brief   Get the counters of the interfaces mDNS runs on
+ *
+ * @param   stats      array for the counters, of num_netifs entries
+ * @param   num_netifs in: entries of the array, out: interfaces filled in
+ * @return
+ *     - ESP_OK success
+ *     - ESP_ERR_INVALID_STATE  mDNS is not running
+ *     - ESP_ERR_INVALID_ARG    stats or num_netifs is NULL
+ */
+esp_err_t mdns_stats_get_netifs(mdns_netif_stats_t stats[], size_t *num_netifs);
+
+/**
+ * @brief   Reset the counters of the mDNS engine and of its interfaces
+ *
+ * @return
+ *     - ESP_OK success
+ *     - ESP_ERR_INVALID_STATE  mDNS is not running
+ */
+esp_err_t mdns_stats_reset(void);
+
 #ifdef __cplusplus
 }
 #endif
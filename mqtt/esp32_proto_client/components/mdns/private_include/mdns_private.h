@@ -6,6 +6,7 @@
 #ifndef MDNS_PRIVATE_H_
 #define MDNS_PRIVATE_H_
 
+#include <stdatomic.h>
 #include "sdkconfig.h"
 #include "mdns.h"
 #include "esp_task.h"
@@ -49,6 +50,11 @@
 
 /** The maximum number of services */
 #define MDNS_MAX_SERVICES           CONFIG_MDNS_MAX_SERVICES
+#define MDNS_SERVICE_INDEX_SIZE     32                      // Buckets of the service lookup tables, power of two
+#define MDNS_SEARCH_INDEX_SIZE      32                      // Buckets of the running search lookup tables, power of two
+#define MDNS_SLOT_HOST              MDNS_MAX_SERVICES       // Probe slot of the host A/AAAA records, after the service slots
+#define MDNS_SLOT_WORDS             ((MDNS_MAX_SERVICES + 32) / 32)
+#define MDNS_PROBE_COUNT            3                       // Probes sent before the records are announced
 
 #define MDNS_ANSWER_PTR_TTL         4500
 #define MDNS_ANSWER_TXT_TTL         4500
@@ -90,10 +96,24 @@
 #warning "mDNS task priority is higher than ESP_TASKD_EVENT_PRIO, mDNS library might not work correctly"
 #endif
 #define MDNS_TASK_AFFINITY          CONFIG_MDNS_TASK_AFFINITY
+#ifdef CONFIG_MDNS_PARSE_WORKER
+#define MDNS_PARSE_WORKER           1
+#if CONFIG_FREERTOS_UNICORE || MDNS_TASK_AFFINITY > 1
+#define MDNS_PARSE_WORKER_AFFINITY  MDNS_TASK_AFFINITY
+#else
+#define MDNS_PARSE_WORKER_AFFINITY  (1 - MDNS_TASK_AFFINITY)   // the other core than the mDNS task
+#endif
+#else
+#define MDNS_PARSE_WORKER           0
+#endif
 #define MDNS_SERVICE_ADD_TIMEOUT_MS CONFIG_MDNS_SERVICE_ADD_TIMEOUT_MS
 
 #define MDNS_PACKET_QUEUE_LEN       16                      // Maximum packets that can be queued for parsing
 #define MDNS_ACTION_QUEUE_LEN       CONFIG_MDNS_ACTION_QUEUE_LEN  // Maximum actions pending to the server
+// Slots of the action ring, a power of two with room for the whole pool, the tx action and the stop action
+#define MDNS_ACTION_RING_SIZE       (MDNS_ACTION_QUEUE_LEN <= 14 ? 16 : MDNS_ACTION_QUEUE_LEN <= 30 ? 32 : \
+                                     MDNS_ACTION_QUEUE_LEN <= 62 ? 64 : 128)
+#define MDNS_ACTION_BATCH_MAX       8                       // Actions run by the service task per lock acquisition
 #define MDNS_TXT_MAX_LEN            1024                    // Maximum string length of text data in TXT record
 #if defined(CONFIG_LWIP_IPV6) && defined(CONFIG_MDNS_RESPOND_REVERSE_QUERIES)
 #define MDNS_NAME_MAX_LEN           (64+4)                  // Need to account for IPv6 reverse queries (64 char address  + ".ip6" )
@@ -101,7 +121,21 @@
 #define MDNS_NAME_MAX_LEN           64                      // Maximum string length of hostname, instance, service and proto
 #endif
 #define MDNS_NAME_BUF_LEN           (MDNS_NAME_MAX_LEN+1)   // Maximum char buffer size to hold hostname, instance, service or proto
+#define MDNS_LABEL_MAX_LEN          63                      // Maximum length of one label of a name in DNS wire format
+#define MDNS_LABELS_BUF_LEN         256                     // Buffer to hold a name in DNS wire format (up to 255 bytes)
 #define MDNS_MAX_PACKET_SIZE        1460                    // Maximum size of mDNS  outgoing packet
+#define MDNS_PARSE_ARENA_SIZE       MDNS_MAX_PACKET_SIZE    // Parser memory per packet, bigger packets spill over to the heap
+#define MDNS_PARSE_ARENA_ALIGN      8
+#define MDNS_PARSE_NAMES_MAX        16                      // Names the parse worker decodes ahead per packet, the mDNS task reads the others
+#define MDNS_PARSE_WORKER_SLOTS     4                       // Packets decoded ahead at once, the mDNS task decodes the others itself
+#define MDNS_RESULT_SLAB_SIZE       512                     // Memory of a query result set, more slabs of this size are added
+#define MDNS_RESULT_SET_SIZE        16                      // Buckets of the result lookup tables, power of two
+#define MDNS_TX_QUEUE_MIN_SIZE      8                       // Initial capacity of the tx queue, doubled when full
+#define MDNS_NAME_DICT_SIZE         256                     // Names remembered for compression per outgoing packet, power of two
+#define MDNS_CACHE_SIZE             CONFIG_MDNS_CACHE_SIZE  // Records of other hosts kept by the resolver cache, 0 disables it
+#define MDNS_CACHE_INDEX_SIZE       32                      // Buckets of the resolver cache, power of two
+#define MDNS_CACHE_MAX_TTL          86400                   // Cached TTLs are capped to a day (seconds)
+#define MDNS_CACHE_FLUSH_DELAY_MS   1000                    // Cache-flush records keep the ones received this recently (RFC 6762, 10.2)
 
 #define MDNS_HEAD_LEN               12
 #define MDNS_HEAD_ID_OFFSET         0
@@ -123,9 +157,10 @@
 #define MDNS_SRV_FQDN_OFFSET        6
 
 #define MDNS_TIMER_PERIOD_US        (CONFIG_MDNS_TIMER_PERIOD_MS*1000)
+#define MDNS_SEARCH_RESEND_MS       1000
 
-#define MDNS_SERVICE_LOCK()     xSemaphoreTake(_mdns_service_semaphore, portMAX_DELAY)
-#define MDNS_SERVICE_UNLOCK()   xSemaphoreGive(_mdns_service_semaphore)
+#define MDNS_SERVICE_LOCK()     _mdns_service_lock()
+#define MDNS_SERVICE_UNLOCK()   _mdns_service_unlock()
 
 #define queueToEnd(type, queue, item)       \
     if (!queue) {                           \
@@ -225,10 +260,10 @@ typedef struct mdns_parsed_question_s {
     uint16_t type;
     bool sub;
     bool unicast;
-    char *host;
-    char *service;
-    char *proto;
-    char *domain;
+    const char *host;
+    const char *service;
+    const char *proto;
+    const char *domain;
 } mdns_parsed_question_t;
 
 typedef struct mdns_parsed_record_s {
@@ -258,9 +293,83 @@ typedef struct {
     uint8_t distributed;
     mdns_parsed_question_t *questions;
     mdns_parsed_record_t *records;
+    struct mdns_known_answer_s *known_answers;
     uint16_t id;
 } mdns_parsed_packet_t;
 
+typedef struct mdns_arena_chunk_s {
+    struct mdns_arena_chunk_s *next;
+    size_t size;
+    size_t used;
+    uint8_t *data;
+} mdns_arena_chunk_t;
+
+/**
+ * @brief Bump allocator holding everything the parser builds from one packet, released at once when it's done
+ */
+typedef struct {
+    mdns_arena_chunk_t head;                // describes buf
+    mdns_arena_chunk_t *current;            // chunk being filled, heap chunks are chained after head
+    uint8_t buf[MDNS_PARSE_ARENA_SIZE] __attribute__((aligned(MDNS_PARSE_ARENA_ALIGN)));
+} mdns_parse_arena_t;
+
+/**
+ * @brief Names of a received packet decoded ahead of parsing it, in the order they appear in the packet
+ */
+typedef struct {
+    uint8_t count;
+    struct {
+        const uint8_t *at;                  // where the name starts in the packet
+        const uint8_t *next;                // the data after it, NULL if the name is malformed
+        mdns_name_t name;
+    } names[MDNS_PARSE_NAMES_MAX];
+} mdns_parse_names_t;
+
+/**
+ * @brief Scratch state of the packet parser, each task parsing packets has its own
+ */
+typedef struct {
+    mdns_name_t name;                       // name of the question or record being parsed
+    mdns_name_t data_name;                  // name in the record data, read for the cache
+    mdns_parse_arena_t arena;
+    const mdns_parse_names_t *names;        // decoded ahead, NULL if none
+    uint8_t names_pos;                      // first of them not passed yet
+} mdns_parser_t;
+
+/**
+ * @brief Query result as allocated from its result set, the public mdns_result_t leads to the set
+ */
+typedef struct mdns_result_node_s {
+    struct mdns_result_set_s *set;
+    struct mdns_result_node_s *instance_next;   // next in the same instances bucket
+    struct mdns_result_node_s *host_next;       // next in the same hosts bucket
+    uint32_t seq;                               // order in the result list, newest highest
+    uint32_t instance_hash;
+    uint32_t host_hash;
+    mdns_result_t result;
+} mdns_result_node_t;
+
+/**
+ * @brief Results of one query with their names, addresses and TXT items, allocated from slabs
+ */
+typedef struct mdns_result_set_s {
+    mdns_result_node_t *instances[MDNS_RESULT_SET_SIZE];   // results hashed by instance name
+    mdns_result_node_t *hosts[MDNS_RESULT_SET_SIZE];       // results hashed by host name
+    uint32_t seq;
+    uint32_t live;                          // results not freed yet, the set goes with the last one
+    mdns_arena_chunk_t head;                // describes buf
+    mdns_arena_chunk_t *current;            // slab being filled, heap slabs are chained after head
+    uint8_t buf[MDNS_RESULT_SLAB_SIZE] __attribute__((aligned(MDNS_PARSE_ARENA_ALIGN)));
+} mdns_result_set_t;
+
+/**
+ * @brief Offsets of the names (and their suffixes) written to the outgoing packet, hashed for name compression
+ */
+typedef struct {
+    uint16_t offsets[MDNS_NAME_DICT_SIZE];  // 0 for a free slot
+    uint16_t count;                         // once 3/4 full the packet is searched instead
+} mdns_name_dict_t;
+
 typedef struct {
     mdns_if_t tcpip_if;
     mdns_ip_protocol_t ip_protocol;
@@ -271,32 +380,46 @@ typedef struct {
     uint8_t multicast;
 } mdns_rx_packet_t;
 
-typedef struct mdns_txt_linked_item_s {
-    const char *key;                        /*!< item key name */
-    char *value;                            /*!< item value string */
-    uint8_t value_len;                      /*!< item value length */
-    struct mdns_txt_linked_item_s *next;    /*!< next result, or NULL for the last result in the list */
-} mdns_txt_linked_item_t;
-
-typedef struct mdns_subtype_s {
-    const char *subtype;                    /*!< subtype */
-    struct mdns_subtype_s *next;            /*!< next result, or NULL for the last result in the list */
-} mdns_subtype_t;
-
+/**
+ * @brief Service names and record data in DNS wire format, serialized again when the service or hostname changes
+ */
 typedef struct {
-    const char *instance;
-    const char *service;
-    const char *proto;
-    const char *hostname;
+    uint32_t generation;                    // _mdns_server->wire_generation it was built for
+    uint16_t type_offset;                   // _service._proto.local, the end of the instance name
+    uint16_t srv_offset;                    // SRV data: priority, weight, port and target host name
+    uint16_t srv_len;                       // 0 if there is no target host
+    uint8_t data[];                         // instance._service._proto.local
+} mdns_service_wire_t;
+
+/**
+ * @brief Service, allocated in one block with its names
+ *
+ * The TXT items are kept as the TXT record data is sent: each item is a length byte followed by "key=value"
+ * (or "key" without value). Subtypes are NUL terminated strings stored one after the other.
+ */
+typedef struct {
+    const char *instance;                   // in names, or allocated on its own once it's renamed
+    const char *service;                    // in names
+    const char *proto;                      // in names
+    const char *hostname;                   // in names, or allocated on its own once the hostname changes
     uint16_t priority;
     uint16_t weight;
     uint16_t port;
-    mdns_txt_linked_item_t *txt;
-    mdns_subtype_t *subtype;
+    uint16_t txt_len;                       // 0 without TXT items
+    uint16_t subtypes_len;
+    uint16_t names_len;
+    uint8_t *txt;
+    char *subtypes;
+    mdns_service_wire_t *wire;
+    char names[];                           // service, proto, instance and hostname
 } mdns_service_t;
 
 typedef struct mdns_srv_item_s {
     struct mdns_srv_item_s *next;
+    struct mdns_srv_item_s *type_next;      // next item in the same service_types bucket
+    struct mdns_srv_item_s *instance_next;  // next item in the same service_instances bucket
+    uint32_t seq;                           // order of addition, the buckets are sorted newest first like the list
+    uint16_t slot;                          // index in service_slots and bit of the service in the probe slots
     mdns_service_t *service;
 } mdns_srv_item_t;
 
@@ -317,6 +440,16 @@ typedef struct mdns_host_item_t {
     struct mdns_host_item_t *next;
 } mdns_host_item_t;
 
+/**
+ * @brief Record of ours listed in the answers of a query, the querier has it already (RFC 6762, 7.1)
+ */
+typedef struct mdns_known_answer_s {
+    struct mdns_known_answer_s *next;
+    uint16_t type;
+    mdns_service_t *service;                // service records
+    mdns_host_item_t *host;                 // address and reverse records
+} mdns_known_answer_t;
+
 typedef struct mdns_out_answer_s {
     struct mdns_out_answer_s *next;
     uint16_t type;
@@ -330,27 +463,60 @@ typedef struct mdns_out_answer_s {
 } mdns_out_answer_t;
 
 typedef struct mdns_tx_packet_s {
-    struct mdns_tx_packet_s *next;
     uint32_t send_at;
+    uint32_t seq;                           // orders packets scheduled for the same time
     mdns_if_t tcpip_if;
     mdns_ip_protocol_t ip_protocol;
     esp_ip_addr_t dst;
     uint16_t port;
     uint16_t flags;
     uint8_t distributed;
+    bool aggregate;                         // shared response open to the answers for other queriers
     mdns_out_question_t *questions;
     mdns_out_answer_t *answers;
     mdns_out_answer_t *servers;
     mdns_out_answer_t *additional;
-    bool queued;
     uint16_t id;
 } mdns_tx_packet_t;
 
+/**
+ * @brief Record of another host kept by the resolver cache, allocated in one block with its names
+ */
+typedef struct mdns_cache_entry_s {
+    struct mdns_cache_entry_s *newer;       // LRU list, the most recently used entry first
+    struct mdns_cache_entry_s *older;
+    struct mdns_cache_entry_s *hash_next;   // bucket of the type and owner name
+    uint32_t received_at;
+    uint32_t expires_at;
+    uint16_t type;
+    mdns_if_t tcpip_if;
+    mdns_ip_protocol_t ip_protocol;
+    const char *host;                       // owner name: host (A, AAAA) or instance (SRV, TXT), empty for PTR
+    const char *service;                    // owner name: service and proto, empty for A and AAAA
+    const char *proto;
+    const char *target;                     // instance (PTR) or host (SRV), empty otherwise
+    uint16_t port;                          // SRV
+    uint16_t txt_len;                       // TXT
+    const uint8_t *txt;
+    esp_ip_addr_t addr;                     // A, AAAA
+    char strings[];
+} mdns_cache_entry_t;
+
+typedef struct {
+    mdns_cache_entry_t *index[MDNS_CACHE_INDEX_SIZE];
+    mdns_cache_entry_t *newest;
+    mdns_cache_entry_t *oldest;
+    uint16_t count;
+} mdns_cache_t;
+
+typedef struct {
+    uint32_t bits[MDNS_SLOT_WORDS];
+} mdns_slots_t;
+
 typedef struct {
     mdns_pcb_state_t state;
-    mdns_srv_item_t **probe_services;
-    uint8_t probe_services_len;
-    uint8_t probe_ip;
+    mdns_slots_t probe[MDNS_PROBE_COUNT];   // services and host being probed, by the number of probes sent
+    mdns_slots_t announce;                  // probed, announced once nothing is left probing
     uint8_t probe_running;
     uint16_t failed_probes;
 } mdns_pcb_t;
@@ -362,8 +528,23 @@ typedef enum {
     SEARCH_MAX
 } mdns_search_once_state_t;
 
+/**
+ * @brief Host name of a result of a running PTR or SRV search, the A/AAAA records of the host go to the search
+ */
+typedef struct mdns_search_host_s {
+    struct mdns_search_host_s *next;        // next in the same search_hosts bucket
+    struct mdns_search_host_s *search_next; // next host of the same search
+    uint32_t hash;
+    struct mdns_search_once_s *search;
+    mdns_result_t *result;
+} mdns_search_host_t;
+
 typedef struct mdns_search_once_s {
     struct mdns_search_once_s *next;
+    struct mdns_search_once_s *index_next;  // next search in the same search_index bucket
+    uint32_t seq;                           // order of the running searches, 0 once finished
+    uint32_t key;                           // hash of the name the matching records have, see _mdns_search_key()
+    mdns_search_host_t *hosts;
 
     mdns_search_once_state_t state;
     uint32_t started_at;
@@ -388,11 +569,41 @@ typedef struct mdns_server_s {
     const char *hostname;
     const char *instance;
     mdns_srv_item_t *services;
-    QueueHandle_t action_queue;
+    mdns_srv_item_t *service_types[MDNS_SERVICE_INDEX_SIZE];       // services hashed by service and proto
+    mdns_srv_item_t *service_instances[MDNS_SERVICE_INDEX_SIZE];   // services hashed by instance, service and proto
+    mdns_srv_item_t *service_slots[MDNS_MAX_SERVICES];             // services by their probe slot
+    uint32_t service_seq;
+    uint32_t wire_generation;               // bumped on changes of names, ports and TXT of the services
+    struct mdns_action_queue_s *action_queue;
     SemaphoreHandle_t action_sema;
-    mdns_tx_packet_t *tx_queue_head;
+    mdns_tx_packet_t **tx_queue;            // min-heap of the scheduled packets, earliest send_at first
+    uint16_t tx_queue_len;
+    uint16_t tx_queue_size;
+    uint32_t tx_seq;
+    bool tx_action_queued;                  // the tx action is waiting in the action queue
     mdns_search_once_t *search_once;
+    mdns_search_once_t *search_index[MDNS_SEARCH_INDEX_SIZE];  // running searches hashed by the name they look for
+    mdns_search_host_t *search_hosts[MDNS_SEARCH_INDEX_SIZE];  // host names of the PTR and SRV search results
+    uint32_t search_seq;                    // order of the running searches, newest highest
+    bool search_done;                       // a running search got max_results, to finish after the packet
+    uint32_t search_at;                     // next resend or timeout of the running searches
+    bool search_pending;                    // search_at is set, no running searches otherwise
     esp_timer_handle_t timer_handle;
+    uint32_t timer_at;                      // deadline of the armed one-shot timer
+    bool timer_armed;
+    mdns_parser_t parser;                   // used by the service task only
+    mdns_name_dict_t tx_names;              // names of the packet being sent, service task only
+    bool tx_batching;                       // the service task is running a batch of actions
+    // multicast responses held back until the end of the batch, by interface, protocol and shared
+    mdns_tx_packet_t *tx_batch[MDNS_MAX_INTERFACES][MDNS_IP_PROTOCOL_MAX][2];
+#if MDNS_PARSE_WORKER
+    QueueHandle_t parse_queue;              // received packets for the parse worker
+    QueueHandle_t parse_free;               // names of parse_slots not in use
+    mdns_parse_names_t *parse_slots;
+#endif
+#if MDNS_CACHE_SIZE
+    mdns_cache_t cache;                     // records received from other hosts
+#endif
 } mdns_server_t;
 
 typedef struct {
@@ -422,7 +633,8 @@ typedef struct {
         } srv_port;
         struct {
             mdns_srv_item_t *service;
-            mdns_txt_linked_item_t *txt;
+            uint8_t *txt;                   // TXT items in wire format
+            uint16_t txt_len;
         } srv_txt_replace;
         struct {
             mdns_srv_item_t *service;
@@ -441,11 +653,9 @@ typedef struct {
         struct {
             mdns_search_once_t *search;
         } search_add;
-        struct {
-            mdns_tx_packet_t *packet;
-        } tx_handle;
         struct {
             mdns_rx_packet_t *packet;
+            mdns_parse_names_t *names;      // decoded by the parse worker, NULL otherwise
         } rx_handle;
         struct {
             const char *hostname;
@@ -454,6 +664,50 @@ typedef struct {
     } data;
 } mdns_action_t;
 
+typedef struct {
+    _Atomic uint32_t posted;
+    _Atomic uint32_t dropped;               // refused as all the actions of the pool were pending
+    _Atomic uint32_t rx_dropped;            // received packets among the dropped actions
+    _Atomic uint32_t high_water;            // most actions pending at once
+    _Atomic uint32_t batches[MDNS_ACTION_BATCH_MAX];    // batches run by the service task, by number of actions - 1
+    _Atomic uint32_t coalesced;             // responses merged into another one of the same batch
+} mdns_action_stats_t;
+
+/**
+ * @brief Engine counters behind mdns_stats_get(), kept across mdns_free() and mdns_init()
+ */
+typedef struct {
+    _Atomic uint32_t rx_packets[MDNS_MAX_INTERFACES];   // handed over to the engine by the networking
+    _Atomic uint32_t rx_bytes[MDNS_MAX_INTERFACES];
+    _Atomic uint32_t rx_dropped[MDNS_MAX_INTERFACES];   // refused as all the actions of the pool were pending
+    _Atomic uint32_t parse_time[MDNS_STATS_PARSE_BUCKETS];
+    _Atomic uint32_t allocs;
+    _Atomic uint32_t alloc_failures;
+    _Atomic uint32_t suppressed;            // answers left out as known to the querier
+    _Atomic uint32_t searches;
+    _Atomic uint32_t lock_taken;
+    _Atomic uint64_t lock_time_us;
+    _Atomic uint32_t lock_max_us;
+} mdns_stats_counters_t;
+
+/**
+ * @brief Actions for the service task: a fixed pool with a lock-free free list and a bounded MPSC ring
+ *
+ * Any task may allocate and post actions, only the service task takes them out of the ring.
+ */
+typedef struct mdns_action_queue_s {
+    mdns_action_t pool[MDNS_ACTION_QUEUE_LEN];
+    _Atomic uint16_t pool_next[MDNS_ACTION_QUEUE_LEN]; // free list links, index + 1 (0 ends the list)
+    _Atomic uint32_t pool_head;             // first free action (index + 1) in the low half, ABA tag in the high half
+    struct {
+        _Atomic uint32_t seq;               // ring position the slot is ready for: to post at if equal, to take if one more
+        mdns_action_t *action;
+    } ring[MDNS_ACTION_RING_SIZE];
+    _Atomic uint32_t ring_head;             // next position to post at
+    _Atomic uint32_t ring_tail;             // next position to take, moved by the service task only
+    mdns_action_stats_t stats;
+} mdns_action_queue_t;
+
 /*
  * @brief  Convert mnds if to esp-netif handle
  *
@@ -0,0 +1,7 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#pragma once
+
+#define ESP_TASK_PRIO_MAX       25
+#define ESP_TASKD_EVENT_PRIO    (ESP_TASK_PRIO_MAX - 5)
@@ -0,0 +1,23 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#pragma once
+
+// Host test configuration, mirrors the linux target defaults with the socket backend
+#define CONFIG_IDF_TARGET_LINUX             1
+#define CONFIG_MDNS_NETWORKING_SOCKET       1
+#define CONFIG_LWIP_IPV6                    1
+#define CONFIG_LWIP_IPV6_NUM_ADDRESSES      3
+#define CONFIG_MDNS_MAX_INTERFACES          3
+#define CONFIG_MDNS_MAX_SERVICES            128
+#define CONFIG_MDNS_CACHE_SIZE              64
+#define CONFIG_MDNS_TASK_PRIORITY           1
+#define CONFIG_MDNS_ACTION_QUEUE_LEN        16
+#define CONFIG_MDNS_TASK_STACK_SIZE         4096
+#define CONFIG_MDNS_TASK_AFFINITY           0x0
+#define CONFIG_MDNS_SERVICE_ADD_TIMEOUT_MS  2000
+#define CONFIG_MDNS_TIMER_PERIOD_MS         100
+#define CONFIG_MDNS_MULTIPLE_INSTANCE       1
+#define CONFIG_MDNS_PREDEF_NETIF_STA        0
+#define CONFIG_MDNS_PREDEF_NETIF_AP         0
+#define CONFIG_MDNS_PREDEF_NETIF_ETH        0
@@ -1,9 +1,12 @@
+#include <atomic>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
 #include <functional>
 #include <inttypes.h>
 #include <memory>
+#include <mutex>
+#include <string_view>
 #include <vector>
 
 // This must precede any framework header
@@ -13,11 +16,11 @@
 #include <esp_log.h>
 
 #include <esp_err.h>
-#include <esp_eth.h>
 #include <esp_event.h>
 #include <esp_idf_version.h>
 #include <esp_netif.h>
 #include <esp_system.h>
+#include <esp_timer.h>
 #include <mqtt_client.h>
 
 #include <freertos/FreeRTOS.h>
@@ -25,24 +28,69 @@
 
 #include <nvs_flash.h>
 
-#include <lwip/netdb.h>
+#if CONFIG_IDF_TARGET_LINUX
+// Host process statistics
+#include <malloc.h>
+#include <sys/resource.h>
+#else
+#include <esp_eth.h>
+#include <esp_heap_caps.h>
+#include <esp_mac.h>
+#endif
 
 // External dependencies
+#include <broker_cache.h>
 #include <mdns.h>
+#if !CONFIG_IDF_TARGET_LINUX
 #include <ethernet_init.h>
+#endif
 #include <gps.pb-c.h>
+#include <host_resolver.h>
+#include <metrics.pb-c.h>
+#include <topic_router.h>
 
+#if !CONFIG_IDF_TARGET_LINUX
 static const char* ETH_TAG = "eth_log";
+#endif
 static const char* MDNS_TAG = "mDNS_log";
 static const char* TAG = "MQTT-protobuf example";
 
 static const char* subscriber_topic = "esp32/gps/subscribe";
 static const char* publisher_topic = "esp32/gps/publish";
+static const char* metrics_topic = "esp32/gps/metrics";
 
 // MQTT client handle
 static esp_mqtt_client_handle_t mqtt_client = nullptr;
 static bool mqtt_connected = false;
 
+// Broker address the client is configured with, may be a cached one pending revalidation
+static constexpr size_t broker_address_len = 64;
+static char broker_address[broker_address_len] = "";
+static std::mutex broker_lock;
+static std::atomic<bool> broker_resolving{false};
+static constexpr uint32_t broker_resolve_timeout_ms = 2000;
+// Address the client connected to, stored in NVS by the main task
+static char broker_connected_address[broker_address_len] = "";
+static std::atomic<bool> broker_connected_pending{false};
+// Resolution outcome, handed from the resolver task to the main task
+static host_resolver_cb_t broker_resolved_cb = nullptr;
+static bool broker_resolved_found = false;
+static esp_ip_addr_t broker_resolved_addr{};
+static std::atomic<bool> broker_resolved_pending{false};
+
+// Runs the broker work posted by other tasks
+static TaskHandle_t main_task = nullptr;
+
+// Incoming topics dispatch table
+static topic_router mqtt_router;
+static topic_reassembler mqtt_fragments;
+
+// Data traffic counters, updated from both the MQTT and main tasks
+static std::atomic<uint32_t> msgs_sent{0};
+static std::atomic<uint32_t> msgs_acked{0};
+static std::atomic<uint32_t> msgs_failed{0};
+static std::atomic<uint32_t> msgs_received{0};
+
 static void log_error_if_nonzero(const char *message, int error_code)
 {
     if (error_code != 0) {
@@ -85,11 +133,13 @@ std::vector<uint8_t> serialize_gps_data(const Gps__Coords& msg)
     // Serialize to buffer
     gps__coords__pack(&msg, buf.data());
 
+#if CONFIG_LOG_MESSAGES
     // Show the length of message
-    ESP_LOGI(TAG, "Writing %d serialized bytes", len);
+    ESP_LOGI(TAG, "Writing %zu serialized bytes", len);
 
     // Show the buffer byte by byte
     ESP_LOG_BUFFER_HEXDUMP(TAG, buf.data(), len, ESP_LOG_INFO);
+#endif
 
     return buf;
 }
@@ -107,6 +157,51 @@ std::shared_ptr<Gps__Coords> deserialize_gps_data(const uint8_t* data, size_t le
     return pmsg;
 }
 
+// Let the router decode gps payloads
+template<>
+struct topic_decoder<Gps__Coords>
+{
+    static std::shared_ptr<Gps__Coords> decode(const uint8_t* data, size_t len)
+    {
+        auto pmsg = deserialize_gps_data(data, len);
+
+        if (!pmsg)
+        {
+            ESP_LOGE(TAG, "Cannot decode gps message of %zu bytes", len);
+        }
+
+        return pmsg;
+    }
+};
+
+// Show the received gps data
+static void on_gps_data(std::string_view topic, const Gps__Coords& gps)
+{
+    ++msgs_received;
+
+#if CONFIG_LOG_MESSAGES
+    ESP_LOGI(TAG, "Show received message contents:");
+    ESP_LOGI(TAG, "Device: %" PRIu64, gps.device);
+    ESP_LOGI(TAG, "Latitude: %" PRId32, gps.latitudex1e7);
+    ESP_LOGI(TAG, "Longitude: %" PRId32, gps.longitudex1e7);
+    ESP_LOGI(TAG, "Altitude: %" PRId32, gps.altitudemillimetres);
+    ESP_LOGI(TAG, "Radius: %" PRId32, gps.radiusmillimetres);
+    ESP_LOGI(TAG, "Speed: %" PRId32, gps.speedmillimetrespersecond);
+    ESP_LOGI(TAG, "Satellites: %" PRId32, gps.svs);
+    std::time_t time = gps.timeutc;
+    ESP_LOGI(TAG, "Time: %s", std::ctime(&time));
+#endif
+}
+
+// Populate the dispatch table with the handled topics
+static void setup_mqtt_routes()
+{
+    if (!mqtt_router.add<Gps__Coords>(subscriber_topic, on_gps_data))
+    {
+        ESP_LOGE(TAG, "Invalid topic filter %s", subscriber_topic);
+    }
+}
+
 /*
  * @brief Event handler registered to receive MQTT events
  *
@@ -130,11 +225,22 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 
         if (!msg_id)
         {
-            msg_id = esp_mqtt_client_subscribe(mqtt_client, subscriber_topic, 0);
-            ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
+            for (const auto& filter : mqtt_router.filters())
+            {
+                msg_id = esp_mqtt_client_subscribe(mqtt_client, filter.c_str(), 0);
+                ESP_LOGI(TAG, "sent subscribe %s successful, msg_id=%d", filter.c_str(), msg_id);
+            }
         }
 
         mqtt_connected = true;
+
+        {
+            // remember the last-good address for the next boot, flash writes are left to the main task
+            std::lock_guard<std::mutex> lock(broker_lock);
+            memcpy(broker_connected_address, broker_address, sizeof(broker_address));
+        }
+        broker_connected_pending = true;
+        xTaskNotifyGive(main_task);
         break;
 
     case MQTT_EVENT_DISCONNECTED:
@@ -146,6 +252,12 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 
     case MQTT_EVENT_PUBLISHED:
         ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+        ++msgs_acked;
+        break;
+
+    case MQTT_EVENT_DELETED:
+        ESP_LOGI(TAG, "MQTT_EVENT_DELETED, msg_id=%d", event->msg_id);
+        ++msgs_failed;
         break;
 
     case MQTT_EVENT_SUBSCRIBED:
@@ -168,37 +280,23 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 
     case MQTT_EVENT_DATA:
         ESP_LOGI(TAG, "MQTT_EVENT_DATA");
-        ESP_LOGI(TAG, "TOPIC=%.*s\r\n", event->topic_len, event->topic);
 
-        if (event->data_len != event->total_data_len)
+        // Large messages arrive in several events, only the first one carries the topic
+        if (mqtt_fragments.feed({event->topic, (size_t)event->topic_len}, (const uint8_t*)event->data,
+                                event->data_len, event->current_data_offset, event->total_data_len))
         {
-            ESP_LOGE(TAG,
-                     "There is message fragmentation!!!! size %d and total size %d",
-                     event->data_len,
-                     event->total_data_len);
-        }
-
-        // Special treatment for gps data
-        if (!std::strncmp(event->topic, subscriber_topic, std::strlen(subscriber_topic)))
-        {
-            auto gps = deserialize_gps_data((const uint8_t*)event->data, event->data_len);
-
-            // Show the recovered contents
-            ESP_LOGI(TAG, "Show received message contents:");
-            ESP_LOGI(TAG, "Device: %lld", gps->device);
-            ESP_LOGI(TAG, "Latitude: %ld", gps->latitudex1e7);
-            ESP_LOGI(TAG, "Longitude: %ld", gps->longitudex1e7);
-            ESP_LOGI(TAG, "Altitude: %ld", gps->altitudemillimetres);
-            ESP_LOGI(TAG, "Radius: %ld", gps->radiusmillimetres);
-            ESP_LOGI(TAG, "Speed: %ld", gps->speedmillimetrespersecond);
-            ESP_LOGI(TAG, "Satellites: %ld", gps->svs);
-            std::time_t time = gps->timeutc;
-            ESP_LOGI(TAG, "Time: %s", std::ctime(&time));
+            std::string_view topic = mqtt_fragments.topic();
+            ESP_LOGI(TAG, "TOPIC=%.*s\r\n", (int)topic.size(), topic.data());
 
+            if (!mqtt_router.dispatch(topic, mqtt_fragments.data(), mqtt_fragments.size()))
+            {
+                ESP_LOGI(TAG, "Unknown topic detected is %.*s", (int)topic.size(), topic.data());
+            }
         }
-        else
+        else if (event->data_len != event->total_data_len)
         {
-            ESP_LOGI(TAG, "Unknown topic detected is %s", event->topic);
+            ESP_LOGD(TAG, "Fragment of %d bytes at %d out of %d", event->data_len, event->current_data_offset,
+                     event->total_data_len);
         }
 
         break;
@@ -209,6 +307,99 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
     }
 }
 
+// Take a snapshot of the heap, tasks and MQTT traffic and publish it
+static void publish_metrics()
+{
+    Metrics__Snapshot msg = METRICS__SNAPSHOT__INIT; // message static initialization
+
+    msg.uptimems = esp_timer_get_time() / 1000;
+    msg.msgssent = msgs_sent;
+    msg.msgsacked = msgs_acked;
+    msg.msgsfailed = msgs_failed;
+    msg.msgsreceived = msgs_received;
+    msg.outboxsize = esp_mqtt_client_get_outbox_size(mqtt_client);
+
+#if CONFIG_IDF_TARGET_LINUX
+    // host process memory use
+    struct mallinfo2 heap = mallinfo2();
+    struct rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    msg.heapinuse = heap.uordblks;
+    msg.maxrsskb = usage.ru_maxrss;
+#else
+    // the 48 bit factory MAC identifies the device
+    uint8_t mac[6] = {};
+    esp_efuse_mac_get_default(mac);
+    static_assert(sizeof(mac) <= sizeof(msg.device));
+    std::memcpy(&msg.device, mac, sizeof(mac));
+
+    msg.freeheap = esp_get_free_heap_size();
+    msg.minfreeheap = esp_get_minimum_free_heap_size();
+    msg.largestfreeblock = heap_caps_get_largest_free_block(MALLOC_CAP_DEFAULT);
+#endif
+
+    // the linux FreeRTOS port runs the tasks on pthreads, their stacks and load are meaningless
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY && !CONFIG_IDF_TARGET_LINUX
+    // some slack for tasks created meanwhile
+    std::vector<TaskStatus_t> status(uxTaskGetNumberOfTasks() + 2);
+    uint32_t total_runtime = 0;
+    status.resize(uxTaskGetSystemState(status.data(), status.size(), &total_runtime));
+
+    // the message only references the task names
+    std::vector<Metrics__TaskStack> stacks(status.size());
+    std::vector<Metrics__TaskStack*> pstacks(status.size());
+    for (size_t i = 0; i < status.size(); ++i)
+    {
+        metrics__task_stack__init(&stacks[i]);
+        stacks[i].name = const_cast<char*>(status[i].pcTaskName);
+        stacks[i].highwatermark = status[i].usStackHighWaterMark;
+        pstacks[i] = &stacks[i];
+    }
+    msg.n_tasks = pstacks.size();
+    msg.tasks = pstacks.data();
+
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    // load is whatever the idle task of each core didn't get since the last snapshot
+    static uint32_t last_total_runtime = 0;
+    static uint32_t last_idle_runtime[portNUM_PROCESSORS] = {};
+    uint32_t load[portNUM_PROCESSORS] = {};
+    uint32_t elapsed = total_runtime - last_total_runtime;
+
+    for (int core = 0; core < portNUM_PROCESSORS; ++core)
+    {
+        TaskHandle_t idle = xTaskGetIdleTaskHandleForCore(core);
+        for (const TaskStatus_t& task : status)
+        {
+            if (task.xHandle == idle)
+            {
+                uint32_t idle_elapsed = task.ulRunTimeCounter - last_idle_runtime[core];
+                if (elapsed && idle_elapsed < elapsed)
+                {
+                    load[core] = 1000 - (uint64_t)idle_elapsed * 1000 / elapsed;
+                }
+                last_idle_runtime[core] = task.ulRunTimeCounter;
+                break;
+            }
+        }
+    }
+    last_total_runtime = total_runtime;
+
+    msg.n_cpuloadpermille = portNUM_PROCESSORS;
+    msg.cpuloadpermille = load;
+#endif // CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+#endif // CONFIG_FREERTOS_USE_TRACE_FACILITY && !CONFIG_IDF_TARGET_LINUX
+
+    std::vector<uint8_t> buf(metrics__snapshot__get_packed_size(&msg));
+    metrics__snapshot__pack(&msg, buf.data());
+
+    // QoS 0: metrics are not accounted as data traffic
+    esp_mqtt_client_publish(mqtt_client, metrics_topic, (const char*)buf.data(), buf.size(), 0, 0);
+
+    ESP_LOGI(TAG, "Metrics: heap %" PRIu32 " (min %" PRIu32 ") outbox %" PRIi32 " sent %" PRIu32 " acked %" PRIu32
+             " failed %" PRIu32 " received %" PRIu32, msg.freeheap, msg.minfreeheap, msg.outboxsize, msg.msgssent,
+             msg.msgsacked, msg.msgsfailed, msg.msgsreceived);
+}
+
 void start_mdns_service()
 {
     //initialize mDNS service
@@ -223,50 +414,218 @@ void start_mdns_service()
     mdns_hostname_set("esp32-mqtt-test");
 }
 
-const char* resolveHostAndLog(const char* host_name);
-const char* resolve_mdns_host(const char * host_name);
-
-static void mqtt_app_start(void)
+// Point the client at a new address, starting it the first time
+static void connect_broker(const char* address)
 {
-    const char* address = nullptr;
-
-    // try actual network framework
-    address = resolveHostAndLog(CONFIG_BROKER_HOSTNAME);
-    if ( nullptr == address )
+    bool changed;
     {
-        // Because internal mDNS is broken and cannot listen multicast fallback to the external one
-        address = resolve_mdns_host(CONFIG_BROKER_HOSTNAME);
-
-        if ( nullptr == address )
-            address = CONFIG_BROKER_HOSTNAME; // fallback to mqtt
+        // not held across client calls, the MQTT task takes it while dispatching events
+        std::lock_guard<std::mutex> lock(broker_lock);
+        changed = strcmp(broker_address, address) != 0;
+        snprintf(broker_address, sizeof(broker_address), "%s", address);
     }
 
+    esp_mqtt_client_config_t mqtt_cfg = {
+        .broker {
+            .address {
+                .hostname = address,
+                .transport = MQTT_TRANSPORT_OVER_TCP,
+                .port = CONFIG_BROKER_PORT
+            },
+        },
+    };
+
     if ( nullptr == mqtt_client)
     {
-        esp_mqtt_client_config_t mqtt_cfg = {
-            .broker {
-                .address {
-                    .hostname = address,
-                    .transport = MQTT_TRANSPORT_OVER_TCP,
-                    .port = CONFIG_BROKER_PORT
-                },
-            },
-        };
         mqtt_client = esp_mqtt_client_init(&mqtt_cfg);
 
         /* The last argument may be used to pass data to the event handler, in this example mqtt_event_handler */
         esp_mqtt_client_register_event(mqtt_client, MQTT_EVENT_ANY, mqtt_event_handler, NULL);
 
-        ESP_LOGI(TAG, "Start MQTT client loop");
+        ESP_LOGI(TAG, "Start MQTT client loop on %s", address);
         esp_mqtt_client_start(mqtt_client);
     }
     else
     {
-        ESP_LOGI(TAG, "Reconnect MQTT client loop");
+        if (changed)
+        {
+            esp_mqtt_set_config(mqtt_client, &mqtt_cfg);
+        }
+
+        ESP_LOGI(TAG, "Reconnect MQTT client loop on %s", address);
         esp_mqtt_client_reconnect(mqtt_client);
     }
 }
 
+// Format a resolved address as the client broker hostname
+static void format_address(const esp_ip_addr_t* addr, char* address, size_t len)
+{
+    if (ESP_IPADDR_TYPE_V6 == addr->type)
+    {
+        snprintf(address, len, IPV6STR, IPV62STR(addr->u_addr.ip6));
+    }
+    else
+    {
+        snprintf(address, len, IPSTR, IP2STR(&addr->u_addr.ip4));
+    }
+}
+
+// First resolution, connects to whatever the fastest resolver found
+static void on_broker_resolved(const char* hostname, const esp_ip_addr_t* addr, void*)
+{
+    char address[broker_address_len];
+    if (addr)
+    {
+        format_address(addr, address, sizeof(address));
+        ESP_LOGI(TAG, "Broker %s resolved to %s", hostname, address);
+    }
+    else
+    {
+        ESP_LOGI(TAG, "Cannot resolve broker %s", CONFIG_BROKER_HOSTNAME);
+        snprintf(address, sizeof(address), "%s", CONFIG_BROKER_HOSTNAME); // fallback to mqtt
+    }
+
+    broker_resolving = false;
+    connect_broker(address);
+}
+
+// Resolution after connecting with a cached address, only acts if the broker moved
+static void on_broker_revalidated(const char* hostname, const esp_ip_addr_t* addr, void*)
+{
+    broker_resolving = false;
+
+    if (!addr)
+    {
+        ESP_LOGI(TAG, "Cannot revalidate broker address, keeping the cached one");
+        return;
+    }
+
+    char address[broker_address_len];
+    format_address(addr, address, sizeof(address));
+
+    bool changed;
+    {
+        std::lock_guard<std::mutex> lock(broker_lock);
+        changed = strcmp(broker_address, address) != 0;
+    }
+
+    if (changed)
+    {
+        ESP_LOGI(TAG, "Broker %s moved to %s", hostname, address);
+        connect_broker(address);
+    }
+}
+
+// Resolver callback, runs on a resolver task with a small stack: the main task connects
+static void post_broker_resolution(const char*, const esp_ip_addr_t* addr, void*)
+{
+    {
+        std::lock_guard<std::mutex> lock(broker_lock);
+        broker_resolved_found = addr != nullptr;
+        if (addr)
+        {
+            broker_resolved_addr = *addr;
+        }
+    }
+    broker_resolved_pending = true;
+    xTaskNotifyGive(main_task);
+}
+
+// Race DNS against mDNS for the broker hostname, the callback runs on the main task
+static void resolve_broker(host_resolver_cb_t cb)
+{
+    static const char* const candidates[] = { CONFIG_BROKER_HOSTNAME };
+
+    if (broker_resolving.exchange(true))
+    {
+        return; // a lookup is already running and will connect
+    }
+
+    broker_resolved_cb = cb;
+    esp_err_t err = host_resolver_start(candidates, sizeof(candidates) / sizeof(*candidates),
+                                        broker_resolve_timeout_ms, post_broker_resolution, nullptr);
+    if (ESP_OK != err)
+    {
+        ESP_LOGI(TAG, "Cannot start broker resolution: %s", esp_err_to_name(err));
+        post_broker_resolution(nullptr, nullptr, nullptr);
+    }
+}
+
+// Hand the resolution outcome, if any, to the callback the lookup was started with
+static void run_broker_resolution()
+{
+    if (!broker_resolved_pending.exchange(false))
+    {
+        return;
+    }
+
+    bool found;
+    esp_ip_addr_t addr;
+    {
+        std::lock_guard<std::mutex> lock(broker_lock);
+        found = broker_resolved_found;
+        addr = broker_resolved_addr;
+    }
+
+    broker_resolved_cb(CONFIG_BROKER_HOSTNAME, found ? &addr : nullptr, nullptr);
+}
+
+// Store the address the client connected to, if any, out of the MQTT task and the broker lock
+static void cache_broker_address()
+{
+    if (!broker_connected_pending.exchange(false))
+    {
+        return;
+    }
+
+    char address[broker_address_len];
+    {
+        std::lock_guard<std::mutex> lock(broker_lock);
+        memcpy(address, broker_connected_address, sizeof(address));
+    }
+
+    if (address[0] && strcmp(address, CONFIG_BROKER_HOSTNAME))
+    {
+        broker_cache_set(CONFIG_BROKER_HOSTNAME, address);
+    }
+}
+
+// Sleep for the given time running the broker work other tasks post meanwhile
+static void main_task_wait(TickType_t delay)
+{
+    TickType_t start = xTaskGetTickCount();
+    TickType_t elapsed = 0;
+    do
+    {
+        // like vTaskDelay(0) a zero delay still yields
+        if (!ulTaskNotifyTake(pdTRUE, delay - elapsed) && !delay)
+        {
+            taskYIELD();
+        }
+        run_broker_resolution();
+        cache_broker_address();
+    }
+    while ((elapsed = xTaskGetTickCount() - start) < delay);
+}
+
+static void mqtt_app_start(void)
+{
+    char address[broker_address_len];
+
+    // a last-good address lets us connect without waiting for the resolvers
+    if (ESP_OK == broker_cache_get(CONFIG_BROKER_HOSTNAME, address, sizeof(address)))
+    {
+        ESP_LOGI(TAG, "Using cached address %s for %s", address, CONFIG_BROKER_HOSTNAME);
+        connect_broker(address);
+        resolve_broker(on_broker_revalidated);
+    }
+    else
+    {
+        resolve_broker(on_broker_resolved);
+    }
+}
+
+#if !CONFIG_IDF_TARGET_LINUX
 void eth_check_and_set_dns(const char* new_dns)
 {
     // count the interfaces
@@ -314,74 +673,6 @@ void eth_check_and_set_dns(const char* new_dns)
     }
 }
 
-const char* resolve_mdns_host(const char * host_name)
-{
-    ESP_LOGI(MDNS_TAG, "Query A: %s.local", host_name);
-
-    esp_ip4_addr_t addr{};
-
-    esp_err_t err = mdns_query_a(host_name, 2000,  &addr);
-    if(err){
-        if(err == ESP_ERR_NOT_FOUND){
-            ESP_LOGI(MDNS_TAG, "Host was not found!");
-            return nullptr;
-        }
-        ESP_LOGI(MDNS_TAG,"Query Failed");
-        return nullptr;
-    }
-
-    ESP_LOGI(MDNS_TAG,"Hostname: %s resolved via mDNS to " IPSTR, host_name, IP2STR(&addr));
-    return inet_ntoa(addr);
-}
-
-const char* resolveHostAndLog(const char* host_name)
-{
-    hostent* remoteHost;
-    ESP_LOGI(TAG, "Calling gethostbyname with %s", host_name);
-    remoteHost = lwip_gethostbyname(host_name);
-
-    if (nullptr == remoteHost) {
-        ESP_LOGI(TAG, "gethostbyname call failed");
-        return nullptr;
-    }
-
-    ESP_LOGI(TAG, "Function returned:");
-    ESP_LOGI(TAG, "\tOfficial name: %s", remoteHost->h_name);
-
-    int i = 0;
-    for (auto pAlias = remoteHost->h_aliases; *pAlias != 0; pAlias++) {
-        ESP_LOGI(TAG,"\tAlternate name #%d: %s", ++i, *pAlias);
-    }
-    ESP_LOGI(TAG,"\tAddress type: ");
-    switch (remoteHost->h_addrtype) {
-    case AF_INET:
-        ESP_LOGI(TAG,"AF_INET");
-        break;
-    default:
-        ESP_LOGI(TAG," %d", remoteHost->h_addrtype);
-        break;
-    }
-    ESP_LOGI(TAG,"\tAddress length: %d", remoteHost->h_length);
-
-    i = 0;
-    const char* address = nullptr;
-    if (remoteHost->h_addrtype == AF_INET)
-    {
-        while (remoteHost->h_addr_list[i] != 0) {
-            ip4_addr_t ip{};
-            ip.addr = *(u_long *) remoteHost->h_addr_list[i++];
-            const char* itaddress = inet_ntoa(ip);
-            ESP_LOGI(TAG,"\tIP Address #%d: %s", i, itaddress);
-            if (nullptr == address && nullptr != itaddress)
-            {   // keep the first valid one
-                address = itaddress;
-            }
-        }
-    }
-
-    return address;
-}
-
 /** Event handler for Ethernet events */
 static void eth_event_handler(void *arg, esp_event_base_t event_base,
                               int32_t event_id, void *event_data)
@@ -446,17 +737,6 @@ static void got_ip_event_handler(void *arg, esp_event_base_t event_base,
     // Initialize mDNS
     start_mdns_service();
 
-/*
-    // Testing resolution
-    resolve_mdns_host("DESKTOP-Barro");
-
-    // .local is case sensitive
-    resolveHostAndLog("DESKTOP-Barro.local");
-
-    resolveHostAndLog("localhost");
-    resolveHostAndLog("google.com");
-*/
-
     // Start MQTT client loop
     mqtt_app_start();
 }
@@ -517,6 +797,34 @@ static void ethernet_app_start(void)
     }
 }
 
+#else
+// Use the host network, which is already up, instead of the Ethernet
+static void host_app_start(void)
+{
+    esp_netif_inherent_config_t esp_netif_config = {};
+    esp_netif_config.if_key = "HOST_DEF";
+    esp_netif_config.if_desc = CONFIG_EXAMPLE_HOST_NETIF;
+    esp_netif_config_t cfg = {
+        .base = &esp_netif_config,
+    };
+    esp_netif_t *host_netif = esp_netif_new(&cfg);
+
+    // Initialize mDNS and bind it to the host interface
+    start_mdns_service();
+    if (host_netif && ESP_OK == mdns_register_netif(host_netif))
+    {
+        mdns_netif_action(host_netif, (mdns_event_actions_t)(MDNS_EVENT_ENABLE_IP4 | MDNS_EVENT_ANNOUNCE_IP4));
+    }
+    else
+    {
+        ESP_LOGI(MDNS_TAG, "Cannot bind mDNS to host interface %s", CONFIG_EXAMPLE_HOST_NETIF);
+    }
+
+    // Start MQTT client loop
+    mqtt_app_start();
+}
+#endif // !CONFIG_IDF_TARGET_LINUX
+
 extern "C" void app_main(void)
 {
     ESP_LOGI(TAG, "[APP] Startup..");
@@ -535,33 +843,62 @@ extern "C" void app_main(void)
     ESP_ERROR_CHECK(esp_netif_init());
     ESP_ERROR_CHECK(esp_event_loop_create_default());
 
+    // Resolutions started from the event handlers connect from here
+    main_task = xTaskGetCurrentTaskHandle();
+
+    // Routes must be ready before the client connects
+    setup_mqtt_routes();
+
+#if CONFIG_IDF_TARGET_LINUX
+    host_app_start();
+#else
     // Start Ethernet driver state machine
     ethernet_app_start();
+#endif
 
     // Loop publishing while connected
     int counter = 0;
+    int64_t next_metrics_us = 0;
     while(true)
     {
-        vTaskDelay(1000 / portTICK_PERIOD_MS);
+        main_task_wait(pdMS_TO_TICKS(mqtt_connected ? CONFIG_PUBLISH_PERIOD_MS : 1000));
         if (mqtt_client && mqtt_connected)
         {
             // Generate a new payload message
             auto msg = random_gps_data();
 
+#if CONFIG_LOG_MESSAGES
             ESP_LOGI(TAG, "Show new message contents:");
-            ESP_LOGI(TAG, "Device: %lld", msg.device);
-            ESP_LOGI(TAG, "Latitude: %ld", msg.latitudex1e7);
-            ESP_LOGI(TAG, "Longitude: %ld", msg.longitudex1e7);
-            ESP_LOGI(TAG, "Altitude: %ld", msg.altitudemillimetres);
-            ESP_LOGI(TAG, "Radius: %ld", msg.radiusmillimetres);
-            ESP_LOGI(TAG, "Speed: %ld", msg.speedmillimetrespersecond);
-            ESP_LOGI(TAG, "Satellites: %ld", msg.svs);
+            ESP_LOGI(TAG, "Device: %" PRIu64, msg.device);
+            ESP_LOGI(TAG, "Latitude: %" PRId32, msg.latitudex1e7);
+            ESP_LOGI(TAG, "Longitude: %" PRId32, msg.longitudex1e7);
+            ESP_LOGI(TAG, "Altitude: %" PRId32, msg.altitudemillimetres);
+            ESP_LOGI(TAG, "Radius: %" PRId32, msg.radiusmillimetres);
+            ESP_LOGI(TAG, "Speed: %" PRId32, msg.speedmillimetrespersecond);
+            ESP_LOGI(TAG, "Satellites: %" PRId32, msg.svs);
             std::time_t time = msg.timeutc;
             ESP_LOGI(TAG, "Time: %s", std::ctime(&time));
+#endif
 
             auto data = serialize_gps_data(msg);
+#if CONFIG_LOG_MESSAGES
             ESP_LOGI(TAG, "publishing data: %d", counter);
-            esp_mqtt_client_publish(mqtt_client, publisher_topic, (const char*)data.data(), data.size(), 1, 0);
+#endif
+            if (esp_mqtt_client_publish(mqtt_client, publisher_topic, (const char*)data.data(), data.size(), 1, 0) < 0)
+            {
+                ++msgs_failed;
+            }
+            else
+            {
+                ++msgs_sent;
+            }
+
+            int64_t now_us = esp_timer_get_time();
+            if (CONFIG_METRICS_PERIOD && now_us >= next_metrics_us)
+            {
+                next_metrics_us = now_us + CONFIG_METRICS_PERIOD * 1000000LL;
+                publish_metrics();
+            }
         }
         else if(mqtt_client)
         {